@@ -7,8 +7,15 @@
 #include "dcc_pkt.h"
 #include "dcc_throttle.h"
 #include "dcc_command.h"
+#include "dcc_core1.h"
 #include "tokens.h"
 
+// Define to run the command station (DccCommand, and the DccAdc sampling it
+// does) on core 1 by itself. Everything here stays on core 0 and talks to it
+// through a DccCore1.
+
+#undef INCLUDE_CORE1
+
 // Stream used for both input (commands/parameters) and output messages.
 
 static Stream& stream = Serial;
@@ -26,6 +33,7 @@ static bool loop_svc_cv_read();
 static bool loop_svc_cv_write();
 static bool loop_svc_address_read();
 static bool loop_svc_address_write();
+static void svc_op_show(const DccCommand::SvcOp& op);
 
 static loop_func *active = &loop_nop;
 
@@ -50,6 +58,18 @@ static void cv_try();
 static void read_try();
 static void write_try();
 static void address_try();
+static void stats_try();
+static void refresh_try();
+static void air_try();
+static void air_max_try();
+static void fast_read_try();
+static void adc_sync_try();
+static void acks_try();
+static void trip_try();
+static void trip_ma_try();
+static void trip_us_try();
+static void trace_try();
+static void cache_try();
 
 static void cmd_help(bool verbose=false);
 static void loco_help(bool verbose=false);
@@ -60,6 +80,18 @@ static void cv_help(bool verbose=false);
 static void read_help(bool verbose=false);
 static void write_help(bool verbose=false);
 static void address_help(bool verbose=false);
+static void stats_help(bool verbose=false);
+static void refresh_help(bool verbose=false);
+static void air_help(bool verbose=false);
+static void air_max_help(bool verbose=false);
+static void fast_read_help(bool verbose=false);
+static void adc_sync_help(bool verbose=false);
+static void acks_help(bool verbose=false);
+static void trip_help(bool verbose=false);
+static void trip_ma_help(bool verbose=false);
+static void trip_us_help(bool verbose=false);
+static void trace_help(bool verbose=false);
+static void cache_help(bool verbose=false);
 static void print_help(bool verbose, const char *help_short,
                        int p_min, int p_max, const char *help_long);
 static void print_help(bool verbose, const char *help_short, const char *help_long);
@@ -67,9 +99,15 @@ static void tab_over(int num_tokens, int to_column=12);
 
 // DCC interface
 
-static DccAdc adc(dcc_adc_gpio);
+static DccAdc adc(dcc_adc_gpio, dcc_adc_uv_per_ma);
+#ifdef INCLUDE_CORE1
+static DccCommand engine(dcc_sig_gpio, dcc_pwr_gpio, adc);
+static DccCore1 command(engine);
+static DccCore1::Throttle *throttle = nullptr;
+#else
 static DccCommand command(dcc_sig_gpio, dcc_pwr_gpio, adc);
 static DccThrottle *throttle = nullptr;
+#endif
 
 // When reading/writing CVs, the cv_num_g is set in one command and the read or
 // write command is in the next. Global statics are used to save them.
@@ -79,6 +117,12 @@ static int cv_val_g = DccPkt::cv_val_inv;
 
 static int address_g = DccPkt::address_inv;
 
+// Reading or writing an address uses service mode sessions of several CV
+// operations (DccCommand::mode_svc_session).
+
+static DccCommand::SvcOp svc_op_g[DccCommand::svc_op_max];
+static int svc_op_cnt_g = 0;
+
 // The start time of a long operation (read or write in service mode) is saved
 // so the overall time can be printed.
 
@@ -88,7 +132,7 @@ static uint32_t start_ms = 0;
 // when an operation is done that works but might not have any immediate
 // effect (like changing the loco speed when the track is not powered on).
 
-static const char *mode_info(DccCommand& command);
+static const char *mode_info(DccCommand::Mode mode);
 
 //////////////////////////////////////////////////////////////////////////////
 
@@ -144,6 +188,18 @@ void loop()
 
 //////////////////////////////////////////////////////////////////////////////
 
+#ifdef INCLUDE_CORE1
+
+// core 1 does nothing but run the command station
+void loop1()
+{
+    command.loop1();
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+
 static void cmd_try()
 {
     if (tokens.count() == 0)
@@ -165,6 +221,30 @@ static void cmd_try()
         write_try();
     } else if (strcmp(tokens[0], "A") == 0) {
         address_try();
+    } else if (strcmp(tokens[0], "STATS") == 0) {
+        stats_try();
+    } else if (strcmp(tokens[0], "REFRESH") == 0) {
+        refresh_try();
+    } else if (strcmp(tokens[0], "AIR") == 0) {
+        air_try();
+    } else if (strcmp(tokens[0], "AIRMAX") == 0) {
+        air_max_try();
+    } else if (strcmp(tokens[0], "FASTREAD") == 0) {
+        fast_read_try();
+    } else if (strcmp(tokens[0], "ADCSYNC") == 0) {
+        adc_sync_try();
+    } else if (strcmp(tokens[0], "ACKS") == 0) {
+        acks_try();
+    } else if (strcmp(tokens[0], "TRIP") == 0) {
+        trip_try();
+    } else if (strcmp(tokens[0], "TRIPMA") == 0) {
+        trip_ma_try();
+    } else if (strcmp(tokens[0], "TRIPUS") == 0) {
+        trip_us_try();
+    } else if (strcmp(tokens[0], "TRACE") == 0) {
+        trace_try();
+    } else if (strcmp(tokens[0], "CACHE") == 0) {
+        cache_try();
     } else {
         // tokens[0] unrecognized
         tab_over(1);
@@ -182,6 +262,18 @@ static void cmd_help(bool verbose)
     cv_help(verbose);
     read_help(verbose);
     write_help(verbose);
+    stats_help(verbose);
+    refresh_help(verbose);
+    air_help(verbose);
+    air_max_help(verbose);
+    fast_read_help(verbose);
+    adc_sync_help(verbose);
+    acks_help(verbose);
+    trip_help(verbose);
+    trip_ma_help(verbose);
+    trip_us_help(verbose);
+    trace_help(verbose);
+    cache_help(verbose);
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -266,7 +358,7 @@ static void speed_try()
         stream.printf("OK: speed %d\n", speed);
         if (command.mode() != DccCommand::MODE_OPS) {
             tab_over(0);
-            stream.printf("NOTE: %s\n", mode_info(command));
+            stream.printf("NOTE: %s\n", mode_info(command.mode()));
         }
     } else {
         tab_over(2);
@@ -339,7 +431,7 @@ static void function_try()
         stream.printf("OK: f%d on\n", func);
         if (command.mode() != DccCommand::MODE_OPS) {
             tab_over(0);
-            stream.printf("NOTE: %s\n", mode_info(command));
+            stream.printf("NOTE: %s\n", mode_info(command.mode()));
         }
     } else if (strcmp(tokens[2], "OFF") == 0) {
         throttle->function(func, false);
@@ -347,7 +439,7 @@ static void function_try()
         stream.printf("OK: f%d off\n", func);
         if (command.mode() != DccCommand::MODE_OPS) {
             tab_over(0);
-            stream.printf("NOTE: %s\n", mode_info(command));
+            stream.printf("NOTE: %s\n", mode_info(command.mode()));
         }
     } else {
         tab_over(3);
@@ -393,7 +485,7 @@ static void track_try()
             tab_over(2);
             stream.printf("ERROR: can't turn track on\n");
             tab_over(0);
-            stream.printf("%s\n", mode_info(command));
+            stream.printf("%s\n", mode_info(command.mode()));
         }
     } else if (strcmp(tokens[1], "OFF") == 0) {
         if (command.mode() == DccCommand::MODE_OPS) {
@@ -404,7 +496,7 @@ static void track_try()
             tab_over(2);
             stream.printf("ERROR: can't turn track off\n");
             tab_over(0);
-            stream.printf("%s\n", mode_info(command));
+            stream.printf("%s\n", mode_info(command.mode()));
         }
     } else {
         tab_over(2);
@@ -481,6 +573,8 @@ static void cv_help(bool verbose)
 // C 8         OK: cv8
 // R           OK: reading cv8
 //             read cv8 = 101 (0x65) in 816 ms
+// R           OK: reading cv8 (nothing on the track)
+//             ERROR: no load reading cv8 in 20 ms (no decoder?)
 // T ON        OK: track on
 // R           ERROR: track must be off to read a cv in service mode
 
@@ -533,6 +627,8 @@ static void read_help(bool verbose)
 //             W <n>, -127 <= n <= 255
 // W 8         OK: write cv8 = 8 (0x08) in svc mode
 //             cv8 written with 8 (0x08) in 184 ms
+// W 8         OK: write cv8 = 8 (0x08) in svc mode (nothing on the track)
+//             ERROR: no load writing cv8 in 20 ms (no decoder?)
 // T ON        OK: track on
 // W 8         OK: write cv8 = 8 (0x08) in ops mode
 
@@ -570,8 +666,10 @@ static void write_try()
                       cv_num_g, uint(cv_val_g), uint(cv_val_g));
         // use svc mode if not already in ops mode
         if (command.mode() == DccCommand::MODE_OPS) {
-            stream.printf(" in ops mode ...\n");
-            throttle->write_cv(cv_num_g, cv_val_g);
+            if (throttle->write_cv(cv_num_g, cv_val_g))
+                stream.printf(" in ops mode ...\n");
+            else
+                stream.printf(" in ops mode: ERROR: write queue full\n");
         } else {
             xassert(command.mode() == DccCommand::MODE_OFF);
             stream.printf(" in svc mode ...\n");
@@ -609,30 +707,28 @@ static void write_help(bool verbose)
 //             read cv1 = 3 (0x03) in 828 ms
 //             OK: short address = 3
 // A 66        set address to 66 ...
-//             write cv1 = 66 (0x42) ...
-//             cv1 written with 66 (0x42) in 180 ms
-//             write cv29[5] = 0 ...
-//             cv29 written with 0 (0x00) in 179 ms
-//             OK: short address set to 66
+//             cv1 written with 66 (0x42)
+//             cv29[5] written with 0 (0x00)
+//             OK: short address set to 66 in 279 ms
 // A R         read address ...
 //             read cv29[5] ...
 //             read cv29[5] = 0 in 180 ms
 //             read cv1 = 66 (0x42) in 827 ms
 //             OK: short address = 66
 // A 9876      set address to 9876 ...
-//             write cv18 = 148 (0x94) ...
-//             cv18 written with 148 (0x94) in 179 ms
-//             write cv17 = 230 (0xe6) ...
-//             cv17 written with 230 (0xe6) in 180 ms
-//             write cv29[5] = 1 ...
-//             cv29 written with 1 (0x01) in 179 ms
-//             OK: long address set to 9876
+//             cv18 written with 148 (0x94)
+//             cv17 written with 230 (0xe6)
+//             cv29[5] written with 1 (0x01)
+//             OK: long address set to 9876 in 385 ms
 // A R         read address ...
 //             read cv29[5] ...
 //             read cv29[5] = 1 in 260 ms
-//             read cv18 = 148 (0x94) in 822 ms
-//             read cv17 = 230 (0xe6) in 826 ms
-//             OK: long address = 9876
+//             read cv18 = 148 (0x94)
+//             read cv17 = 230 (0xe6)
+//             OK: long address = 9876 in 1519 ms
+// A R         read address ... (nothing on the track)
+//             read cv29[5] ...
+//             ERROR: no load reading cv29 in 20 ms (no decoder?)
 // A X         ERROR: "X" not "R" or an integer
 //             A R
 //             A <n>, 1 <= n <= 10239
@@ -645,36 +741,25 @@ static void write_help(bool verbose)
 // Address is short if it is <= 127
 // Address is long if it is > 127
 //
-// To write:
-//  Here:
-//      set address_g with address to write (long or short)
-//      if short:
-//          start write of address here:        cv_num_g = 1,  cv_val_g = address_g
-//      if long:
-//          start write of address_lo here:     cv_num_g = 18, cv_val_g = address_g & 0xff
+// To write, one session (svc_op_g) does all the writes:
+//  short:  write cv1 = address_g, then clear cv29[5]
+//  long:   write cv18 = address_g & 0xff, then cv17 = (address_g >> 8) | 0xc0,
+//          then set cv29[5]
 //  In loop_svc_address_write:
-//      if cv_num_g is 1 (address):
-//          start clearing of cv29[5]:          cv_num_g = 29, cv_val_g = 0
-//      else if cv_num_g is 18 (address_lo):
-//          start write of address_hi:          cv_num_g = 17, cv_val_g = (address >> 8) | 0xc0
-//      else if cv_num_g is 17 (address_hi):
-//          start setting of cv29[5]:           cv_num_g = 29, cv_val_g = 1
-//      else if cv_num_g is 29 (config):
-//          done (success)
+//      done (success if all the writes succeeded)
+// Either one is done as soon as the first operation finds no load.
 // To read:
 //  Here:
 //      start read of cv29[5]:                  cv_num_g = 29
 //  In loop_svc_addres_read:
 //      if cv_num_g is 29 (config):
 //          if cv29[5]=0, start read of cv1:    cv_num_g = 1
-//          if cv29[5]=1, start read of cv18:   cv_num_g = 18
+//          if cv29[5]=1, start a session reading cv18 and cv17:
+//                                              cv_num_g = 18
 //      else if cv_num_g is 1 (address):
 //          done (success), address_g = value
-//      else if cv_num_g is 18 (address_lo):
-//          address_g = value
-//          start read of cv17:                 cv_num_g = 17
-//      else if cv_num_g is 17 (address_hi):
-//          done (success), address_g = address_g | (value & 0x3f) << 8
+//      else if cv_num_g is 18 (session):
+//          done (success), address_g = cv18 | (cv17 & 0x3f) << 8
 
 static void address_try()
 {
@@ -733,19 +818,23 @@ static void address_try()
         // Short address is <= 127
         // Short address: write CV1, then clear CV29 bit 5
         // Long address: write CV18 and CV17, then set CV29 bit 5
-        // Start the first write (CV1 or CV17) and let loop_svc_address_write
-        // figure out what to do next (based on cv_num_g).
+        typedef DccCommand::SvcOp SvcOp;
+        svc_op_cnt_g = 0;
         if (address_g <= 127) {
-            cv_num_g = DccCv::address;
-            cv_val_g = address_g;
+            svc_op_g[svc_op_cnt_g++] = { SvcOp::WRITE_CV, 0, DccCv::address,
+                                         uint8_t(address_g), -1, 0, 0 };
+            svc_op_g[svc_op_cnt_g++] = { SvcOp::WRITE_BIT, 5, DccCv::config,
+                                         0, -1, 0, 0 };
         } else {
-            cv_num_g = DccCv::address_lo;
-            cv_val_g = address_g & 0xff;
+            svc_op_g[svc_op_cnt_g++] = { SvcOp::WRITE_CV, 0, DccCv::address_lo,
+                                         uint8_t(address_g & 0xff), -1, 0, 0 };
+            svc_op_g[svc_op_cnt_g++] = { SvcOp::WRITE_CV, 0, DccCv::address_hi,
+                                         uint8_t((address_g >> 8) | 0xc0), -1, 0, 0 };
+            svc_op_g[svc_op_cnt_g++] = { SvcOp::WRITE_BIT, 5, DccCv::config,
+                                         1, -1, 0, 0 };
         }
         active = &loop_svc_address_write;
-        tab_over(0);
-        stream.printf("write cv%d = %d (0x%02x) ...\n", cv_num_g, uint(cv_val_g), uint(cv_val_g));
-        command.mode_svc_write_cv(cv_num_g, cv_val_g);
+        command.mode_svc_session(svc_op_g, svc_op_cnt_g);
     }
 
     start_ms = millis();
@@ -764,6 +853,488 @@ static void address_help(bool verbose)
 
 //////////////////////////////////////////////////////////////////////////////
 
+// Example output:
+//
+// STATS       packets 8211 (resets 0)
+//             speed 4105, function 4106, ops write 0, other 0
+//             svc verify 0, svc write 0
+//             idle 1 (late 0)
+//             longest refill gap 0 us
+//             irq 418632, max 1890 ns, avg 1205 ns
+//             acks 9, detect avg 900 us, max 1100 us
+//             verify/write groups cut short 8
+//             adc overruns 0, errors 0, sync late 0
+//             overcurrent trips 0, retries 0
+
+static void stats_try()
+{
+    DccBitstreamStats stats;
+    command.stats(stats);
+
+    tab_over(1);
+    stream.printf("packets %u (resets %u)\n", stats.pkt_cnt, stats.reset_cnt);
+    tab_over(0);
+    stream.printf("speed %u, function %u, ops write %u, other %u\n",
+                  stats.speed_cnt, stats.func_cnt, stats.ops_write_cnt,
+                  stats.other_cnt);
+    tab_over(0);
+    stream.printf("svc verify %u, svc write %u\n", stats.svc_verify_cnt,
+                  stats.svc_write_cnt);
+    tab_over(0);
+    stream.printf("idle %u (late %u)\n", stats.idle_cnt, stats.late_cnt);
+    tab_over(0);
+    stream.printf("longest refill gap %u us\n", stats.gap_max_us);
+
+    uint32_t mhz = clock_get_hz(clk_sys) / 1000000;
+    uint32_t max_ns = stats.isr_max_cyc * 1000 / mhz;
+    uint32_t avg_ns = 0;
+    if (stats.isr_cnt > 0)
+        avg_ns = uint32_t(stats.isr_cyc * 1000 / mhz / stats.isr_cnt);
+    tab_over(0);
+    stream.printf("irq %u, max %u ns, avg %u ns\n", stats.isr_cnt, max_ns, avg_ns);
+
+    // ack detection latency, from the first adc sample over the threshold
+    DccAdc::AckStats ack;
+    adc.ack_stats(ack);
+    tab_over(0);
+    stream.printf("acks %u, detect avg %u us, max %u us\n", ack.cnt,
+                  ack.avg_us, ack.max_us);
+    tab_over(0);
+    stream.printf("verify/write groups cut short %u\n", stats.cancel_cnt);
+    tab_over(0);
+    stream.printf("adc overruns %u, errors %u, sync late %u\n", adc.overrun_cnt(),
+                  adc.err_cnt(), stats.sync_late_cnt);
+    tab_over(0);
+    stream.printf("overcurrent trips %u, retries %u\n", command.trip_cnt(),
+                  command.trip_retry_cnt());
+
+#ifdef INCLUDE_CORE1
+    tab_over(0);
+    stream.printf("core 0 stalls covered %u\n", command.stall_cnt());
+#endif
+
+    tokens.eat(1);
+}
+
+static void stats_help(bool verbose)
+{
+    print_help(verbose, "STATS",
+               "show bitstream and ack statistics");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Example output:
+//
+// REFRESH
+//  adrs  state  refreshes  avg ms  max ms
+//     3  run         1234    61.2    75.0
+//  1234  idle          98   998.1  1004.2
+
+static void refresh_try()
+{
+    stream.printf("\n");
+    command.show_refresh();
+
+    tokens.eat(1);
+}
+
+static void refresh_help(bool verbose)
+{
+    print_help(verbose, "REFRESH",
+               "show refresh interval for each loco");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Example output:
+//
+// AIR
+// window 20.0 s, 3412 packets, 153540 bits, 19.98 s on track (99.9%)
+// refresh estimate 703 ms for 100 throttles (max off)
+//  adrs  packets    util  avg us
+//     3      130    0.6%    5930
+
+static void air_try()
+{
+    stream.printf("\n");
+    command.show_airtime();
+
+    tokens.eat(1);
+}
+
+static void air_help(bool verbose)
+{
+    print_help(verbose, "AIR",
+               "show track time used, total and for each loco");
+}
+
+// All paths with expected output:
+//
+// AIRMAX X    ERROR: "X" not an integer
+//             AIRMAX <n>, 0 <= n <= 60000
+// AIRMAX -1   ERROR: "-1" out of range
+//             AIRMAX <n>, 0 <= n <= 60000
+// AIRMAX 500  OK: refresh max 500 ms
+
+static const int air_max_ms_max = 60000;
+
+static void air_max_try()
+{
+    if (tokens.count() < 2)
+        return; // wait for another token
+
+    int ms;
+    if (!str_to_int(tokens[1], ms)) {
+        tab_over(2);
+        stream.printf("ERROR: \"%s\" not an integer\n", tokens[1]);
+        tab_over(0);
+        air_max_help();
+        tokens.eat(2);
+        return;
+    }
+
+    if (0 <= ms && ms <= air_max_ms_max) {
+        command.refresh_max_ms(ms);
+        tab_over(2);
+        stream.printf("OK: refresh max %d ms\n", ms);
+    } else {
+        tab_over(2);
+        stream.printf("ERROR: \"%s\" out of range\n", tokens[1]);
+        tab_over(0);
+        air_max_help();
+    }
+
+    tokens.eat(2);
+}
+
+static void air_max_help(bool verbose)
+{
+    print_help(verbose, "AIRMAX <n>", 0, air_max_ms_max,
+               "refuse new locos past this refresh time (0 off)");
+}
+
+// All paths with expected output:
+//
+// FASTREAD ON   OK: fast reads on
+// FASTREAD OFF  OK: fast reads off
+// FASTREAD X    ERROR: "X" unrecognized
+//               FASTREAD ON|OFF
+
+static void fast_read_try()
+{
+    if (tokens.count() < 2)
+        return; // wait for another token
+
+    if (strcmp(tokens[1], "ON") == 0) {
+        command.svc_read_fast(true);
+        tab_over(2);
+        stream.printf("OK: fast reads on\n");
+    } else if (strcmp(tokens[1], "OFF") == 0) {
+        command.svc_read_fast(false);
+        tab_over(2);
+        stream.printf("OK: fast reads off\n");
+    } else {
+        tab_over(2);
+        stream.printf("ERROR: \"%s\" unrecognized\n", tokens[1]);
+        tab_over(0);
+        fast_read_help();
+    }
+
+    tokens.eat(2);
+}
+
+static void fast_read_help(bool verbose)
+{
+    print_help(verbose, "FASTREAD ON|OFF",
+               "service mode reads stop early on clean acks");
+}
+
+// All paths with expected output:
+//
+// ADCSYNC ON   OK: adc sync on
+// ADCSYNC OFF  OK: adc sync off
+// ADCSYNC X    ERROR: "X" unrecognized
+//              ADCSYNC ON|OFF
+//
+// Takes effect the next time the track is turned on.
+
+static void adc_sync_try()
+{
+    if (tokens.count() < 2)
+        return; // wait for another token
+
+    if (strcmp(tokens[1], "ON") == 0) {
+        command.adc_sync(dcc_adc_sync_slice);
+        tab_over(2);
+        stream.printf("OK: adc sync on\n");
+    } else if (strcmp(tokens[1], "OFF") == 0) {
+        command.adc_sync(-1);
+        tab_over(2);
+        stream.printf("OK: adc sync off\n");
+    } else {
+        tab_over(2);
+        stream.printf("ERROR: \"%s\" unrecognized\n", tokens[1]);
+        tab_over(0);
+        adc_sync_help();
+    }
+
+    tokens.eat(2);
+}
+
+static void adc_sync_help(bool verbose)
+{
+    print_help(verbose, "ADCSYNC ON|OFF",
+               "sample current mid half bit, away from edges");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Example output:
+//
+// ACKS
+// op  bit  ack  conf  base  noise  thresh  peak  width  rejects
+//  0    7  yes  100%    20      1      50   118    5.7        0
+//  0    6  no   100%    20      1      50    21      -        0
+//  ...
+//  0   cv  yes   83%    20      1      50   101    5.6        0
+
+static void acks_try()
+{
+    stream.printf("\n");
+    command.show_svc_ack();
+
+    tokens.eat(1);
+}
+
+static void acks_help(bool verbose)
+{
+    print_help(verbose, "ACKS",
+               "show ack decisions of the last read or write");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Example output:
+//
+// TRIP
+// trip at 2500 mA for 2.0 ms: 1 trips, 0 retries, power off (retry in 180 ms)
+// last trip, mA every 0.1 ms up to it:
+//  -12.7    21    20    20    19    21    20    20    21
+//  ...
+//   -0.7  2999  2999  2999  2999  2999  2999  2999  2999
+
+static void trip_try()
+{
+    stream.printf("\n");
+    command.show_trip();
+
+    tokens.eat(1);
+}
+
+static void trip_help(bool verbose)
+{
+    print_help(verbose, "TRIP",
+               "show overcurrent trips and the current before the last");
+}
+
+// All paths with expected output:
+//
+// TRIPMA X     ERROR: "X" not an integer
+//              TRIPMA <n>, 0 <= n <= 3000
+// TRIPMA 4000  ERROR: "4000" out of range
+//              TRIPMA <n>, 0 <= n <= 3000
+// TRIPMA 2000  OK: trip at 2000 mA
+
+static void trip_ma_try()
+{
+    if (tokens.count() < 2)
+        return; // wait for another token
+
+    int ma;
+    if (!str_to_int(tokens[1], ma)) {
+        tab_over(2);
+        stream.printf("ERROR: \"%s\" not an integer\n", tokens[1]);
+        tab_over(0);
+        trip_ma_help();
+        tokens.eat(2);
+        return;
+    }
+
+    if (0 <= ma && ma <= DccCommand::trip_ma_max) {
+        command.trip(ma, command.trip_us());
+        tab_over(2);
+        if (ma == 0)
+            stream.printf("OK: trip off\n");
+        else
+            stream.printf("OK: trip at %d mA\n", ma);
+    } else {
+        tab_over(2);
+        stream.printf("ERROR: \"%s\" out of range\n", tokens[1]);
+        tab_over(0);
+        trip_ma_help();
+    }
+
+    tokens.eat(2);
+}
+
+static void trip_ma_help(bool verbose)
+{
+    print_help(verbose, "TRIPMA <n>", 0, DccCommand::trip_ma_max,
+               "overcurrent trip level, mA (0 off)");
+}
+
+// All paths with expected output:
+//
+// TRIPUS X      ERROR: "X" not an integer
+//               TRIPUS <n>, 100 <= n <= 10000
+// TRIPUS 50     ERROR: "50" out of range
+//               TRIPUS <n>, 100 <= n <= 10000
+// TRIPUS 1000   OK: trip after 1000 us
+
+static const int trip_us_min = 100; // one adc sample
+
+static void trip_us_try()
+{
+    if (tokens.count() < 2)
+        return; // wait for another token
+
+    int us;
+    if (!str_to_int(tokens[1], us)) {
+        tab_over(2);
+        stream.printf("ERROR: \"%s\" not an integer\n", tokens[1]);
+        tab_over(0);
+        trip_us_help();
+        tokens.eat(2);
+        return;
+    }
+
+    if (trip_us_min <= us && us <= DccCommand::trip_us_max) {
+        command.trip(command.trip_ma(), us);
+        tab_over(2);
+        stream.printf("OK: trip after %d us\n", us);
+    } else {
+        tab_over(2);
+        stream.printf("ERROR: \"%s\" out of range\n", tokens[1]);
+        tab_over(0);
+        trip_us_help();
+    }
+
+    tokens.eat(2);
+}
+
+static void trip_us_help(bool verbose)
+{
+    print_help(verbose, "TRIPUS <n>", trip_us_min, DccCommand::trip_us_max,
+               "overcurrent time to trip, usec");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// All paths with expected output:
+//
+// TRACE ON    OK: trace on
+// TRACE OFF   OK: trace off
+// TRACE DUMP  TRACE 5321 bytes, 0 lost
+//             <5321 bytes, DccAdc::trace_start's records>
+// TRACE X     ERROR: "X" unrecognized
+//             TRACE ON|OFF|DUMP
+//
+// The dump is what has been traced since the last one (or since TRACE ON),
+// binary, right after the line giving its length; the trace keeps going.
+
+static void trace_try()
+{
+    if (tokens.count() < 2)
+        return; // wait for another token
+
+    if (strcmp(tokens[1], "ON") == 0) {
+        command.trace(true);
+        tab_over(2);
+        stream.printf("OK: trace on\n");
+    } else if (strcmp(tokens[1], "OFF") == 0) {
+        command.trace(false);
+        tab_over(2);
+        stream.printf("OK: trace off\n");
+    } else if (strcmp(tokens[1], "DUMP") == 0) {
+        // take it out first, so the length is known and what gets traced
+        // while it is sent waits for the next dump
+        static uint8_t buf[DccAdc::trace_max];
+        int len = command.trace_read(buf, sizeof(buf));
+        tab_over(2);
+        stream.printf("TRACE %d bytes, %u lost\n", len, command.trace_lost());
+        stream.write(buf, len);
+    } else {
+        tab_over(2);
+        stream.printf("ERROR: \"%s\" unrecognized\n", tokens[1]);
+        tab_over(0);
+        trace_help();
+    }
+
+    tokens.eat(2);
+}
+
+static void trace_help(bool verbose)
+{
+    print_help(verbose, "TRACE ON|OFF|DUMP",
+               "tagged current trace; DUMP sends it, binary");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// All paths with expected output:
+//
+// CACHE X      ERROR: "X" not an integer
+//              CACHE <n>|OFF, 1 <= n <= 10239
+// CACHE 99999  ERROR: "99999" out of range
+//              CACHE <n>|OFF, 1 <= n <= 10239
+// CACHE 1234   OK: cv cache for loco 1234 on the programming track
+// CACHE OFF    OK: cv cache off on the programming track
+//
+// With a loco set, service mode reads and writes of a cv value already known
+// for it are done without going to the track (DccCommand::svc_loco). Ops
+// mode writes go through the cache either way.
+
+static void cache_try()
+{
+    if (tokens.count() < 2)
+        return; // wait for another token
+
+    int loco;
+    if (strcmp(tokens[1], "OFF") == 0) {
+        command.svc_loco(DccPkt::address_inv);
+        command.svc_read_cached(false);
+        tab_over(2);
+        stream.printf("OK: cv cache off on the programming track\n");
+    } else if (!str_to_int(tokens[1], loco)) {
+        tab_over(2);
+        stream.printf("ERROR: \"%s\" not an integer\n", tokens[1]);
+        tab_over(0);
+        cache_help();
+    } else if (DccPkt::address_min <= loco && loco <= DccPkt::address_max) {
+        command.svc_loco(loco);
+        command.svc_read_cached(true);
+        tab_over(2);
+        stream.printf("OK: cv cache for loco %d on the programming track\n", loco);
+    } else {
+        tab_over(2);
+        stream.printf("ERROR: \"%s\" out of range\n", tokens[1]);
+        tab_over(0);
+        cache_help();
+    }
+
+    tokens.eat(2);
+}
+
+static void cache_help(bool verbose)
+{
+    print_help(verbose, "CACHE <n>|OFF",
+               DccPkt::address_min, DccPkt::address_max,
+               "loco on the programming track, for the cv cache");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
 static void print_help(bool verbose, const char *help_short,
                        int p_min, int p_max, const char *help_long)
 {
@@ -812,15 +1383,15 @@ static void tab_over(int num_tokens, int to_column)
 
 //////////////////////////////////////////////////////////////////////////////
 
-static const char *mode_info(DccCommand& command)
+static const char *mode_info(DccCommand::Mode mode)
 {
-    if (command.mode() == DccCommand::MODE_OFF)
+    if (mode == DccCommand::MODE_OFF)
         return "command station is powered off";
-    else if (command.mode() == DccCommand::MODE_OPS)
+    else if (mode == DccCommand::MODE_OPS)
         return "command station is powered on";
-    else if (command.mode() == DccCommand::MODE_SVC_WRITE_CV)
+    else if (mode == DccCommand::MODE_SVC_WRITE_CV)
         return "command station is writing a cv in service mode";
-    else if (command.mode() == DccCommand::MODE_SVC_READ_CV)
+    else if (mode == DccCommand::MODE_SVC_READ_CV)
         return "command station is reading a cv in service mode";
     else
         return "command station is in an unknown mode";
@@ -845,6 +1416,9 @@ static bool loop_svc_cv_read()
         if (result)
             stream.printf("OK: read cv%d = %u (0x%02x) in %u ms\n", cv_num_g,
                           uint(value), uint(value), millis() - start_ms);
+        else if (command.svc_no_load())
+            stream.printf("ERROR: no load reading cv%d in %u ms (no decoder?)\n",
+                          cv_num_g, millis() - start_ms);
         else
             stream.printf("ERROR reading cv%d in %u ms\n", cv_num_g, millis() - start_ms);
         return false; // done!
@@ -863,6 +1437,9 @@ static bool loop_svc_cv_write()
         if (result)
             stream.printf("OK: cv%d written with %u (0x%02x) in %u ms\n", cv_num_g,
                           uint(cv_val_g), uint(cv_val_g), millis() - start_ms);
+        else if (command.svc_no_load())
+            stream.printf("ERROR: no load writing cv%d in %u ms (no decoder?)\n",
+                          cv_num_g, millis() - start_ms);
         else
             stream.printf("ERROR writing cv%d with %u (0x%02x) in %u ms\n", cv_num_g,
                           uint(cv_val_g), uint(cv_val_g), millis() - start_ms);
@@ -879,12 +1456,38 @@ static bool loop_svc_address_read()
 {
     bool result;
     uint8_t value;
+
+    if (cv_num_g == DccCv::address_lo) {
+        // long address session
+        if (!command.svc_session_done(result, svc_op_g))
+            return true; // keep waiting
+        if (command.svc_no_load()) {
+            tab_over(0);
+            stream.printf("ERROR: no load reading cv%d in %u ms (no decoder?)\n",
+                          cv_num_g, millis() - start_ms);
+            return false; // done!
+        }
+        for (int i = 0; i < svc_op_cnt_g; i++)
+            svc_op_show(svc_op_g[i]);
+        if (!result)
+            return false; // done!
+        // long address, done
+        address_g = svc_op_g[0].val | (int(svc_op_g[1].val & ~0xc0) << 8);
+        tab_over(0);
+        stream.printf("OK: long address = %d in %u ms\n", address_g,
+                      millis() - start_ms);
+        return false;
+    }
+
     if (!command.svc_done(result, value))
         return true; // keep waiting
 
     if (!result) {
         tab_over(0);
-        if (cv_num_g == DccCv::config)
+        if (command.svc_no_load())
+            stream.printf("ERROR: no load reading cv%d in %u ms (no decoder?)\n",
+                          cv_num_g, millis() - start_ms);
+        else if (cv_num_g == DccCv::config)
             stream.printf("ERROR reading cv%d[5] in %u ms\n", cv_num_g, millis() - start_ms);
         else
             stream.printf("ERROR reading cv%d in %u ms\n", cv_num_g, millis() - start_ms);
@@ -897,38 +1500,30 @@ static bool loop_svc_address_read()
         tab_over(0);
         stream.printf("read cv%d[5] = %u in %u ms\n", cv_num_g,
                       uint(value), millis() - start_ms);
-        if (value == 0)
+        if (value == 0) {
             cv_num_g = DccCv::address; // short address, read it
-        else
-            cv_num_g = DccCv::address_lo; // long address, read lower half
-        command.mode_svc_read_cv(cv_num_g);
+            command.mode_svc_read_cv(cv_num_g);
+        } else {
+            // long address, read both halves in one session
+            typedef DccCommand::SvcOp SvcOp;
+            cv_num_g = DccCv::address_lo;
+            svc_op_g[0] = { SvcOp::READ_CV, 0, DccCv::address_lo, 0, -1, 0, 0 };
+            svc_op_g[1] = { SvcOp::READ_CV, 0, DccCv::address_hi, 0, -1, 0, 0 };
+            svc_op_cnt_g = 2;
+            command.mode_svc_session(svc_op_g, svc_op_cnt_g);
+        }
         start_ms = millis();
         return true; // keep going
     } else {
+        xassert(cv_num_g == DccCv::address);
         tab_over(0);
         stream.printf("read cv%d = %u (0x%02x) in %u ms\n", cv_num_g,
                       uint(value), uint(value), millis() - start_ms);
-        if (cv_num_g == DccCv::address) {
-            // short address, done
-            address_g = uint(value);
-            tab_over(0);
-            stream.printf("OK: short address = %d\n", address_g);
-            return false;
-        } else if (cv_num_g == DccCv::address_lo) {
-            // long address: save address_lo and read address_hi
-            address_g = uint(value);
-            cv_num_g = DccCv::address_hi;
-            command.mode_svc_read_cv(cv_num_g);
-            start_ms = millis();
-            return true; // keep going
-        } else {
-            xassert(cv_num_g == DccCv::address_hi);
-            // long address, done
-            address_g |= (int(value & ~0xc0) << 8);
-            tab_over(0);
-            stream.printf("OK: long address = %d\n", address_g);
-            return false;
-        }
+        // short address, done
+        address_g = uint(value);
+        tab_over(0);
+        stream.printf("OK: short address = %d\n", address_g);
+        return false;
     }
 }
 
@@ -937,69 +1532,61 @@ static bool loop_svc_address_read()
 static bool loop_svc_address_write()
 {
     bool result;
-    if (!command.svc_done(result))
+    if (!command.svc_session_done(result, svc_op_g))
         return true; // keep waiting
 
-    // one of the writes has finished
-
     xassert(DccPkt::address_min <= address_g && address_g <= DccPkt::address_max);
-    xassert(cv_num_g == DccCv::address ||
-            cv_num_g == DccCv::address_lo || cv_num_g == DccCv::address_hi ||
-            cv_num_g == DccCv::config);
 
-    if (!result) {
+    if (command.svc_no_load()) {
         tab_over(0);
-        if (cv_num_g == DccCv::config)
-            stream.printf("ERROR writing cv%d[5] with %u in %u ms\n",
-                          cv_num_g, uint(cv_val_g), millis() - start_ms);
-        else
-            stream.printf("ERROR writing cv%d with %u (0x%02x) in %u ms\n",
-                          cv_num_g, uint(cv_val_g), uint(cv_val_g),
-                          millis() - start_ms);
+        stream.printf("ERROR: no load writing cv%d in %u ms (no decoder?)\n",
+                      svc_op_g[0].cv_num, millis() - start_ms);
         return false; // done!
     }
 
-    tab_over(0);
-    stream.printf("cv%d written with %u (0x%02x) in %u ms\n", cv_num_g,
-                  uint(cv_val_g), uint(cv_val_g), millis() - start_ms);
+    for (int i = 0; i < svc_op_cnt_g; i++)
+        svc_op_show(svc_op_g[i]);
 
-    tab_over(0);
-    if (cv_num_g == DccCv::address) {
-        // short address, and just wrote CV1 (address)
-        // clear CV29 bit 5
-        cv_num_g = DccCv::config;
-        cv_val_g = 0; // only used for an error message if needed
-        stream.printf("write cv%d[%d] = %d ...\n", cv_num_g, 5, 0);
-        command.mode_svc_write_bit(cv_num_g, 5, 0);
-        start_ms = millis();
-        return true; // keep going
-    } else if (cv_num_g == DccCv::address_lo) {
-        cv_num_g = DccCv::address_hi;
-        cv_val_g = (address_g >> 8) | 0xc0;
-        stream.printf("write cv%d = %d (0x%02x) ...\n", cv_num_g,
-                      uint(cv_val_g), uint(cv_val_g));
-        command.mode_svc_write_cv(cv_num_g, cv_val_g);
-        start_ms = millis();
-        return true; // keep going
-    } else if (cv_num_g == DccCv::address_hi) {
-        // set CV29 bit 5
-        cv_num_g = DccCv::config;
-        cv_val_g = 1; // only used for an error message if needed
-        stream.printf("write cv%d[%d] = %d ...\n", cv_num_g, 5, 1);
-        command.mode_svc_write_bit(cv_num_g, 5, 1);
-        start_ms = millis();
-        return true; // keep going
-    } else {
-        xassert(cv_num_g == DccCv::config);
-    }
-
-    cv_num_g = DccPkt::cv_num_inv;
-    cv_val_g = DccPkt::cv_val_inv;
+    if (!result)
+        return false; // done!
 
+    tab_over(0);
     if (address_g <= 127)
-        stream.printf("OK: short address set to %d\n", address_g);
+        stream.printf("OK: short address set to %d in %u ms\n", address_g,
+                      millis() - start_ms);
     else
-        stream.printf("OK: long address set to %d\n", address_g);
+        stream.printf("OK: long address set to %d in %u ms\n", address_g,
+                      millis() - start_ms);
 
     return false; // done!
 }
+
+//////////////////////////////////////////////////////////////////////////////
+
+// one line for an operation in a finished session
+static void svc_op_show(const DccCommand::SvcOp& op)
+{
+    typedef DccCommand::SvcOp SvcOp;
+
+    char cv[16];
+    if (op.type == SvcOp::READ_BIT || op.type == SvcOp::WRITE_BIT)
+        snprintf(cv, sizeof(cv), "cv%d[%d]", op.cv_num, op.bit_num);
+    else
+        snprintf(cv, sizeof(cv), "cv%d", op.cv_num);
+
+    tab_over(0);
+
+    if (op.status == -1) {
+        stream.printf("%s not done\n", cv);
+    } else if (op.type == SvcOp::READ_CV || op.type == SvcOp::READ_BIT) {
+        if (op.status == 1)
+            stream.printf("read %s = %u (0x%02x)\n", cv, uint(op.val), uint(op.val));
+        else
+            stream.printf("ERROR reading %s\n", cv);
+    } else {
+        if (op.status == 1)
+            stream.printf("%s written with %u (0x%02x)\n", cv, uint(op.val), uint(op.val));
+        else
+            stream.printf("ERROR writing %s with %u (0x%02x)\n", cv, uint(op.val), uint(op.val));
+    }
+}
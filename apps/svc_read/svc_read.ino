@@ -6,7 +6,7 @@
 #include "dcc_throttle.h"
 #include "dcc_command.h"
 
-static DccAdc adc(dcc_adc_gpio);
+static DccAdc adc(dcc_adc_gpio, dcc_adc_uv_per_ma);
 static DccCommand command(dcc_sig_gpio, dcc_pwr_gpio, adc);
 
 static const int cv_num = 8;
@@ -57,7 +57,7 @@ void loop()
                           time_ms, cv_num, uint(value), uint(value));
         else
             Serial.printf("failed in %lu msec\n", time_ms);
-        command.show_ack_ma();
+        command.show_svc_ack();
         adc.log_show();
         printed = true;
     }
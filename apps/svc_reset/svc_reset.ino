@@ -7,7 +7,7 @@
 #include "dcc_command.h"
 #include "dcc_cv.h"
 
-static DccAdc adc(dcc_adc_gpio);
+static DccAdc adc(dcc_adc_gpio, dcc_adc_uv_per_ma);
 static DccCommand command(dcc_sig_gpio, dcc_pwr_gpio, adc);
 
 
@@ -52,7 +52,7 @@ void loop()
     if (millis() >= (start_ms + 1000) && !printed) {
         Serial.printf("reset %s in %lu msec\n",
                       result ? "succeeded" : "failed", time_ms);
-        command.show_ack_ma();
+        command.show_svc_ack();
         adc.log_show();
         printed = true;
     }
@@ -7,7 +7,7 @@
 #include "dcc_throttle.h"
 #include "dcc_command.h"
 
-static DccAdc adc(dcc_adc_gpio);
+static DccAdc adc(dcc_adc_gpio, dcc_adc_uv_per_ma);
 static DccCommand command(dcc_sig_gpio, dcc_pwr_gpio, adc);
 
 static int address = 2265;
@@ -1,19 +1,93 @@
 #include <Arduino.h>
 #include "hardware/adc.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "xassert.h"
 #include "dcc_adc.h"
 
 
-DccAdc::DccAdc(int gpio) :
+DccAdc *DccAdc::_me = nullptr;
+
+const uint32_t DccAdc::_block_cnt = block_cnt;
+
+
+// 12 bits: raw [0...4096] is [0...ref_mv], so
+// ma = raw * ref_mv * 1000 / (4096 * uv_per_ma), rounded once here into
+// the fixed-point scale.
+DccAdc::DccAdc(int gpio, int uv_per_ma, int ref_mv) :
     _gpio(gpio),
-    _err_cnt(0)
+    _ma_scale(((uint64_t(ref_mv) * 1000 << ma_scale_bits) + 4096 * uv_per_ma / 2) /
+              (4096 * uv_per_ma)),
+    _take_cnt(0),
+    _take_us(0),
+    _overrun_cnt(0),
+    _err_cnt(0),
+    _short_sum(0),
+    _long_sum(0),
+    _avg_sum(0),
+    _avg_sq_sum(0),
+    _dma_ch(-1),
+    _dma_ctl(-1),
+    _sync_dreq(-1),
+    _sync_ch(-1),
+    _sync_ctl(-1),
+    _sync_cs(0),
+    _ack_state(ACK_OFF),
+    _ack(false),
+    _ack_raw(0),
+    _ack_release_raw(0),
+    _ack_rising(false),
+    _ack_rise_us(0),
+    _ack_start_us(0),
+    _ack_peak_num(0),
+    _ack_peak_raw(0),
+    _ack_width_us(0),
+    _ack_reject_cnt(0),
+    _ack_reject_us(0),
+    _ack_time_us(0),
+    _ack_seen_us(0),
+    _ack_func(nullptr),
+    _ack_arg(nullptr),
+    _ack_cnt(0),
+    _ack_max_us(0),
+    _ack_sum_us(0),
+    _ack_end_max_us(0),
+    _ack_end_sum_us(0),
+    _trip_armed(false),
+    _tripped(false),
+    _trip_raw(0),
+    _trip_need(0),
+    _trip_over(0),
+    _trip_cnt(0),
+    _trip_time_us(0),
+    _trip_func(nullptr),
+    _trip_arg(nullptr),
+    // _trip_capture set when used
+    // _trace set when used
+    _trace_head(0),
+    _trace_tail(0),
+    _trace_lost(0),
+    _trace_func(nullptr),
+    _trace_arg(nullptr),
+    _trace_sync(true),
+    _trace_pkt(0),
+    _trace_prev(0)
 {
+    xassert(uv_per_ma > 0 && ref_mv > 0);
+    xassert(_ma_scale < (1u << 20)); // 4095 * _ma_scale fits
+
+    // the sums start out as all zero samples
+    memset(_ring, 0, sizeof(_ring));
+    memset(_avg, 0, sizeof(_avg));
+
     if (_gpio < 0)
         return;
 
     adc_init();
     adc_gpio_init(_gpio);            // e.g. 26
     adc_select_input(_gpio - 26);    // e.g. 0; rp2040 GPIO 26 is ADC 0
-    adc_fifo_setup(true, false, 0, true, false); // err_in_fifo true
+    // dreq when there is at least 1 sample; err_in_fifo true
+    adc_fifo_setup(true, true, 1, true, false);
     adc_set_clkdiv(clock_rate / sample_rate - 1);
     log_reset();
 }
@@ -25,12 +99,81 @@ DccAdc::~DccAdc()
 }
 
 
+// The irq is enabled on the core that calls this, and the handler runs
+// there. The handler is exclusive, so there is only one DccAdc. DMA_IRQ_0 is
+// DccBitstreamPio's; this uses DMA_IRQ_1.
+//
+// Do not do DMA setup in the constructor since this might be a static
+// object, and other stuff is not fully initialized. The dma runs from the
+// first start() on, waiting on the adc when it is stopped.
 void DccAdc::start()
 {
     if (_gpio < 0)
         return;
 
-    adc_run(true);
+    if (_dma_ch < 0) {
+        _me = this;
+        _dma_ch = dma_claim_unused_channel(true);
+        _dma_ctl = dma_claim_unused_channel(true);
+
+        dma_channel_config config = dma_channel_get_default_config(_dma_ch);
+        channel_config_set_transfer_data_size(&config, DMA_SIZE_16);
+        channel_config_set_read_increment(&config, false);
+        channel_config_set_write_increment(&config, true);
+        channel_config_set_ring(&config, true, ring_bits);
+        channel_config_set_dreq(&config, DREQ_ADC);
+        channel_config_set_chain_to(&config, _dma_ctl);
+        dma_channel_configure(_dma_ch, &config, _ring, &adc_hw->fifo,
+                              block_cnt, false);
+
+        config = dma_channel_get_default_config(_dma_ctl);
+        channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+        channel_config_set_read_increment(&config, false);
+        channel_config_set_write_increment(&config, false);
+        dma_channel_configure(_dma_ctl, &config,
+                              &dma_hw->ch[_dma_ch].al1_transfer_count_trig,
+                              &_block_cnt, 1, false);
+
+        irq_set_exclusive_handler(DMA_IRQ_1, dma_handler);
+        dma_channel_set_irq1_enabled(_dma_ch, true);
+        dma_channel_start(_dma_ch);
+    }
+
+    // not an overrun, however long it was stopped
+    _take_us = time_us_32();
+    _trace_sync = true;
+    irq_set_enabled(DMA_IRQ_1, true);
+
+    if (_sync_dreq < 0) {
+        adc_run(true);
+        return;
+    }
+
+    // set up each time, since the slice can change
+    if (_sync_ch < 0) {
+        _sync_ch = dma_claim_unused_channel(true);
+        _sync_ctl = dma_claim_unused_channel(true);
+    }
+
+    dma_channel_config config = dma_channel_get_default_config(_sync_ch);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, false);
+    channel_config_set_dreq(&config, _sync_dreq);
+    channel_config_set_chain_to(&config, _sync_ctl);
+    dma_channel_configure(_sync_ch, &config, &adc_hw->cs, &_sync_cs,
+                          block_cnt, false);
+
+    config = dma_channel_get_default_config(_sync_ctl);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, false);
+    dma_channel_configure(_sync_ctl, &config,
+                          &dma_hw->ch[_sync_ch].al1_transfer_count_trig,
+                          &_block_cnt, 1, false);
+
+    _sync_cs = adc_hw->cs | ADC_CS_START_ONCE_BITS;
+    dma_channel_start(_sync_ch);
 }
 
 
@@ -40,51 +183,418 @@ void DccAdc::stop()
         return;
 
     adc_run(false);
+    if (_sync_ch >= 0) {
+        // the control channel again, in case the abort let the chain go
+        dma_channel_abort(_sync_ctl);
+        dma_channel_abort(_sync_ch);
+        dma_channel_abort(_sync_ctl);
+    }
+    if (_dma_ch >= 0)
+        irq_set_enabled(DMA_IRQ_1, false);
+    _ack_state = ACK_OFF;
+    _trip_armed = false;
 }
 
 
-void DccAdc::loop()
+// From the core the interrupt runs on (the one that called start()). The
+// sums are read again if a sample was taken while they were being read.
+//
+// var = (n * sum(avg^2) - sum(avg)^2) / n^2
+void DccAdc::baseline(Baseline& base) const
 {
-    if (_gpio < 0)
-        return;
+    uint32_t avg_sum;
+    uint32_t avg_sq_sum;
+    uint32_t take_cnt;
+    do {
+        take_cnt = _take_cnt;
+        __dmb();
+        avg_sum = _avg_sum;
+        avg_sq_sum = _avg_sq_sum;
+        base.ma = long_ma();
+        __dmb();
+    } while (_take_cnt != take_cnt);
+
+    int64_t var = int64_t(long_cnt) * avg_sq_sum - int64_t(avg_sum) * avg_sum;
+    if (var < 0)
+        var = 0; // rounding
+    float sd_raw = sqrtf(float(var)) / long_cnt;
+    base.noise_ma = sd_raw * _ma_scale / (1 << ma_scale_bits) + 0.5f;
+}
+
+
+void DccAdc::ack_arm(uint16_t ack_ma, uint16_t release_ma,
+                     void (*func)(void *), void *arg)
+{
+    xassert(release_ma <= ack_ma);
+
+    // off while the handler's state is set up
+    _ack_state = ACK_OFF;
+    __dmb();
+    _ack = false;
+    _ack_raw = ma_to_raw(ack_ma);
+    _ack_release_raw = ma_to_raw(release_ma);
+    _ack_rising = false;
+    _ack_rise_us = time_us_32();
+    _ack_peak_num = _take_cnt + short_cnt;
+    _ack_peak_raw = 0;
+    _ack_width_us = 0;
+    _ack_reject_cnt = 0;
+    _ack_reject_us = 0;
+    _ack_func = func;
+    _ack_arg = arg;
+    // the handler can't see it armed before it sees all of the above
+    __dmb();
+    _ack_state = ACK_BELOW;
+}
+
+
+void DccAdc::trip_arm(uint16_t trip_ma, uint32_t trip_us,
+                      void (*func)(void *), void *arg)
+{
+    xassert(trip_us > 0);
+
+    const uint32_t sample_us = synced() ? sync_min_us : 1000000 / sample_rate;
+
+    // off while the handler's state is set up
+    _trip_armed = false;
+    __dmb();
+    _tripped = false;
+    _trip_raw = ma_to_raw(trip_ma);
+    _trip_need = (trip_us + sample_us - 1) / sample_us;
+    _trip_over = 0;
+    _trip_func = func;
+    _trip_arg = arg;
+    // the handler can't see it armed before it sees all of the above
+    __dmb();
+    _trip_armed = true;
+}
+
+
+void DccAdc::trip_capture(uint16_t *ma) const
+{
+    for (int i = 0; i < trip_capture_max; i++)
+        ma[i] = raw_to_ma(_trip_capture[i]);
+}
+
+
+// Off while the ring is emptied, so the handler doesn't write it.
+void DccAdc::trace_start(trace_func *func, void *arg)
+{
+    xassert(func != nullptr);
+
+    _trace_func = nullptr;
+    __dmb();
+    _trace_head = 0;
+    _trace_tail = 0;
+    _trace_lost = 0;
+    _trace_sync = true;
+    _trace_arg = arg;
+    __dmb();
+    _trace_func = func;
+}
+
+
+// Take up to cnt bytes out of the trace ring, oldest first; returns how
+// many. Whole records are written at a time, but can be taken out in
+// pieces.
+int DccAdc::trace_read(uint8_t *buf, int cnt)
+{
+    uint32_t tail = _trace_tail;
+    uint32_t len = _trace_head - tail;
+    __dmb();
+    if (len > uint32_t(cnt))
+        len = cnt;
+    for (uint32_t i = 0; i < len; i++)
+        buf[i] = _trace[(tail + i) % trace_max];
+    __dmb();
+    _trace_tail = tail + len;
+    return len;
+}
+
+
+// From the handler, with each sample. A record that doesn't fit is dropped,
+// and the trace starts over with the next one that does.
+void DccAdc::trace(uint32_t num, uint32_t sample_us, uint16_t adc_val)
+{
+    uint32_t pkt;
+    uint8_t tag = (*_trace_func)(_trace_arg, sample_us, pkt);
+    xassert(tag <= trace_tag_max);
+
+    uint8_t rec[8];
+    int len = 0;
+
+    if (_trace_sync) {
+        rec[len++] = 0x90;
+        for (int i = 0; i < 4; i++)
+            rec[len++] = num >> (8 * i);
+    }
+
+    if (_trace_sync || pkt != _trace_pkt)
+        rec[len++] = 0xc0 | tag;
 
-    // We get readings in the adc fifo at sample_rate
+    int delta = int(adc_val) - int(_trace_prev);
+    if (_trace_sync || delta < -64 || delta > 63) {
+        rec[len++] = 0x80 | (adc_val >> 8);
+        rec[len++] = adc_val & 0xff;
+    } else {
+        rec[len++] = delta & 0x7f;
+    }
 
-    if (adc_fifo_is_empty())
+    uint32_t head = _trace_head;
+    if (trace_max - (head - _trace_tail) < uint32_t(len)) {
+        _trace_lost++;
+        _trace_sync = true;
         return;
+    }
+
+    for (int i = 0; i < len; i++)
+        _trace[(head + i) % trace_max] = rec[i];
+    __dmb();
+    _trace_head = head + len;
 
-    uint16_t adc_val = adc_fifo_get();
+    _trace_sync = false;
+    _trace_pkt = pkt;
+    _trace_prev = adc_val;
+}
+
+
+void DccAdc::ack_seen(AckSeen& seen) const
+{
+    seen.ack = _ack;
+    seen.peak_ma = raw_to_ma(_ack_peak_raw);
+    seen.width_us = _ack_width_us;
+    seen.reject_cnt = _ack_reject_cnt;
+    seen.reject_us = _ack_reject_us;
+}
+
+
+void DccAdc::ack_stats(AckStats& stats) const
+{
+    stats.cnt = _ack_cnt;
+    stats.max_us = _ack_max_us;
+    stats.avg_us = stats.cnt == 0 ? 0 : _ack_sum_us / stats.cnt;
+    stats.end_max_us = _ack_end_max_us;
+    stats.end_avg_us = stats.cnt == 0 ? 0 : _ack_end_sum_us / stats.cnt;
+}
+
+
+void DccAdc::ack_stats_reset()
+{
+    _ack_cnt = 0;
+    _ack_max_us = 0;
+    _ack_sum_us = 0;
+    _ack_end_max_us = 0;
+    _ack_end_sum_us = 0;
+}
+
+
+void DccAdc::dma_handler()
+{
+    DccAdc *me = _me;
+    dma_channel_acknowledge_irq1(me->_dma_ch);
+    me->take();
+}
+
+
+// Samples written by the dma so far (numbered like _take_cnt). The write
+// address gives where in the ring; it is less than a ring ahead of
+// _take_cnt unless the handler has fallen a whole ring behind.
+uint32_t DccAdc::written() const
+{
+    uint32_t take_cnt = _take_cnt;
+    uintptr_t addr = dma_channel_hw_addr(_dma_ch)->write_addr;
+    uint32_t idx = (addr - uintptr_t(_ring)) / sizeof(_ring[0]);
+    return take_cnt + (idx - take_cnt) % ring_max;
+}
+
+
+// Take the samples the dma has written since the last time, in order. The
+// last one was just converted, and the ones before it are a sample apart;
+// synced, that's the time since the last take over the samples, but no more
+// than a zero's half bit.
+//
+// Taking a sample subtracts the one long_cnt before it from the long sum,
+// so that one has to still be in the ring: at most take_max are taken at a
+// time, leaving ring_slack for the dma to keep writing while they are.
+//
+// If the handler was held off longer than that, written() may be short by
+// whole rings; the time since the last take says how many (synced, at the
+// most there can be, a sample every one's half bit). Then only the
+// newest take_max are taken, the ones before them are counted lost, and the
+// sums start over from the samples just before the ones taken.
+void DccAdc::take()
+{
+    const uint32_t sample_us = 1000000 / sample_rate;
+    const uint32_t ring_slack = ring_max / 8;
+    const uint32_t take_max = ring_max - ring_slack - long_cnt; // 282
+    uint32_t now_us = time_us_32();
+
+    uint32_t take_cnt = _take_cnt;
+    uint32_t new_cnt = written() - take_cnt;
+
+    uint32_t since_us = now_us - _take_us;
+    uint32_t due_cnt = since_us / (synced() ? sync_min_us : sample_us);
+    if (due_cnt >= take_max) {
+        uint32_t laps = (due_cnt - new_cnt + ring_max / 2) / ring_max;
+        uint32_t end = take_cnt + laps * ring_max + new_cnt;
+        if (end - take_cnt > take_max) {
+            new_cnt = take_max;
+            _overrun_cnt += end - new_cnt - take_cnt;
+            take_cnt = end - new_cnt;
+            resum(take_cnt);
+            _trace_sync = true;
+        }
+    }
+    _take_us = now_us;
+
+    uint32_t step_us = sample_us;
+    if (synced() && new_cnt > 0 && since_us / new_cnt < sample_us)
+        step_us = since_us / new_cnt;
+
+    for (uint32_t i = 0; i < new_cnt; i++)
+        sample(take_cnt + i, now_us - (new_cnt - 1 - i) * step_us);
+}
+
+
+// Called from the handler with each sample, by number.
+void DccAdc::sample(uint32_t num, uint32_t sample_us)
+{
+    uint16_t& slot = _ring[num % ring_max];
+    uint16_t adc_val = slot;
 
     if (adc_val & 0x8000)
         _err_cnt++;
 
     adc_val &= 0x0fff;
+    slot = adc_val;
 
 #ifdef INCLUDE_LOG
     if (_log_idx < log_max)
         _log[_log_idx++] = adc_val;
 #endif
 
-    _avg[_avg_idx] = adc_val;
-    _avg_idx++;
-    if (_avg_idx >= avg_max)
-        _avg_idx = 0;
+    // in with this one, out with the one leaving each window
+    uint32_t short_sum = _short_sum + adc_val - _ring[(num - short_cnt) % ring_max];
+    _short_sum = short_sum;
+    _long_sum = _long_sum + adc_val - _ring[(num - long_cnt) % ring_max];
+
+    // and the same for the short average's spread
+    uint16_t avg = (short_sum + short_cnt / 2) / short_cnt;
+    uint16_t avg_old = _avg[(num - long_cnt) % avg_max];
+    _avg[num % avg_max] = avg;
+    _avg_sum = _avg_sum + avg - avg_old;
+    _avg_sq_sum = _avg_sq_sum + avg * avg - avg_old * avg_old;
+
+    __dmb();
+    _take_cnt = num + 1;
+
+    if (_trip_armed) {
+        if (adc_val >= _trip_raw)
+            _trip_over++;
+        else if (_trip_over > 0)
+            _trip_over--;
+        if (_trip_over >= _trip_need) {
+            // the samples up to this one have all been taken
+            for (int i = 0; i < trip_capture_max; i++)
+                _trip_capture[i] = _ring[(num + 1 - trip_capture_max + i) % ring_max];
+            _trip_armed = false;
+            _trip_time_us = sample_us;
+            _trip_cnt++;
+            _tripped = true;
+            if (_trip_func != nullptr)
+                (*_trip_func)(_trip_arg);
+        }
+    }
+
+    if (_trace_func != nullptr)
+        trace(num, sample_us, adc_val);
+
+    if (_ack_state == ACK_OFF)
+        return;
+
+    if (adc_val < _ack_raw) {
+        _ack_rising = false;
+    } else if (!_ack_rising) {
+        _ack_rising = true;
+        _ack_rise_us = sample_us;
+    }
+
+    if (int32_t(num - _ack_peak_num) >= 0 && avg > _ack_peak_raw)
+        _ack_peak_raw = avg;
+
+    switch (_ack_state) {
+
+    case ACK_BELOW:
+        if (avg >= _ack_raw) {
+            _ack_start_us = sample_us;
+            _ack_state = ACK_ABOVE;
+        }
+        break;
+
+    case ACK_ABOVE:
+        if (avg < _ack_release_raw) {
+            // too short for an ack
+            uint32_t us = sample_us - _ack_start_us;
+            _ack_reject_cnt++;
+            if (_ack_reject_us < us)
+                _ack_reject_us = us;
+            _ack_state = ACK_BELOW;
+        } else if (sample_us - _ack_start_us >= ack_width_min_us) {
+            // Long enough, so whatever is left to send can stop now; it's an
+            // ack if it ends before it's too long.
+            _ack_seen_us = sample_us - _ack_rise_us;
+            _ack_time_us = sample_us;
+            _ack_width_us = sample_us - _ack_start_us;
+            _ack_state = ACK_HELD;
+            if (_ack_func != nullptr)
+                (*_ack_func)(_ack_arg);
+        }
+        break;
+
+    case ACK_HELD:
+        _ack_width_us = sample_us - _ack_start_us;
+        if (avg < _ack_release_raw) {
+            uint32_t us = sample_us - _ack_rise_us;
+            _ack_cnt++;
+            _ack_sum_us += _ack_seen_us;
+            if (_ack_max_us < _ack_seen_us)
+                _ack_max_us = _ack_seen_us;
+            _ack_end_sum_us += us;
+            if (_ack_end_max_us < us)
+                _ack_end_max_us = us;
+            _ack = true;
+            _ack_state = ACK_OFF; // done measuring
+        } else if (_ack_width_us > ack_width_max_us) {
+            // too long for an ack
+            _ack_reject_cnt++;
+            if (_ack_reject_us < _ack_width_us)
+                _ack_reject_us = _ack_width_us;
+            _ack_state = ACK_LONG;
+        }
+        break;
+
+    case ACK_LONG:
+        _ack_width_us = sample_us - _ack_start_us;
+        if (avg < _ack_release_raw)
+            _ack_state = ACK_BELOW;
+        break;
+
+    default:
+        break;
+
+    }
 }
 
 
 uint16_t DccAdc::short_ma() const
 {
-    uint16_t raw = short_raw();
-    uint16_t mv = raw_to_mv(raw);
-    return mv_to_ma(mv);
+    return raw_to_ma(short_raw());
 }
 
 
 uint16_t DccAdc::long_ma() const
 {
-    uint16_t raw = long_raw();
-    uint16_t mv = raw_to_mv(raw);
-    return mv_to_ma(mv);
+    return raw_to_ma(long_raw());
 }
 
 
@@ -103,7 +613,8 @@ void DccAdc::log_show()
     Serial.printf("\n");
     Serial.printf("adc log: %d entries\n", _log_idx);
     Serial.printf("\n");
-    Serial.printf("err_cnt = %d\n", _err_cnt);
+    Serial.printf("err_cnt = %u\n", _err_cnt);
+    Serial.printf("overrun_cnt = %u\n", _overrun_cnt);
     Serial.printf("\n");
     Serial.printf(" idx  raw\n");
   //               ---- ----
@@ -114,52 +625,88 @@ void DccAdc::log_show()
 }
 
 
-uint16_t DccAdc::avg_raw(int cnt) const
+// Start the sums over from the samples in the ring before end, after an
+// overrun: the long_cnt before end, and the short_cnt before each of those
+// for its short average. They were written in the dma's last lap but never
+// taken, so their error flags are cleared here; they are counted lost, not
+// errors.
+void DccAdc::resum(uint32_t end)
 {
-    uint32_t sum = 0;
-    int i = _avg_idx;
-    for (int j = 0; j < cnt; j++) {
-        i--;
-        if (i < 0)
-            i = avg_max - 1;
-        sum += _avg[i];
+    const uint32_t start = end - long_cnt - short_cnt;
+    uint32_t short_sum = 0;
+    uint32_t long_sum = 0;
+    uint32_t avg_sum = 0;
+    uint32_t avg_sq_sum = 0;
+    for (uint32_t num = start; num != end; num++) {
+        uint16_t& slot = _ring[num % ring_max];
+        slot &= 0x0fff;
+        short_sum += slot;
+        if (num - start >= short_cnt)
+            short_sum -= _ring[(num - short_cnt) % ring_max];
+        if (end - num <= long_cnt) {
+            long_sum += slot;
+            uint16_t avg = (short_sum + short_cnt / 2) / short_cnt;
+            _avg[num % avg_max] = avg;
+            avg_sum += avg;
+            avg_sq_sum += avg * avg;
+        }
     }
-    return (sum + cnt / 2) / cnt;
+    _short_sum = short_sum;
+    _long_sum = long_sum;
+    _avg_sum = avg_sum;
+    _avg_sq_sum = avg_sq_sum;
 }
 
 
-uint16_t DccAdc::short_raw() const
+// Safe from either core. The copy is good if the dma has not come around
+// to the oldest sample copied by the time it's done; otherwise it's done
+// again.
+uint32_t DccAdc::snapshot(uint16_t *buf, int cnt) const
 {
-    return avg_raw(short_cnt);
+    xassert(0 < cnt && cnt <= snapshot_max);
+
+    while (true) {
+        uint32_t end = _take_cnt;
+        __dmb();
+        for (int i = 0; i < cnt; i++)
+            buf[i] = _ring[(end - cnt + i) % ring_max];
+        __dmb();
+        if (_dma_ch < 0 || written() - (end - cnt) <= uint32_t(ring_max))
+            return end;
+    }
 }
 
 
-uint16_t DccAdc::long_raw() const
+uint16_t DccAdc::short_raw() const
 {
-    return avg_raw(long_cnt);
+    return (_short_sum + short_cnt / 2) / short_cnt;
 }
 
 
-uint16_t DccAdc::raw_to_mv(uint16_t raw)
+uint16_t DccAdc::long_raw() const
 {
-    // With 12 bits, 3.3V ref, mv = (raw / 4096) * 3300
-    // Basically, [0...4096] -> [0...3300]
+    return (_long_sum + long_cnt / 2) / long_cnt;
+}
 
-    const uint32_t ref_mv = 3300;
-    const uint16_t raw_max = 4096;
 
-    return (raw * ref_mv + raw_max/2) / raw_max;
+// DRV8874 at 3.3V: 48000, i.e. 0.7324 mA per count
+uint16_t DccAdc::raw_to_ma(uint16_t raw) const
+{
+    const uint32_t half = 1 << (ma_scale_bits - 1);
+    return (raw * _ma_scale + half) >> ma_scale_bits;
 }
 
 
-uint16_t DccAdc::mv_to_ma(uint16_t mv)
+// Lowest raw reading that converts to ma or more, so comparing raw readings
+// (or averages) to it is the same as comparing their mA to ma. 4096 (never
+// reached) if none does.
+uint16_t DccAdc::ma_to_raw(uint16_t ma) const
 {
-    // Pololu DRV8874: 1.1 mv/ma
-    //                 0.9091 ma/mv
-    // 1.1 = 8192 / 7447
-    const uint32_t mul = 8192 / 1.1; // 7447
-    const uint32_t div = 8192;
-    // ma = mv * 7447 / 8192
-
-    return (mv * mul + div/2) / div;
+    // raw * _ma_scale + half >= ma << ma_scale_bits
+    const uint32_t half = 1 << (ma_scale_bits - 1);
+    if (ma == 0)
+        return 0;
+    uint64_t need = (uint64_t(ma) << ma_scale_bits) - half;
+    uint64_t raw = (need + _ma_scale - 1) / _ma_scale;
+    return raw > 4096 ? 4096 : raw;
 }
@@ -5,22 +5,208 @@
 #undef INCLUDE_LOG
 
 
+// Track current, sampled at sample_rate. DMA moves each sample from the adc
+// fifo into a ring of ring_max as it comes, so nothing depends on how often
+// the main loop runs. Every block_cnt samples the dma interrupt takes the
+// new ones from the ring (running sums for the averages, and ack detection);
+// it runs on the core that calls start(), and only falls behind
+// (overrun_cnt) if it is held off for most of the ring (about 28 msec).
+//
+// The averages are kept as running sums, so short_ma() and long_ma() cost
+// the same whatever the window, and converted to mA with one fixed-point
+// multiply, scaled for the driver's current sense and the board's adc
+// reference.
+//
+// Ack detection also runs in the interrupt: once armed with a threshold, a
+// run starts when the short average gets to it, and lasts until the short
+// average drops under a lower release level. Once a run has lasted long
+// enough to be an ack (ack_width_min_us), the function given, if any, is
+// called from the interrupt handler right away; ack() latches when the run
+// ends, if it was not too long to be one (ack_width_max_us). Shorter runs
+// are noise, and longer ones a load coming on (a motor starting); both are
+// rejected.
+//
+// So does overcurrent detection (trip_arm), so the function it calls can cut
+// track power a bounded number of samples after a short starts, however
+// busy the main loop is.
+
 class DccAdc
 {
 
     public:
 
-        DccAdc(int gpio);
+        // uv_per_ma is the driver's current sense output (the Pololu
+        // DRV8874 carrier gives 1.1 mV/mA), and ref_mv the adc reference.
+        DccAdc(int gpio, int uv_per_ma=1100, int ref_mv=3300);
         ~DccAdc();
 
         void start();
         void stop();
 
-        void loop();
+        // false for gpio -1 (no adc): nothing is sampled, and the averages
+        // stay 0
+        bool present() const { return _gpio >= 0; }
+
+        // Synced sampling: instead of running free at sample_rate, the adc
+        // converts once each time the pwm slice with wrap dreq dreq wraps,
+        // which DccBitstream::adc_sync runs at a fixed phase in each half
+        // bit, away from the edges. Samples then come every half bit (58 or
+        // 100 usec): the windows are the same number of samples (as short as
+        // 0.9 and 9.6 msec), sample times are spread over the time since the
+        // handler last ran, and trip_us is counted in the shortest half bits
+        // (so a trip never comes sooner, but can come later, up to 100/58 of
+        // trip_us in a run of zero bits). -1, the default, is free-running.
+        // Takes effect at start().
+        void sync(int dreq) { _sync_dreq = dreq; }
+        bool synced() const { return _sync_dreq >= 0; }
 
         uint16_t short_ma() const;
         uint16_t long_ma() const;
 
+        // Baseline for ack detection: the long average, and the spread
+        // (standard deviation) of the short average over the same window,
+        // which is what noise on the track does to the short average.
+        struct Baseline {
+            uint16_t ma;
+            uint16_t noise_ma;
+        };
+        void baseline(Baseline& base) const;
+
+        // Copy the newest cnt samples taken (raw adc counts, oldest first)
+        // into buf, none of them overwritten while being copied. Returns the
+        // sample count (samples are numbered from 0 at construction) as of
+        // the newest one, i.e. the newest is number (return value - 1).
+        uint32_t snapshot(uint16_t *buf, int cnt) const;
+        static const int snapshot_max = 256;
+
+        // samples lost because the interrupt was held off for a whole ring,
+        // and samples the adc flagged as conversion errors
+        uint32_t overrun_cnt() const { return _overrun_cnt; }
+        uint32_t err_cnt() const { return _err_cnt; }
+
+        // Arm ack detection (clearing ack() and ack_seen()) with a
+        // threshold and a release level in mA, the release halfway from the
+        // baseline to the threshold. func must be quick and safe to call
+        // from an interrupt handler. Armed until an ack ends (its width is
+        // measured until then), ack_disarm(), or stop().
+        void ack_arm(uint16_t ack_ma, uint16_t release_ma,
+                     void (*func)(void *)=nullptr, void *arg=nullptr);
+        void ack_disarm() { _ack_state = ACK_OFF; }
+        bool ack() const { return _ack; }
+
+        // A run is going: not long enough yet to say if it's an ack, long
+        // enough but not over, or rejected as too long but not over.
+        bool ack_busy() const
+        {
+            return _ack_state == ACK_ABOVE || _ack_state == ACK_HELD ||
+                   _ack_state == ACK_LONG;
+        }
+
+        // NMRA S-9.2.3: an ack is 6 msec +/- 1 msec. Widths are measured on
+        // the short average, from the threshold going up to the release
+        // going down. With the release halfway to the baseline, that's
+        // within half the short window under the pulse's width, and within
+        // the whole window over it, so these are the least a 5 msec pulse
+        // and the most a 7 msec pulse can measure. The function given to
+        // ack_arm() is called as soon as a run reaches ack_width_min_us; so
+        // no ack is seen sooner than that after it starts, which is what
+        // telling an ack from noise costs. A run over ack_width_max_us is
+        // not an ack, and ack() only latches when the run has ended.
+        static const uint32_t short_us = 1000000 / 10000 * 16;
+        static const uint32_t ack_width_min_us = 5000 - short_us / 2;
+        static const uint32_t ack_width_max_us = 7000 + short_us;
+
+        // What detection saw since it was armed: the highest short average
+        // (from a short window after arming, so none of it is from before),
+        // the width of the ack (so far, if it's still going or the adc was
+        // stopped first), and the runs over the threshold rejected as too
+        // short or too long, with the longest of them.
+        struct AckSeen {
+            bool ack;
+            uint16_t peak_ma;
+            uint32_t width_us;
+            uint16_t reject_cnt;
+            uint32_t reject_us;
+        };
+        void ack_seen(AckSeen& seen) const;
+
+        // time_us_32() of the sample the last run reached ack_width_min_us
+        // at (the function given to ack_arm() was called)
+        uint32_t ack_time_us() const { return _ack_time_us; }
+
+        // Ack detection latency: from the first sample at or over the
+        // threshold (in the run of them that ends with the detection) to the
+        // sample the run reached ack_width_min_us at (avg_us, max_us), and
+        // to the sample it ended at and ack() latched (end_avg_us,
+        // end_max_us). All acks since construction or ack_stats_reset().
+        struct AckStats {
+            uint32_t cnt;
+            uint32_t avg_us;
+            uint32_t max_us;
+            uint32_t end_avg_us;
+            uint32_t end_max_us;
+        };
+        void ack_stats(AckStats& stats) const;
+        void ack_stats_reset();
+
+        // Overcurrent trip, also in the interrupt. Once armed, each sample at
+        // or over trip_ma counts up and each one under it counts down (not
+        // below zero), so a driver chopping at its current limit still
+        // trips; when the count gets to trip_us worth of samples, tripped()
+        // latches, the trip_capture_max samples up to that one are kept, and
+        // func, if any, is called from the interrupt handler (it should cut
+        // track power). A short is seen at most a block (200 usec) after the
+        // last sample it needs. Armed until it trips, trip_disarm(), or
+        // stop(); arm again to retry.
+        void trip_arm(uint16_t trip_ma, uint32_t trip_us,
+                      void (*func)(void *)=nullptr, void *arg=nullptr);
+        void trip_disarm() { _trip_armed = false; }
+        bool tripped() const { return _tripped; }
+
+        // trips since construction, and time_us_32() of the sample the last
+        // one was seen at
+        uint32_t trip_cnt() const { return _trip_cnt; }
+        uint32_t trip_time_us() const { return _trip_time_us; }
+
+        // Samples (in mA, oldest first, a sample time apart, or a half bit
+        // when synced) up to the one the last trip was seen at, which is
+        // last; good while tripped().
+        static const int trip_capture_max = 128;
+        static const uint32_t trip_capture_us = 1000000 / 10000;
+        void trip_capture(uint16_t *ma) const;
+
+        // Current trace: every sample taken, tagged with what was going out
+        // on the track, delta-encoded into a byte ring of trace_max for
+        // trace_read() to take out (from either core) and send on as is.
+        // Records:
+        //
+        //   0ddddddd               sample, d (-64..63) more than the last
+        //   1000hhhh llllllll      sample, raw adc count hhhhllllllll
+        //   10010000 + 4 bytes     sync: sample number (little-endian) of
+        //                          the next sample, which is a full one
+        //   11tttttt               tag t (0..63): the samples after it were
+        //                          taken while packet t was going out
+        //
+        // A trace starts with a sync, a tag and a full sample, and starts
+        // over that way after anything is lost: records dropped for a full
+        // ring, or samples not taken (the adc stopped, or overran). func is
+        // called from the interrupt handler with each sample's time, and
+        // returns the tag for the packet going out then, setting pkt to
+        // something that changes with each packet.
+        typedef uint8_t trace_func(void *arg, uint32_t sample_us, uint32_t& pkt);
+        void trace_start(trace_func *func, void *arg);
+        void trace_stop() { _trace_func = nullptr; }
+        bool tracing() const { return _trace_func != nullptr; }
+        int trace_read(uint8_t *buf, int cnt);
+        static const int trace_max = 16384; // 1.6 sec of samples, or more
+        static const uint8_t trace_tag_max = 63;
+
+        // samples (records) dropped for a full ring since trace_start()
+        uint32_t trace_lost() const { return _trace_lost; }
+
+        // a trace's raw adc counts in mA
+        uint16_t raw_to_ma(uint16_t raw) const;
+
         static constexpr bool logging()
         {
 #ifdef INCLUDE_LOG
@@ -36,26 +222,132 @@ class DccAdc
     private:
 
         int _gpio;
-        
-        uint16_t avg_raw(int cnt) const;
+
+        // mA per raw adc count, with 16 fraction bits
+        const uint32_t _ma_scale;
+        static const int ma_scale_bits = 16;
+
         uint16_t short_raw() const;
         uint16_t long_raw() const;
 
-        static uint16_t raw_to_mv(uint16_t raw);
-        static uint16_t mv_to_ma(uint16_t mv);
+        uint16_t ma_to_raw(uint16_t ma) const;
 
         static const uint32_t clock_rate = 48000000;
         static const uint32_t sample_rate = 10000; // 10 KHz = 100 usec per sample
 
-        static const int avg_max = sample_rate / 60; // 1 cycle of 60 Hz noise
+        static const int short_cnt = 16;
+        static_assert(short_us == 1000000 / sample_rate * short_cnt);
+        static_assert(trip_capture_us == 1000000 / sample_rate);
+
+        static const int long_cnt = sample_rate / 60; // 1 cycle of 60 Hz noise
+
+        // Sample ring, written by dma. The dma write ring wraps on the
+        // ring's size in bytes, so it is aligned to that. Samples before
+        // _take_cnt (modulo ring_max) have been taken by the interrupt
+        // (error flag cleared, added to the sums, and seen by ack
+        // detection); snapshot() only uses those.
+        static const int ring_bits = 10;
+        static const int ring_max = (1 << ring_bits) / sizeof(uint16_t); // 512
+        static const int block_cnt = 2;
+        static const uint32_t _block_cnt; // dma reads it to restart the block
+        alignas(1 << ring_bits) uint16_t _ring[ring_max];
+        volatile uint32_t _take_cnt;
+        uint32_t _take_us;          // when the interrupt last ran
+        volatile uint32_t _overrun_cnt;
+        volatile uint32_t _err_cnt;
+
+        // Sums of the newest short_cnt and long_cnt samples taken. Each
+        // sample taken is added, and the one it pushes out of the window
+        // (still in the ring) subtracted.
+        volatile uint32_t _short_sum;
+        volatile uint32_t _long_sum;
+
+        // The short average (raw, rounded) as of each of the newest long_cnt
+        // samples, by sample number, with running sums of them and of their
+        // squares for the baseline's spread.
+        static const int avg_max = 256;
         uint16_t _avg[avg_max];
-        int _avg_idx;
+        volatile uint32_t _avg_sum;
+        volatile uint32_t _avg_sq_sum;
 
-        static const int short_cnt = 16;
+        void resum(uint32_t end);
+
+        // The data channel moves block_cnt samples then chains to the
+        // control channel, which writes block_cnt to the data channel's
+        // count and trigger register to start the next block.
+        int _dma_ch;                // -1 until start()
+        int _dma_ctl;
+
+        // Synced, a channel paced by the slice's wrap writes _sync_cs (cs
+        // with START_ONCE) to the adc, block_cnt times, then chains to a
+        // control channel that starts it again, the same way.
+        int _sync_dreq;
+        int _sync_ch;               // -1 until a synced start()
+        int _sync_ctl;
+        uint32_t _sync_cs;
+        static const uint32_t sync_min_us = 58; // a one's half bit
+        uint32_t written() const;
+        void take();
+
+        // ack detection, compared as raw adc counts in the handler
+        enum AckState : uint8_t {
+            ACK_OFF,                // not armed, not measuring
+            ACK_BELOW,              // armed, no run going
+            ACK_ABOVE,              // run going, not for ack_width_min_us yet
+            ACK_HELD,               // long enough; measuring its width
+            ACK_LONG,               // too long; waiting for it to end
+        };
+        volatile AckState _ack_state;
+        volatile bool _ack;
+        uint16_t _ack_raw;          // ma_to_raw(ack_ma)
+        uint16_t _ack_release_raw;  // ma_to_raw(release_ma)
+        bool _ack_rising;           // last sample was at or over _ack_raw
+        uint32_t _ack_rise_us;      // first sample of that run
+        uint32_t _ack_start_us;     // first sample of the run over the threshold
+        uint32_t _ack_peak_num;     // sample number the peak is from
+        volatile uint16_t _ack_peak_raw;
+        volatile uint32_t _ack_width_us;
+        volatile uint16_t _ack_reject_cnt;
+        volatile uint32_t _ack_reject_us;
+        volatile uint32_t _ack_time_us;
+        uint32_t _ack_seen_us;      // latency to ack_width_min_us, this run
+        void (*_ack_func)(void *);
+        void *_ack_arg;
+        volatile uint32_t _ack_cnt;
+        volatile uint32_t _ack_max_us;
+        volatile uint32_t _ack_sum_us;
+        volatile uint32_t _ack_end_max_us;
+        volatile uint32_t _ack_end_sum_us;
+
+        // overcurrent trip, also compared as raw adc counts
+        volatile bool _trip_armed;
+        volatile bool _tripped;
+        uint16_t _trip_raw;         // ma_to_raw(trip_ma)
+        uint32_t _trip_need;        // samples over (net) to trip
+        uint32_t _trip_over;        // count so far
+        volatile uint32_t _trip_cnt;
+        volatile uint32_t _trip_time_us;
+        void (*_trip_func)(void *);
+        void *_trip_arg;
+        uint16_t _trip_capture[trip_capture_max];
+
+        // trace ring, written at _trace_head by the handler and read at
+        // _trace_tail, same as the sample ring's take
+        uint8_t _trace[trace_max];
+        volatile uint32_t _trace_head;
+        volatile uint32_t _trace_tail;
+        volatile uint32_t _trace_lost;
+        trace_func * volatile _trace_func;
+        void *_trace_arg;
+        bool _trace_sync;           // next record starts over
+        uint32_t _trace_pkt;        // packet of the last tag written
+        uint16_t _trace_prev;       // last sample written
+        void trace(uint32_t num, uint32_t sample_us, uint16_t adc_val);
 
-        static const int long_cnt = avg_max;
+        void sample(uint32_t num, uint32_t sample_us);
 
-        int _err_cnt;
+        static DccAdc *_me;         // one adc, one handler
+        static void dma_handler();
 
 #ifdef INCLUDE_LOG
         static const int log_max = 1 * sample_rate; // 1 sec
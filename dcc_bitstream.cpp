@@ -1,6 +1,7 @@
 #include <Arduino.h>
 #include "hardware/irq.h"
 #include "hardware/pwm.h"
+#include "xassert.h"
 #include "dbg_gpio.h"
 #include "pwm_irq_mux.h"
 #include "dcc_pkt.h"
@@ -34,15 +35,35 @@ DccBitstream::DccBitstream(int sig_gpio, int pwr_gpio) :
     _pwr_gpio(pwr_gpio),
     _pkt_idle(),
     _pkt_reset(),
-    _pkt_a(),
-    _pkt_b(),
-    _current(&_pkt_idle),
-    _next(&_pkt_idle),
+    _enc_used(0),
+    _head(0),
+    _tail(0),
+    _cancel(false),
+    _cancel_head(0),
+    _busy(false),
+    _pkt_cnt(0),
+    // _type_cnt zeroed below
+    _idle_cnt(0),
+    _late_cnt(0),
+    _cancel_cnt(0),
+    _empty_us(0),
+    _gap_max_us(0),
+    _sync_late_cnt(0),
+    _isr_cnt(0),
+    _isr_max_cyc(0),
+    _isr_cyc(0),
+    _current(&_enc_idle),
+    // _started set when used
+    _started_cnt(0),
+    _bit(nullptr),      // set in start_*()
+    _bit_end(nullptr),  // set in start_*()
     _preamble_bits(DccPkt::ops_preamble_bits),
     _slice(pwm_gpio_to_slice_num(sig_gpio)),
     _channel(pwm_gpio_to_channel(sig_gpio)),
-    _byte(INT_MAX), // set in start_*()
-    _bit(INT_MAX)   // set in start_*()
+    _sync_slice(-1),
+    _sync_run(-1),
+    _half_us(0),
+    _half_next_us(0)
 {
     DbgGpio::init({0});
 
@@ -52,6 +73,15 @@ DccBitstream::DccBitstream(int sig_gpio, int pwr_gpio) :
     // _slice and _channel in the initialization above is okay since that
     // does not require anything else to be initialized.
 
+    for (int i = 0; i < enc_max; i++)
+        _enc[i].msg_len = _enc[i].used = 0; // unused
+
+    for (int i = 0; i < DccPkt::type_max; i++)
+        _type_cnt[i] = 0;
+
+    encode(_enc_idle, _pkt_idle);
+    encode(_enc_reset, _pkt_reset);
+
     gpio_set_function(sig_gpio, GPIO_FUNC_PWM);
 
     // track power off
@@ -75,17 +105,17 @@ void DccBitstream::power(bool on)
 
 void DccBitstream::start_ops()
 {
-    start(DccPkt::ops_preamble_bits, _pkt_idle);
+    start(DccPkt::ops_preamble_bits, _enc_idle);
 }
 
 
 void DccBitstream::start_svc()
 {
-    start(DccPkt::svc_preamble_bits, _pkt_reset);
+    start(DccPkt::svc_preamble_bits, _enc_reset);
 }
 
 
-void DccBitstream::start(int preamble_bits, DccPkt& first)
+void DccBitstream::start(int preamble_bits, Enc& first)
 {
     uint32_t sys_hz = clock_get_hz(clk_sys);
     const uint32_t pwm_hz = 1000000; // 1 MHz; 1 usec/count
@@ -106,19 +136,42 @@ void DccBitstream::start(int preamble_bits, DccPkt& first)
     pwm_clear_irq(_slice);
     pwm_set_irq_enabled(_slice, true);
 
-    _preamble_bits = preamble_bits;
+    // Encodings include the preamble, so they all change if the preamble
+    // length changes.
+    if (_preamble_bits != preamble_bits) {
+        _preamble_bits = preamble_bits;
+        encode(_enc_idle, _pkt_idle);
+        encode(_enc_reset, _pkt_reset);
+        for (int i = 0; i < enc_max; i++)
+            _enc[i].msg_len = _enc[i].used = 0;
+    }
 
+    _head = _tail = 0;          // queue empty
+    _cancel = false;
+    _empty_us = time_us_32();
     _current = &first;
-    _next = &_pkt_idle;
+    log_started(time_us_32());
 
-    _byte = -1;                 // sending preamble
-    _bit = _preamble_bits - 1;  // there's no previous packet, so no
-                                // stop bit as part of the preamble;
-                                // set _bit to len-1
+    _bit = _current->bits;
+    _bit_end = _bit + _current->bit_cnt;
 
     power(true);                // track power on
 
-    next_bit();
+    // There's no previous packet, so no stop bit as part of the preamble;
+    // send the extra preamble bit here.
+    prog_bit(bit_1);
+    _half_us = bit_1.level;
+
+    // The sync slice's first wrap is sync_phase_us into the first bit. It
+    // starts a moment ahead of the signal's; the first handler sets it right.
+    _sync_run = _sync_slice;
+    if (_sync_run >= 0) {
+        pwm_set_enabled(_sync_run, false);
+        pwm_init(_sync_run, &config, false);
+        pwm_set_wrap(_sync_run, _half_us - 1);
+        pwm_set_counter(_sync_run, _half_us - sync_phase_us);
+        pwm_set_enabled(_sync_run, true);
+    }
 
     pwm_set_enabled(_slice, true);
 
@@ -129,83 +182,243 @@ void DccBitstream::start(int preamble_bits, DccPkt& first)
 }
 
 
+int DccBitstream::adc_sync(int slice)
+{
+    xassert(slice < 0 || uint(slice) != _slice);
+
+    _sync_slice = slice;
+    return slice < 0 ? -1 : pwm_get_dreq(slice);
+}
+
+
 void DccBitstream::stop()
 {
     power(false);               // track power off
     pwm_set_irq_enabled(_slice, false);
     // stop with output low (0% duty)
     pwm_set_chan_level(_slice, _channel, 0);
+    // Anything still queued is dropped. The irq is off, so _tail can be
+    // written here.
+    _tail = _head;
     // Let the pwm keep running so it gets to the end of the current bit and
     // switches to the 0% duty cycle. If the bitstream starts again, it'll be
     // disabled while it is initialized.
 }
 
 
-void DccBitstream::send_packet(const DccPkt& pkt)
+void DccBitstream::send_packet(const DccPkt& pkt, int repeat)
 {
-    pwm_set_irq_enabled(_slice, false);
+    enqueue(lookup(pkt), repeat);
+}
 
-    // make sure the irq is really disabled before changing _next and _pkt_a/b
-    __dmb();
 
-    if (_current == &_pkt_a) {
-        _pkt_b = pkt; // copy packet (only 12 bytes)
-        _next = &_pkt_b;
-    } else {
-        _pkt_a = pkt; // copy
-        _next = &_pkt_a;
+void DccBitstream::enqueue(Enc *enc, int repeat)
+{
+    xassert(repeat > 0);
+
+    uint32_t head = _head;
+
+    if (head == _tail && _busy) {
+        // the irq handler wrote _empty_us before emptying the queue
+        __dmb();
+        uint32_t gap_us = time_us_32() - _empty_us;
+        if (_gap_max_us < gap_us)
+            _gap_max_us = gap_us;
     }
 
-    // make sure _next and _pkt_a/b are in memory before enabling the irq
+    xassert(int(head - _tail) < slot_max);
+
+    Slot& slot = _slot[head % slot_max];
+    slot.enc = enc;
+    slot.repeat = repeat;
+
+    // make sure the slot is in memory before the ISR can see it
     __dmb();
 
-    pwm_set_irq_enabled(_slice, true);
+    _head = head + 1;
+}
+
+
+// true if enc is queued or being sent
+bool DccBitstream::in_use(const Enc *enc) const
+{
+    // Read _tail before _current. The ISR sets _current from the slot at
+    // _tail before incrementing _tail, so between the two reads every
+    // entry the ISR could be sending is either in [tail, _head) or is
+    // _current.
+    uint32_t tail = _tail;
+    __dmb();
+    if (enc == _current)
+        return true;
+    for (uint32_t i = tail; i != _head; i++)
+        if (_slot[i % slot_max].enc == enc)
+            return true;
+    return false;
+}
+
+
+// Find pkt's encoding in _enc[], or encode it into the least recently used
+// entry that is not queued or being sent, so the ISR never sees an entry
+// change.
+DccBitstream::Enc *DccBitstream::lookup(const DccPkt& pkt)
+{
+    const int msg_len = pkt.msg_len();
+
+    _enc_used++;
+
+    Enc *lru = nullptr;
+
+    for (int i = 0; i < enc_max; i++) {
+        Enc *enc = &_enc[i];
+        if (enc->msg_len == msg_len) {
+            int b = 0;
+            while (b < msg_len && enc->msg[b] == pkt.data(b))
+                b++;
+            if (b == msg_len) {
+                enc->used = _enc_used;
+                return enc;
+            }
+        }
+        if (lru == nullptr || enc->used < lru->used)
+            if (!in_use(enc))
+                lru = enc;
+    }
+
+    xassert(lru != nullptr);
+
+    encode(*lru, pkt);
+    lru->used = _enc_used;
+
+    return lru;
+}
+
+
+int DccBitstream::pkt_bits(const DccPkt& pkt, int preamble_bits)
+{
+    return preamble_bits + pkt.msg_len() * 9;
+}
+
+
+uint32_t DccBitstream::pkt_us(const DccPkt& pkt, int preamble_bits)
+{
+    const int msg_len = pkt.msg_len();
+
+    int ones = 0;
+    for (int byte = 0; byte < msg_len; byte++)
+        ones += __builtin_popcount(pkt.data(byte));
+
+    int zeros = msg_len * 9 - ones; // including start bits
+    ones += preamble_bits;          // including previous stop bit
+
+    return ones * (bit_1.wrap + 1) + zeros * (bit_0.wrap + 1);
+}
+
+
+void DccBitstream::encode(Enc& enc, const DccPkt& pkt)
+{
+    const int msg_len = pkt.msg_len();
+
+    xassert(0 < msg_len && msg_len <= int(sizeof(enc.msg)));
+
+    Bit *bit = enc.bits;
+
+    // preamble; the previous packet's stop bit is the first preamble bit
+    for (int i = 1; i < _preamble_bits; i++)
+        *bit++ = bit_1;
+
+    // start bit then msb first for each byte
+    for (int byte = 0; byte < msg_len; byte++) {
+        uint8_t b = pkt.data(byte);
+        enc.msg[byte] = b;
+        *bit++ = bit_0;
+        for (int i = 7; i >= 0; i--)
+            *bit++ = ((b >> i) & 1) ? bit_1 : bit_0;
+    }
+
+    // stop bit
+    *bit++ = bit_1;
+
+    enc.bit_cnt = bit - enc.bits;
+    enc.msg_len = msg_len;
+    enc.type = pkt.type(_preamble_bits == DccPkt::svc_preamble_bits);
+
+    xassert(enc.bit_cnt <= bits_max);
 }
 
 
 void DccBitstream::next_bit()
 {
-    // byte -1 is the preamble, then byte=0,1,...msg_len-1 for the message bytes
-    if (_byte == -1) {
-        // sending preamble
-        // _bit=[pre_len-1...0], then -1 when preamble is done
-        if (_bit == -1) {
-            // end of preamble, send packet start bit
-            prog_bit(0);
-            _byte = 0;
-            _bit = 8 - 1;
-        } else {
-            // continue preamble
-            prog_bit(1);
-            _bit--;
+    prog_bit(*_bit);
+
+    if (++_bit == _bit_end)
+        next_packet();
+}
+
+
+// Called from the ISR when the last bit of _current has been programmed.
+// This is the consumer side of the queue (see send_packet); it never masks
+// anything or waits on the producer.
+//
+// The bit before that one has just started going out, so the next packet
+// starts going out after both of them.
+void DccBitstream::next_packet()
+{
+    uint32_t start_us = time_us_32() + (_bit_end[-2].wrap + 1) + (_bit_end[-1].wrap + 1);
+
+    uint32_t tail = _tail;
+    bool cancel = false;
+
+    if (_cancel) {
+        _cancel = false;
+        uint32_t head = _cancel_head;
+        if (int(head - tail) > 0) {
+            // drop [tail, head); the slot at tail can have repeats left
+            cancel = true;
+            _cancel_cnt++;
+            _empty_us = time_us_32();
+            __dmb();
+            _tail = tail = head;
         }
+    }
+
+    if (tail == _head && cancel) {
+        // in place of what was dropped
+        _current = &_enc_reset;
+        _pkt_cnt++;
+        _type_cnt[DccPkt::TYPE_RESET]++;
+    } else if (tail == _head) {
+        // nothing queued
+        _current = &_enc_idle;
+        _idle_cnt++;
+        if (_busy)
+            _late_cnt++;
     } else {
-        int msg_len = _current->msg_len();
-        // _bit = 7...0, then -1 means stop bit
-        if (_bit == -1) {
-            // send stop bit
-            if ((_byte + 1) == msg_len) {
-                // end of message, send 1
-                prog_bit(1);
-                // next message
-                _current = _next;
-                _next = &_pkt_idle;
-                _byte = -1; // preamble
-                // stop bit counts as first bit of next preamble
-                // set _bit to pre_len-1, minus one more for the stop bit
-                _bit = _preamble_bits - 2;
-            } else {
-                // more bytes in message, send 0
-                prog_bit(0);
-                _byte++;
-                _bit = 8 - 1;
-            }
-        } else {
-            int b = (_current->data(_byte) >> _bit) & 1;
-            prog_bit(b);
-            _bit--;
+        Slot& slot = _slot[tail % slot_max];
+        _current = slot.enc;
+        _pkt_cnt++;
+        _type_cnt[_current->type]++;
+        if (--slot.repeat == 0) {
+            // last repeat started; slot goes back to producer
+            _empty_us = time_us_32();
+            __dmb();
+            _tail = tail + 1;
         }
     }
+
+    log_started(start_us);
+
+    _bit = _current->bits;
+    _bit_end = _bit + _current->bit_cnt;
+}
+
+
+void DccBitstream::log_started(uint32_t start_us)
+{
+    Started& s = _started[_started_cnt % started_max];
+    s.start_us = start_us;
+    s.msg_len = _current->msg_len;
+    memcpy(s.msg, _current->msg, sizeof(s.msg));
+    _started_cnt++;
 }
 
 
@@ -213,7 +426,96 @@ void DccBitstream::pwm_handler(void *arg)
 {
     //DbgGpio g(0);
 
+    uint32_t start_cyc = rp2040.getCycleCount();
+
     DccBitstream *me = (DccBitstream *)arg;
 
+    if (me->_sync_run >= 0)
+        me->sync_bit();
+
     me->next_bit();
+
+    uint32_t cyc = rp2040.getCycleCount() - start_cyc;
+    me->_isr_cnt++;
+    me->_isr_cyc += cyc;
+    if (me->_isr_max_cyc < cyc)
+        me->_isr_max_cyc = cyc;
+}
+
+
+// From the handler, at the start of a bit, before the next one is programmed.
+// The sync slice is in the last half of the previous bit, to wrap
+// sync_phase_us into this one; its wrap register is latched then, and again
+// halfway through this bit, so both take this bit's half-bit time. Its
+// counter is set from the signal's: how far into this bit it is, plus what
+// the previous bit's last half had to go to get here.
+void DccBitstream::sync_bit()
+{
+    uint8_t half_prev_us = _half_us;
+    _half_us = _half_next_us;
+
+    pwm_set_wrap(_sync_run, _half_us - 1);
+
+    uint16_t ctr = pwm_get_counter(_slice);
+    if (ctr + sync_margin_us > sync_phase_us) {
+        _sync_late_cnt++;
+        return;
+    }
+    pwm_set_counter(_sync_run, half_prev_us - sync_phase_us + ctr);
+}
+
+
+// Producer or another irq handler. Only what is queued when this is called
+// is dropped; a slot the producer is filling now is not in it yet.
+void DccBitstream::cancel()
+{
+    _cancel_head = _head;
+    __dmb();
+    _cancel = true;
+}
+
+
+void DccBitstream::busy(bool b)
+{
+    // When going busy, the gap starts now (not when the queue emptied).
+    if (b && !_busy)
+        _empty_us = time_us_32();
+    _busy = b;
+}
+
+
+void DccBitstream::stats(DccBitstreamStats& stats) const
+{
+    stats.pkt_cnt = _pkt_cnt;
+    stats.reset_cnt = _type_cnt[DccPkt::TYPE_RESET];
+    stats.speed_cnt = _type_cnt[DccPkt::TYPE_SPEED];
+    stats.func_cnt = _type_cnt[DccPkt::TYPE_FUNC];
+    stats.ops_write_cnt = _type_cnt[DccPkt::TYPE_OPS_WRITE];
+    stats.svc_verify_cnt = _type_cnt[DccPkt::TYPE_SVC_VERIFY];
+    stats.svc_write_cnt = _type_cnt[DccPkt::TYPE_SVC_WRITE];
+    stats.other_cnt = _type_cnt[DccPkt::TYPE_IDLE] + _type_cnt[DccPkt::TYPE_OTHER];
+    stats.idle_cnt = _idle_cnt;
+    stats.late_cnt = _late_cnt;
+    stats.cancel_cnt = _cancel_cnt;
+    stats.gap_max_us = _gap_max_us;
+    stats.sync_late_cnt = _sync_late_cnt;
+    stats.isr_cnt = _isr_cnt;
+    stats.isr_max_cyc = _isr_max_cyc;
+    stats.isr_cyc = _isr_cyc;
+}
+
+
+void DccBitstream::stats_reset()
+{
+    _pkt_cnt = 0;
+    for (int i = 0; i < DccPkt::type_max; i++)
+        _type_cnt[i] = 0;
+    _idle_cnt = 0;
+    _late_cnt = 0;
+    _cancel_cnt = 0;
+    _gap_max_us = 0;
+    _sync_late_cnt = 0;
+    _isr_cnt = 0;
+    _isr_max_cyc = 0;
+    _isr_cyc = 0;
 }
@@ -3,6 +3,7 @@
 #include <Arduino.h>
 #include "hardware/pwm.h"
 #include "dcc_pkt.h"
+#include "dcc_bitstream_stats.h"
 
 
 class DccBitstream
@@ -19,56 +20,201 @@ class DccBitstream
         void start_svc();
         void stop();
 
-        inline bool need_packet()
+        // true if everything queued has started going out
+        inline bool need_packet() const
         {
-            return (_next == &_pkt_idle);
+            return _head == _tail;
         }
 
-        void send_packet(const DccPkt& pkt);
+        // number of queue slots not yet started
+        inline int pending() const
+        {
+            return int(_head - _tail);
+        }
 
-        inline void send_reset()
+        // Queue pkt to be sent repeat times in a row. The queue must not be
+        // full (pending() < slot_max). Does not mask the irq; see next_bit().
+        void send_packet(const DccPkt& pkt, int repeat=1);
+
+        inline void send_reset(int repeat=1)
         {
-            send_packet(_pkt_reset);
+            enqueue(&_enc_reset, repeat);
         }
 
+        // The producer says whether it always has something to send (ops
+        // mode with throttles, or in the middle of a service mode operation).
+        // An idle packet sent while busy means the producer was late.
+        void busy(bool b);
+
+        // Drop everything queued so far, including the repeats left of the
+        // packet going out. That packet finishes, then the first one queued
+        // after this call goes out, or a reset if there isn't one. Can be
+        // called from another irq handler on the same core (DccCommand does,
+        // from the adc's when it sees an ack).
+        void cancel();
+
+        // The packets started (each repeat, and idle packets, counted), for
+        // telling what was on the track when: DccAdc's trace reads them from
+        // its irq handler, on the same core. started(n) is packet n, one of
+        // the last started_max; its start_us is when its first bit goes out,
+        // which is two bits after the handler starts it (see next_bit()).
+        struct Started {
+            uint32_t start_us;
+            uint8_t msg[3];     // enough to tell what it is
+            uint8_t msg_len;
+        };
+        static const int started_max = 4;
+        uint32_t started_cnt() const { return _started_cnt; }
+        const Started& started(uint32_t n) const
+        {
+            return _started[n % started_max];
+        }
+
+        // ADC sync: a pwm slice nothing else uses (slice, -1 for none) is run
+        // locked to the signal's, wrapping sync_phase_us into each half bit,
+        // for DccAdc::sync to start a conversion on each wrap, so samples are
+        // never taken right at an edge, where the driver switching spikes
+        // the current. The interrupt handler sets its wrap for each bit, and
+        // its counter from the signal's so it can't drift; a handler too
+        // late to do that before the wrap puts one bit's samples off phase
+        // (sync_late_cnt). Takes effect at the next start. Returns the
+        // slice's dreq, or -1 for none.
+        int adc_sync(int slice);
+        static const int sync_phase_us = 29; // middle of a one's half bit
+
+        void stats(DccBitstreamStats& stats) const;
+        void stats_reset();
+
+        // Bits and time on the track for pkt sent back-to-back with other
+        // packets: the preamble (the previous packet's stop bit, then
+        // preamble_bits-1 more) and the start and data bits, using the
+        // bit_0 and bit_1 times prog_bit() programs.
+        static int pkt_bits(const DccPkt& pkt,
+                            int preamble_bits=DccPkt::ops_preamble_bits);
+        static uint32_t pkt_us(const DccPkt& pkt,
+                               int preamble_bits=DccPkt::ops_preamble_bits);
+
+        static const int slot_max = 8; // power of 2
+
     private:
 
         int _pwr_gpio;
 
         DccPktIdle _pkt_idle;
         DccPktReset _pkt_reset;
-        DccPkt _pkt_a;
-        DccPkt _pkt_b;
 
-        // ISR sends packet at _current. When it is done:
-        //   _current = _next   // _pkt_a, _pkt_b, _pkt_idle, _pkt_reset
-        //   _next = _pkt_idle
-        //   start packet at _current with _preamble_bits
-
-        DccPkt *_first;     // first _current to go
-        DccPkt *_current;   // never nullptr
-        DccPkt *_next;      // _pkt_idle if nothing to send
+        // One bit as programmed into the pwm.
+        // Period is wrap+1 usec (pwm_hz = 1 MHz), and output is high for
+        // count=[0...level-1], low for count=[level...wrap].
+        // Wrap is bit_us-1 and level is bit_us/2.
+        // E.g. for square wave with period 4 us, wrap=3 and level=2.
+        struct Bit {
+            uint8_t wrap;
+            uint8_t level;
+        };
+
+        static constexpr Bit bit_0 = { 2 * 100 - 1, 100 }; // half-bit times
+        static constexpr Bit bit_1 = { 2 * 58 - 1, 58 };
+
+        // preamble (20 max) + 8 bytes * (start bit + 8) + stop = 93 bits
+        static const int bits_max = DccPkt::svc_preamble_bits + 8 * 9 + 1;
+
+        // A packet encoded as the sequence of bits the ISR programs into the
+        // pwm: preamble (_preamble_bits-1, since the previous packet's stop
+        // bit is the first bit of this preamble), start bits, data, and the
+        // stop bit. The message bytes are kept so a packet sent again (e.g.
+        // a throttle's speed and function refresh) can reuse its encoding.
+        struct Enc {
+            uint8_t msg[8];
+            int msg_len;        // 0 if entry is unused
+            uint32_t used;      // _enc_used when last looked up, 0 if unused
+            DccPkt::Type type;  // for stats
+            int bit_cnt;
+            Bit bits[bits_max];
+        };
+
+        Enc _enc_idle;
+        Enc _enc_reset;
+
+        static const int enc_max = 16;
+        Enc _enc[enc_max];
+        uint32_t _enc_used;
+
+        // Single-producer (send_packet), single-consumer (ISR) queue.
+        //
+        // The producer fills _slot[_head % slot_max] and then increments
+        // _head. When the ISR finishes a packet, it starts the slot at
+        // _tail (or _enc_idle if the queue is empty), decrements its repeat
+        // count, and increments _tail when the last repeat has started. The
+        // producer only writes _head and slots outside [_tail, _head); the
+        // ISR only writes _tail and the repeat count of the slot at _tail.
+        struct Slot {
+            Enc *enc;
+            int repeat;
+        };
+
+        Slot _slot[slot_max];
+        volatile uint32_t _head;
+        volatile uint32_t _tail;
+
+        // Set by cancel(), with the _head to drop up to, and taken by the ISR
+        // at the next packet.
+        volatile bool _cancel;
+        volatile uint32_t _cancel_head;
+
+        // statistics (see DccBitstreamStats)
+        volatile bool _busy;
+        volatile uint32_t _pkt_cnt;
+        volatile uint32_t _type_cnt[DccPkt::type_max]; // from the queue
+        volatile uint32_t _idle_cnt;
+        volatile uint32_t _late_cnt;
+        volatile uint32_t _cancel_cnt;
+        volatile uint32_t _empty_us; // when the irq handler last moved _tail
+        uint32_t _gap_max_us;       // written by the producer
+        volatile uint32_t _sync_late_cnt;
+        volatile uint32_t _isr_cnt;
+        volatile uint32_t _isr_max_cyc;
+        volatile uint64_t _isr_cyc;
+
+        Enc * volatile _current; // never nullptr
+
+        Started _started[started_max];
+        volatile uint32_t _started_cnt;
+        void log_started(uint32_t start_us);
+
+        const Bit *_bit;    // next bit to program in _current
+        const Bit *_bit_end;
 
         int _preamble_bits;
 
         uint _slice;    // uint to match pico-sdk
         uint _channel;  // uint to match pico-sdk
 
-        int _byte; // -1 for preamble, then index in _current
-        int _bit;  // counts down bit in preamble or _byte
+        // adc sync slice as set, and as started (-1 for none)
+        int _sync_slice;
+        int _sync_run;
+        static const int sync_margin_us = 4; // to set its counter before it wraps
+        uint8_t _half_us;       // half-bit time of the bit going out
+        uint8_t _half_next_us;  // of the bit programmed to go next
+        void sync_bit();
+
+        void start(int preamble_bits, Enc& first);
+
+        void encode(Enc& enc, const DccPkt& pkt);
+
+        Enc *lookup(const DccPkt& pkt);
+
+        bool in_use(const Enc *enc) const;
+
+        void enqueue(Enc *enc, int repeat);
 
-        void start(int preamble_bits, DccPkt& first);
+        void next_packet();
 
-        inline void prog_bit(int b)
+        inline void prog_bit(const Bit& b)
         {
-            // Period is wrap+1 usec (pwm_hz = 1 MHz), and output is high for
-            // count=[0...level-1], low for count=[level...wrap].
-            // Set wrap to bit_us-1 and level to bit_us/2.
-            // E.g. for square wave with period 4 us, wrap=3 and level=2.
-
-            int half_us = (b == 0 ? 100 : 58); // half-bit times
-            pwm_set_wrap(_slice, 2 * half_us - 1);
-            pwm_set_chan_level(_slice, _channel, half_us);
+            pwm_set_wrap(_slice, b.wrap);
+            pwm_set_chan_level(_slice, _channel, b.level);
+            _half_next_us = b.level;
         }
 
         void next_bit();
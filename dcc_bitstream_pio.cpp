@@ -0,0 +1,477 @@
+#include <Arduino.h>
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/pio.h"
+#include "xassert.h"
+#include "dcc_pkt.h"
+#include "dcc_pio_words.h"
+#include "dcc_bitstream_pio.h"
+
+
+// PIO program:
+//
+// The state machine runs at 1 MHz (1 usec per instruction cycle), and drives
+// the signal gpio with side-set. Each packet is a header word with the bit
+// count (minus one), followed by the bits msb-first (see DccPioWords).
+//
+//  0 new_pkt:  pull block          side 0      ; header word
+//  1           out x, 32           side 0      ; x = bit count - 1
+//  2           jmp bit2            side 0
+//  3 bit:      nop                 side 0 [2]  ; same time as 0..2
+//  4 bit2:     pull ifempty block  side 0      ; next data word if needed
+//  5           out y, 1            side 0      ; y = bit
+//  6           jmp y-- one         side 0
+//  7 zero:     set y, 31           side 1 [3]  ; high 4 +
+//  8 h0:       jmp y-- h0          side 1 [2]  ;   32*3 = 100
+//  9           set y, 29           side 0 [2]  ; low 3 +
+// 10 l0:       jmp y-- l0          side 0 [2]  ;   30*3 +
+// 11           jmp x-- bit         side 0      ;   1 + 3 + 3 = 100
+// 12           jmp new_pkt         side 0      ; (packets end with a one)
+// 13 one:      set y, 27           side 1 [1]  ; high 2 +
+// 14 h1:       jmp y-- h1          side 1 [1]  ;   28*2 = 58
+// 15           set y, 24           side 0      ; low 1 +
+// 16 l1:       jmp y-- l1          side 0 [1]  ;   25*2 +
+// 17           jmp x-- bit         side 0      ;   1 + 3 + 3 = 58
+//              (wrap to new_pkt)
+//
+// The low half of each bit includes the 7 cycles to get the next bit
+// (instructions 11 or 17, 3, and 4..6). At the end of a packet, the path
+// through 17 (not taken) and 0..2 is also 7 cycles, so there is no gap
+// between packets.
+//
+// If the fifo runs dry the state machine stalls at the pull with the output
+// low, stretching the stop bit. The DMA handler always queues at least an
+// idle packet, and the fifo (joined, 8 words) holds two packets, so this
+// should only happen if interrupts are held off for a packet time.
+
+uint16_t DccBitstreamPio::prog_instr[prog_len];
+
+const pio_program DccBitstreamPio::prog = {
+    .instructions = prog_instr,
+    .length = prog_len,
+    .origin = -1,
+};
+
+DccBitstreamPio *DccBitstreamPio::dma_owner[NUM_DMA_CHANNELS];
+
+
+DccBitstreamPio::DccBitstreamPio(int sig_gpio, int pwr_gpio, PIO pio) :
+    _sig_gpio(sig_gpio),
+    _pwr_gpio(pwr_gpio),
+    _pio(pio),
+    _sm(-1),
+    _offset(0),
+    _dma_ch(-1),
+    _pkt_idle(),
+    _pkt_reset(),
+    _head(0),
+    _tail(0),
+    _cancel(false),
+    _cancel_head(0),
+    _busy(false),
+    _pkt_cnt(0),
+    // _type_cnt zeroed below
+    _idle_cnt(0),
+    _late_cnt(0),
+    _cancel_cnt(0),
+    _empty_us(0),
+    _gap_max_us(0),
+    _isr_cnt(0),
+    _isr_max_cyc(0),
+    _isr_cyc(0),
+    _current(&_words_idle),
+    // _started set when used
+    _started_cnt(0),
+    _next_start_us(0),
+    _preamble_bits(DccPkt::ops_preamble_bits)
+{
+    // Do not do PIO or DMA setup here since this might be a static object,
+    // and other stuff is not fully initialized (e.g. clock_get_hz()). That
+    // is done in start().
+
+    for (int i = 0; i < DccPkt::type_max; i++)
+        _type_cnt[i] = 0;
+
+    encode(_words_idle, _pkt_idle, _preamble_bits - 1);
+
+    // track power off
+    gpio_init(_pwr_gpio);
+    power(false);
+    gpio_set_dir(_pwr_gpio, GPIO_OUT);
+}
+
+
+DccBitstreamPio::~DccBitstreamPio()
+{
+    stop(); // track power off, output low
+
+    if (_dma_ch >= 0) {
+        dma_owner[_dma_ch] = nullptr;
+        dma_channel_unclaim(_dma_ch);
+    }
+
+    if (_sm >= 0) {
+        pio_remove_program(_pio, &prog, _offset);
+        pio_sm_unclaim(_pio, _sm);
+    }
+}
+
+
+void DccBitstreamPio::power(bool on)
+{
+    gpio_put(_pwr_gpio, on ? 1 : 0);
+}
+
+
+void DccBitstreamPio::start_ops()
+{
+    start(DccPkt::ops_preamble_bits, _pkt_idle);
+}
+
+
+void DccBitstreamPio::start_svc()
+{
+    start(DccPkt::svc_preamble_bits, _pkt_reset);
+}
+
+
+void DccBitstreamPio::program_init()
+{
+    // side-set is 1 bit, not optional, so delays are 0..15
+    const uint s0 = pio_encode_sideset(1, 0);
+    const uint s1 = pio_encode_sideset(1, 1);
+
+    // jump targets are relative to the start of the program;
+    // pio_add_program() relocates them
+    const uint new_pkt = 0;
+    const uint bit = 3;
+    const uint bit2 = 4;
+    const uint h0 = 8;
+    const uint l0 = 10;
+    const uint one = 13;
+    const uint h1 = 14;
+    const uint l1 = 16;
+
+    int i = 0;
+    prog_instr[i++] = pio_encode_pull(false, true) | s0;
+    prog_instr[i++] = pio_encode_out(pio_x, 32) | s0;
+    prog_instr[i++] = pio_encode_jmp(bit2) | s0;
+    prog_instr[i++] = pio_encode_nop() | s0 | pio_encode_delay(2);
+    prog_instr[i++] = pio_encode_pull(true, true) | s0;
+    prog_instr[i++] = pio_encode_out(pio_y, 1) | s0;
+    prog_instr[i++] = pio_encode_jmp_y_dec(one) | s0;
+    // zero
+    prog_instr[i++] = pio_encode_set(pio_y, 31) | s1 | pio_encode_delay(3);
+    prog_instr[i++] = pio_encode_jmp_y_dec(h0) | s1 | pio_encode_delay(2);
+    prog_instr[i++] = pio_encode_set(pio_y, 29) | s0 | pio_encode_delay(2);
+    prog_instr[i++] = pio_encode_jmp_y_dec(l0) | s0 | pio_encode_delay(2);
+    prog_instr[i++] = pio_encode_jmp_x_dec(bit) | s0;
+    prog_instr[i++] = pio_encode_jmp(new_pkt) | s0;
+    // one
+    prog_instr[i++] = pio_encode_set(pio_y, 27) | s1 | pio_encode_delay(1);
+    prog_instr[i++] = pio_encode_jmp_y_dec(h1) | s1 | pio_encode_delay(1);
+    prog_instr[i++] = pio_encode_set(pio_y, 24) | s0;
+    prog_instr[i++] = pio_encode_jmp_y_dec(l1) | s0 | pio_encode_delay(1);
+    prog_instr[i++] = pio_encode_jmp_x_dec(bit) | s0;
+
+    xassert(i == prog_len);
+}
+
+
+void DccBitstreamPio::start(int preamble_bits, const DccPkt& first)
+{
+    if (_sm < 0) {
+        // first start: claim state machine and dma channel, load program
+        program_init();
+        xassert(pio_can_add_program(_pio, &prog));
+        _offset = pio_add_program(_pio, &prog);
+        _sm = pio_claim_unused_sm(_pio, true);
+
+        _dma_ch = dma_claim_unused_channel(true);
+        dma_owner[_dma_ch] = this;
+
+        static bool handler_added = false;
+        if (!handler_added) {
+            irq_add_shared_handler(DMA_IRQ_0, dma_handler,
+                                   PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+            irq_set_enabled(DMA_IRQ_0, true);
+            handler_added = true;
+        }
+    }
+
+    // If this is a start after a previous stop, the state machine is
+    // disabled and the dma channel is idle.
+
+    pio_sm_set_enabled(_pio, _sm, false);
+
+    uint32_t sys_hz = clock_get_hz(clk_sys);
+    const uint32_t pio_hz = 1000000; // 1 MHz; 1 usec/instruction
+    uint32_t pio_div = sys_hz / pio_hz;
+
+    pio_sm_config config = pio_get_default_sm_config();
+    sm_config_set_wrap(&config, _offset, _offset + prog_len - 1);
+    sm_config_set_sideset(&config, 1, false, false);
+    sm_config_set_sideset_pins(&config, _sig_gpio);
+    sm_config_set_out_shift(&config, false, false, 32); // msb first, no autopull
+    sm_config_set_fifo_join(&config, PIO_FIFO_JOIN_TX);
+    sm_config_set_clkdiv_int_frac(&config, pio_div, 0);
+
+    pio_gpio_init(_pio, _sig_gpio);
+    pio_sm_set_consecutive_pindirs(_pio, _sm, _sig_gpio, 1, true);
+    pio_sm_init(_pio, _sm, _offset, &config);
+    pio_sm_clear_fifos(_pio, _sm);
+
+    dma_channel_config dma_config = dma_channel_get_default_config(_dma_ch);
+    channel_config_set_transfer_data_size(&dma_config, DMA_SIZE_32);
+    channel_config_set_read_increment(&dma_config, true);
+    channel_config_set_write_increment(&dma_config, false);
+    channel_config_set_dreq(&dma_config, pio_get_dreq(_pio, _sm, true));
+    dma_channel_configure(_dma_ch, &dma_config, &_pio->txf[_sm], nullptr, 0,
+                          false);
+
+    _preamble_bits = preamble_bits;
+
+    // idle is the fill packet, always with the short preamble following
+    // the previous packet's stop bit
+    encode(_words_idle, _pkt_idle, _preamble_bits - 1);
+    encode(_words_reset, _pkt_reset, _preamble_bits - 1);
+
+    // There's no previous packet, so no stop bit as part of the preamble for
+    // the first one; send it with the full preamble.
+    encode(_words_first, first, _preamble_bits);
+
+    _head = _tail = 0;          // queue empty
+    _cancel = false;
+    _empty_us = time_us_32();
+    _current = &_words_first;
+    _next_start_us = time_us_32();
+    log_started();
+
+    power(true);                // track power on
+
+    dma_channel_acknowledge_irq0(_dma_ch);
+    dma_channel_set_irq0_enabled(_dma_ch, true);
+    dma_channel_transfer_from_buffer_now(_dma_ch, _current->w, _current->cnt);
+
+    pio_sm_set_enabled(_pio, _sm, true);
+}
+
+
+void DccBitstreamPio::stop()
+{
+    power(false);               // track power off
+
+    if (_sm < 0)
+        return;                 // never started
+
+    dma_channel_set_irq0_enabled(_dma_ch, false);
+    dma_channel_abort(_dma_ch);
+    pio_sm_set_enabled(_pio, _sm, false);
+    // stop with output low
+    pio_sm_exec(_pio, _sm, pio_encode_nop() | pio_encode_sideset(1, 0));
+    // Anything still queued is dropped. The irq is off, so _tail can be
+    // written here.
+    _tail = _head;
+}
+
+
+void DccBitstreamPio::enqueue(const DccPkt& pkt, int repeat)
+{
+    xassert(repeat > 0);
+
+    uint32_t head = _head;
+
+    if (head == _tail && _busy) {
+        // the dma handler wrote _empty_us before emptying the queue
+        __dmb();
+        uint32_t gap_us = time_us_32() - _empty_us;
+        if (_gap_max_us < gap_us)
+            _gap_max_us = gap_us;
+    }
+
+    xassert(int(head - _tail) < slot_max);
+
+    // The slot at head is not in [_tail-1, _head), so the DMA handler is
+    // not using it.
+    Slot& slot = _slot[head % ring_max];
+    encode(slot.words, pkt, _preamble_bits - 1);
+    slot.repeat = repeat;
+
+    // make sure the slot is in memory before the handler can see it
+    __dmb();
+
+    _head = head + 1;
+}
+
+
+// dma is done loading _current into the fifo; start the next one
+void DccBitstreamPio::next_packet()
+{
+    uint32_t tail = _tail;
+    bool cancel = false;
+
+    if (_cancel) {
+        _cancel = false;
+        uint32_t head = _cancel_head;
+        if (int(head - tail) > 0) {
+            // drop [tail, head); none of them is loading
+            cancel = true;
+            _cancel_cnt++;
+            _empty_us = time_us_32();
+            __dmb();
+            _tail = tail = head;
+        }
+    }
+
+    if (tail == _head && cancel) {
+        // in place of what was dropped
+        _current = &_words_reset;
+        _pkt_cnt++;
+        _type_cnt[DccPkt::TYPE_RESET]++;
+    } else if (tail == _head) {
+        // nothing queued
+        _current = &_words_idle;
+        _idle_cnt++;
+        if (_busy)
+            _late_cnt++;
+    } else {
+        Slot& slot = _slot[tail % ring_max];
+        _current = &slot.words;
+        _pkt_cnt++;
+        _type_cnt[_current->type]++;
+        if (--slot.repeat == 0) {
+            // last repeat started; slot goes back to producer
+            _empty_us = time_us_32();
+            __dmb();
+            _tail = tail + 1;
+        }
+    }
+
+    log_started();
+
+    dma_channel_transfer_from_buffer_now(_dma_ch, _current->w, _current->cnt);
+}
+
+
+// _current was just started; it goes out when the packet before it is
+// done, or now if the fifo ran dry
+void DccBitstreamPio::log_started()
+{
+    uint32_t start_us = _next_start_us;
+    uint32_t now_us = time_us_32();
+    if (int32_t(start_us - now_us) < 0)
+        start_us = now_us;
+    _next_start_us = start_us + _current->us;
+
+    Started& s = _started[_started_cnt % started_max];
+    s.start_us = start_us;
+    s.msg_len = _current->msg_len;
+    memcpy(s.msg, _current->msg, sizeof(s.msg));
+    _started_cnt++;
+}
+
+
+void DccBitstreamPio::encode(Words& words, const DccPkt& pkt, int preamble_bits)
+{
+    words.cnt = DccPioWords::encode(pkt, preamble_bits, words.w);
+    words.msg_len = pkt.msg_len();
+    for (int i = 0; i < int(sizeof(words.msg)); i++)
+        words.msg[i] = i < words.msg_len ? pkt.data(i) : 0;
+    // the words have the stop bit too, which pkt_us counts in the next
+    // packet's preamble
+    words.us = pkt_us(pkt, preamble_bits + 1);
+    words.type = pkt.type(_preamble_bits == DccPkt::svc_preamble_bits);
+}
+
+
+void DccBitstreamPio::dma_handler()
+{
+    for (int ch = 0; ch < NUM_DMA_CHANNELS; ch++) {
+        DccBitstreamPio *me = dma_owner[ch];
+        if (me != nullptr && dma_channel_get_irq0_status(ch)) {
+            uint32_t start_cyc = rp2040.getCycleCount();
+            dma_channel_acknowledge_irq0(ch);
+            me->next_packet();
+            uint32_t cyc = rp2040.getCycleCount() - start_cyc;
+            me->_isr_cnt++;
+            me->_isr_cyc += cyc;
+            if (me->_isr_max_cyc < cyc)
+                me->_isr_max_cyc = cyc;
+        }
+    }
+}
+
+
+void DccBitstreamPio::cancel()
+{
+    _cancel_head = _head;
+    __dmb();
+    _cancel = true;
+}
+
+
+void DccBitstreamPio::busy(bool b)
+{
+    // When going busy, the gap starts now (not when the queue emptied).
+    if (b && !_busy)
+        _empty_us = time_us_32();
+    _busy = b;
+}
+
+
+void DccBitstreamPio::stats(DccBitstreamStats& stats) const
+{
+    stats.pkt_cnt = _pkt_cnt;
+    stats.reset_cnt = _type_cnt[DccPkt::TYPE_RESET];
+    stats.speed_cnt = _type_cnt[DccPkt::TYPE_SPEED];
+    stats.func_cnt = _type_cnt[DccPkt::TYPE_FUNC];
+    stats.ops_write_cnt = _type_cnt[DccPkt::TYPE_OPS_WRITE];
+    stats.svc_verify_cnt = _type_cnt[DccPkt::TYPE_SVC_VERIFY];
+    stats.svc_write_cnt = _type_cnt[DccPkt::TYPE_SVC_WRITE];
+    stats.other_cnt = _type_cnt[DccPkt::TYPE_IDLE] + _type_cnt[DccPkt::TYPE_OTHER];
+    stats.idle_cnt = _idle_cnt;
+    stats.late_cnt = _late_cnt;
+    stats.cancel_cnt = _cancel_cnt;
+    stats.gap_max_us = _gap_max_us;
+    stats.sync_late_cnt = 0;
+    stats.isr_cnt = _isr_cnt;
+    stats.isr_max_cyc = _isr_max_cyc;
+    stats.isr_cyc = _isr_cyc;
+}
+
+
+void DccBitstreamPio::stats_reset()
+{
+    _pkt_cnt = 0;
+    for (int i = 0; i < DccPkt::type_max; i++)
+        _type_cnt[i] = 0;
+    _idle_cnt = 0;
+    _late_cnt = 0;
+    _cancel_cnt = 0;
+    _gap_max_us = 0;
+    _isr_cnt = 0;
+    _isr_max_cyc = 0;
+    _isr_cyc = 0;
+}
+
+
+int DccBitstreamPio::pkt_bits(const DccPkt& pkt, int preamble_bits)
+{
+    return preamble_bits + pkt.msg_len() * 9;
+}
+
+
+// one is 2 * 58 usec and zero 2 * 100 usec (see the program above)
+uint32_t DccBitstreamPio::pkt_us(const DccPkt& pkt, int preamble_bits)
+{
+    const int msg_len = pkt.msg_len();
+
+    int ones = 0;
+    for (int byte = 0; byte < msg_len; byte++)
+        ones += __builtin_popcount(pkt.data(byte));
+
+    int zeros = msg_len * 9 - ones; // including start bits
+    ones += preamble_bits;          // including previous stop bit
+
+    return ones * 2 * 58 + zeros * 2 * 100;
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <Arduino.h>
+#include "hardware/dma.h"
+#include "hardware/pio.h"
+#include "dcc_pkt.h"
+#include "dcc_pio_words.h"
+#include "dcc_bitstream_stats.h"
+
+
+// Same interface as DccBitstream, but the bits are generated by a PIO state
+// machine fed by DMA. Each packet is converted to a word stream (see
+// DccPioWords) when it is queued, and the CPU takes one interrupt per packet
+// (DMA done) instead of one per bit.
+
+class DccBitstreamPio
+{
+
+    public:
+
+        DccBitstreamPio(int sig_gpio, int pwr_gpio, PIO pio=pio0);
+        ~DccBitstreamPio();
+
+        void power(bool on);
+
+        void start_ops();
+        void start_svc();
+        void stop();
+
+        // true if everything queued has started going out
+        inline bool need_packet() const
+        {
+            return _head == _tail;
+        }
+
+        // number of queue slots not yet started
+        inline int pending() const
+        {
+            return int(_head - _tail);
+        }
+
+        // Queue pkt to be sent repeat times in a row. The queue must not be
+        // full (pending() < slot_max). Does not mask the irq.
+        inline void send_packet(const DccPkt& pkt, int repeat=1)
+        {
+            enqueue(pkt, repeat);
+        }
+
+        inline void send_reset(int repeat=1)
+        {
+            enqueue(_pkt_reset, repeat);
+        }
+
+        // Same as DccBitstream's.
+        void busy(bool b);
+
+        // Same as DccBitstream's, except that the packet after the one going
+        // out is already in the fifo too, so it also goes out.
+        void cancel();
+
+        // Same as DccBitstream's, except that a packet is started when its
+        // words go into the fifo, and its start_us is when the packets ahead
+        // of it there are done.
+        struct Started {
+            uint32_t start_us;
+            uint8_t msg[3];     // enough to tell what it is
+            uint8_t msg_len;
+        };
+        static const int started_max = 4;
+        uint32_t started_cnt() const { return _started_cnt; }
+        const Started& started(uint32_t n) const
+        {
+            return _started[n % started_max];
+        }
+
+        // Not here: there's no handler each bit to keep a slice locked to
+        // the state machine's bits, so the adc runs free. Always -1.
+        int adc_sync(int slice) { (void)slice; return -1; }
+
+        void stats(DccBitstreamStats& stats) const;
+        void stats_reset();
+
+        // Same as DccBitstream's, using the state machine's bit times.
+        static int pkt_bits(const DccPkt& pkt,
+                            int preamble_bits=DccPkt::ops_preamble_bits);
+        static uint32_t pkt_us(const DccPkt& pkt,
+                               int preamble_bits=DccPkt::ops_preamble_bits);
+
+        static const int slot_max = 8; // power of 2
+
+    private:
+
+        int _sig_gpio;
+        int _pwr_gpio;
+
+        PIO _pio;
+        int _sm;        // -1 until start_*()
+        uint _offset;   // where program is loaded
+        int _dma_ch;    // -1 until start_*()
+
+        DccPktIdle _pkt_idle;
+        DccPktReset _pkt_reset;
+
+        struct Words {
+            uint32_t w[DccPioWords::words_max];
+            int cnt;
+            uint8_t msg[3];     // for Started
+            uint8_t msg_len;
+            uint32_t us;        // pkt_us
+            DccPkt::Type type;  // for stats
+        };
+        void encode(Words& words, const DccPkt& pkt, int preamble_bits);
+
+        Words _words_idle;
+        Words _words_reset; // in place of packets dropped by cancel()
+        Words _words_first; // first packet, with the full preamble
+
+        // Single-producer (send_packet), single-consumer (DMA handler) queue,
+        // same as DccBitstream's except each slot holds its own words. The
+        // slot before _tail can still be loading into the fifo, so there are
+        // twice as many slots as can be pending; a slot is not reused until
+        // the transfer from it is done.
+        //
+        // DMA handler loads words at _current into the PIO's fifo. When that
+        // transfer is done, it starts the slot at _tail (or _words_idle if
+        // the queue is empty), decrements its repeat count, and increments
+        // _tail when the last repeat has started.
+        struct Slot {
+            Words words;
+            int repeat;
+        };
+
+        static const int ring_max = 2 * slot_max;
+        Slot _slot[ring_max];
+        volatile uint32_t _head;
+        volatile uint32_t _tail;
+
+        // same as DccBitstream's
+        volatile bool _cancel;
+        volatile uint32_t _cancel_head;
+
+        // statistics (see DccBitstreamStats)
+        volatile bool _busy;
+        volatile uint32_t _pkt_cnt;
+        volatile uint32_t _type_cnt[DccPkt::type_max]; // from the queue
+        volatile uint32_t _idle_cnt;
+        volatile uint32_t _late_cnt;
+        volatile uint32_t _cancel_cnt;
+        volatile uint32_t _empty_us; // when the dma handler last moved _tail
+        uint32_t _gap_max_us;       // written by the producer
+        volatile uint32_t _isr_cnt;
+        volatile uint32_t _isr_max_cyc;
+        volatile uint64_t _isr_cyc;
+
+        const Words *_current; // never nullptr
+
+        // Started; packets go out back to back, so each one starts when the
+        // one before it is done, unless the fifo ran dry
+        Started _started[started_max];
+        volatile uint32_t _started_cnt;
+        uint32_t _next_start_us;
+        void log_started();
+
+        int _preamble_bits;
+
+        void start(int preamble_bits, const DccPkt& first);
+
+        void enqueue(const DccPkt& pkt, int repeat);
+
+        void next_packet();
+
+        // PIO program, built by program_init()
+        static const int prog_len = 18;
+        static uint16_t prog_instr[prog_len];
+        static const pio_program prog;
+        static void program_init();
+
+        // one shared DMA irq handler; find the object from the channel
+        static DccBitstreamPio *dma_owner[NUM_DMA_CHANNELS];
+        static void dma_handler();
+
+}; // class DccBitstreamPio
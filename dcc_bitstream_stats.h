@@ -0,0 +1,32 @@
+#pragma once
+
+#include <Arduino.h>
+
+
+// Counters kept by DccBitstream and DccBitstreamPio, mostly in the irq
+// handler. All are since the object was created or stats_reset() was last
+// called. They are read without masking the irq, so a snapshot taken while
+// the bitstream is running can be off by a packet.
+
+struct DccBitstreamStats
+{
+    uint32_t pkt_cnt;       // packets sent from the queue (each repeat counts)
+    uint32_t reset_cnt;     //   of those, resets (from send_reset(), or
+                            //   in place of packets dropped by cancel())
+    uint32_t speed_cnt;     //   speed (DccPkt::type())
+    uint32_t func_cnt;      //   function
+    uint32_t ops_write_cnt; //   ops mode cv write
+    uint32_t svc_verify_cnt; //  service mode verify (byte or bit)
+    uint32_t svc_write_cnt; //   service mode write (byte or bit)
+    uint32_t other_cnt;     //   anything else
+    uint32_t idle_cnt;      // idle packets sent because the queue was empty
+    uint32_t late_cnt;      //   of those, sent while the producer was busy
+    uint32_t cancel_cnt;    // cancel() calls that dropped packets
+    uint32_t gap_max_us;    // longest time from the queue going empty to the
+                            //   next send_packet(), while the producer was busy
+    uint32_t sync_late_cnt; // bits the adc sync slice was set too late for
+                            //   (DccBitstream::adc_sync)
+    uint32_t isr_cnt;       // irq handler calls
+    uint32_t isr_max_cyc;   // longest irq handler call, in cpu cycles
+    uint64_t isr_cyc;       // total of all irq handler calls, in cpu cycles
+};
@@ -1,5 +1,4 @@
 #include <Arduino.h>
-#include <list>
 #include "xassert.h"
 #include "dcc_adc.h"
 #include "dcc_throttle.h"
@@ -10,12 +9,56 @@ DccCommand::DccCommand(int sig_gpio, int pwr_gpio, DccAdc& adc) :
     _bitstream(sig_gpio, pwr_gpio),
     _adc(adc),
     _mode(MODE_OFF),
-    // _throttles uses default initializer
-    _next_throttle(_throttles.begin()),
+    // _throttle uses default initializer
+    // _link_next, _link_prev, _free set below
+    _free_cnt(0),
+    _throttle_cnt(0),
+    _next_throttle(-1),
+    _refresh_weight(refresh_weight_default),
+    _idle_refresh_us(idle_refresh_us_default),
+    // _refresh set when a throttle is created
+    // _air set below
+    // _throttle_air set when a throttle is created
+    _refresh_air_us(0),
+    _refresh_air_cnt(0),
+    _refresh_pkt_us(_bitstream.pkt_us(DccPktSpeed128())),
+    _refresh_max_us(0),
+    _ops_pkt_cnt(0),
+    _next_urgent(-1),
+    _urgent_run(0),
+    _next_write(-1),
+    _write_share_pct(write_share_pct_default),
+    _write_credit(0),
+    _trip_ma(trip_ma_default),
+    _trip_us(trip_us_default),
+    _trip_on_us(0),
+    _trip_backoff_ms(0),
+    _trip_seen(0),
+    _trip_retry_cnt(0),
+    _trace_pkt(0),
+    _trace_tag(TRACE_IDLE),
     // _svc_status set when needed
-    // _ack_ma set when needed
+    _svc_no_load(false),
+    _svc_load_checked(false),
+    _svc_start_us(0),
+    // _ack_ma, _ack_base_ma, _ack_noise_ma set when needed
+    _ack_cancel(true),
+    // _svc_ack set when used
+    _svc_ack_cnt(0),
+    _svc_ack_open(false),
     _reset1_cnt(0),
     _reset2_cnt(0),
+    // _svc_op set when used
+    _svc_op_cnt(0),
+    _svc_op_idx(0),
+    _svc_session_status(-1),
+    _svc_page(),
+    _svc_page_cv(0),
+    _cv_cache(),
+    _svc_loco(DccPkt::address_inv),
+    _svc_read_cached(false),
+    _svc_cached_cnt(0),
+    // _svc_one set when used
     _pkt_svc_write_cv(),
     _write_cnt(0),
     _pkt_svc_write_bit(),
@@ -26,37 +69,141 @@ DccCommand::DccCommand(int sig_gpio, int pwr_gpio, DccAdc& adc) :
     _verify_bit_val(1),
     _verify_cnt(0),
     _read_bit(-1),
-    _cv_val(0)
+    _cv_val(0),
+    _read_fast(false),
+    _read_fast_now(false),
+    _fast_verify_cnt(fast_verify_default),
+    _fast_clean(0),
+    // _group_* set when a group starts
+    _fast_retry_cnt(0),
+    _fast_restart_cnt(0)
 {
+    // all free; lowest index on top of the stack
+    for (int i = throttle_max - 1; i >= 0; i--) {
+        _link_next[i] = _link_prev[i] = link_free;
+        _free[_free_cnt++] = i;
+    }
+
+    airtime_reset();
 }
 
 
 DccCommand::~DccCommand()
 {
-    for (DccThrottle *throttle : _throttles) {
-        _throttles.remove(throttle);
-        delete throttle;
-    }
-    _next_throttle = _throttles.begin();
 }
 
 
 void DccCommand::mode_off()
 {
     _mode = MODE_OFF;
+    ack_close();
     _adc.stop();
     _bitstream.stop();
+    _bitstream.busy(false);
 }
 
 
+// The trip is armed before power goes on, so a short that's already there
+// is caught.
 void DccCommand::mode_ops()
 {
     _mode = MODE_OPS;
+    _adc.start();
+    trip_arm();
+    _trip_on_us = time_us_32();
+    _trip_backoff_ms = 0;
     _bitstream.start_ops();
+    _bitstream.busy(_throttle_cnt > 0);
 }
 
 
 void DccCommand::mode_svc_write_cv(int cv_num, uint8_t cv_val)
+{
+    _svc_op_cnt = 0;
+    _svc_one = {SvcOp::WRITE_CV, 0, uint16_t(cv_num), cv_val, -1, 0, 0};
+    if (svc_cached(_svc_one)) {
+        svc_from_cache(0);
+        return;
+    }
+    svc_write_cv_init(cv_num, cv_val);
+    _adc.start();
+    start_svc();
+}
+
+
+void DccCommand::mode_svc_write_bit(int cv_num, int bit_num, int bit_val)
+{
+    _svc_op_cnt = 0;
+    _svc_one = {SvcOp::WRITE_BIT, uint8_t(bit_num), uint16_t(cv_num),
+                uint8_t(bit_val), -1, 0, 0};
+    if (svc_cached(_svc_one)) {
+        svc_from_cache(0);
+        return;
+    }
+    svc_write_bit_init(cv_num, bit_num, bit_val);
+    _adc.start();
+    start_svc();
+}
+
+
+void DccCommand::mode_svc_read_cv(int cv_num)
+{
+    _svc_op_cnt = 0;
+    _svc_one = {SvcOp::READ_CV, 0, uint16_t(cv_num), 0, -1, 0, 0};
+    if (svc_cached(_svc_one)) {
+        svc_from_cache(_svc_one.val);
+        return;
+    }
+    svc_read_cv_init(cv_num);
+    _adc.start();
+    start_svc();
+}
+
+
+void DccCommand::mode_svc_read_bit(int cv_num, int bit_num)
+{
+    _svc_op_cnt = 0;
+    _svc_one = {SvcOp::READ_BIT, uint8_t(bit_num), uint16_t(cv_num), 0, -1, 0, 0};
+    if (svc_cached(_svc_one)) {
+        svc_from_cache(_svc_one.val);
+        return;
+    }
+    svc_read_bit_init(cv_num, bit_num);
+    _adc.start();
+    start_svc();
+}
+
+
+// Operations the cache has are done without going to the track; if that's
+// all of them, the session is done before it starts.
+void DccCommand::mode_svc_session(const SvcOp *op, int op_cnt)
+{
+    xassert(0 < op_cnt && op_cnt <= svc_op_max);
+
+    for (int i = 0; i < op_cnt; i++) {
+        _svc_op[i] = op[i];
+        _svc_op[i].status = -1;
+    }
+    _svc_op_cnt = op_cnt;
+    _svc_op_idx = 0;
+    _svc_session_status = -1;
+    _svc_page.forget();
+
+    while (_svc_op_idx < op_cnt && svc_cached(_svc_op[_svc_op_idx]))
+        _svc_op_idx++;
+    if (_svc_op_idx == op_cnt) {
+        svc_from_cache(0);
+        _svc_session_status = 1;
+        return;
+    }
+
+    svc_op_init(_svc_op[_svc_op_idx]);
+    _adc.start();
+    start_svc();
+}
+
+
+void DccCommand::svc_write_cv_init(int cv_num, uint8_t cv_val)
 {
     _mode = MODE_SVC_WRITE_CV;
 
@@ -64,65 +211,301 @@ void DccCommand::mode_svc_write_cv(int cv_num, uint8_t cv_val)
 
     _reset1_cnt = 20;
     _write_cnt = 5;
+    _write_bit_cnt = 0;
     _reset2_cnt = 5;
     _pkt_svc_write_cv.set_cv(cv_num, cv_val); // validates cv_num
-
-    _adc.start();
-
-    _bitstream.start_svc();
 }
 
 
-void DccCommand::mode_svc_write_bit(int cv_num, int bit_num, int bit_val)
+void DccCommand::svc_write_bit_init(int cv_num, int bit_num, int bit_val)
 {
     _mode = MODE_SVC_WRITE_CV;
 
     _svc_status = -1; // "not done"
 
     _reset1_cnt = 20;
+    _write_cnt = 0;
     _write_bit_cnt = 5;
     _reset2_cnt = 5;
     _pkt_svc_write_bit.set_cv_bit(cv_num, bit_num, bit_val);
-
-    _adc.start();
-
-    _bitstream.start_svc();
 }
 
 
-void DccCommand::mode_svc_read_cv(int cv_num)
+void DccCommand::svc_read_cv_init(int cv_num)
 {
     _mode = MODE_SVC_READ_CV;
 
     _svc_status = -1; // "not done"
 
     _reset1_cnt = 20;
+    _verify_cnt = 5;
+    _reset2_cnt = 5;
     _cv_val = 0;
     _read_bit = -1;
     _verify_bit_val = 1;
+    _read_fast_now = _read_fast;
     _pkt_svc_verify_bit.set_cv_bit(cv_num);
     _pkt_svc_verify_cv.set_cv_num(cv_num);
-
-    _adc.start();
-
-    _bitstream.start_svc();
 }
 
 
-void DccCommand::mode_svc_read_bit(int cv_num, int bit_num)
+void DccCommand::svc_read_bit_init(int cv_num, int bit_num)
 {
     _mode = MODE_SVC_READ_CV;
 
     _svc_status = -1; // "not done"
 
     _reset1_cnt = 20;
+    _verify_cnt = 5;
+    _reset2_cnt = 5;
+    _cv_val = 0;
     _read_bit = bit_num;
     _verify_bit_val = 0; // 0 then 1
+    _read_fast_now = _read_fast;
     _pkt_svc_verify_bit.set_cv_bit(cv_num);
+}
 
-    _adc.start();
 
-    _bitstream.start_svc();
+// An indexed operation starts with the first page cv that needs writing,
+// if any; each time one is written, svc_end comes back here for the next.
+void DccCommand::svc_op_init(const SvcOp& op)
+{
+    _svc_page_cv = 0;
+
+    switch (op.type) {
+    case SvcOp::READ_CV:
+        svc_read_cv_init(op.cv_num);
+        break;
+    case SvcOp::READ_BIT:
+        svc_read_bit_init(op.cv_num, op.bit_num);
+        break;
+    case SvcOp::WRITE_CV:
+        svc_write_cv_init(op.cv_num, op.val);
+        break;
+    case SvcOp::WRITE_BIT:
+        svc_write_bit_init(op.cv_num, op.bit_num, op.val);
+        break;
+    case SvcOp::READ_INDEXED:
+    case SvcOp::WRITE_INDEXED:
+        if (_svc_page.hi != op.index_hi) {
+            _svc_page_cv = DccCv::index_hi;
+            svc_write_cv_init(DccCv::index_hi, op.index_hi);
+        } else if (_svc_page.lo != op.index_lo) {
+            _svc_page_cv = DccCv::index_lo;
+            svc_write_cv_init(DccCv::index_lo, op.index_lo);
+        } else if (op.type == SvcOp::READ_INDEXED) {
+            svc_read_cv_init(op.cv_num);
+        } else {
+            svc_write_cv_init(op.cv_num, op.val);
+        }
+        break;
+    }
+}
+
+
+// Queue the first packets of the operation svc_op_init set up, in a session
+// after the first, behind the resets that end the one before.
+void DccCommand::svc_op_begin()
+{
+    _reset1_cnt = 0;
+    if (_mode == MODE_SVC_WRITE_CV)
+        begin_svc_write();
+    else
+        begin_svc_read();
+}
+
+
+// Keep the session's page up to date after op (or a page write ahead of it)
+// is done.
+void DccCommand::svc_page_written(const SvcOp& op)
+{
+    if (_svc_page_cv != 0) {
+        int val = _svc_page_cv == DccCv::index_hi ? op.index_hi : op.index_lo;
+        _svc_page.written(_svc_page_cv, _svc_status == 1 ? val : -1);
+    } else if (op.type == SvcOp::WRITE_CV) {
+        _svc_page.written(op.cv_num, _svc_status == 1 ? op.val : -1);
+    } else if (op.type == SvcOp::READ_CV) {
+        _svc_page.written(op.cv_num, _svc_status == 1 ? _cv_val : -1);
+    } else if (op.type == SvcOp::WRITE_BIT) {
+        _svc_page.written(op.cv_num, -1);
+    }
+}
+
+
+// Returns true if the cache answers op: a write of the value (or bit) the cv
+// already has, or with _svc_read_cached, a read. op is done (status 1, and a
+// read's val filled in).
+bool DccCommand::svc_cached(SvcOp& op)
+{
+    uint8_t val;
+    if (_svc_loco == DccPkt::address_inv ||
+        !_cv_cache.get(_svc_loco, op.cv_num, val, op.page()))
+        return false;
+
+    switch (op.type) {
+    case SvcOp::WRITE_CV:
+    case SvcOp::WRITE_INDEXED:
+        if (val != op.val)
+            return false;
+        break;
+    case SvcOp::WRITE_BIT:
+        if (((val >> op.bit_num) & 1) != op.val)
+            return false;
+        break;
+    case SvcOp::READ_CV:
+    case SvcOp::READ_INDEXED:
+        if (!_svc_read_cached)
+            return false;
+        op.val = val;
+        break;
+    case SvcOp::READ_BIT:
+        if (!_svc_read_cached)
+            return false;
+        op.val = (val >> op.bit_num) & 1;
+        break;
+    }
+
+    op.status = 1;
+    _svc_cached_cnt++;
+    return true;
+}
+
+
+// Done from the cache: succeeded, with no acks, and the track stays off.
+void DccCommand::svc_from_cache(uint8_t val)
+{
+    mode_off();
+    _svc_no_load = false;
+    _svc_ack_cnt = 0;
+    _svc_ack_open = false;
+    _cv_val = val;
+    _svc_status = 1;
+}
+
+
+// Put what op (or the page write ahead of it) found out in the cache, once
+// it's done. A no load failure says nothing about the decoder.
+void DccCommand::svc_cache(const SvcOp& op)
+{
+    if (_svc_loco == DccPkt::address_inv || _svc_no_load)
+        return;
+
+    if (_svc_page_cv != 0) {
+        int val = _svc_page_cv == DccCv::index_hi ? op.index_hi : op.index_lo;
+        if (_svc_status == 1)
+            _cv_cache.set(_svc_loco, _svc_page_cv, val);
+        else
+            _cv_cache.forget(_svc_loco, _svc_page_cv);
+        return;
+    }
+
+    int index = op.page();
+    switch (op.type) {
+    case SvcOp::READ_CV:
+    case SvcOp::READ_INDEXED:
+        if (_svc_status == 1)
+            _cv_cache.set(_svc_loco, op.cv_num, _cv_val, index);
+        break;
+    case SvcOp::READ_BIT:
+        if (_svc_status == 1)
+            _cv_cache.set_bit(_svc_loco, op.cv_num, op.bit_num, _cv_val, index);
+        break;
+    case SvcOp::WRITE_CV:
+    case SvcOp::WRITE_INDEXED:
+        if (_svc_status == 1)
+            _cv_cache.set(_svc_loco, op.cv_num, op.val, index);
+        else
+            _cv_cache.forget(_svc_loco, op.cv_num, index);
+        break;
+    case SvcOp::WRITE_BIT:
+        if (_svc_status == 1)
+            _cv_cache.set_bit(_svc_loco, op.cv_num, op.bit_num, op.val, index);
+        else
+            _cv_cache.forget(_svc_loco, op.cv_num, index);
+        break;
+    }
+}
+
+
+// Start the bitstream in service mode and queue the initial resets. The
+// loop_svc_* functions see the last of them start when need_packet() goes
+// true.
+void DccCommand::start_svc()
+{
+    _adc.trip_disarm(); // if it was in ops mode
+    _bitstream.start_svc(); // first reset starts going out
+    _bitstream.busy(true);
+    _bitstream.send_reset(_reset1_cnt - 1);
+    _svc_start_us = time_us_32();
+    _svc_no_load = false;
+    _svc_load_checked = !_adc.present();
+    // A fast read's first group takes an ack baseline. Later ones, also in
+    // the operations after it in a session, skip it right after an ack.
+    _group_ack = false;
+    _svc_ack_cnt = 0;
+    _svc_ack_open = false;
+}
+
+
+// While the initial resets are going out: once svc_load_us of them have
+// gone, the long average is all from them, and if it's under
+// svc_load_min_ma there's no decoder to ack. The operation (and a session,
+// which svc_end doesn't go on with after a failure) ends here. Returns true
+// if it did.
+bool DccCommand::svc_load_check()
+{
+    if (_svc_load_checked || (time_us_32() - _svc_start_us) < svc_load_us)
+        return false;
+
+    _svc_load_checked = true;
+
+    if (_adc.long_ma() >= svc_load_min_ma)
+        return false;
+
+    _svc_no_load = true;
+    _svc_status = 0;
+    svc_end();
+    return true;
+}
+
+
+// The operation is done (_svc_status is 0 or 1), and if it's not done early
+// on an ack, its last reset has started. In a session that has more to do,
+// the next operation's first packets are queued behind that reset now, with
+// the track still powered and the decoder still in service mode, and so are
+// the page writes ahead of an indexed operation and the operation after
+// them. Operations the cache has are done on the way. Otherwise the track
+// is turned off.
+void DccCommand::svc_end()
+{
+    svc_cache(_svc_op_cnt > 0 ? _svc_op[_svc_op_idx] : _svc_one);
+
+    if (_svc_op_cnt > 0) {
+        SvcOp& op = _svc_op[_svc_op_idx];
+        svc_page_written(op);
+        if (_svc_page_cv != 0 && _svc_status == 1) {
+            // page cv written; the other one, or the operation itself
+            svc_op_init(op);
+            svc_op_begin();
+            return;
+        }
+        op.status = _svc_status;
+        if (op.type == SvcOp::READ_CV || op.type == SvcOp::READ_BIT ||
+            op.type == SvcOp::READ_INDEXED)
+            op.val = _cv_val;
+        if (_svc_status == 1) {
+            while (++_svc_op_idx < _svc_op_cnt && svc_cached(_svc_op[_svc_op_idx]))
+                ;
+            if (_svc_op_idx < _svc_op_cnt) {
+                svc_op_init(_svc_op[_svc_op_idx]);
+                svc_op_begin();
+                return;
+            }
+        }
+        _svc_session_status = _svc_status;
+    }
+
+    mode_off();
 }
 
 
@@ -150,6 +533,20 @@ bool DccCommand::svc_done(bool& result, uint8_t& val)
 }
 
 
+bool DccCommand::svc_session_done(bool& result, SvcOp *op) const
+{
+    if (_svc_op_cnt == 0 || _svc_session_status == -1)
+        return false;
+
+    result = (_svc_session_status == 1);
+
+    for (int i = 0; i < _svc_op_cnt; i++)
+        op[i] = _svc_op[i];
+
+    return true;
+}
+
+
 void DccCommand::loop()
 {
     if (_mode == MODE_OFF) {
@@ -157,94 +554,594 @@ void DccCommand::loop()
     } else if (_mode == MODE_OPS) {
         loop_ops();
     } else if (_mode == MODE_SVC_WRITE_CV) {
-        _adc.loop();
         loop_svc_write();
     } else if (_mode == MODE_SVC_READ_CV) {
-        _adc.loop();
         loop_svc_read();
     }
 }
 
 
+// Keep a couple of packets queued so a late loop() doesn't mean an idle
+// packet, but not so many that a speed change waits behind them.
+//
+// Each packet queued is the next change from a throttle with one (urgent),
+// the next ops mode write from a throttle with one, or the next refresh
+// packet from the throttle next_refresh() picks.
+//
+// A speed or function change waits for the ops_pending_max slots already
+// queued, plus changes for other throttles found ahead of it; it does not
+// wait for the refresh rotation. A slot is one packet, except a write,
+// which is DccThrottle::write_send_cnt packets; since a write always leaves
+// the credit (below) negative, no two slots in a row are writes, so the
+// wait is at most write_send_cnt + ops_pending_max - 1 packet times before
+// the change's own packet (the sim's pom scenario sees under 70 ms to the
+// end of that one). Each change is sent DccThrottle::change_cnt() times
+// this way.
+//
+// Writes are held to _write_share_pct of the packets (each repeat counted)
+// while there are other packets to send: every other packet earns
+// _write_share_pct of credit, every write packet costs (100 - share), and a
+// write can start when the credit is not negative. Credit does not build up
+// while there are no writes.
 void DccCommand::loop_ops()
 {
-    if (_bitstream.need_packet()) {
-        if (_next_throttle != _throttles.end()) {
-            _bitstream.send_packet((*_next_throttle)->next_packet());
-            _next_throttle++;
-            if (_next_throttle == _throttles.end())
-                _next_throttle = _throttles.begin();
+    loop_trip();
+
+    while (_bitstream.pending() < ops_pending_max && _next_throttle >= 0) {
+        int repeat;
+        DccPkt pkt;
+        DccThrottle *throttle = nullptr;
+        bool write = false;
+        if (_urgent_run < urgent_run_max)
+            throttle = find_urgent();
+        if (throttle != nullptr) {
+            pkt = throttle->next_urgent(repeat);
+            account(throttle - _throttle, pkt, repeat, false);
+            _urgent_run++;
+        } else if (_write_credit >= 0 && (throttle = find_write()) != nullptr) {
+            pkt = throttle->next_write(repeat);
+            account(throttle - _throttle, pkt, repeat, false);
+            write = true;
+        } else {
+            int idx = next_refresh();
+            pkt = _throttle[idx].next_packet(repeat);
+            refreshed(idx);
+            account(idx, pkt, repeat, true);
+            _urgent_run = 0;
+        }
+        if (write) {
+            _write_credit -= (100 - _write_share_pct) * repeat;
+        } else {
+            _write_credit += _write_share_pct * repeat;
+            if (_write_credit > 0)
+                _write_credit = 0;
+        }
+        _bitstream.send_packet(pkt, repeat);
+        _ops_pkt_cnt++;
+    }
+}
+
+
+void DccCommand::trip(int ma, int us)
+{
+    xassert(0 <= ma && ma <= trip_ma_max);
+    xassert(0 < us && us <= trip_us_max);
+
+    _trip_ma = ma;
+    _trip_us = us;
+
+    // a trip waiting to retry picks it up when it does
+    if (_mode == MODE_OPS && !_adc.tripped())
+        trip_arm();
+}
+
+
+void DccCommand::trip_arm()
+{
+    if (_trip_ma > 0)
+        _adc.trip_arm(_trip_ma, _trip_us, trip_handler, this);
+    else
+        _adc.trip_disarm();
+}
+
+
+// adc irq handler, on the core running the command (and the bitstream)
+void DccCommand::trip_handler(void *arg)
+{
+    DccCommand *me = (DccCommand *)arg;
+    me->_bitstream.power(false);
+}
+
+
+// Power is already off if it tripped; this only decides when it comes back
+// on. The backoff is set the first time through after the trip: doubled if
+// power had not stayed on for trip_ok_ms, otherwise back to the start.
+void DccCommand::loop_trip()
+{
+    if (!_adc.tripped())
+        return;
+
+    uint32_t trip_us = _adc.trip_time_us();
+
+    if (_trip_seen != _adc.trip_cnt()) {
+        _trip_seen = _adc.trip_cnt();
+        if (_trip_backoff_ms == 0 || trip_us - _trip_on_us >= trip_ok_ms * 1000)
+            _trip_backoff_ms = trip_retry_min_ms;
+        else if (_trip_backoff_ms < trip_retry_max_ms)
+            _trip_backoff_ms *= 2;
+    }
+
+    if (time_us_32() - trip_us < _trip_backoff_ms * 1000)
+        return;
+
+    trip_arm();
+    _trip_on_us = time_us_32();
+    _trip_retry_cnt++;
+    _bitstream.power(true);
+}
+
+
+void DccCommand::trace(bool on)
+{
+    if (on) {
+        _trace_pkt = _bitstream.started_cnt();
+        _trace_tag = TRACE_IDLE;
+        _adc.trace_start(trace_tag, this);
+    } else {
+        _adc.trace_stop();
+    }
+}
+
+
+// adc irq handler. The bitstream's handler runs on the same core at the same
+// priority, so the packets started don't change while they are looked at.
+// The sample goes with the newest one started before it was taken; samples
+// from before all the ones still kept go with the oldest.
+uint8_t DccCommand::trace_tag(void *arg, uint32_t sample_us, uint32_t& pkt)
+{
+    DccCommand *me = (DccCommand *)arg;
+
+    uint32_t started_cnt = me->_bitstream.started_cnt();
+    uint32_t back = started_cnt;
+    if (back > uint32_t(me->_bitstream.started_max))
+        back = me->_bitstream.started_max;
+    if (back == 0) {
+        pkt = 0;
+        return TRACE_IDLE;
+    }
+
+    uint32_t n = started_cnt - 1;
+    while (n != started_cnt - back &&
+           int32_t(sample_us - me->_bitstream.started(n).start_us) < 0)
+        n--;
+
+    pkt = n;
+    if (n != me->_trace_pkt) {
+        const auto& s = me->_bitstream.started(n);
+        me->_trace_pkt = n;
+        me->_trace_tag = me->trace_tag(s.msg, s.msg_len);
+    }
+    return me->_trace_tag;
+}
+
+
+// msg is the packet's first (up to) 3 bytes
+uint8_t DccCommand::trace_tag(const uint8_t *msg, int msg_len) const
+{
+    if (msg[0] == 0xff)
+        return TRACE_IDLE;
+
+    if (msg_len == 3 && msg[0] == 0x00 && msg[1] == 0x00)
+        return TRACE_RESET;
+
+    bool svc = (_mode == MODE_SVC_WRITE_CV || _mode == MODE_SVC_READ_CV);
+    if (!svc || msg_len != 4 || (msg[0] & 0xf0) != 0x70)
+        return TRACE_OPS;
+
+    switch ((msg[0] >> 2) & 3) {
+    case 1:
+        return TRACE_VERIFY_CV;
+    case 3:
+        return TRACE_WRITE_CV;
+    case 2:
+        if (msg[2] & 0x10)
+            return TRACE_WRITE_BIT;
+        return TRACE_VERIFY_BIT + ((msg[2] & 7) << 1) + ((msg[2] >> 3) & 1);
+    default:
+        return TRACE_OPS; // reserved
+    }
+}
+
+
+// Find a throttle with a change to send, starting after the last one found
+// so one busy throttle doesn't keep the others waiting.
+DccThrottle *DccCommand::find_urgent()
+{
+    if (_next_urgent < 0)
+        return nullptr;
+
+    int idx = _next_urgent;
+    do {
+        DccThrottle *throttle = &_throttle[idx];
+        idx = _link_next[idx];
+        if (throttle->urgent()) {
+            _next_urgent = idx;
+            return throttle;
         }
+    } while (idx != _next_urgent);
+
+    return nullptr;
+}
+
+
+// Find a throttle with writes queued, starting after the last one found so
+// each throttle's writes take turns with the others'.
+DccThrottle *DccCommand::find_write()
+{
+    if (_next_write < 0)
+        return nullptr;
+
+    int idx = _next_write;
+    do {
+        DccThrottle *throttle = &_throttle[idx];
+        idx = _link_next[idx];
+        if (throttle->write_pending() > 0) {
+            _next_write = idx;
+            return throttle;
+        }
+    } while (idx != _next_write);
+
+    return nullptr;
+}
+
+
+void DccCommand::write_share_pct(int pct)
+{
+    xassert(1 <= pct && pct <= write_share_pct_max);
+
+    _write_share_pct = pct;
+}
+
+
+// Next throttle to refresh: the one with the highest score, where the score
+// is the time since its last refresh, times _refresh_weight if it is running.
+// Idle throttles that have gone _idle_refresh_us come first, longest wait
+// first. Ties go to the first in the rotation from
+// _next_throttle, and _next_throttle moves past the one picked, so equal
+// throttles take turns. This looks at every throttle, which for
+// throttle_max is a few usec per packet.
+int DccCommand::next_refresh()
+{
+    xassert(_next_throttle >= 0);
+
+    static const uint64_t overdue = uint64_t(1) << 40; // > any weighted time
+
+    uint32_t now_us = time_us_32();
+
+    int best = -1;
+    uint64_t best_score = 0;
+
+    int idx = _next_throttle;
+    do {
+        const Refresh& r = _refresh[idx];
+        uint32_t wait_us = now_us - r.last_us;
+        uint64_t score;
+        if (!_throttle[idx].idle())
+            score = uint64_t(wait_us) * _refresh_weight;
+        else if (wait_us >= _idle_refresh_us)
+            score = overdue + wait_us;
+        else
+            score = wait_us;
+        if (best < 0 || score > best_score) {
+            best = idx;
+            best_score = score;
+        }
+        idx = _link_next[idx];
+    } while (idx != _next_throttle);
+
+    _next_throttle = _link_next[best];
+
+    return best;
+}
+
+
+void DccCommand::refreshed(int idx)
+{
+    Refresh& r = _refresh[idx];
+
+    uint32_t now_us = time_us_32();
+
+    if (r.cnt > 0) {
+        uint32_t interval_us = now_us - r.last_us;
+        r.sum_us += interval_us;
+        if (r.max_us < interval_us)
+            r.max_us = interval_us;
+    }
+    r.last_us = now_us;
+    r.cnt++;
+}
+
+
+void DccCommand::account(int idx, const DccPkt& pkt, int repeat, bool refresh)
+{
+    uint32_t bits = _bitstream.pkt_bits(pkt) * repeat;
+    uint32_t us = _bitstream.pkt_us(pkt) * repeat;
+
+    _air.pkt_cnt += repeat;
+    _air.bit_cnt += bits;
+    _air.us += us;
+
+    Air& a = _throttle_air[idx];
+    a.pkt_cnt += repeat;
+    a.bit_cnt += bits;
+    a.us += us;
+
+    if (refresh) {
+        _refresh_air_us += us;
+        _refresh_air_cnt++;
+        _refresh_pkt_us = uint32_t(_refresh_air_us / _refresh_air_cnt);
+    }
+}
+
+
+void DccCommand::airtime(Airtime& air) const
+{
+    air.pkt_cnt = _air.pkt_cnt;
+    air.bit_cnt = _air.bit_cnt;
+    air.window_us = time_us_64() - _air.start_us;
+    air.pkt_us = _air.us;
+    if (air.pkt_us > air.window_us)
+        air.pkt_us = air.window_us; // packets still pending
+}
+
+
+void DccCommand::airtime(const DccThrottle *throttle, Airtime& air) const
+{
+    int idx = throttle - _throttle;
+
+    xassert(0 <= idx && idx < throttle_max);
+    xassert(_link_next[idx] != link_free);
+
+    const Air& a = _throttle_air[idx];
+
+    air.pkt_cnt = a.pkt_cnt;
+    air.bit_cnt = a.bit_cnt;
+    air.window_us = time_us_64() - a.start_us;
+    air.pkt_us = a.us;
+    if (air.pkt_us > air.window_us)
+        air.pkt_us = air.window_us;
+}
+
+
+void DccCommand::airtime_reset()
+{
+    uint64_t now_us = time_us_64();
+
+    _air = Air();
+    _air.start_us = now_us;
+
+    for (int idx = 0; idx < throttle_max; idx++) {
+        _throttle_air[idx] = Air();
+        _throttle_air[idx].start_us = now_us;
+    }
+}
+
+
+void DccCommand::refresh_max_ms(int ms)
+{
+    xassert(ms >= 0);
+
+    _refresh_max_us = ms * 1000;
+}
+
+
+// Before any refreshes, the average is taken to be a speed packet with a
+// short address. account() updates it on the core running the ops loop; the
+// 64-bit sums behind it are not read here, so a call from the other core
+// does not see them torn.
+uint32_t DccCommand::refresh_est_us(int throttle_cnt) const
+{
+    return throttle_cnt * _refresh_pkt_us;
+}
+
+
+bool DccCommand::refresh_admit(int throttle_cnt) const
+{
+    return _refresh_max_us == 0 || refresh_est_us(throttle_cnt) <= _refresh_max_us;
+}
+
+
+// window 20.0 s, 3412 packets, 153540 bits, 19.98 s on track (99.9%)
+// refresh estimate 703 ms for 100 throttles (max off)
+//  adrs  packets    util  avg us
+//     3      130    0.6%    5930
+void DccCommand::show_airtime()
+{
+    Airtime air;
+    airtime(air);
+
+    Serial.printf("window %0.1f s, %u packets, %u bits, %0.2f s on track (%0.1f%%)\n",
+                  air.window_us / 1e6, air.pkt_cnt, air.bit_cnt,
+                  air.pkt_us / 1e6,
+                  air.window_us > 0 ? 100.0 * air.pkt_us / air.window_us : 0.0);
+
+    Serial.printf("refresh estimate %u ms for %d throttles",
+                  refresh_est_us(_throttle_cnt) / 1000, _throttle_cnt);
+    if (_refresh_max_us == 0)
+        Serial.printf(" (max off)\n");
+    else
+        Serial.printf(" (max %u ms)\n", _refresh_max_us / 1000);
+
+    if (_throttle_cnt == 0)
+        return;
+
+    Serial.printf(" adrs  packets    util  avg us\n");
+
+    for (int idx = 0; idx < throttle_max; idx++) {
+        if (_link_next[idx] == link_free)
+            continue;
+        airtime(&_throttle[idx], air);
+        Serial.printf("%5d  %7u  %5.1f%%  %6u\n",
+                      _throttle[idx].address(), air.pkt_cnt,
+                      air.window_us > 0 ? 100.0 * air.pkt_us / air.window_us : 0.0,
+                      air.pkt_cnt > 0 ? uint32_t(air.pkt_us / air.pkt_cnt) : 0);
+    }
+}
+
+
+void DccCommand::refresh_weight(int weight)
+{
+    xassert(1 <= weight && weight <= refresh_weight_max);
+
+    _refresh_weight = weight;
+}
+
+
+void DccCommand::idle_refresh_ms(int ms)
+{
+    xassert(ms > 0);
+
+    _idle_refresh_us = ms * 1000;
+}
+
+
+void DccCommand::refresh_stats(const DccThrottle *throttle,
+                               RefreshStats& stats) const
+{
+    int idx = throttle - _throttle;
+
+    xassert(0 <= idx && idx < throttle_max);
+    xassert(_link_next[idx] != link_free);
+
+    const Refresh& r = _refresh[idx];
+
+    stats.cnt = r.cnt;
+    stats.max_us = r.max_us;
+    stats.avg_us = 0;
+    if (r.cnt > 1)
+        stats.avg_us = uint32_t(r.sum_us / (r.cnt - 1));
+}
+
+
+// The next refresh of each throttle starts its intervals over; it does not
+// change when that refresh is due.
+void DccCommand::refresh_reset()
+{
+    for (int idx = 0; idx < throttle_max; idx++) {
+        _refresh[idx].cnt = 0;
+        _refresh[idx].max_us = 0;
+        _refresh[idx].sum_us = 0;
+    }
+}
+
+
+//  adrs  state  refreshes  avg ms  max ms
+//     3  run         1234    61.2    75.0
+//  1234  idle          98   998.1  1004.2
+void DccCommand::show_refresh()
+{
+    if (_throttle_cnt == 0) {
+        Serial.printf("no throttles\n");
+        return;
+    }
+
+    Serial.printf(" adrs  state  refreshes  avg ms  max ms\n");
+
+    for (int idx = 0; idx < throttle_max; idx++) {
+        if (_link_next[idx] == link_free)
+            continue;
+        const Refresh& r = _refresh[idx];
+        uint32_t avg_us = r.cnt > 1 ? uint32_t(r.sum_us / (r.cnt - 1)) : 0;
+        Serial.printf("%5d  %-5s  %9u  %6.1f  %6.1f\n",
+                      _throttle[idx].address(),
+                      _throttle[idx].idle() ? "idle" : "run",
+                      r.cnt, avg_us / 1000.0, r.max_us / 1000.0);
     }
 }
 
 
+// Before the first call, mode_svc_write_*() starts the initial resets going
+// out. As the loop is repeatedly called:
+//   1. partway through the initial resets, svc_load_check ends the write if
+//      there's no load; when the last initial reset has started, it gets the
+//      ack baseline and queues the writes (_write_cnt or _write_bit_cnt) and
+//      the resets after them (_reset2_cnt); the bitstream sends them without
+//      further polling
+//   2. if an ack is seen at any point after that, the write succeeded, and
+//      the adc irq handler drops the writes and resets not sent yet
+//   3. when the last reset has started (or on an ack), it's done
+// In a session, an operation after the first starts at step 1 with no
+// initial resets, and it's not done on an ack until its last reset starts
+// and the ack is over.
+
 void DccCommand::loop_svc_write()
 {
     if (_reset1_cnt > 0) {
+        if (svc_load_check())
+            return;
         if (_bitstream.need_packet()) {
-            _bitstream.send_reset();
-            _reset1_cnt--;
-            if (_reset1_cnt == 0) {
-                // Use the long average adc reading as the baseline for
-                // detecting an ack pulse.
-                _ack_ma = _adc.long_ma() + ack_inc_ma;
-                //Serial.printf("long_ma = %u, ack_ma = %u\n", long_ma, _ack_ma);
-            }
-        }
-    } else {
-        // Checking the current needs to be outside the need_packet clauses
-        // and is done while the write and subsequent reset packets are going.
-        // Use the short average adc reading.
-        uint16_t short_ma = _adc.short_ma();
-        if (short_ma >= _ack_ma) {
-            // Ack! Don't send any more packets, and power off.
-#ifndef INCLUDE_ADC_LOG
-            _write_cnt = 0;
-            _write_bit_cnt = 0;
-            _reset2_cnt = 0;
-#endif
-            _svc_status = 1;
+            _reset1_cnt = 0;
+            begin_svc_write();
         }
-        if (_write_cnt > 0) {
-            xassert(_write_bit_cnt == 0);
-            if (_bitstream.need_packet()) {
-                _bitstream.send_packet(_pkt_svc_write_cv);
-                _write_cnt--;
-            }
-        } else if (_write_bit_cnt > 0) {
-            xassert(_write_cnt == 0);
-            if (_bitstream.need_packet()) {
-                _bitstream.send_packet(_pkt_svc_write_bit);
-                _write_bit_cnt--;
-            }
-        } else if (_reset2_cnt > 0) {
-            if (_bitstream.need_packet()) {
-                _bitstream.send_reset();
-                _reset2_cnt--;
-            }
-        } else {
-            if (_svc_status == -1)
-                _svc_status = 0; // failed, timeout
-            mode_off();
+        return;
+    }
+
+    // The adc irq handler checks the current while the write and subsequent
+    // reset packets are going, and cancels the rest of them on an ack.
+    if (_adc.ack()) {
+        // Ack!
+        _svc_status = 1;
+        // If logging adc (for analysis), we keep going to see the full ack.
+        // In a session, the resets still going out lead into the next
+        // operation. Otherwise, don't send any more packets, and power off.
+        if (!_adc.logging() && _svc_op_cnt == 0) {
+            svc_end();
+            return;
         }
     }
+
+    if (!_bitstream.need_packet())
+        return;
+
+    if (ack_held())
+        return;
+
+    // last reset has started
+    if (_svc_status == -1)
+        _svc_status = 0; // failed, timeout
+    svc_end();
+}
+
+
+// the initial resets are done (in a session, the resets ending the operation
+// before); queue the writes and the resets after them
+void DccCommand::begin_svc_write()
+{
+    // The resets just sent are the baseline for detecting an ack pulse.
+    ack_baseline();
+    ack_arm(true);
+    if (_write_cnt > 0)
+        _bitstream.send_packet(_pkt_svc_write_cv, _write_cnt);
+    else
+        _bitstream.send_packet(_pkt_svc_write_bit, _write_bit_cnt);
+    _bitstream.send_reset(_reset2_cnt);
 }
 
 
 // Before the first call (when starting the read), mode_svc_read_cv() sets:
-//   _reset1_cnt to the number of initial resets (20)
+//   _reset1_cnt to the number of initial resets (20), and starts them going
 //   _cv_val = 0, so this loop can OR-in one bits as they are discovered
 //   _svc_status = -1, to indicate the read is in progress
 //
 // As the loop is repeatedly called:
-//   1. it will send out the initial resets
+//   1. it will wait for the initial resets (svc_load_check ends the read
+//      partway through them if there's no load)
 //   2. it will, for each bit 7...0:
-//      a. send out five bit-verifies (that the bit is one)
-//      b. send out five resets
+//      a. queue five bit-verifies (that the bit is one)
+//      b. queue five resets
 //      c. and if an ack is received during any of those 10 packets, a one bit
 //         is ORed into _cv_val
-//   3. after the verify-bit for bit 0, it sends out five byte-verifies for
+//   3. after the verify-bit for bit 0, it queues five byte-verifies for
 //      the cv with the built-up _cv_val, then five more resets
 //      a. if an ack is received during any of those 10 packets, we are done,
 //         _svc_status is set to 1 (success), and calling svc_done() will
@@ -252,6 +1149,14 @@ void DccCommand::loop_svc_write()
 //      b. if no ack has been received when the last reset goes out, we are
 //         done, _svc_status is set to 0 (failed), and calling svc_done() will
 //         return "done/error"
+//
+// Each group of verifies and resets is queued at once; the next group is
+// queued when the last reset of the previous one has started. An ack drops
+// what's left of its group right away (from the adc irq handler), and the
+// next group goes when the ack is over.
+//
+// In a session, an operation after the first starts at step 2 with no
+// initial resets, and it's not done on an ack until its last reset starts.
 
 void DccCommand::loop_svc_read()
 {
@@ -259,31 +1164,22 @@ void DccCommand::loop_svc_read()
 
     if (_reset1_cnt > 0) {
         // first 20 resets are going out
+        if (svc_load_check())
+            return;
         if (_bitstream.need_packet()) {
-            _bitstream.send_reset();
-            _reset1_cnt--;
-            if (_reset1_cnt == 0) {
-                // Done with resets.
-                // Use the long average adc reading as the baseline for
-                // detecting an ack pulse.
-                _ack_ma = _adc.long_ma() + ack_inc_ma;
-                //Serial.printf("long_ma = %u, ack_ma = %u\n", long_ma, _ack_ma);
-                if (0 <= _read_bit && _read_bit < 8)
-                    _verify_bit = _read_bit; // just the one bit
-                else
-                    _verify_bit = 7; // 7...0
-                _pkt_svc_verify_bit.set_bit(_verify_bit, _verify_bit_val);
-                _verify_cnt = 5;
-#ifdef INCLUDE_ACK_DBG
-                _ack_dbg_ma[_verify_bit] = _ack_ma;
-#endif
-            }
+            _reset1_cnt = 0;
+            // Done with resets.
+            begin_svc_read();
         }
         return;
     }
 
-    uint16_t short_ma = _adc.short_ma();
-    if (short_ma >= _ack_ma) {
+    if (_read_fast_now) {
+        loop_svc_read_fast();
+        return;
+    }
+
+    if (_adc.ack()) {
         // Ack!
         if (0 <= _read_bit && _read_bit < 8) {
             // Could be checking for 0 or for 1
@@ -291,20 +1187,22 @@ void DccCommand::loop_svc_read()
             // Either way we're done
             _svc_status = 1;
             // If logging adc (for analysis), we keep going to see the
-            // full ack. If not logging, we're done.
-            if constexpr (!_adc.logging()) {
-                _verify_cnt = 0;
-                _reset2_cnt = 0;
+            // full ack. In a session, we keep going to the last reset.
+            // Otherwise, we're done.
+            if (!_adc.logging() && _svc_op_cnt == 0) {
+                svc_end();
+                return;
             }
         } else {
             if (_verify_bit == 8) {
                 // This is the ack for the byte-verify at the end
                 _svc_status = 1;
                 // If logging adc (for analysis), we keep going to see the
-                // full ack. If not logging, we're done.
-                if constexpr (!_adc.logging()) {
-                    _verify_cnt = 0;
-                    _reset2_cnt = 0;
+                // full ack. In a session, we keep going to the last reset.
+                // Otherwise, we're done.
+                if (!_adc.logging() && _svc_op_cnt == 0) {
+                    svc_end();
+                    return;
                 }
             } else {
                 // This is an ack for a bit-verify
@@ -313,121 +1211,551 @@ void DccCommand::loop_svc_read()
         }
     }
 
-    if (_verify_cnt > 0) {
+    if (!_bitstream.need_packet())
+        return; // verifies and resets for _verify_bit still going out
 
-        if (_bitstream.need_packet()) {
-            if (_verify_bit == 8)
-                _bitstream.send_packet(_pkt_svc_verify_cv);
-            else
-                _bitstream.send_packet(_pkt_svc_verify_bit);
-            _verify_cnt--;
-            if (_verify_cnt == 0)
-                _reset2_cnt = 5;
+    if (ack_held())
+        return;
+
+    // The last reset for _verify_bit has started. Get a new baseline and a
+    // new ack threshold each time just before sending out the verify
+    // packets. The current does not always hold steady through the whole
+    // sequence. After an ack, keep the threshold, since the ack that just
+    // ended is still in the long average.
+    if (!_adc.ack())
+        ack_baseline();
+
+    // done with 5 verifies and 5 resets for _verify_bit
+    if (_verify_bit == _read_bit) {
+
+        // bit read
+        if (_verify_bit_val == 0 && _svc_status == -1) {
+            _verify_bit_val = 1;
+            _pkt_svc_verify_bit.set_bit(_verify_bit, _verify_bit_val);
+            send_verify();
+        } else {
+            // got an ack for 0, or tried 0, then 1
+            if (_svc_status == -1)
+                _svc_status = 0; // didn't get an ack for either
+            svc_end();
         }
 
-    } else if (_reset2_cnt > 0) {
+    } else {
 
-        if (_bitstream.need_packet()) {
-            _bitstream.send_reset();
-            _reset2_cnt--;
+        // byte read
+        if (_verify_bit == 8) {
+            // byte verify done
+            if (_svc_status == -1)
+                _svc_status = 0; // failed, timeout
+            svc_end();
+        } else if (_verify_bit > 0) {
+            xassert(_verify_bit_val == 1);
+            _verify_bit--;
+            _pkt_svc_verify_bit.set_bit(_verify_bit, 1);
+            send_verify();
+        } else {
+            xassert(_verify_bit == 0);
+            // start byte verify
+            _verify_bit = 8; // signifies verify byte
+            _pkt_svc_verify_cv.set_cv_val(_cv_val);
+            send_verify();
         }
 
-        if (_reset2_cnt == 0) {
-            // Get a new long average adc reading and a new ack threshold each
-            // time just before sending out the verify packets. The current
-            // does not always hold steady through the whole sequence.
-            _ack_ma = _adc.long_ma() + ack_inc_ma;
-            //Serial.printf("long_ma = %u, ack_ma = %u\n", long_ma, _ack_ma);
-        }
+    } // bit read or byte read
+
+} // void DccCommand::loop_svc_read
+
+
+// the initial resets are done (in a session, the resets ending the operation
+// before); queue the first verifies and the resets after them
+void DccCommand::begin_svc_read()
+{
+    if (0 <= _read_bit && _read_bit < 8)
+        _verify_bit = _read_bit; // just the one bit
+    else
+        _verify_bit = 7; // 7...0
+    _pkt_svc_verify_bit.set_bit(_verify_bit, _verify_bit_val);
+    if (_read_fast_now) {
+        _group_retry = false;
+        fast_group_start();
+        return;
+    }
+    // The resets just sent are the baseline for detecting an ack pulse.
+    ack_baseline();
+    send_verify();
+}
 
+
+// queue the verifies for _verify_bit (8 for byte), then the resets after them
+void DccCommand::send_verify()
+{
+    ack_arm(true);
+    if (_verify_bit == 8)
+        _bitstream.send_packet(_pkt_svc_verify_cv, _verify_cnt);
+    else
+        _bitstream.send_packet(_pkt_svc_verify_bit, _verify_cnt);
+    _bitstream.send_reset(_reset2_cnt);
+}
+
+
+// Fast read, after the first group has started (begin_svc_read). Each
+// time the packet queued last starts going out, the next one is picked:
+//   1. another verify, until _group_verify_cnt have gone or an ack is seen
+//   2. a reset, if an ack was seen and is not over (or no reset has gone
+//      since the verifies), or if no ack was seen and fewer than
+//      fast_after_cnt resets have gone since the verifies (or a run over the
+//      threshold is going, not yet long enough to say if it's an ack)
+//   3. otherwise the group is done, and the first verify of the next group
+//      goes (fast_group_done)
+// An ack starts at the end of the decoder's second verify, so with two
+// verifies and two resets, no ack means none came for the whole first reset.
+//
+// A group is clean if the highest current seen was well clear of the ack
+// threshold: with an ack, at least half the threshold's step (above the
+// baseline) over it, or without one, at least that much under it.
+// fast_clean_run clean groups in a row drop a verify (down to
+// fast_verify_min); a group that isn't clean is sent again with _verify_cnt
+// verifies, which is also what the following groups use.
+
+void DccCommand::loop_svc_read_fast()
+{
+    // The peak is from when the first verify is done, so the tail of an
+    // ack in the group before doesn't count.
+    uint16_t short_ma = _adc.short_ma();
+    if (_group_sent >= 2 && short_ma > _group_peak_ma)
+        _group_peak_ma = short_ma;
+    if (_adc.ack())
+        _group_ack = true;
+
+    if (!_bitstream.need_packet())
+        return; // the packet queued last has not started
+
+    if (_group_sent < _group_verify_cnt && !_group_ack) {
+        fast_send_verify();
+        _group_sent++;
+        return;
+    }
+
+    if (_group_ack ? (_adc.ack_busy() || _group_after == 0)
+                   : (_group_after < fast_after_cnt || _adc.ack_busy())) {
+        _bitstream.send_reset();
+        _group_after++;
+        return;
+    }
+
+    // A run rejected as too short or too long for an ack is a decoder
+    // answering in a way this can't read, so leave it to the standard way,
+    // for this read and the ones after.
+    DccAdc::AckSeen seen;
+    _adc.ack_seen(seen);
+    if (!_group_ack && seen.reject_cnt > 0) {
+        _read_fast = false;
+        _group_retry = false;
+        fast_restart();
+        return;
+    }
+
+    bool clean;
+    if (_group_ack)
+        clean = _group_peak_ma >= _ack_ma + ack_step_ma() / 2;
+    else
+        clean = _group_peak_ma + ack_step_ma() / 2 < _ack_ma;
+
+    if (clean) {
+        if (++_fast_clean >= fast_clean_run && _fast_verify_cnt > fast_verify_min) {
+            _fast_verify_cnt--;
+            _fast_clean = 0;
+        }
     } else {
+        _fast_clean = 0;
+        _fast_verify_cnt = _verify_cnt;
+        if (!_group_retry) {
+            // same verify again
+            _fast_retry_cnt++;
+            _group_retry = true;
+            fast_group_start();
+            return;
+        }
+        // Twice in a row: the current is too close to call this way (e.g.
+        // acks shorter than the standard's), so don't go on guessing.
+        _group_retry = false;
+        fast_restart();
+        return;
+    }
 
-        // done with 5 verifies and 5 resets for _verify_bit
-        if (_verify_bit == _read_bit) {
+    _group_retry = false;
+    fast_group_done(_group_ack);
+}
+
+
+// Start a group with its first verify. The ack baseline is taken again
+// only if the group before had no ack, since an ack that just ended would
+// still be in the long average.
+void DccCommand::fast_group_start()
+{
+    if (!_group_ack)
+        ack_baseline();
+    ack_arm(false); // one packet is queued at a time; nothing to cancel
+    _group_verify_cnt = _group_retry ? _verify_cnt : _fast_verify_cnt;
+    _group_sent = 1;
+    _group_after = 0;
+    _group_peak_ma = 0;
+    _group_ack = false;
+    fast_send_verify();
+}
 
-            // bit read
-            if (_verify_bit_val == 0) {
-                _verify_bit_val = 1;
-                _pkt_svc_verify_bit.set_bit(_verify_bit, _verify_bit_val);
-                _verify_cnt = 5;
-            } else {
-                // tried 0, then 1; hopefully got an ack for one of them
-                if (_svc_status == -1)
-                    _svc_status = 0; // didn't get an ack for either
-                mode_off();
-            }
 
+// A group is done; go on to the next bit, or finish. Anything that doesn't
+// add up (no ack for the byte verify, or for either value of a single bit)
+// starts the read over the standard way.
+void DccCommand::fast_group_done(bool ack)
+{
+    if (_verify_bit == 8) {
+        // byte verify
+        if (ack) {
+            _svc_status = 1;
+            svc_end();
+            return;
+        }
+    } else if (_verify_bit == _read_bit) {
+        // bit read
+        if (ack) {
+            _cv_val = _verify_bit_val;
+            _svc_status = 1;
+            svc_end();
+            return;
+        }
+        if (_verify_bit_val == 0) {
+            _verify_bit_val = 1;
+            _pkt_svc_verify_bit.set_bit(_verify_bit, _verify_bit_val);
+            fast_group_start();
+            return;
+        }
+    } else {
+        // byte read
+        if (ack)
+            _cv_val |= (1 << _verify_bit);
+        if (_verify_bit > 0) {
+            _verify_bit--;
+            _pkt_svc_verify_bit.set_bit(_verify_bit, 1);
         } else {
+            _verify_bit = 8; // signifies verify byte
+            _pkt_svc_verify_cv.set_cv_val(_cv_val);
+        }
+        fast_group_start();
+        return;
+    }
+
+    fast_restart();
+}
+
+
+// Start the read over the standard way, from the same point in the
+// bitstream.
+void DccCommand::fast_restart()
+{
+    _fast_restart_cnt++;
+    _read_fast_now = false;
+    _cv_val = 0;
+    _verify_bit_val = (_read_bit >= 0) ? 0 : 1;
+    begin_svc_read();
+}
 
-            // byte read
-            if (_verify_bit == 8) {
-                // byte verify done
-                if (_svc_status == -1)
-                    _svc_status = 0; // failed, timeout
-                mode_off();
-            } else if (_verify_bit > 0) {
-                xassert(_verify_bit_val == 1);
-                _verify_bit--;
-                _pkt_svc_verify_bit.set_bit(_verify_bit, 1);
-                _verify_cnt = 5;
-#ifdef INCLUDE_ACK_DBG
-                _ack_dbg_ma[_verify_bit] = _ack_ma;
-#endif
-            } else {
-                xassert(_verify_bit == 0);
-                // start byte verify
-                _verify_bit = 8; // signifies verify byte
-                _pkt_svc_verify_cv.set_cv_val(_cv_val);
-                _verify_cnt = 5;
-#ifdef INCLUDE_ACK_DBG
-                _ack_dbg_ma[_verify_bit] = _ack_ma;
-#endif
-            }
 
-        } // bit read or byte read
+// Take the baseline from the resets just sent, and set the threshold a
+// step over it: ack_sigma times its noise, from ack_step_min_ma to
+// ack_inc_ma.
+void DccCommand::ack_baseline()
+{
+    DccAdc::Baseline base;
+    _adc.baseline(base);
+
+    uint32_t step_ma = ack_sigma * base.noise_ma;
+    if (step_ma < ack_step_min_ma)
+        step_ma = ack_step_min_ma;
+    else if (step_ma > ack_inc_ma)
+        step_ma = ack_inc_ma;
+
+    _ack_base_ma = base.ma;
+    _ack_noise_ma = base.noise_ma;
+    _ack_ma = base.ma + step_ma;
+}
+
+
+// Arm the adc's ack detection with _ack_ma (released halfway back to the
+// baseline) for the group about to be queued, closing the group before.
+// With cancel, an ack drops the rest of the group's verifies (or writes) and
+// resets from the bitstream right from the adc irq handler, instead of
+// waiting for them to go out. Not while logging the adc, which wants the
+// whole sequence.
+void DccCommand::ack_arm(bool cancel)
+{
+    ack_close();
+    if (_svc_ack_cnt < svc_ack_max) {
+        SvcAck& a = _svc_ack[_svc_ack_cnt++];
+        a.op = _svc_op_cnt > 0 ? _svc_op_idx : 0;
+        a.bit = _mode == MODE_SVC_WRITE_CV ? -1 : _verify_bit;
+        a.ack = false;
+        a.confidence = 0;
+        a.base_ma = _ack_base_ma;
+        a.noise_ma = _ack_noise_ma;
+        a.ack_ma = _ack_ma;
+        a.peak_ma = 0;
+        a.width_us = 0;
+        a.reject_cnt = 0;
+        _svc_ack_open = true;
     }
 
-} // void DccCommand::loop_svc_read
+    uint16_t release_ma = _ack_ma - ack_step_ma() / 2;
+    if (cancel && _ack_cancel && !_adc.logging())
+        _adc.ack_arm(_ack_ma, release_ma, ack_handler, this);
+    else
+        _adc.ack_arm(_ack_ma, release_ma);
+}
+
+
+// adc irq handler, on the core running the command (and the bitstream)
+void DccCommand::ack_handler(void *arg)
+{
+    DccCommand *me = (DccCommand *)arg;
+    me->_bitstream.cancel();
+}
+
 
+// The group is done going out, and the decoder can still be acking: an ack
+// was seen and is not over, or a run over the threshold is going but not
+// for long enough yet to say. Keep sending resets until the run is over,
+// so an ack isn't taken for one to whatever goes next. Returns true if a
+// reset was queued.
+bool DccCommand::ack_held()
+{
+    if (!_adc.ack_busy())
+        return false;
+    _bitstream.send_reset();
+    return true;
+}
 
-DccThrottle *DccCommand::create_throttle()
+
+// Fill in the open group's decision from what the adc saw. An ack is surer
+// the further the current got over the threshold (all the way at twice the
+// threshold's step over the baseline); no ack is surer the further the
+// current stayed under the threshold. A run too long to be an ack is no
+// ack (DccAdc rejects it).
+void DccCommand::ack_close()
 {
-    DccThrottle* throttle = new DccThrottle();
-    _throttles.push_back(throttle);
-    _next_throttle = _throttles.begin();
-    return throttle;
+    if (!_svc_ack_open)
+        return;
+    _svc_ack_open = false;
+
+    DccAdc::AckSeen seen;
+    _adc.ack_seen(seen);
+
+    SvcAck& a = _svc_ack[_svc_ack_cnt - 1];
+    a.ack = seen.ack;
+    a.peak_ma = seen.peak_ma;
+    a.width_us = seen.width_us > UINT16_MAX ? UINT16_MAX : seen.width_us;
+    a.reject_cnt = seen.reject_cnt;
+
+    uint32_t step = a.ack_ma - a.base_ma;
+    uint32_t rise = a.peak_ma > a.base_ma ? a.peak_ma - a.base_ma : 0;
+    if (rise > 2 * step)
+        rise = 2 * step;
+
+    if (a.ack) {
+        a.confidence = rise <= step ? 50 : 50 + 50 * (rise - step) / step;
+    } else {
+        a.confidence = rise >= step ? 50 : 100 - 50 * rise / step;
+    }
+}
+
+
+const DccCommand::SvcAck& DccCommand::svc_ack(int idx) const
+{
+    xassert(0 <= idx && idx < _svc_ack_cnt);
+
+    return _svc_ack[idx];
+}
+
+
+void DccCommand::fast_send_verify()
+{
+    if (_verify_bit == 8)
+        _bitstream.send_packet(_pkt_svc_verify_cv);
+    else
+        _bitstream.send_packet(_pkt_svc_verify_bit);
+}
+
+
+DccThrottle *DccCommand::create_throttle(bool admit)
+{
+    if (_free_cnt == 0)
+        return nullptr;
+
+    if (admit && !refresh_admit(_throttle_cnt + 1))
+        return nullptr;
+
+    int idx = _free[--_free_cnt];
+
+    _throttle[idx] = DccThrottle(&_cv_cache); // default address, speed, functions
+
+    // a new throttle is due for a refresh now
+    _refresh[idx] = Refresh();
+    _refresh[idx].last_us = time_us_32() - _idle_refresh_us;
+
+    _throttle_air[idx] = Air();
+    _throttle_air[idx].start_us = time_us_64();
+
+    if (_next_throttle < 0) {
+        // only one
+        _link_next[idx] = _link_prev[idx] = idx;
+        _next_throttle = _next_urgent = _next_write = idx;
+    } else {
+        // insert behind _next_throttle, i.e. last in the rotation
+        int next = _next_throttle;
+        int prev = _link_prev[next];
+        _link_next[idx] = next;
+        _link_prev[idx] = prev;
+        _link_next[prev] = idx;
+        _link_prev[next] = idx;
+    }
+
+    _throttle_cnt++;
+
+    if (_mode == MODE_OPS)
+        _bitstream.busy(true);
+
+    return &_throttle[idx];
 }
 
 
 void DccCommand::delete_throttle(DccThrottle *throttle)
 {
-    _throttles.remove(throttle);
-    delete throttle;
-    _next_throttle = _throttles.begin();
+    int idx = throttle - _throttle;
+
+    xassert(0 <= idx && idx < throttle_max);
+    xassert(_link_next[idx] != link_free);
+
+    int next = _link_next[idx];
+    int prev = _link_prev[idx];
+
+    if (next == idx) {
+        // was the only one
+        _next_throttle = _next_urgent = _next_write = -1;
+    } else {
+        _link_next[prev] = next;
+        _link_prev[next] = prev;
+        if (_next_throttle == idx)
+            _next_throttle = next;
+        if (_next_urgent == idx)
+            _next_urgent = next;
+        if (_next_write == idx)
+            _next_write = next;
+    }
+
+    _link_next[idx] = _link_prev[idx] = link_free;
+    _free[_free_cnt++] = idx;
+
+    _throttle_cnt--;
+
+    if (_mode == MODE_OPS)
+        _bitstream.busy(_throttle_cnt > 0);
 }
 
 
 void DccCommand::show()
 {
-    if (_throttles.empty()) {
+    if (_throttle_cnt == 0) {
         Serial.printf("no throttles\n");
     } else {
-        for (DccThrottle *throttle : _throttles) {
+        for (int idx = 0; idx < throttle_max; idx++) {
+            if (_link_next[idx] == link_free)
+                continue;
             Serial.printf("throttle:\n");
-            throttle->show();
+            _throttle[idx].show();
         }
     }
 }
 
 
-void DccCommand::show_ack_ma()
+// op  bit  ack  conf  base  noise  thresh  peak  width  rejects
+//  0    7  yes  100%    20      1      50   118    5.7        0
+//  0    6  no   100%    20      1      50    21      -        0
+//  0   cv  yes   83%    20      1      50   101    5.6        0
+void DccCommand::show_svc_ack()
+{
+    if (_svc_ack_cnt == 0) {
+        Serial.printf("no acks checked\n");
+        return;
+    }
+
+    Serial.printf("op  bit  ack  conf  base  noise  thresh  peak  width  rejects\n");
+
+    for (int idx = 0; idx < _svc_ack_cnt; idx++) {
+        const SvcAck& a = _svc_ack[idx];
+        char bit[4];
+        if (a.bit < 0)
+            strcpy(bit, "wr");
+        else if (a.bit == 8)
+            strcpy(bit, "cv");
+        else
+            snprintf(bit, sizeof(bit), "%d", a.bit);
+        char width[8];
+        if (a.ack)
+            snprintf(width, sizeof(width), "%.1f", a.width_us / 1000.0);
+        else
+            strcpy(width, "-");
+        Serial.printf("%2d  %3s  %-3s  %3u%%  %4u  %5u  %6u  %4u  %5s  %7u\n",
+                      a.op, bit, a.ack ? "yes" : "no", a.confidence,
+                      a.base_ma, a.noise_ma, a.ack_ma, a.peak_ma, width,
+                      a.reject_cnt);
+    }
+}
+
+
+// trip at 2500 mA for 2.0 ms: 3 trips, 2 retries, power off (retry in 480 ms)
+// last trip, mA every 0.1 ms up to it:
+//  -12.7    21    20    20    19    21    20    20    21
+//  ...
+//   -0.7  2999  2999  2999  2999  2999  2999  2999  2999
+void DccCommand::show_trip()
 {
-#ifdef INCLUDE_ACK_DBG
-    Serial.printf("ack_ma =");
-    for (int bit = 7; bit >= 0; bit--)
-        Serial.printf(" %u", _ack_dbg_ma[bit]);
-    Serial.printf(" %u\n", _ack_dbg_ma[8]);
-#else
-    //Serial.printf("ACK_DBG not enabled in dcc_command.h\n");
-#endif
+    if (_trip_ma == 0)
+        Serial.printf("trip off: ");
+    else
+        Serial.printf("trip at %u mA for %.1f ms: ", _trip_ma, _trip_us / 1000.0);
+
+    uint32_t trip_cnt = _adc.trip_cnt();
+    Serial.printf("%u trips, %u retries", trip_cnt, _trip_retry_cnt);
+
+    if (tripped()) {
+        uint32_t off_ms = (time_us_32() - _adc.trip_time_us()) / 1000;
+        uint32_t wait_ms = off_ms < _trip_backoff_ms ? _trip_backoff_ms - off_ms : 0;
+        Serial.printf(", power off (retry in %u ms)", wait_ms);
+    }
+    Serial.printf("\n");
+
+    if (trip_cnt == 0)
+        return;
+
+    static const int per_line = 8;
+    const int sample_us = DccAdc::trip_capture_us;
+    uint16_t ma[DccAdc::trip_capture_max];
+    _adc.trip_capture(ma);
+
+    // synced, samples are a half bit apart, so they are numbered instead
+    bool synced = _adc.synced();
+    if (synced)
+        Serial.printf("last trip, mA every half bit up to it:\n");
+    else
+        Serial.printf("last trip, mA every %.1f ms up to it:\n", sample_us / 1000.0);
+    for (int i = 0; i < DccAdc::trip_capture_max; i++) {
+        int n = i + 1 - DccAdc::trip_capture_max;
+        if (i % per_line == 0 && synced)
+            Serial.printf("%6d", n);
+        else if (i % per_line == 0)
+            Serial.printf("%6.1f", n * sample_us / 1000.0);
+        Serial.printf("  %4u", ma[i]);
+        if (i % per_line == per_line - 1)
+            Serial.printf("\n");
+    }
 }
@@ -1,15 +1,20 @@
 #pragma once
 
 #include <Arduino.h>
-#include <list>
 #include "dcc_adc.h"
-#include "dcc_bitstream.h"
 #include "dcc_cv.h"
+#include "dcc_cv_cache.h"
+#include "dcc_throttle.h"
 
-#undef INCLUDE_ACK_DBG
-
+// define to generate the bitstream with PIO+DMA (one interrupt per packet)
+// instead of the PWM wrap interrupt (one interrupt per bit)
+#undef INCLUDE_BITSTREAM_PIO
 
-class DccThrottle;
+#ifdef INCLUDE_BITSTREAM_PIO
+#include "dcc_bitstream_pio.h"
+#else
+#include "dcc_bitstream.h"
+#endif
 
 
 class DccCommand
@@ -41,38 +46,434 @@ class DccCommand
         bool svc_done(bool& result);
         bool svc_done(bool& result, uint8_t& val);
 
+        // No load: with nothing drawing current on the track (no decoder,
+        // or a bad connection) there is nothing to ack, and an operation
+        // would send all its resets and verifies (or writes) before failing.
+        // Instead, the long average is checked once svc_load_us of the
+        // initial resets have gone; under svc_load_min_ma, the operation (in
+        // a session, the whole session) fails right there, and this is true
+        // until the next one starts. Not checked without an adc.
+        bool svc_no_load() const { return _svc_no_load; }
+        static const uint32_t svc_load_us = 20000; // past the long window
+        static const uint16_t svc_load_min_ma = 5;
+
+        // Service mode session: a list of operations run back to back with
+        // the track powered the whole time. Only the first one starts with
+        // the power-on resets; each one after it starts as soon as the
+        // resets that end the one before have started, since those are the
+        // resets it needs ahead of its first packet. The first operation to
+        // fail ends the session, and the ones after it are not run.
+        //
+        // READ_INDEXED and WRITE_INDEXED are for a cv in the page selected
+        // by cv31 (index_hi) and cv32 (index_lo). The page is kept for the
+        // session (DccCv::Page), and each page cv is written ahead of the
+        // operation only if it changes; a page write failing fails the
+        // operation. Sorting the operations by page first (DccCv::sort_pages)
+        // writes them the fewest times. The page is not kept from one
+        // session to the next, since with the track off the decoder on it
+        // can be changed.
+        struct SvcOp {
+            enum Type : uint8_t {
+                READ_CV, READ_BIT, WRITE_CV, WRITE_BIT, READ_INDEXED, WRITE_INDEXED
+            };
+            Type type;
+            uint8_t bit_num;    // READ_BIT, WRITE_BIT
+            uint16_t cv_num;
+            uint8_t val;        // to write (WRITE_BIT: 0 or 1), or read
+            int8_t status;      // -1 not run, 0 failed, 1 success
+            uint8_t index_hi;   // *_INDEXED
+            uint8_t index_lo;
+            int page() const
+            {
+                if (type != READ_INDEXED && type != WRITE_INDEXED)
+                    return -1;
+                return (index_hi << 8) | index_lo;
+            }
+        };
+        static const int svc_op_max = 8;
+        void mode_svc_session(const SvcOp *op, int op_cnt);
+
+        // Returns true if the session is done, with result true if every
+        // operation succeeded, and status and val (reads) filled in for each
+        // of the op_cnt operations in op[].
+        bool svc_session_done(bool& result, SvcOp *op) const;
+
+        // CV cache (DccCvCache), shared with the throttles. Service mode
+        // only knows which decoder is on the track when told: with
+        // svc_loco set to its address, reads and acked writes (and page
+        // writes) go in the cache under it, a write of a value already
+        // known is done without going to the track, and so is a read with
+        // svc_read_cached on (off by default, since a decoder can change a
+        // cv by itself). A failed write forgets the cv. An operation done
+        // from the cache succeeds right away with no acks, and a session
+        // runs only the ones that aren't. svc_loco is address_inv (the
+        // default) for a decoder that isn't known, and nothing is cached.
+        void svc_loco(int address) { _svc_loco = address; }
+        int svc_loco() const { return _svc_loco; }
+        void svc_read_cached(bool cached) { _svc_read_cached = cached; }
+        bool svc_read_cached() const { return _svc_read_cached; }
+        DccCvCache& cv_cache() { return _cv_cache; }
+
+        // service mode operations done from the cache
+        uint32_t svc_cached_cnt() const { return _svc_cached_cnt; }
+
+        // Fast service mode reads (off by default). Each verify group ends
+        // as soon as an ack has been seen and is over, or when one can't
+        // come any more, and sends only as many verifies as recent acks have
+        // needed: fewer while acks are clean, back up to 5 when one isn't.
+        // A bit whose current is marginal (an ack or no ack close to the
+        // threshold) is verified again with 5; if it is marginal again, or
+        // the byte verify at the end fails, the read starts over the
+        // standard way. So does a read that sees a run too short or too long
+        // for an ack, and fast reads are then off (svc_read_fast() returns
+        // false) until turned on again.
+        void svc_read_fast(bool fast) { _read_fast = fast; }
+        bool svc_read_fast() const { return _read_fast; }
+
+        // Acks are seen by the adc irq handler. By default an ack also
+        // drops the rest of a standard read's verify group, or a write's
+        // writes, and the resets after them, right away; the next group goes
+        // as soon as the ack is over. With cancel off, the whole group goes
+        // out.
+        void svc_ack_cancel(bool cancel) { _ack_cancel = cancel; }
+        bool svc_ack_cancel() const { return _ack_cancel; }
+
+        // fast read verify groups sent again, and fast reads started over
+        uint32_t svc_read_retry_cnt() const { return _fast_retry_cnt; }
+        uint32_t svc_read_restart_cnt() const { return _fast_restart_cnt; }
+
+        // The ack threshold adapts to the track. Before each group, the
+        // baseline (DccAdc::baseline) is taken from the resets just sent,
+        // and the threshold set a significant step over it: ack_sigma times
+        // its noise, but at least ack_step_min_ma, so a weak ack is seen on
+        // a quiet track, and at most ack_inc_ma, the step the standard asks
+        // for, so a noisy track still sees a good ack. A noise burst that
+        // gets over it is rejected by DccAdc for being shorter than an ack,
+        // and a load coming on that stays over it for being longer.
+        //
+        // Each group's decision is kept, with its confidence, for the
+        // service mode operation (or session) last started: one per verify
+        // group in the order sent, or one for a write's writes.
+        struct SvcAck {
+            int8_t op;          // in a session; 0 for a single operation
+            int8_t bit;         // 7..0 bit verify, 8 byte verify, -1 write
+            bool ack;
+            uint8_t confidence; // percent, 50 to 100
+            uint16_t base_ma;   // baseline
+            uint16_t noise_ma;  // and its noise
+            uint16_t ack_ma;    // threshold
+            uint16_t peak_ma;   // highest short average
+            uint16_t width_us;  // ack's (0 for none)
+            uint16_t reject_cnt; // runs too short or too long for an ack
+        };
+        static const int svc_ack_max = 32; // later groups are not kept
+        int svc_ack_cnt() const { return _svc_ack_cnt; }
+        const SvcAck& svc_ack(int idx) const;
+        void show_svc_ack();
+
+        // Overcurrent protection in ops mode, where the adc runs the whole
+        // time the track is on. Current at or over trip_ma for trip_us
+        // (DccAdc::trip_arm) cuts track power from the adc irq handler. The
+        // packets keep going, and power comes back on by itself after a
+        // backoff: trip_retry_min_ms, doubling each time it trips again
+        // within trip_ok_ms of coming back on, up to trip_retry_max_ms.
+        // trip_ma 0 is off.
+        void trip(int ma, int us);
+        int trip_ma() const { return _trip_ma; }
+        int trip_us() const { return _trip_us; }
+        static const int trip_ma_max = 3000; // adc full scale, DRV8874 carrier
+        static const int trip_us_max = 10000;
+
+        // power is off for a trip, waiting to come back on
+        bool tripped() const { return _mode == MODE_OPS && _adc.tripped(); }
+
+        // trips, and times power came back on, since construction
+        uint32_t trip_cnt() const { return _adc.trip_cnt(); }
+        uint32_t trip_retry_cnt() const { return _trip_retry_cnt; }
+
+        void show_trip();
+
+        // ADC sync (DccBitstream::adc_sync, DccAdc::sync): samples taken at
+        // a fixed phase in each half bit, away from the driver's switching
+        // spikes, timed by pwm slice slice (which nothing else can use), or
+        // free-running for -1, the default. No effect with the PIO
+        // bitstream. Takes effect at the next mode_*().
+        void adc_sync(int slice) { _adc.sync(_bitstream.adc_sync(slice)); }
+        bool adc_sync() const { return _adc.synced(); }
+
+        // Current trace (DccAdc::trace_start): every adc sample, tagged with
+        // the packet going out on the track when it was taken. A bit verify
+        // is tagged TRACE_VERIFY_BIT + 2 * bit + val. Packets are told apart
+        // by what they are, and service mode ones (0111xxxx, which in ops
+        // mode is a short address 112..127) only in service mode.
+        enum TraceTag : uint8_t {
+            TRACE_IDLE,
+            TRACE_RESET,
+            TRACE_OPS,
+            TRACE_VERIFY_CV,
+            TRACE_WRITE_CV,
+            TRACE_WRITE_BIT,
+            TRACE_VERIFY_BIT = 16,  // .. 31
+        };
+        void trace(bool on);
+        bool trace() const { return _adc.tracing(); }
+        int trace_read(uint8_t *buf, int cnt) { return _adc.trace_read(buf, cnt); }
+        uint32_t trace_lost() const { return _adc.trace_lost(); }
+
         void loop();
 
-        DccThrottle *create_throttle();
+        void stats(DccBitstreamStats& stats) const { _bitstream.stats(stats); }
+        void stats_reset() { _bitstream.stats_reset(); }
+
+        // packets queued by the ops loop
+        uint32_t ops_pkt_cnt() const { return _ops_pkt_cnt; }
+
+        // Throttles come from a fixed pool; create_throttle() returns
+        // nullptr if all throttle_max are in use, or if admit is true and
+        // refresh_admit() says no.
+        DccThrottle *create_throttle(bool admit=true);
         void delete_throttle(DccThrottle *throttle);
 
-        void show();
+        int throttle_cnt() const { return _throttle_cnt; }
+
+        static const int throttle_max = 128; // 255 max
 
-        void show_ack_ma();
+        // Refresh weighting. Each refresh goes to the throttle that has gone
+        // longest without one, with a running throttle's time counted
+        // refresh_weight times over, so in steady state running throttles
+        // are refreshed refresh_weight times as often as idle ones
+        // (DccThrottle::idle). An idle throttle that has gone idle_refresh_ms
+        // goes ahead of the weighting, so each is refreshed at least that
+        // often, unless there are too many throttles for that. A weight of 1
+        // refreshes all throttles equally.
+        void refresh_weight(int weight);
+        int refresh_weight() const { return _refresh_weight; }
+        static const int refresh_weight_max = 64;
+
+        void idle_refresh_ms(int ms);
+        int idle_refresh_ms() const { return _idle_refresh_us / 1000; }
+
+        struct RefreshStats {
+            uint32_t cnt;       // refresh packets queued
+            uint32_t avg_us;    // average time between them
+            uint32_t max_us;    // longest time between them
+        };
+
+        // Refresh packets for one throttle (not the changes sent ahead of
+        // them), since it was created or refresh_reset() was called.
+        // Times are when the packets are queued.
+        void refresh_stats(const DccThrottle *throttle, RefreshStats& stats) const;
+        void refresh_reset();
+
+        void show_refresh();
+
+        // Share of the packets (each repeat counted) that queued ops mode
+        // writes can take while there is other traffic; with no writes
+        // queued, it all goes to the other traffic. Speed and function
+        // changes go ahead of writes. The limit keeps some refresh going
+        // during a long upload.
+        void write_share_pct(int pct);
+        int write_share_pct() const { return _write_share_pct; }
+        static const int write_share_pct_max = 90;
+
+        // Airtime: bits and time on the track (DccBitstream::pkt_us) of the
+        // packets the ops loop queues, each repeat counted, for all
+        // throttles or one, since airtime_reset() or the throttle was
+        // created. Packets queued for a deleted throttle stay in the total.
+        // Packets are counted when queued, so pkt_us would run ahead of
+        // window_us by the packets pending; it is held to window_us.
+        struct Airtime {
+            uint32_t pkt_cnt;
+            uint32_t bit_cnt;
+            uint64_t pkt_us;
+            uint64_t window_us; // time since reset or create
+        };
+        void airtime(Airtime& air) const;
+        void airtime(const DccThrottle *throttle, Airtime& air) const;
+        void airtime_reset();
+
+        // Admission control. The refresh interval estimate for a number of
+        // throttles is that many times the average refresh packet time so
+        // far, i.e. as if all were running and refreshed equally. With
+        // refresh_max_ms set (0, the default, is off), refresh_admit() is
+        // false for a number of throttles that would go over it. Both only
+        // read one word the ops loop keeps, so they can be called from the
+        // other core.
+        void refresh_max_ms(int ms);
+        int refresh_max_ms() const { return _refresh_max_us / 1000; }
+        uint32_t refresh_est_us(int throttle_cnt) const;
+        bool refresh_admit(int throttle_cnt) const;
+
+        void show_airtime();
+
+        void show();
 
     private:
 
+#ifdef INCLUDE_BITSTREAM_PIO
+        DccBitstreamPio _bitstream;
+#else
         DccBitstream _bitstream;
+#endif
 
         DccAdc& _adc;
 
         Mode _mode;
 
+        // Throttle pool. Throttles in use are on a circular doubly-linked
+        // list (by index, in _link_next and _link_prev), which is the
+        // refresh rotation. Free ones are on a stack (_free). Create inserts
+        // just behind _next_throttle, so a new throttle waits its turn like
+        // the others, and delete only moves _next_throttle if it pointed at
+        // the throttle deleted, so the rotation is not restarted.
+        DccThrottle _throttle[throttle_max];
+        uint8_t _link_next[throttle_max];
+        uint8_t _link_prev[throttle_max];
+        static const uint8_t link_free = 0xff; // _link_next of a free throttle
+        uint8_t _free[throttle_max];
+        int _free_cnt;
+        int _throttle_cnt;
+
         // for MODE_OPS
-        std::list<DccThrottle*> _throttles;
-        std::list<DccThrottle*>::iterator _next_throttle;
+        int _next_throttle; // index, or -1 if no throttles
+        int _refresh_weight;
+        static const int refresh_weight_default = 4;
+        uint32_t _idle_refresh_us;
+        static const uint32_t idle_refresh_us_default = 1000000;
+        int next_refresh();
+
+        // refresh times, per throttle
+        struct Refresh {
+            uint32_t cnt;       // since create or refresh_reset()
+            uint32_t last_us;
+            uint32_t max_us;
+            uint64_t sum_us;    // of the cnt - 1 intervals
+        };
+        Refresh _refresh[throttle_max];
+        void refreshed(int idx);
+
+        // airtime, all throttles and per throttle
+        struct Air {
+            uint32_t pkt_cnt;
+            uint32_t bit_cnt;
+            uint64_t us;
+            uint64_t start_us;
+        };
+        Air _air;
+        Air _throttle_air[throttle_max];
+        void account(int idx, const DccPkt& pkt, int repeat, bool refresh);
+
+        // all refresh packets ever, and their average published in one
+        // word for refresh_est_us()
+        uint64_t _refresh_air_us;
+        uint32_t _refresh_air_cnt;
+        volatile uint32_t _refresh_pkt_us;
+        uint32_t _refresh_max_us;
+        static const int ops_pending_max = 2; // bitstream queue slots
+        uint32_t _ops_pkt_cnt;
         void loop_ops();
 
+        // Speed and function changes (DccThrottle::urgent) go ahead of the
+        // refresh rotation, but after urgent_run_max of them in a row one
+        // refresh packet goes out so the rotation is not starved.
+        int _next_urgent; // index, or -1 if no throttles
+        static const int urgent_run_max = 4;
+        int _urgent_run;
+        DccThrottle *find_urgent();
+
+        // ops mode writes (DccThrottle::write_cv/write_bit)
+        int _next_write; // index, or -1 if no throttles
+        int _write_share_pct;
+        static const int write_share_pct_default = 50;
+        int _write_credit;
+        DccThrottle *find_write();
+
+        // overcurrent trip and retry
+        uint16_t _trip_ma;
+        uint16_t _trip_us;
+        static const uint16_t trip_ma_default = 2500;
+        static const uint16_t trip_us_default = 2000;
+        static const uint32_t trip_retry_min_ms = 250;
+        static const uint32_t trip_retry_max_ms = 8000;
+        static const uint32_t trip_ok_ms = 2000;
+        uint32_t _trip_on_us;       // when power last came on
+        uint32_t _trip_backoff_ms;  // for the last trip; 0 for none yet
+        uint32_t _trip_seen;        // _adc.trip_cnt() as of the last one
+        uint32_t _trip_retry_cnt;
+        void trip_arm();
+        static void trip_handler(void *arg);
+        void loop_trip();
+
+        // current trace: the packet (by DccBitstream::started_cnt) the last
+        // sample was in, and its tag
+        uint32_t _trace_pkt;
+        uint8_t _trace_tag;
+        static uint8_t trace_tag(void *arg, uint32_t sample_us, uint32_t& pkt);
+        uint8_t trace_tag(const uint8_t *msg, int msg_len) const;
+
         // for MODE_SVC_*
         int _svc_status; // -1 not done, 0 failed, 1 success
+        bool _svc_no_load;
+        bool _svc_load_checked;
+        uint32_t _svc_start_us;
+        bool svc_load_check();
         uint16_t _ack_ma;
+        uint16_t _ack_base_ma;
+        uint16_t _ack_noise_ma;
         static const uint16_t ack_inc_ma = 60;
-#ifdef INCLUDE_ACK_DBG
-        uint16_t _ack_dbg_ma[9]; // 0..7 are bits, 8 is byte
-#endif
+        static const uint16_t ack_step_min_ma = 30;
+        static const int ack_sigma = 4;
+        bool _ack_cancel;
+        void ack_baseline();
+        uint16_t ack_step_ma() const { return _ack_ma - _ack_base_ma; }
 
+        // per group decisions; the last one is open (its ack can still be
+        // going) until the next group is armed or the track is turned off
+        SvcAck _svc_ack[svc_ack_max];
+        int _svc_ack_cnt;
+        bool _svc_ack_open;
+        void ack_close();
+
+        // Counts are how many times to send each packet; each group is
+        // queued in the bitstream at once with these repeat counts.
         int _reset1_cnt;
         int _reset2_cnt;
+        void start_svc();
+        void svc_end();
+
+        // ack detection runs in the adc irq handler (DccAdc::ack_arm)
+        void ack_arm(bool cancel);
+        static void ack_handler(void *arg);
+        bool ack_held();
+
+        // for mode_svc_session; _svc_op_cnt is 0 for a single operation
+        SvcOp _svc_op[svc_op_max];
+        int _svc_op_cnt;
+        int _svc_op_idx;            // the one running
+        int _svc_session_status;    // -1 not done, 0 failed, 1 success
+        void svc_op_init(const SvcOp& op);
+        void svc_op_begin();
+
+        // page selected in the session, and the page cv being written ahead
+        // of an indexed operation (0 for none)
+        DccCv::Page _svc_page;
+        int _svc_page_cv;
+        void svc_page_written(const SvcOp& op);
+
+        // cv cache; _svc_one is a single operation, as an SvcOp
+        DccCvCache _cv_cache;
+        int _svc_loco;
+        bool _svc_read_cached;
+        uint32_t _svc_cached_cnt;
+        SvcOp _svc_one;
+        bool svc_cached(SvcOp& op);
+        void svc_from_cache(uint8_t val);
+        void svc_cache(const SvcOp& op);
+
+        void svc_write_cv_init(int cv_num, uint8_t cv_val);
+        void svc_write_bit_init(int cv_num, int bit_num, int bit_val);
+        void svc_read_cv_init(int cv_num);
+        void svc_read_bit_init(int cv_num, int bit_num);
 
         // for MODE_SVC_WRITE_CV
         DccPktSvcWriteCv _pkt_svc_write_cv;
@@ -80,6 +481,7 @@ class DccCommand
         DccPktSvcWriteBit _pkt_svc_write_bit;
         int _write_bit_cnt;
         void loop_svc_write();
+        void begin_svc_write();
 
         // for MODE_SVC_READ_CV
         DccPktSvcVerifyBit _pkt_svc_verify_bit;
@@ -90,4 +492,31 @@ class DccCommand
         int _read_bit; // -1 when doing a byte read, or 0..7 when doing a bit read
         uint8_t _cv_val;
         void loop_svc_read();
+        void begin_svc_read();
+        void send_verify();
+
+        // Fast reads send one packet at a time, deciding what's next as each
+        // one starts. A group is the verifies for one bit (or the byte) and
+        // the resets after them.
+        bool _read_fast;
+        bool _read_fast_now;    // this read; false once it starts over
+        int _fast_verify_cnt;   // verifies per group, fast_verify_min.._verify_cnt
+        static const int fast_verify_min = 2;
+        static const int fast_verify_default = 3;
+        static const int fast_after_cnt = 2;  // resets that no ack has to last
+        static const int fast_clean_run = 8;  // clean groups to drop a verify
+        int _fast_clean;
+        int _group_verify_cnt;
+        int _group_sent;        // verifies
+        int _group_after;       // resets
+        uint16_t _group_peak_ma;
+        bool _group_ack;
+        bool _group_retry;
+        uint32_t _fast_retry_cnt;
+        uint32_t _fast_restart_cnt;
+        void loop_svc_read_fast();
+        void fast_group_start();
+        void fast_restart();
+        void fast_group_done(bool ack);
+        void fast_send_verify();
 };
@@ -10,12 +10,16 @@ static const int dcc_sig_gpio = 17; // PH
 static const int dcc_pwr_gpio = 16; // EN
 static const int dcc_slp_gpio = -1; // SLP
 static const int dcc_adc_gpio = 26; // CS (ADC0)
+static const int dcc_adc_uv_per_ma = 1100; // DRV8874 carrier, 1.1 mV/mA
+static const int dcc_adc_sync_slice = 7; // pwm slice, no gpio (adc sync)
 #else
 // engine house
 static const int dcc_sig_gpio = 27; // PH
 static const int dcc_pwr_gpio = 28; // EN
 static const int dcc_slp_gpio = 22; // SLP
 static const int dcc_adc_gpio = 26; // CS (ADC0)
+static const int dcc_adc_uv_per_ma = 1100; // DRV8874 carrier, 1.1 mV/mA
+static const int dcc_adc_sync_slice = 7; // pwm slice, no gpio (adc sync)
 #endif
 
 #elif (defined ARDUINO_PIMORONI_TINY2040)
@@ -0,0 +1,467 @@
+#include <Arduino.h>
+#include "xassert.h"
+#include "dcc_command.h"
+#include "dcc_throttle.h"
+#include "dcc_core1.h"
+
+
+DccCore1::DccCore1(DccCommand& command) :
+    _command(command),
+    _req(),
+    _rsp(),
+    _throttle_free_cnt(0),
+    _mode(DccCommand::MODE_OFF),
+    _svc_status(-1),
+    _svc_val(0),
+    _svc_no_load(false),
+    // _svc_op set when used
+    _svc_op_cnt(0),
+    _svc_busy(false),
+    // _run_op set when used
+    _run_op_cnt(0),
+    _loop_us(0),
+    _stall_cnt(0)
+{
+    for (int i = DccCommand::throttle_max - 1; i >= 0; i--) {
+        _throttle[i]._core1 = this;
+        _throttle_free[_throttle_free_cnt++] = i;
+    }
+}
+
+
+DccCore1::~DccCore1()
+{
+}
+
+
+void DccCore1::mode_off()
+{
+    _mode = DccCommand::MODE_OFF;
+    request(OP_MODE_OFF);
+}
+
+
+void DccCore1::mode_ops()
+{
+    _mode = DccCommand::MODE_OPS;
+    request(OP_MODE_OPS);
+}
+
+
+void DccCore1::mode_svc_write_cv(int cv_num, uint8_t cv_val)
+{
+    _mode = DccCommand::MODE_SVC_WRITE_CV;
+    _svc_status = -1;
+    _svc_no_load = false;
+    _svc_op_cnt = 0;
+    request(OP_SVC_WRITE_CV, nullptr, cv_num, cv_val);
+}
+
+
+void DccCore1::mode_svc_write_bit(int cv_num, int bit_num, int bit_val)
+{
+    _mode = DccCommand::MODE_SVC_WRITE_CV;
+    _svc_status = -1;
+    _svc_no_load = false;
+    _svc_op_cnt = 0;
+    request(OP_SVC_WRITE_BIT, nullptr, cv_num, bit_num, bit_val);
+}
+
+
+void DccCore1::mode_svc_read_cv(int cv_num)
+{
+    _mode = DccCommand::MODE_SVC_READ_CV;
+    _svc_status = -1;
+    _svc_no_load = false;
+    _svc_op_cnt = 0;
+    request(OP_SVC_READ_CV, nullptr, cv_num);
+}
+
+
+void DccCore1::mode_svc_read_bit(int cv_num, int bit_num)
+{
+    _mode = DccCommand::MODE_SVC_READ_CV;
+    _svc_status = -1;
+    _svc_no_load = false;
+    _svc_op_cnt = 0;
+    request(OP_SVC_READ_BIT, nullptr, cv_num, bit_num);
+}
+
+
+void DccCore1::mode_svc_session(const DccCommand::SvcOp *op, int op_cnt)
+{
+    xassert(0 < op_cnt && op_cnt <= DccCommand::svc_op_max);
+
+    bool read = (op[0].type == DccCommand::SvcOp::READ_CV ||
+                 op[0].type == DccCommand::SvcOp::READ_BIT ||
+                 op[0].type == DccCommand::SvcOp::READ_INDEXED);
+    _mode = read ? DccCommand::MODE_SVC_READ_CV : DccCommand::MODE_SVC_WRITE_CV;
+    _svc_status = -1;
+    _svc_no_load = false;
+    for (int i = 0; i < op_cnt; i++) {
+        _svc_op[i] = op[i];
+        // unsigned, since index_lo can have the sign bit
+        uint32_t cv = (uint32_t(op[i].index_lo) << 24) |
+                      (uint32_t(op[i].index_hi) << 16) | op[i].cv_num;
+        request(OP_SVC_SESSION_OP, nullptr, (i << 8) | op[i].type, int(cv),
+                (op[i].bit_num << 8) | op[i].val);
+    }
+    _svc_op_cnt = op_cnt;
+    request(OP_SVC_SESSION, nullptr, op_cnt);
+}
+
+
+bool DccCore1::svc_session_done(bool& result, DccCommand::SvcOp *op) const
+{
+    if (_svc_op_cnt == 0 || _svc_status == -1)
+        return false;
+
+    result = (_svc_status == 1);
+
+    for (int i = 0; i < _svc_op_cnt; i++)
+        op[i] = _svc_op[i];
+
+    return true;
+}
+
+
+bool DccCore1::svc_done(bool& result)
+{
+    if (_svc_status == -1)
+        return false;
+
+    result = (_svc_status == 1);
+    return true;
+}
+
+
+bool DccCore1::svc_done(bool& result, uint8_t& val)
+{
+    if (_svc_status == -1)
+        return false;
+
+    result = (_svc_status == 1);
+
+    if (result)
+        val = _svc_val;
+
+    return true;
+}
+
+
+// core 0
+void DccCore1::loop()
+{
+    _loop_us = time_us_32();
+
+    Rsp rsp;
+    while (_rsp.get(rsp)) {
+        if (rsp.op >= 0) {
+            // one of a session's; the session's own result follows
+            _svc_op[rsp.op].status = rsp.status;
+            _svc_op[rsp.op].val = rsp.val;
+            continue;
+        }
+        // the command is off when a svc operation is done
+        _mode = DccCommand::MODE_OFF;
+        _svc_val = rsp.val;
+        _svc_no_load = rsp.no_load;
+        _svc_status = rsp.status;
+    }
+}
+
+
+DccCore1::Throttle *DccCore1::create_throttle()
+{
+    if (_throttle_free_cnt == 0)
+        return nullptr;
+    int throttle_cnt = DccCommand::throttle_max - _throttle_free_cnt;
+    // only reads the average refresh packet time core 1 publishes
+    if (!_command.refresh_admit(throttle_cnt + 1))
+        return nullptr;
+    Throttle *throttle = &_throttle[_throttle_free[--_throttle_free_cnt]];
+    // Core 1 may not have run the delete of the throttle this proxy had yet;
+    // it still has that one's _throttle, which write_done() ignores until
+    // core 1 has run this create.
+    throttle->_create_cnt++;
+    throttle->_write_queued = 0;
+    throttle->_page.forget();
+    request(OP_THROTTLE_CREATE, throttle, int(throttle->_create_cnt));
+    return throttle;
+}
+
+
+void DccCore1::delete_throttle(Throttle *throttle)
+{
+    int idx = throttle - _throttle;
+    xassert(0 <= idx && idx < DccCommand::throttle_max);
+    request(OP_THROTTLE_DELETE, throttle);
+    _throttle_free[_throttle_free_cnt++] = idx;
+}
+
+
+void DccCore1::Throttle::address(int address)
+{
+    _page.forget();
+    _core1->request(OP_THROTTLE_ADDRESS, this, address);
+}
+
+
+void DccCore1::Throttle::speed(int speed)
+{
+    _core1->request(OP_THROTTLE_SPEED, this, speed);
+}
+
+
+void DccCore1::Throttle::function(int func, bool on)
+{
+    _core1->request(OP_THROTTLE_FUNCTION, this, func, on ? 1 : 0);
+}
+
+
+void DccCore1::Throttle::estop()
+{
+    _core1->request(OP_THROTTLE_ESTOP, this);
+}
+
+
+bool DccCore1::Throttle::write_cv(int cv_num, uint8_t cv_val)
+{
+    if (write_pending() >= DccThrottle::write_max)
+        return false;
+    _write_queued++;
+    _page.written(cv_num, cv_val);
+    _core1->request(OP_THROTTLE_WRITE_CV, this, cv_num, cv_val);
+    return true;
+}
+
+
+bool DccCore1::Throttle::write_bit(int cv_num, int bit_num, int bit_val)
+{
+    if (write_pending() >= DccThrottle::write_max)
+        return false;
+    _write_queued++;
+    _page.written(cv_num, -1);
+    _core1->request(OP_THROTTLE_WRITE_BIT, this, cv_num, bit_num, bit_val);
+    return true;
+}
+
+
+bool DccCore1::Throttle::write_indexed(int index_hi, int index_lo, int cv_num,
+                                       uint8_t cv_val)
+{
+    if (write_pending() + _page.writes(index_hi, index_lo) + 1 > DccThrottle::write_max)
+        return false;
+    if (_page.hi != index_hi)
+        write_cv(DccCv::index_hi, index_hi);
+    if (_page.lo != index_lo)
+        write_cv(DccCv::index_lo, index_lo);
+    write_cv(cv_num, cv_val);
+    return true;
+}
+
+
+int DccCore1::Throttle::write_indexed(DccThrottle::Indexed *cv, int cnt)
+{
+    DccCv::sort_pages(cv, cnt);
+    int i;
+    for (i = 0; i < cnt; i++)
+        if (!write_indexed(cv[i].index_hi, cv[i].index_lo, cv[i].cv_num, cv[i].cv_val))
+            break;
+    return i;
+}
+
+
+uint32_t DccCore1::Throttle::write_done() const
+{
+    if (_created != _create_cnt)
+        return 0; // core 1 has not created it yet
+    // _throttle was set before _created
+    __dmb();
+    DccThrottle *throttle = _throttle;
+    return throttle == nullptr ? 0 : throttle->write_done();
+}
+
+
+// core 0
+void DccCore1::request(Op op, Throttle *throttle, int arg0, int arg1, int arg2)
+{
+    Req req;
+    req.op = op;
+    req.throttle = throttle;
+    req.arg[0] = arg0;
+    req.arg[1] = arg1;
+    req.arg[2] = arg2;
+
+    // Core 1 empties the queue every time through its loop, so this only
+    // waits if core 0 sends a burst of requests.
+    while (!_req.put(req))
+        ;
+}
+
+
+// core 1
+void DccCore1::loop1()
+{
+    Req req;
+    while (_req.get(req))
+        run(req);
+
+    uint32_t pkt_cnt = _command.ops_pkt_cnt();
+
+    _command.loop();
+
+    pkt_cnt = _command.ops_pkt_cnt() - pkt_cnt;
+    if (pkt_cnt > 0 && (time_us_32() - _loop_us) > stall_us)
+        _stall_cnt += pkt_cnt;
+
+    // Send the result when the command is off, since with adc logging it
+    // keeps going after the result is known.
+    bool result;
+    uint8_t val = 0;
+    if (_svc_busy && _command.mode() == DccCommand::MODE_OFF &&
+        (_run_op_cnt > 0 ? _command.svc_session_done(result, _run_op)
+                         : _command.svc_done(result, val))) {
+        _svc_busy = false;
+        // core 0 takes results every loop and there is at most one
+        // operation or session outstanding, so these do not fail
+        Rsp rsp;
+        for (int i = 0; i < _run_op_cnt; i++) {
+            rsp.status = _run_op[i].status;
+            rsp.val = _run_op[i].val;
+            rsp.op = i;
+            rsp.no_load = false;
+            _rsp.put(rsp);
+        }
+        rsp.status = result ? 1 : 0;
+        rsp.val = val;
+        rsp.op = -1;
+        rsp.no_load = _command.svc_no_load();
+        _rsp.put(rsp);
+    }
+}
+
+
+// core 1
+void DccCore1::run(const Req& req)
+{
+    switch (req.op) {
+
+    case OP_MODE_OFF:
+        _svc_busy = false;
+        _command.mode_off();
+        break;
+
+    case OP_MODE_OPS:
+        _svc_busy = false;
+        _command.mode_ops();
+        break;
+
+    case OP_SVC_WRITE_CV:
+        _svc_busy = true;
+        _run_op_cnt = 0;
+        _command.mode_svc_write_cv(req.arg[0], req.arg[1]);
+        break;
+
+    case OP_SVC_WRITE_BIT:
+        _svc_busy = true;
+        _run_op_cnt = 0;
+        _command.mode_svc_write_bit(req.arg[0], req.arg[1], req.arg[2]);
+        break;
+
+    case OP_SVC_READ_CV:
+        _svc_busy = true;
+        _run_op_cnt = 0;
+        _command.mode_svc_read_cv(req.arg[0]);
+        break;
+
+    case OP_SVC_READ_BIT:
+        _svc_busy = true;
+        _run_op_cnt = 0;
+        _command.mode_svc_read_bit(req.arg[0], req.arg[1]);
+        break;
+
+    case OP_SVC_SESSION_OP:
+        // operations come one at a time, ahead of OP_SVC_SESSION
+        {
+            int i = req.arg[0] >> 8;
+            xassert(0 <= i && i < DccCommand::svc_op_max);
+            DccCommand::SvcOp& op = _run_op[i];
+            op.type = DccCommand::SvcOp::Type(req.arg[0] & 0xff);
+            uint32_t cv = uint32_t(req.arg[1]);
+            op.cv_num = cv & 0xffff;
+            op.index_hi = (cv >> 16) & 0xff;
+            op.index_lo = (cv >> 24) & 0xff;
+            op.bit_num = req.arg[2] >> 8;
+            op.val = req.arg[2] & 0xff;
+        }
+        break;
+
+    case OP_SVC_SESSION:
+        _svc_busy = true;
+        _run_op_cnt = req.arg[0];
+        _command.mode_svc_session(_run_op, _run_op_cnt);
+        break;
+
+    case OP_TRIP:
+        _command.trip(req.arg[0], req.arg[1]);
+        break;
+
+    case OP_TRACE:
+        _command.trace(req.arg[0] != 0);
+        break;
+
+    case OP_ADC_SYNC:
+        _command.adc_sync(req.arg[0]);
+        break;
+
+    case OP_THROTTLE_CREATE:
+        xassert(req.throttle != nullptr);
+        // same size pools, and admission was checked on core 0, so there's
+        // always one
+        req.throttle->_throttle = _command.create_throttle(false);
+        xassert(req.throttle->_throttle != nullptr);
+        // core 0 can see it once it sees this
+        __dmb();
+        req.throttle->_created = uint32_t(req.arg[0]);
+        break;
+
+    case OP_THROTTLE_DELETE:
+        // Only core 1 writes _throttle, and requests are run in order, so
+        // it is the one this proxy's last create made, even if core 0 has
+        // handed the proxy out again since.
+        xassert(req.throttle != nullptr);
+        xassert(req.throttle->_throttle != nullptr);
+        _command.delete_throttle(req.throttle->_throttle);
+        req.throttle->_throttle = nullptr;
+        break;
+
+    case OP_THROTTLE_ADDRESS:
+        req.throttle->_throttle->address(req.arg[0]);
+        break;
+
+    case OP_THROTTLE_SPEED:
+        req.throttle->_throttle->speed(req.arg[0]);
+        break;
+
+    case OP_THROTTLE_FUNCTION:
+        req.throttle->_throttle->function(req.arg[0], req.arg[1] != 0);
+        break;
+
+    case OP_THROTTLE_ESTOP:
+        req.throttle->_throttle->estop();
+        break;
+
+    case OP_THROTTLE_WRITE_CV:
+        // core 0 checked that it fits
+        if (!req.throttle->_throttle->write_cv(req.arg[0], req.arg[1]))
+            xassert(false);
+        break;
+
+    case OP_THROTTLE_WRITE_BIT:
+        if (!req.throttle->_throttle->write_bit(req.arg[0], req.arg[1], req.arg[2]))
+            xassert(false);
+        break;
+
+    }
+}
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <Arduino.h>
+#include "dcc_command.h"
+#include "dcc_queue.h"
+
+
+// Run a DccCommand (and the DccAdc sampling it does) on core 1 by itself, so
+// a slow print or a USB stall on core 0 can't hold up the packet queue.
+//
+// Core 0 uses this object the same way it would use the DccCommand (mode_*,
+// svc_done, create_throttle, ...), and calls loop() from its loop(). Each
+// call is turned into a request on a queue to core 1; core 1 calls loop1()
+// from its loop1(), which carries out the requests and runs the command's
+// loop(). Service mode results come back to core 0 on a second queue.
+//
+// Everything the DccCommand does happens on core 1, including starting the
+// bitstream and the adc, so both their interrupts are enabled on (and run on)
+// core 1, and an ack seen in the adc's can cancel packets in the bitstream.
+//
+// Throttles are handled the same way: core 0 gets a DccCore1::Throttle, and
+// its setters are requests to core 1 to call the real DccThrottle's.
+
+class DccCore1
+{
+
+    public:
+
+        DccCore1(DccCommand& command);
+        ~DccCore1();
+
+        // core 0
+
+        DccCommand::Mode mode() const { return _mode; }
+
+        void mode_off();
+        void mode_ops();
+        void mode_svc_write_cv(int cv_num, uint8_t cv_val);
+        void mode_svc_write_bit(int cv_num, int bit_num, int bit_val);
+        void mode_svc_read_cv(int cv_num);
+        void mode_svc_read_bit(int cv_num, int bit_num);
+
+        // Same as DccCommand's; the result is available after core 1 has
+        // finished and loop() has picked it up.
+        bool svc_done(bool& result);
+        bool svc_done(bool& result, uint8_t& val);
+        bool svc_no_load() const { return _svc_no_load; }
+
+        // Same as DccCommand's; each operation is a request to core 1, and
+        // the results come back together when the session is done.
+        void mode_svc_session(const DccCommand::SvcOp *op, int op_cnt);
+        bool svc_session_done(bool& result, DccCommand::SvcOp *op) const;
+
+        void loop();
+
+        class Throttle
+        {
+            public:
+                Throttle() :
+                    _core1(nullptr), _throttle(nullptr), _created(0),
+                    _create_cnt(0), _write_queued(0), _page() { }
+                void address(int address);
+                void speed(int speed);
+                void function(int func, bool on);
+                void estop();
+                // Same as DccThrottle's. The queue is counted here, from
+                // the writes sent to core 1 and the real throttle's
+                // write_done(), so a write core 0 is told was queued always
+                // fits when core 1 gets to it.
+                bool write_cv(int cv_num, uint8_t cv_val);
+                bool write_bit(int cv_num, int bit_num, int bit_val);
+                // Same as DccThrottle's. The page is kept here too, from
+                // the same writes in the same order, so the page writes
+                // queued here are the ones the real throttle would queue.
+                bool write_indexed(int index_hi, int index_lo, int cv_num, uint8_t cv_val);
+                int write_indexed(DccThrottle::Indexed *cv, int cnt);
+                uint32_t write_queued() const { return _write_queued; }
+                uint32_t write_done() const;
+                int write_pending() const { return _write_queued - write_done(); }
+            private:
+                friend class DccCore1;
+                DccCore1 *_core1;
+                // Only core 1 writes these: _throttle when it creates and
+                // deletes the throttle, then _created to the create's count.
+                // Until _created catches up with _create_cnt (e.g. a proxy
+                // deleted and handed out again, with core 1 not there yet),
+                // core 0 takes it as no writes done.
+                DccThrottle * volatile _throttle;
+                volatile uint32_t _created;
+                uint32_t _create_cnt;   // core 0
+                uint32_t _write_queued; // core 0
+                DccCv::Page _page;      // core 0
+        };
+
+        // Same as DccCommand's, including returning nullptr when all
+        // DccCommand::throttle_max are in use or refresh_admit() says no.
+        // Admission is decided here on core 0, from the number of throttles
+        // handed out, so core 1 always has one for the request.
+        Throttle *create_throttle();
+        void delete_throttle(Throttle *throttle);
+
+        // Bitstream stats, read directly from core 0 (the counters are
+        // single words, except isr_cyc).
+        void stats(DccBitstreamStats& stats) const { _command.stats(stats); }
+
+        // Packets core 1 queued while core 0 had not been through its loop
+        // for longer than a packet takes to send. With everything on core 0,
+        // these would have been idle packets.
+        uint32_t stall_cnt() const { return _stall_cnt; }
+
+        // Refresh report, also read directly from core 0, so a line can be
+        // off by a refresh.
+        void show_refresh() { _command.show_refresh(); }
+        void show_airtime() { _command.show_airtime(); }
+        void show_svc_ack() { _command.show_svc_ack(); }
+        void show_trip() { _command.show_trip(); }
+
+        // single words that core 1 only reads
+        void refresh_max_ms(int ms) { _command.refresh_max_ms(ms); }
+        int refresh_max_ms() const { return _command.refresh_max_ms(); }
+        void svc_read_fast(bool fast) { _command.svc_read_fast(fast); }
+        bool svc_read_fast() const { return _command.svc_read_fast(); }
+        void svc_loco(int address) { _command.svc_loco(address); }
+        int svc_loco() const { return _command.svc_loco(); }
+        void svc_read_cached(bool cached) { _command.svc_read_cached(cached); }
+        bool svc_read_cached() const { return _command.svc_read_cached(); }
+        uint32_t svc_cached_cnt() const { return _command.svc_cached_cnt(); }
+
+        // Same as DccCommand's; core 1 re-arms the trip with the new
+        // settings, so it's a request.
+        void trip(int ma, int us) { request(OP_TRIP, nullptr, ma, us); }
+        int trip_ma() const { return _command.trip_ma(); }
+        int trip_us() const { return _command.trip_us(); }
+        uint32_t trip_cnt() const { return _command.trip_cnt(); }
+        uint32_t trip_retry_cnt() const { return _command.trip_retry_cnt(); }
+
+        // Same as DccCommand's; core 1 sets up the sampling when it next
+        // starts it, so it's a request.
+        void adc_sync(int slice) { request(OP_ADC_SYNC, nullptr, slice); }
+        bool adc_sync() const { return _command.adc_sync(); }
+
+        // Same as DccCommand's. Starting the trace is a request, since the
+        // adc handler on core 1 reads what it sets up; the trace itself is
+        // read directly from core 0 (DccAdc::trace_read).
+        void trace(bool on) { request(OP_TRACE, nullptr, on ? 1 : 0); }
+        bool trace() const { return _command.trace(); }
+        int trace_read(uint8_t *buf, int cnt) { return _command.trace_read(buf, cnt); }
+        uint32_t trace_lost() const { return _command.trace_lost(); }
+
+        // core 1
+
+        void loop1();
+
+    private:
+
+        DccCommand& _command;
+
+        enum Op : uint8_t {
+            OP_MODE_OFF,
+            OP_MODE_OPS,
+            OP_SVC_WRITE_CV,
+            OP_SVC_WRITE_BIT,
+            OP_SVC_READ_CV,
+            OP_SVC_READ_BIT,
+            OP_SVC_SESSION_OP,
+            OP_SVC_SESSION,
+            OP_TRIP,
+            OP_TRACE,
+            OP_ADC_SYNC,
+            OP_THROTTLE_CREATE,
+            OP_THROTTLE_DELETE,
+            OP_THROTTLE_ADDRESS,
+            OP_THROTTLE_SPEED,
+            OP_THROTTLE_FUNCTION,
+            OP_THROTTLE_ESTOP,
+            OP_THROTTLE_WRITE_CV,
+            OP_THROTTLE_WRITE_BIT,
+        };
+
+        struct Req {
+            Op op;
+            Throttle *throttle; // OP_THROTTLE_*
+            int arg[3];
+        };
+
+        // Service mode result. A session's results are one for each
+        // operation (op is its index), then the session's (op is -1).
+        struct Rsp {
+            int status; // -1 not run, 0 failed, 1 success
+            uint8_t val;
+            int8_t op;  // -1 the operation or session
+            bool no_load; // op -1
+        };
+
+        DccQueue<Req, 16> _req; // core 0 -> core 1
+        DccQueue<Rsp, 16> _rsp; // core 1 -> core 0; a whole session's fit
+
+        void request(Op op, Throttle *throttle=nullptr,
+                     int arg0=0, int arg1=0, int arg2=0);
+
+        // core 0
+        //
+        // Throttles handed out, one for each in the DccCommand's pool. A
+        // deleted one can be handed out again right away; core 1 carries out
+        // the delete before the create that reuses it, whenever it gets to
+        // them.
+        Throttle _throttle[DccCommand::throttle_max];
+        uint8_t _throttle_free[DccCommand::throttle_max];
+        int _throttle_free_cnt;
+        DccCommand::Mode _mode; // as of the last request or result
+        int _svc_status;        // -1 not done, 0 failed, 1 success
+        uint8_t _svc_val;
+        bool _svc_no_load;
+        DccCommand::SvcOp _svc_op[DccCommand::svc_op_max];
+        int _svc_op_cnt;
+
+        // core 1
+        bool _svc_busy; // started a svc operation, result not sent yet
+        DccCommand::SvcOp _run_op[DccCommand::svc_op_max]; // session
+        int _run_op_cnt; // 0 for a single operation
+        void run(const Req& req);
+
+        // shortest packet a throttle sends (speed, short address) is 50
+        // bits, at least 50 * 116 usec
+        static const uint32_t stall_us = 50 * 116;
+        volatile uint32_t _loop_us;   // core 0's last loop()
+        volatile uint32_t _stall_cnt;
+
+}; // class DccCore1
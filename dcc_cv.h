@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 namespace DccCv
 {
 
@@ -25,6 +27,45 @@ const int bell_vol = 283;
 const int clank_vol = 291;
 const int squeal_vol = 435;
 
+// The page of indexed cvs a decoder has selected, i.e. what was last
+// written to index_hi and index_lo, each -1 until known. An indexed cv only
+// needs writes() page writes ahead of it.
+struct Page {
+    int16_t hi;
+    int16_t lo;
+    Page() : hi(-1), lo(-1) { }
+    void forget() { hi = lo = -1; }
+    int writes(int index_hi, int index_lo) const
+    {
+        return (hi != index_hi ? 1 : 0) + (lo != index_lo ? 1 : 0);
+    }
+    // cv_num was written with val, or -1 for a value not known (a bit
+    // write, or one that failed)
+    void written(int cv_num, int val)
+    {
+        if (cv_num == DccCv::index_hi)
+            hi = val;
+        else if (cv_num == DccCv::index_lo)
+            lo = val;
+    }
+};
+
+// Sort cvs by page, so going through them in order writes index_hi and
+// index_lo as few times as possible. T has a page(): (index_hi << 8) |
+// index_lo for an indexed cv, or -1 for one that isn't, which go first.
+// The order within a page is kept. Insertion sort; batches are short.
+template <typename T>
+void sort_pages(T *cv, int cnt)
+{
+    for (int i = 1; i < cnt; i++) {
+        T t = cv[i];
+        int j = i;
+        for (; j > 0 && cv[j - 1].page() > t.page(); j--)
+            cv[j] = cv[j - 1];
+        cv[j] = t;
+    }
+}
+
 };
 
 // SP2265
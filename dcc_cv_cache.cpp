@@ -0,0 +1,166 @@
+#include <Arduino.h>
+#include "xassert.h"
+#include "dcc_pkt.h"
+#include "dcc_cv_cache.h"
+
+
+DccCvCache::DccCvCache() :
+    // _block set below
+    _clock(0),
+    _hit_cnt(0)
+{
+    clear();
+}
+
+
+DccCvCache::~DccCvCache()
+{
+}
+
+
+int DccCvCache::key_index(int cv_num, int index)
+{
+    if (cv_num < indexed_min || cv_num > indexed_max)
+        return index_none;
+    xassert(-1 <= index && index <= 0xffff);
+    return index;
+}
+
+
+DccCvCache::Block *DccCvCache::find(int address, int cv_num, int index)
+{
+    int base = (cv_num - 1) / block_cvs;
+
+    for (Block& b : _block) {
+        if (b.known != 0 && b.address == address && b.index == index &&
+            b.base == base) {
+            b.used = ++_clock;
+            return &b;
+        }
+    }
+
+    return nullptr;
+}
+
+
+// A free block, or else the one used least recently.
+DccCvCache::Block *DccCvCache::alloc(int address, int cv_num, int index)
+{
+    Block *victim = &_block[0];
+    for (Block& b : _block) {
+        if (b.known == 0) {
+            victim = &b;
+            break;
+        }
+        if (uint16_t(_clock - b.used) > uint16_t(_clock - victim->used))
+            victim = &b;
+    }
+
+    victim->address = address;
+    victim->index = index;
+    victim->base = (cv_num - 1) / block_cvs;
+    victim->known = 0;
+    victim->used = ++_clock;
+
+    return victim;
+}
+
+
+bool DccCvCache::get(int address, int cv_num, uint8_t& val, int index)
+{
+    xassert(DccPkt::cv_num_min <= cv_num && cv_num <= DccPkt::cv_num_max);
+
+    index = key_index(cv_num, index);
+    if (index < 0)
+        return false;
+
+    Block *b = find(address, cv_num, index);
+    int i = (cv_num - 1) % block_cvs;
+    if (b == nullptr || (b->known & (1 << i)) == 0)
+        return false;
+
+    val = b->val[i];
+    _hit_cnt++;
+    return true;
+}
+
+
+void DccCvCache::set(int address, int cv_num, uint8_t val, int index)
+{
+    xassert(DccPkt::cv_num_min <= cv_num && cv_num <= DccPkt::cv_num_max);
+
+    index = key_index(cv_num, index);
+    if (index < 0)
+        return;
+
+    Block *b = find(address, cv_num, index);
+    if (b == nullptr)
+        b = alloc(address, cv_num, index);
+
+    int i = (cv_num - 1) % block_cvs;
+    b->val[i] = val;
+    b->known |= (1 << i);
+}
+
+
+void DccCvCache::set_bit(int address, int cv_num, int bit_num, int bit_val, int index)
+{
+    xassert(0 <= bit_num && bit_num <= 7);
+
+    uint8_t val;
+    if (!get(address, cv_num, val, index))
+        return;
+
+    if (bit_val)
+        val |= (1 << bit_num);
+    else
+        val &= ~(1 << bit_num);
+
+    set(address, cv_num, val, index);
+}
+
+
+void DccCvCache::forget(int address, int cv_num, int index)
+{
+    xassert(DccPkt::cv_num_min <= cv_num && cv_num <= DccPkt::cv_num_max);
+
+    index = key_index(cv_num, index);
+    int base = (cv_num - 1) / block_cvs;
+    int i = (cv_num - 1) % block_cvs;
+
+    // without a page, an indexed cv goes from every page
+    for (Block& b : _block)
+        if (b.known != 0 && b.address == address && b.base == base &&
+            (index < 0 || b.index == index))
+            b.known &= ~(1 << i);
+}
+
+
+void DccCvCache::forget(int address)
+{
+    for (Block& b : _block)
+        if (b.address == address)
+            b.known = 0;
+}
+
+
+void DccCvCache::clear()
+{
+    for (Block& b : _block) {
+        b.address = DccPkt::address_min;
+        b.index = index_none;
+        b.base = 0;
+        b.known = 0;
+        b.used = 0;
+    }
+}
+
+
+int DccCvCache::block_cnt() const
+{
+    int cnt = 0;
+    for (const Block& b : _block)
+        if (b.known != 0)
+            cnt++;
+    return cnt;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <Arduino.h>
+
+
+// CV values known for each loco (by address), so a write that wouldn't
+// change anything can be skipped, and a read answered without going to the
+// track. What goes in is up to the user (DccCommand puts in service mode
+// reads and acked writes); a value is only as good as what's known about
+// the decoder, so forget() it when it might have changed some other way.
+//
+// Sparse: values are kept in blocks of block_cvs consecutive cvs of one
+// loco, from a fixed pool of block_max. When the pool is full, the block
+// used least recently is dropped. Indexed cvs (indexed_min..indexed_max) are
+// kept for each page (index: (cv31 << 8) | cv32); without a page (index -1)
+// they are never known, and forgetting one forgets it in every page.
+
+class DccCvCache
+{
+
+    public:
+
+        DccCvCache();
+        ~DccCvCache();
+
+        bool get(int address, int cv_num, uint8_t& val, int index=-1);
+        void set(int address, int cv_num, uint8_t val, int index=-1);
+
+        // one bit of a value already known; nothing if it isn't
+        void set_bit(int address, int cv_num, int bit_num, int bit_val, int index=-1);
+
+        void forget(int address, int cv_num, int index=-1);
+        void forget(int address); // all of a loco's
+        void clear();
+
+        static const int block_cvs = 16;
+        static const int block_max = 64;
+
+        static const int indexed_min = 257;
+        static const int indexed_max = 512;
+
+        // blocks in use, and get() calls that found a value
+        int block_cnt() const;
+        uint32_t hit_cnt() const { return _hit_cnt; }
+
+    private:
+
+        // a block is free when none of its values are known
+        static const uint16_t index_none = 0xffff;
+        struct Block {
+            uint16_t address;
+            uint16_t index;     // index_none for cvs that aren't indexed
+            uint8_t base;       // first cv is base * block_cvs + 1
+            uint16_t known;     // bit i: val[i] is known
+            uint16_t used;      // _clock as of its last use
+            uint8_t val[block_cvs];
+        };
+        static_assert(block_cvs <= 16); // known
+
+        Block _block[block_max];
+        uint16_t _clock;
+        uint32_t _hit_cnt;
+
+        // index to keep cv_num under: none for one that isn't indexed, -1
+        // for an indexed one without a page (never known)
+        static int key_index(int cv_num, int index);
+
+        Block *find(int address, int cv_num, int index);
+        Block *alloc(int address, int cv_num, int index);
+
+}; // class DccCvCache
@@ -0,0 +1,46 @@
+#include <Arduino.h>
+#include "xassert.h"
+#include "dcc_pkt.h"
+#include "dcc_pio_words.h"
+
+
+int DccPioWords::encode(const DccPkt& pkt, int preamble_bits, uint32_t *words)
+{
+    xassert(words != nullptr);
+    xassert(0 < preamble_bits && preamble_bits <= DccPkt::svc_preamble_bits);
+
+    const int msg_len = pkt.msg_len();
+
+    memset(words, 0, words_max * sizeof(uint32_t));
+
+    int idx = 0; // bits written so far
+
+    // preamble
+    for (int i = 0; i < preamble_bits; i++)
+        put_bit(words, idx, 1);
+
+    // start bit then msb first for each byte
+    for (int byte = 0; byte < msg_len; byte++) {
+        put_bit(words, idx, 0);
+        uint8_t b = pkt.data(byte);
+        for (int bit = 7; bit >= 0; bit--)
+            put_bit(words, idx, (b >> bit) & 1);
+    }
+
+    // stop bit
+    put_bit(words, idx, 1);
+
+    xassert(idx <= bits_max);
+
+    words[0] = idx - 1;
+
+    return 1 + (idx + 31) / 32;
+}
+
+
+void DccPioWords::put_bit(uint32_t *words, int& idx, int b)
+{
+    if (b != 0)
+        words[1 + idx / 32] |= (uint32_t(1) << (31 - (idx % 32)));
+    idx++;
+}
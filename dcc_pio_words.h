@@ -0,0 +1,54 @@
+#pragma once
+
+#include <Arduino.h>
+#include "dcc_pkt.h"
+
+
+// Convert a DccPkt to the word stream consumed by the DccBitstreamPio state
+// machine. This does not touch any hardware, so it builds on the host too.
+//
+// Word stream for one packet:
+//
+//   words[0]       number of bits in the packet, minus one
+//   words[1...]    the bits, msb first; unused bits in the last word are
+//                  ignored by the state machine
+//
+// The bits are the preamble (preamble_bits ones), then for each byte in the
+// packet a zero start bit and the byte (msb first), then the one stop bit.
+//
+// When packets go out back-to-back, the stop bit of one packet counts as the
+// first bit of the next packet's preamble (same as DccBitstream::next_bit),
+// so steady-state packets are encoded with preamble_bits-1.
+
+class DccPioWords
+{
+
+    public:
+
+        // preamble (20 max) + 8 bytes * (start bit + 8) + stop = 93 bits
+        static const int bits_max = DccPkt::svc_preamble_bits + 8 * 9 + 1;
+
+        // header word + data words
+        static const int words_max = 1 + (bits_max + 31) / 32;
+
+        // Encode pkt into words[0...words_max-1].
+        // Returns the number of words used, including the header word.
+        static int encode(const DccPkt& pkt, int preamble_bits, uint32_t *words);
+
+        // number of bits in an encoded packet
+        static int bit_cnt(const uint32_t *words)
+        {
+            return int(words[0]) + 1;
+        }
+
+        // bit idx (0...bit_cnt-1) of an encoded packet
+        static int bit(const uint32_t *words, int idx)
+        {
+            return (words[1 + idx / 32] >> (31 - (idx % 32))) & 1;
+        }
+
+    private:
+
+        static void put_bit(uint32_t *words, int& idx, int b);
+
+}; // class DccPioWords
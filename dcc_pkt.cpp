@@ -163,6 +163,45 @@ bool DccPkt::is_svc_direct(const uint8_t *msg, int msg_len)
 }
 
 
+// Ops mode, by the instruction after the address (Std 9.2.1, section 2.3):
+// speed is 01xxxxxx or advanced operation 00111111; functions are 100xxxxx,
+// 101xxxxx, and feature expansion 11011110 and 11011111; a write is the
+// long form cv access 1110CCVV with CC write (11) or bit manipulation (10).
+DccPkt::Type DccPkt::type(bool svc) const
+{
+    if (_msg_len > 0 && _msg[0] == 0xff)
+        return TYPE_IDLE;
+
+    if (_msg_len == 3 && _msg[0] == 0x00 && _msg[1] == 0x00)
+        return TYPE_RESET;
+
+    if (svc) {
+        if (!is_svc_direct(_msg, _msg_len))
+            return TYPE_OTHER;
+        int op = (_msg[0] & 0x0c) >> 2; // 1 verify, 2 bit manip, 3 write
+        if (op == 1 || (op == 2 && (_msg[2] & 0x10) == 0))
+            return TYPE_SVC_VERIFY;
+        return TYPE_SVC_WRITE;
+    }
+
+    int inst = (_msg_len > 0 && (_msg[0] & 0xc0) == 0xc0) ? 2 : 1;
+    if (inst >= _msg_len - 1) // no instruction before the xor byte
+        return TYPE_OTHER;
+    uint8_t b = _msg[inst];
+
+    if ((b & 0xc0) == 0x40 || b == 0x3f)
+        return TYPE_SPEED;
+
+    if ((b & 0xc0) == 0x80 || b == 0xde || b == 0xdf)
+        return TYPE_FUNC;
+
+    if ((b & 0xf0) == 0xe0 && (b & 0x08) != 0)
+        return TYPE_OPS_WRITE;
+
+    return TYPE_OTHER;
+}
+
+
 char *DccPkt::dump(char *buf, int buf_len) const
 {
     xassert(buf != nullptr);
@@ -536,11 +575,12 @@ int DccPktSpeed128::dcc_to_int(uint8_t speed_dcc)
 
 //----------------------------------------------------------------------------
 
-DccPktFunc0::DccPktFunc0(int adrs)
+DccPktFunc0::DccPktFunc0(int adrs, uint32_t funcs)
 {
     xassert(address_min <= adrs && adrs <= address_max);
 
-    refresh(adrs);
+    // packet has f0:f4:f3:f2:f1
+    refresh(adrs, ((funcs >> 1) & 0x0f) | ((funcs & 0x01) << 4));
 }
 
 
@@ -597,11 +637,11 @@ uint8_t DccPktFunc0::funcs() const
 
 //----------------------------------------------------------------------------
 
-DccPktFunc5::DccPktFunc5(int adrs)
+DccPktFunc5::DccPktFunc5(int adrs, uint32_t funcs)
 {
     xassert(address_min <= adrs && adrs <= address_max);
 
-    refresh(adrs);
+    refresh(adrs, (funcs >> f_min) & 0x0f);
 }
 
 
@@ -658,11 +698,11 @@ uint8_t DccPktFunc5::funcs() const
 
 //----------------------------------------------------------------------------
 
-DccPktFunc9::DccPktFunc9(int adrs)
+DccPktFunc9::DccPktFunc9(int adrs, uint32_t funcs)
 {
     xassert(address_min <= adrs && adrs <= address_max);
 
-    refresh(adrs);
+    refresh(adrs, (funcs >> f_min) & 0x0f);
 }
 
 
@@ -719,11 +759,11 @@ uint8_t DccPktFunc9::funcs() const
 
 //----------------------------------------------------------------------------
 
-DccPktFunc13::DccPktFunc13(int adrs)
+DccPktFunc13::DccPktFunc13(int adrs, uint32_t funcs)
 {
     xassert(address_min <= adrs && adrs <= address_max);
 
-    refresh(adrs);
+    refresh(adrs, (funcs >> f_min) & 0xff);
 }
 
 
@@ -780,11 +820,11 @@ uint8_t DccPktFunc13::funcs() const
 
 //----------------------------------------------------------------------------
 
-DccPktFunc21::DccPktFunc21(int adrs)
+DccPktFunc21::DccPktFunc21(int adrs, uint32_t funcs)
 {
     xassert(address_min <= adrs && adrs <= address_max);
 
-    refresh(adrs);
+    refresh(adrs, (funcs >> f_min) & 0xff);
 }
 
 
@@ -54,6 +54,22 @@ class DccPkt
 
         static bool is_svc_direct(const uint8_t *msg, int msg_len);
 
+        // What the packet is, for counting them (DccBitstreamStats).
+        // Service mode packets (0111xxxx, which in ops mode is a short
+        // address 112..127) are only taken as such with svc set.
+        enum Type : uint8_t {
+            TYPE_IDLE,
+            TYPE_RESET,
+            TYPE_SPEED,
+            TYPE_FUNC,
+            TYPE_OPS_WRITE,
+            TYPE_SVC_VERIFY,
+            TYPE_SVC_WRITE,
+            TYPE_OTHER,
+            type_max
+        };
+        Type type(bool svc) const;
+
         char *dump(char *buf, int buf_len) const;
         char *show(char *buf, int buf_len) const;
 
@@ -109,7 +125,7 @@ class DccPktSpeed128 : public DccPkt
 class DccPktFunc0 : public DccPkt
 {
     public:
-        DccPktFunc0(int adrs=3);
+        DccPktFunc0(int adrs=3, uint32_t funcs=0); // funcs bit n is Fn
         virtual int address(int adrs) override;
         bool f(int num) const;
         void f(int num, bool on);
@@ -125,7 +141,7 @@ class DccPktFunc0 : public DccPkt
 class DccPktFunc5 : public DccPkt
 {
     public:
-        DccPktFunc5(int adrs=3);
+        DccPktFunc5(int adrs=3, uint32_t funcs=0); // funcs bit n is Fn
         virtual int address(int adrs) override;
         bool f(int num) const;
         void f(int num, bool on);
@@ -141,7 +157,7 @@ class DccPktFunc5 : public DccPkt
 class DccPktFunc9 : public DccPkt
 {
     public:
-        DccPktFunc9(int adrs=3);
+        DccPktFunc9(int adrs=3, uint32_t funcs=0); // funcs bit n is Fn
         virtual int address(int adrs) override;
         bool f(int num) const;
         void f(int num, bool on);
@@ -157,7 +173,7 @@ class DccPktFunc9 : public DccPkt
 class DccPktFunc13 : public DccPkt
 {
     public:
-        DccPktFunc13(int adrs=3);
+        DccPktFunc13(int adrs=3, uint32_t funcs=0); // funcs bit n is Fn
         virtual int address(int adrs) override;
         bool f(int num) const;
         void f(int num, bool on);
@@ -173,7 +189,7 @@ class DccPktFunc13 : public DccPkt
 class DccPktFunc21 : public DccPkt
 {
     public:
-        DccPktFunc21(int adrs=3);
+        DccPktFunc21(int adrs=3, uint32_t funcs=0); // funcs bit n is Fn
         virtual int address(int adrs) override;
         bool f(int num) const;
         void f(int num, bool on);
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <Arduino.h>
+
+
+// Fixed-size single-producer, single-consumer queue of T. The producer and
+// consumer can be on different cores (or one can be an irq handler); neither
+// side ever blocks or masks anything.
+//
+// Same scheme as the DccBitstream packet queue: the producer only writes
+// _head and the item at _head, the consumer only writes _tail. Items are
+// copied in and out, so T should be small.
+
+template <typename T, int N> // N is a power of 2
+class DccQueue
+{
+
+    public:
+
+        DccQueue() : _head(0), _tail(0)
+        {
+        }
+
+        inline bool empty() const
+        {
+            return _head == _tail;
+        }
+
+        inline bool full() const
+        {
+            return int(_head - _tail) >= N;
+        }
+
+        // producer; returns false (and does nothing) if full
+        bool put(const T& item)
+        {
+            uint32_t head = _head;
+            if (int(head - _tail) >= N)
+                return false;
+            _item[head % N] = item;
+            // make sure the item is in memory before the consumer can see it
+            __dmb();
+            _head = head + 1;
+            return true;
+        }
+
+        // consumer; returns false (and does nothing) if empty
+        bool get(T& item)
+        {
+            uint32_t tail = _tail;
+            if (tail == _head)
+                return false;
+            // don't read the item before seeing _head
+            __dmb();
+            item = _item[tail % N];
+            // done with the item before the producer can reuse it
+            __dmb();
+            _tail = tail + 1;
+            return true;
+        }
+
+    private:
+
+        T _item[N];
+        volatile uint32_t _head;
+        volatile uint32_t _tail;
+
+}; // class DccQueue
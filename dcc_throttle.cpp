@@ -1,22 +1,27 @@
 #include <Arduino.h>
 #include "xassert.h"
 #include "dcc_pkt.h"
+#include "dcc_cv_cache.h"
 #include "dcc_throttle.h"
 
 
-DccThrottle::DccThrottle() :
-    _pkt_speed(),
-    _pkt_func_0(),
-    _pkt_func_5(),
-    _pkt_func_9(),
-    _pkt_func_13(),
-    _pkt_func_21(),
+int DccThrottle::_change_cnt = 3;
+
+
+DccThrottle::DccThrottle(DccCvCache *cv_cache) :
+    _address(3),
+    _speed(0),
+    _funcs(0),
     _seq(0),
-    _pkt_write_cv(),
-    _write_cv_cnt(0),
-    _pkt_write_bit(),
-    _write_bit_cnt(0)
+    _urgent(0),
+    // _write set when used
+    _write_queued(0),
+    _write_done(0),
+    _write_skip_cnt(0),
+    _page(),
+    _cv_cache(cv_cache)
 {
+    memset(_urgent_cnt, 0, sizeof(_urgent_cnt));
 }
 
 
@@ -27,22 +32,31 @@ DccThrottle::~DccThrottle()
 
 void DccThrottle::address(int address)
 {
-    _pkt_speed.address(address);
-    _pkt_func_0.address(address);
-    _pkt_func_5.address(address);
-    _pkt_func_9.address(address);
-    _pkt_func_13.address(address);
-    _pkt_func_21.address(address);
+    xassert(DccPkt::address_min <= address && address <= DccPkt::address_max);
+
+    _address = address;
+    _page.forget(); // another decoder
     _seq = 0;
-    _pkt_write_cv.address(address);
-    _pkt_write_bit.address(address);
+    _urgent = 0;
+    memset(_urgent_cnt, 0, sizeof(_urgent_cnt));
 }
 
 
 void DccThrottle::speed(int speed)
 {
-    _pkt_speed.speed(speed);
-    _seq &= ~1; // back up one if a function packet is next
+    xassert(DccPkt::speed_min <= speed && speed <= DccPkt::speed_max);
+
+    if (_speed == speed)
+        return;
+    _speed = speed;
+    changed(0);
+}
+
+
+// In 128-step speed control, step 1 is emergency stop.
+void DccThrottle::estop()
+{
+    speed(_speed < 0 ? -1 : 1);
 }
 
 
@@ -50,36 +64,184 @@ void DccThrottle::function(int num, bool on)
 {
     xassert(DccPkt::function_min <= num && num <= DccPkt::function_max);
 
-    if (num <= 4) {
-        _pkt_func_0.f(num, on);
-        _seq = 1;
-    } else if (num <= 8) {
-        _pkt_func_5.f(num, on);
-        _seq = 3;
-    } else if (num <= 12) {
-        _pkt_func_9.f(num, on);
-        _seq = 5;
-    } else if (num <= 20) {
-        _pkt_func_13.f(num, on);
-        _seq = 7;
-    } else { // num <= 28
-        _pkt_func_21.f(num, on);
-        _seq = 9;
-    }
+    uint32_t f_bit = 1ul << num;
+
+    if (((_funcs & f_bit) != 0) == on)
+        return;
+
+    if (on)
+        _funcs |= f_bit;
+    else
+        _funcs &= ~f_bit;
+
+    if (num <= 4)
+        changed(1);
+    else if (num <= 8)
+        changed(2);
+    else if (num <= 12)
+        changed(3);
+    else if (num <= 20)
+        changed(4);
+    else // num <= 28
+        changed(5);
+}
+
+
+void DccThrottle::change_cnt(int cnt)
+{
+    xassert(1 <= cnt && cnt <= change_cnt_max);
+
+    _change_cnt = cnt;
+}
+
+
+// A change to a group that is still being sent starts its count over.
+void DccThrottle::changed(int group)
+{
+    xassert(0 <= group && group < group_max);
+
+    _urgent_cnt[group] = _change_cnt;
+    _urgent |= (1 << group);
 }
 
 
-void DccThrottle::write_cv(int cv_num, uint8_t cv_val)
+void DccThrottle::sent(int group)
 {
-    _pkt_write_cv.cv(cv_num, cv_val);
-    _write_cv_cnt = write_cv_send_cnt;
+    xassert(0 <= group && group < group_max);
+
+    if (_urgent_cnt[group] > 0 && --_urgent_cnt[group] == 0)
+        _urgent &= ~(1 << group);
+}
+
+
+bool DccThrottle::write_cv(int cv_num, uint8_t cv_val)
+{
+    xassert(DccPkt::cv_num_min <= cv_num && cv_num <= DccPkt::cv_num_max);
+
+    if (write_pending() >= write_max)
+        return false;
+
+    queue_write(cv_num, cv_val, write_byte, -1,
+                write_known(cv_num, cv_val, write_byte, -1));
+    _page.written(cv_num, cv_val);
+
+    return true;
 }
 
 
-void DccThrottle::write_bit(int cv_num, int bit_num, int bit_val)
+bool DccThrottle::write_bit(int cv_num, int bit_num, int bit_val)
 {
-    _pkt_write_bit.cv_bit(cv_num, bit_num, bit_val);
-    _write_bit_cnt = write_bit_send_cnt;
+    xassert(DccPkt::cv_num_min <= cv_num && cv_num <= DccPkt::cv_num_max);
+    xassert(0 <= bit_num && bit_num <= 7);
+    xassert(bit_val == 0 || bit_val == 1);
+
+    if (write_pending() >= write_max)
+        return false;
+
+    uint8_t bit = (bit_num << 1) | bit_val;
+    queue_write(cv_num, 0, bit, -1, write_known(cv_num, 0, bit, -1));
+    _page.written(cv_num, -1);
+
+    return true;
+}
+
+
+// True if the cv cache has the value a write would give cv_num (in page
+// index), so it can be skipped.
+bool DccThrottle::write_known(int cv_num, uint8_t cv_val, uint8_t bit, int index) const
+{
+    uint8_t val;
+    if (_cv_cache == nullptr || !_cv_cache->get(_address, cv_num, val, index))
+        return false;
+
+    if (bit == write_byte)
+        return val == cv_val;
+    else
+        return ((val >> (bit >> 1)) & 1) == (bit & 1);
+}
+
+
+// Queue a write, or with skip, a place holder that's dropped instead of
+// sent once the writes ahead of it have gone, so write_done() still counts
+// the writes in order. A write that is sent isn't acked, so the cache
+// forgets the cv.
+void DccThrottle::queue_write(int cv_num, uint8_t cv_val, uint8_t bit, int index,
+                              bool skip)
+{
+    Write& w = _write[_write_queued % write_max];
+    w.cv_num = cv_num;
+    w.cv_val = cv_val;
+    w.bit = skip ? write_skip : bit;
+    _write_queued++;
+
+    if (skip)
+        _write_skip_cnt++;
+    else if (_cv_cache != nullptr)
+        _cv_cache->forget(_address, cv_num, index);
+
+    drop_skipped();
+}
+
+
+void DccThrottle::drop_skipped()
+{
+    while (write_pending() > 0 && _write[_write_done % write_max].bit == write_skip)
+        _write_done++;
+}
+
+
+bool DccThrottle::write_indexed(int index_hi, int index_lo, int cv_num, uint8_t cv_val)
+{
+    if (write_pending() + _page.writes(index_hi, index_lo) + 1 > write_max)
+        return false;
+
+    // a value the cache has needs no page writes either
+    int index = (index_hi << 8) | index_lo;
+    bool skip = write_known(cv_num, cv_val, write_byte, index);
+
+    // these fit, and keep _page up to date
+    if (!skip && _page.hi != index_hi)
+        write_cv(DccCv::index_hi, index_hi);
+    if (!skip && _page.lo != index_lo)
+        write_cv(DccCv::index_lo, index_lo);
+    queue_write(cv_num, cv_val, write_byte, index, skip);
+
+    return true;
+}
+
+
+int DccThrottle::write_indexed(Indexed *cv, int cnt)
+{
+    DccCv::sort_pages(cv, cnt);
+
+    int i;
+    for (i = 0; i < cnt; i++)
+        if (!write_indexed(cv[i].index_hi, cv[i].index_lo, cv[i].cv_num, cv[i].cv_val))
+            break;
+
+    return i;
+}
+
+
+// All copies of a write go out back-to-back.
+DccPkt DccThrottle::next_write(int& repeat)
+{
+    xassert(write_pending() > 0);
+
+    const Write& w = _write[_write_done % write_max];
+
+    DccPkt pkt;
+    if (w.bit == write_byte)
+        pkt = DccPktOpsWriteCv(_address, w.cv_num, w.cv_val);
+    else
+        pkt = DccPktOpsWriteBit(_address, w.cv_num, w.bit >> 1, w.bit & 1);
+
+    _write_done++;
+    drop_skipped();
+
+    repeat = write_send_cnt;
+
+    return pkt;
 }
 
 
@@ -88,47 +250,69 @@ void DccThrottle::write_bit(int cv_num, int bit_num, int bit_val)
 // 4. Speed     5. F9-F12
 // 6. Speed     7. F13-F20
 // 8. Speed     9. F21-F28
-DccPkt DccThrottle::next_packet()
+DccPkt DccThrottle::next_packet(int& repeat)
 {
-    xassert(0 <= _seq && _seq < seq_max);
+    xassert(_seq < seq_max);
 
-    if (_write_cv_cnt > 0) {
-        _write_cv_cnt--;
-        return _pkt_write_cv;
-    }
-
-    if (_write_bit_cnt > 0) {
-        _write_bit_cnt--;
-        return _pkt_write_bit;
-    }
+    repeat = 1;
 
     int seq = _seq;
 
     if (++_seq >= seq_max)
         _seq = 0;
 
-    if ((seq & 1) == 0) // if _seq even
-        return _pkt_speed;
+    sent(seq_group(seq));
+
+    return seq_packet(seq);
+}
+
+
+// The changed group with the most sends left goes next (speed first on a
+// tie), so when several groups change together, each goes out once before
+// any goes out again.
+DccPkt DccThrottle::next_urgent(int& repeat)
+{
+    xassert(_urgent != 0);
+
+    repeat = 1;
+
+    int group = 0;
+    for (int g = 1; g < group_max; g++)
+        if (_urgent_cnt[g] > _urgent_cnt[group])
+            group = g;
+
+    sent(group);
+
+    return seq_packet(group_seq(group));
+}
+
+
+// build the packet at seq in the sequence
+DccPkt DccThrottle::seq_packet(int seq) const
+{
+    xassert(0 <= seq && seq < seq_max);
+
+    if ((seq & 1) == 0) // if seq even
+        return DccPktSpeed128(_address, _speed);
     else if (seq == 1)
-        return _pkt_func_0;
+        return DccPktFunc0(_address, _funcs);
     else if (seq == 3)
-        return _pkt_func_5;
+        return DccPktFunc5(_address, _funcs);
     else if (seq == 5)
-        return _pkt_func_9;
+        return DccPktFunc9(_address, _funcs);
     else if (seq == 7)
-        return _pkt_func_13;
+        return DccPktFunc13(_address, _funcs);
     else
-        return _pkt_func_21;
+        return DccPktFunc21(_address, _funcs);
 }
 
 
 void DccThrottle::show()
 {
     char buf[80];
-    Serial.printf("%s\n", _pkt_speed.show(buf, sizeof(buf)));
-    Serial.printf("%s\n", _pkt_func_0.show(buf, sizeof(buf)));
-    Serial.printf("%s\n", _pkt_func_5.show(buf, sizeof(buf)));
-    Serial.printf("%s\n", _pkt_func_9.show(buf, sizeof(buf)));
-    Serial.printf("%s\n", _pkt_func_13.show(buf, sizeof(buf)));
-    Serial.printf("%s\n", _pkt_func_21.show(buf, sizeof(buf)));
+    for (int seq = 0; seq < seq_max; seq++) {
+        if (seq != 0 && (seq & 1) == 0)
+            continue; // speed only once
+        Serial.printf("%s\n", seq_packet(seq).show(buf, sizeof(buf)));
+    }
 }
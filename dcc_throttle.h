@@ -4,45 +4,149 @@
 #include "dcc_pkt.h"
 #include "dcc_cv.h"
 
+class DccCvCache;
+
+
+// One loco. Only the state is kept (address, speed, functions, pending ops
+// mode writes); packets are built when they are asked for.
 
 class DccThrottle
 {
 
     public:
 
-        DccThrottle();
+        // With a cv cache (DccCommand's), a write of a value it has for this
+        // address is skipped, and any other write makes it forget the cv.
+        DccThrottle(DccCvCache *cv_cache=nullptr);
         ~DccThrottle();
 
         void address(int address);
+        int address() const { return _address; }
+
         void speed(int speed);
+        int speed() const { return _speed; }
+
         void function(int func, bool on);
+        bool function(int func) const { return (_funcs & (1ul << func)) != 0; }
+
+        // emergency stop (speed step 1), keeping the direction
+        void estop();
+
+        // Stopped (or e-stopped) and all functions off. DccCommand
+        // refreshes idle throttles less often.
+        bool idle() const
+        {
+            return -1 <= _speed && _speed <= 1 && _funcs == 0;
+        }
+
+        // Ops mode writes are queued, up to write_max of them; these return
+        // false if the queue is full. DccCommand sends each one
+        // write_send_cnt times in a row, taking turns with the other traffic
+        // (DccCommand::write_share_pct).
+        bool write_cv(int cv_num, uint8_t cv_val);
+        bool write_bit(int cv_num, int bit_num, int bit_val);
+        static const int write_max = 8; // power of 2
+
+        // Indexed cvs (DccCv::prime_vol, ...) are in the page selected by
+        // cv31 (index_hi) and cv32 (index_lo). The page last written to this
+        // throttle's decoder is kept (DccCv::Page), and the page cvs are
+        // only queued ahead of the cv when they change. Returns false, with
+        // nothing queued, if the cv and the page writes don't all fit. The
+        // page is forgotten when the address is set; writes to cv31 and
+        // cv32 with write_cv() and write_bit() keep it up to date.
+        bool write_indexed(int index_hi, int index_lo, int cv_num, uint8_t cv_val);
+
+        // A batch of indexed cvs, sorted in place by page (DccCv::sort_pages)
+        // and queued in that order for as long as they fit. Returns how many
+        // were queued; the rest can go when there's room.
+        struct Indexed {
+            uint8_t index_hi;
+            uint8_t index_lo;
+            uint16_t cv_num;
+            uint8_t cv_val;
+            int page() const { return (index_hi << 8) | index_lo; }
+        };
+        int write_indexed(Indexed *cv, int cnt);
 
-        void write_cv(int cv_num, uint8_t cv_val);
-        void write_bit(int cv_num, int bit_num, int bit_val);
+        // Progress: writes queued and writes sent, each since the throttle
+        // was created. A write is sent when write_done() reaches the
+        // write_queued() it was given; all are sent when they are equal.
+        uint32_t write_queued() const { return _write_queued; }
+        uint32_t write_done() const { return _write_done; }
+        int write_pending() const { return _write_queued - _write_done; }
 
-        DccPkt next_packet();
+        // Writes the cv cache said weren't needed. Each is still counted in
+        // write_queued(), and is done as soon as the writes ahead of it are.
+        uint32_t write_skipped() const { return _write_skip_cnt; }
+
+        // next write to send; only call if write_pending() > 0
+        DccPkt next_write(int& repeat);
+
+        // next refresh packet to send, and how many times in a row to send it
+        DccPkt next_packet(int& repeat);
+
+        // True if there is a speed or function change that has not been
+        // sent change_cnt() times yet. DccCommand sends these ahead of the
+        // refresh rotation.
+        bool urgent() const { return _urgent != 0; }
+
+        // next changed packet to send; only call if urgent()
+        DccPkt next_urgent(int& repeat);
+
+        // How many times a changed speed or function group is sent before
+        // it is left to the refresh rotation (a refresh that sends it counts
+        // as one). Applies to changes made after it is set.
+        static void change_cnt(int cnt);
+        static int change_cnt() { return _change_cnt; }
+        static const int change_cnt_max = 15;
 
         void show();
 
     private:
 
-        DccPktSpeed128  _pkt_speed;
-        DccPktFunc0     _pkt_func_0;
-        DccPktFunc5     _pkt_func_5;
-        DccPktFunc9     _pkt_func_9;
-        DccPktFunc13    _pkt_func_13;
-        DccPktFunc21    _pkt_func_21;
+        uint16_t _address;
+        int8_t _speed;      // DccPkt::speed_min...DccPkt::speed_max
+        uint32_t _funcs;    // bit n is Fn
 
         // where in packet sequence we are
         static const int seq_max = 10;
-        int _seq; // _seq = 0..9
+        uint8_t _seq; // _seq = 0..9
+
+        // Groups are speed (0) and the five function groups (1..5). Group g
+        // is sent at _seq = 2g-1 (and speed at every even _seq).
+        static const int group_max = 6;
+        static int seq_group(int seq) { return (seq & 1) ? (seq + 1) / 2 : 0; }
+        static int group_seq(int group) { return group == 0 ? 0 : 2 * group - 1; }
+
+        // Changed groups: times each still has to be sent, and a bit set in
+        // _urgent for each that is not 0.
+        uint8_t _urgent;
+        uint8_t _urgent_cnt[group_max];
+        void changed(int group);
+        void sent(int group);
+
+        static int _change_cnt;
 
-        DccPktOpsWriteCv _pkt_write_cv;
-        static const int write_cv_send_cnt = 5; // how many times to send it
-        int _write_cv_cnt; // times left to send it (5, 4, ... 1, 0)
+        DccPkt seq_packet(int seq) const;
 
-        DccPktOpsWriteBit _pkt_write_bit;
-        static const int write_bit_send_cnt = 5; // how many times to send it
-        int _write_bit_cnt; // times left to send it (5, 4, ... 1, 0)
+        // Ops mode write queue. Writes go in at _write_queued and come out
+        // at _write_done (both mod write_max).
+        struct Write {
+            uint16_t cv_num;
+            uint8_t cv_val;     // write_cv
+            uint8_t bit;        // write_byte, write_skip, or bit_num << 1 | bit_val
+        };
+        static const uint8_t write_byte = 0xff;
+        static const uint8_t write_skip = 0xfe;
+        static const int write_send_cnt = 5; // how many times to send each
+        Write _write[write_max];
+        uint32_t _write_queued;
+        uint32_t _write_done;
+        uint32_t _write_skip_cnt;
+        DccCv::Page _page;
+        DccCvCache *_cv_cache;
+        bool write_known(int cv_num, uint8_t cv_val, uint8_t bit, int index) const;
+        void queue_write(int cv_num, uint8_t cv_val, uint8_t bit, int index, bool skip);
+        void drop_skipped();
 
 }; // class DccThrottle
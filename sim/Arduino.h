@@ -0,0 +1,61 @@
+#pragma once
+
+// Host build of the command station: just enough of Arduino and the pico-sdk
+// for the dcc_* files, backed by the virtual-time hardware in sim.cpp.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <climits>
+#include <cmath>
+#include <sys/types.h> // uint
+
+class Stream
+{
+    public:
+        int printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+        int available() { return 0; }
+        int read() { return -1; }
+        void begin(unsigned long) { }
+        explicit operator bool() const { return true; }
+};
+
+extern Stream Serial;
+
+uint32_t millis();
+uint32_t micros();
+uint64_t time_us_64();
+inline uint32_t time_us_32() { return uint32_t(time_us_64()); }
+
+// A barrier is where an irq coming in can make a difference to the code
+// around it, so the simulation can run one there (Sim::on_preempt).
+void sim_preempt();
+static inline void __dmb() { __sync_synchronize(); sim_preempt(); }
+
+// virtual time does not move while code runs, so cycle counts are all 0
+class RP2040
+{
+    public:
+        uint32_t getCycleCount();
+};
+
+extern RP2040 rp2040;
+static inline void tight_loop_contents() { }
+
+// gpio
+
+#define GPIO_IN 0
+#define GPIO_OUT 1
+#define GPIO_FUNC_PWM 4
+
+void gpio_init(uint gpio);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_put(uint gpio, bool value);
+bool gpio_get(uint gpio);
+void gpio_set_function(uint gpio, int fn);
+
+// clocks
+
+enum clock_index { clk_sys };
+uint32_t clock_get_hz(clock_index clk);
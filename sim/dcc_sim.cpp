@@ -0,0 +1,2592 @@
+// Host simulation of the command station.
+//
+// Runs DccCommand, DccThrottle, DccBitstream and DccAdc against the virtual
+// time hardware in sim.cpp, with a SimDecoder on the track. Everything is
+// deterministic, so runs can be compared before and after a change.
+//
+// Build (from the top of the repo):
+//
+//   g++ -std=gnu++17 -O2 -Isim -I. -o dcc_sim sim/*.cpp
+//       dcc_adc.cpp dcc_bit.cpp dcc_bitstream.cpp dcc_command.cpp
+//       dcc_core1.cpp dcc_cv_cache.cpp dcc_pio_words.cpp dcc_pkt.cpp
+//       dcc_throttle.cpp
+//
+// Usage:
+//
+//   dcc_sim [options] ops [throttles [msec]]   packet rate and idle ratio
+//   dcc_sim [options] read <cv>                service mode read
+//   dcc_sim [options] write <cv> <val>         service mode write
+//   dcc_sim [options] timeline <msec> [svc]    half-bit timeline
+//   dcc_sim [options] latency [throttles]      speed change to rail latency
+//   dcc_sim [options] refresh [throttles [running]]
+//                                              refresh interval, running/idle
+//   dcc_sim [options] admit <refresh_max_ms>   admission control
+//   dcc_sim [options] pom [writes [throttles]] ops mode write upload time
+//   dcc_sim [options] session                  chained svc operations vs session
+//   dcc_sim [options] indexed                  indexed cv page writes, kept/sorted
+//   dcc_sim [options] cache                    config re-applied, with the cv cache
+//   dcc_sim [options] fastread                 standard vs fast svc reads
+//   dcc_sim [options] ack                      ack detection latency, cancel
+//   dcc_sim queue [packets]                    packet queue with irqs at barriers
+//   dcc_sim bits                               bit handler cost, old vs tables
+//   dcc_sim pio                                pio words and program vs pwm signal
+//   dcc_sim throttle                           throttle size and cost, old vs new
+//   dcc_sim changes                            changed groups sent change_cnt times
+//   dcc_sim [options] core1 [cycles]           throttle delete and create on core 0
+//   dcc_sim [options] adc                      adc average query cost
+//   dcc_sim [options] noise                    reads with a noisy decoder
+//   dcc_sim [options] trip                     overcurrent trip and retry
+//   dcc_sim [options] trace                    tagged current trace of reads
+//   dcc_sim [options] sync                     free vs synced adc, with spikes
+//
+// Options:
+//
+//   -l <usec>      virtual time per pass of the main loop (default 10)
+//   -s <usec>      every 100 msec, one pass of the main loop takes this long
+//   -b <mA>        decoder idle current (default 20)
+//   -n <mA>        decoder current noise, peak-to-peak (default 0)
+//   -p <mA>        decoder current bursts, like a sound decoder (default 0)
+//   -a <mA>        decoder ack current (default 100)
+//   -d <usec>      decoder ack delay after the packet (default 0)
+//   -f             fast service mode reads
+//   -v <val>       value of every cv in the decoder (default 0)
+//   -q             no decoder on the track
+//   -e <mA>        driver switching spikes, 10 usec after each edge (default 0)
+//   -y             adc synced to the bitstream (DccCommand::adc_sync)
+
+#include <Arduino.h>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <vector>
+#include "xassert.h"
+#include "dcc_adc.h"
+#include "dcc_bitstream.h"
+#include "dcc_command.h"
+#include "dcc_core1.h"
+#include "dcc_cv.h"
+#include "dcc_cv_cache.h"
+#include "dcc_pio_words.h"
+#include "dcc_pkt.h"
+#include "dcc_throttle.h"
+#include "pwm_irq_mux.h"
+#include "sim.h"
+#include "sim_decoder.h"
+
+
+static const int sig_gpio = 27;
+static const int pwr_gpio = 28;
+static const int adc_gpio = 26;
+static const int sync_slice = 6; // sig_gpio's is 5
+
+static uint32_t loop_us = 10;
+static uint32_t stall_us = 0;
+static uint64_t stall_next_us = 0;
+
+static SimDecoder decoder(pwr_gpio);
+
+// packets seen on the track
+static uint32_t pkt_cnt = 0;
+static uint32_t idle_cnt = 0;
+static uint32_t reset_cnt = 0;
+
+
+static void edge(uint64_t edge_us, int level)
+{
+    decoder.edge(edge_us, level);
+}
+
+
+// track power going on and off, as seen by the adc conversions (so to the
+// nearest sample)
+static bool pwr_on = false;
+static std::vector<uint64_t> pwr_on_us;
+static std::vector<uint64_t> pwr_off_us;
+
+
+static uint16_t current(uint64_t now_us)
+{
+    bool on = Sim::gpio(pwr_gpio);
+    if (on != pwr_on) {
+        (on ? pwr_on_us : pwr_off_us).push_back(now_us);
+        pwr_on = on;
+    }
+    return decoder.current_ma(now_us);
+}
+
+
+// latency: waiting for a speed packet for this address with this speed
+static bool lat_wait = false;
+static int lat_address = 0;
+static uint8_t lat_speed = 0;
+static uint64_t lat_start_us = 0;
+static uint64_t lat_end_us = 0;
+
+
+static void pkt(const uint8_t *pkt, int pkt_len, uint64_t end_us)
+{
+    if (lat_wait && pkt_len == 4 && pkt[0] == lat_address &&
+        pkt[1] == 0x3f && pkt[2] == lat_speed) {
+        lat_end_us = end_us;
+        lat_wait = false;
+    }
+
+    pkt_cnt++;
+    if (pkt_len == 3 && pkt[0] == 0xff)
+        idle_cnt++;
+    else if (pkt_len == 3 && pkt[0] == 0x00 && pkt[1] == 0x00)
+        reset_cnt++;
+}
+
+
+// one pass of the main loop
+static void loop(DccCommand& command)
+{
+    command.loop();
+    Sim::advance_us(loop_us);
+    if (stall_us > 0 && Sim::now_us() >= stall_next_us) {
+        Sim::advance_us(stall_us);
+        stall_next_us = Sim::now_us() + 100000;
+    }
+}
+
+
+static int usage()
+{
+    fprintf(stderr, "usage: dcc_sim [-l usec] [-s usec] [-b mA] [-n mA] [-p mA] [-a mA]\n"
+                    "               [-d usec] [-v val] [-e mA] [-q] [-f] [-y]\n"
+                    "               ops [throttles [msec]] | read <cv> |\n"
+                    "               write <cv> <val> | timeline <msec> [svc] |\n"
+                    "               latency [throttles] |\n"
+                    "               refresh [throttles [running]] |\n"
+                    "               admit <refresh_max_ms> |\n"
+                    "               pom [writes [throttles]] | session |\n"
+                    "               fastread | ack | queue [packets] |\n"
+                    "               bits | pio | throttle | changes |\n"
+                    "               core1 [cycles] | adc |\n"
+                    "               noise | trip | trace | sync | indexed | cache\n");
+    return 1;
+}
+
+
+static int run_ops(DccCommand& command, int throttles, int msec)
+{
+    std::vector<DccThrottle *> throttle;
+
+    for (int i = 0; i < throttles; i++) {
+        throttle.push_back(command.create_throttle());
+        throttle[i]->address(3 + i);
+        throttle[i]->speed(10 + i % 100);
+    }
+
+    command.mode_ops();
+    command.airtime_reset();
+
+    uint64_t start_us = Sim::now_us();
+    uint32_t irq_start = Sim::irq_cnt();
+
+    while (Sim::now_us() < start_us + uint64_t(msec) * 1000)
+        loop(command);
+
+    command.mode_off();
+
+    DccCommand::Airtime air;
+    command.airtime(air);
+    uint32_t refresh_est_us = command.refresh_est_us(throttles);
+
+    for (DccThrottle *t : throttle)
+        command.delete_throttle(t);
+
+    double sec = (Sim::now_us() - start_us) / 1e6;
+
+    printf("throttles       %d\n", throttles);
+    printf("time            %.3f s\n", sec);
+    printf("packets         %u (%.1f/s)\n", pkt_cnt, pkt_cnt / sec);
+    printf("idle packets    %u (%.1f%%)\n", idle_cnt,
+           pkt_cnt > 0 ? 100.0 * idle_cnt / pkt_cnt : 0.0);
+    printf("irqs            %u (%.0f/s)\n", Sim::irq_cnt() - irq_start,
+           (Sim::irq_cnt() - irq_start) / sec);
+
+    DccBitstreamStats stats;
+    command.stats(stats);
+    printf("bitstream       %u queued, %u idle (%u late), "
+           "longest refill gap %u us\n", stats.pkt_cnt, stats.idle_cnt,
+           stats.late_cnt, stats.gap_max_us);
+    printf("by type         %u speed, %u function, %u ops write, %u reset, "
+           "%u other\n", stats.speed_cnt, stats.func_cnt, stats.ops_write_cnt,
+           stats.reset_cnt, stats.other_cnt);
+    printf("airtime         %u bits, %.3f s (%.1f%%), refresh estimate %.1f ms\n",
+           air.bit_cnt, air.pkt_us / 1e6, 100.0 * air.pkt_us / air.window_us,
+           refresh_est_us / 1e3);
+
+    return 0;
+}
+
+
+// Create throttles (half with long addresses, all running) until admission
+// control refuses one, with refresh_max_ms set.
+static int run_admit(DccCommand& command, int refresh_max_ms)
+{
+    std::vector<DccThrottle *> throttle;
+
+    command.refresh_max_ms(refresh_max_ms);
+    command.mode_ops();
+
+    while (true) {
+        DccThrottle *t = command.create_throttle();
+        if (t == nullptr)
+            break;
+        int n = throttle.size();
+        t->address((n & 1) ? 1000 + n : 3 + n);
+        t->speed(10 + n % 100);
+        throttle.push_back(t);
+        uint64_t end_us = Sim::now_us() + 200000;
+        while (Sim::now_us() < end_us)
+            loop(command);
+    }
+
+    command.refresh_weight(1);
+    command.refresh_reset();
+    uint64_t end_us = Sim::now_us() + 10000000;
+    while (Sim::now_us() < end_us)
+        loop(command);
+
+    command.mode_off();
+
+    uint32_t max_us = 0;
+    for (DccThrottle *t : throttle) {
+        DccCommand::RefreshStats stats;
+        command.refresh_stats(t, stats);
+        max_us = std::max(max_us, stats.max_us);
+    }
+
+    int n = throttle.size();
+    printf("refresh_max_ms  %d\n", refresh_max_ms);
+    printf("admitted        %d throttles\n", n);
+    printf("estimate        %.1f ms (%d), %.1f ms (%d)\n",
+           command.refresh_est_us(n) / 1e3, n,
+           command.refresh_est_us(n + 1) / 1e3, n + 1);
+    printf("measured max    %.1f ms\n", max_us / 1e3);
+
+    for (DccThrottle *t : throttle)
+        command.delete_throttle(t);
+
+    return 0;
+}
+
+
+// run a service mode operation already started; print result and time
+// For each number of throttles, change the speed of one of them at
+// pseudo-random times and measure the time until the end of the first speed
+// packet with the new speed.
+static int run_latency(DccCommand& command, int throttles_max)
+{
+    static const int throttles_cnt[] = { 1, 2, 5, 10, 20, 30, 50, 100 };
+    static const int samples = 50;
+
+    uint32_t rand = 1;
+
+    printf("throttles  avg ms  max ms\n");
+
+    for (int throttles : throttles_cnt) {
+
+        if (throttles > throttles_max)
+            break;
+
+        std::vector<DccThrottle *> throttle;
+
+        for (int i = 0; i < throttles; i++) {
+            throttle.push_back(command.create_throttle());
+            throttle[i]->address(3 + i);
+            throttle[i]->speed(10);
+        }
+
+        command.mode_ops();
+
+        // let the initial speed packets (and their repeats) go out
+        uint64_t settle_us = Sim::now_us() + 2000000;
+        while (Sim::now_us() < settle_us ||
+               std::any_of(throttle.begin(), throttle.end(),
+                           [](DccThrottle *t) { return t->urgent(); }))
+            loop(command);
+
+        uint64_t lat_sum_us = 0;
+        uint64_t lat_max_us = 0;
+
+        for (int sample = 0; sample < samples; sample++) {
+
+            // let the refresh get to some random point
+            rand = rand * 1664525 + 1013904223;
+            uint64_t wait_us = Sim::now_us() + 10000 + (rand >> 8) % 50000;
+            while (Sim::now_us() < wait_us)
+                loop(command);
+
+            int t = sample % throttles;
+            int speed = 20 + sample;
+
+            lat_address = 3 + t;
+            lat_speed = speed | 0x80; // forward
+            lat_start_us = Sim::now_us();
+            lat_wait = true;
+
+            throttle[t]->speed(speed);
+
+            while (lat_wait)
+                loop(command);
+
+            uint64_t lat_us = lat_end_us - lat_start_us;
+            lat_sum_us += lat_us;
+            if (lat_max_us < lat_us)
+                lat_max_us = lat_us;
+        }
+
+        command.mode_off();
+
+        for (DccThrottle *t : throttle)
+            command.delete_throttle(t);
+
+        printf("%9d  %6.1f  %6.1f\n", throttles,
+               lat_sum_us / 1e3 / samples, lat_max_us / 1e3);
+    }
+
+    return 0;
+}
+
+
+// Refresh intervals with some throttles running and the rest parked (speed
+// 0, functions off), first with every throttle refreshed equally (weight
+// 1), then with DccCommand's default refresh weighting.
+static int run_refresh(DccCommand& command, int throttles, int running)
+{
+    static const int msec = 20000;
+
+    int refresh_weight = command.refresh_weight();
+
+    printf("throttles %d, running %d, idle_refresh_ms %d\n",
+           throttles, running, command.idle_refresh_ms());
+    printf("weight  running avg/max ms  idle avg/max ms\n");
+
+    for (int pass = 0; pass < 2; pass++) {
+
+        command.refresh_weight(pass == 0 ? 1 : refresh_weight);
+
+        std::vector<DccThrottle *> throttle;
+
+        for (int i = 0; i < throttles; i++) {
+            throttle.push_back(command.create_throttle());
+            throttle[i]->address(3 + i);
+            if (i < running) {
+                throttle[i]->speed(20);
+                throttle[i]->function(0, true);
+            }
+        }
+
+        command.mode_ops();
+
+        // let the initial changes and refreshes go out
+        uint64_t settle_us = Sim::now_us() + 2000000;
+        while (Sim::now_us() < settle_us ||
+               std::any_of(throttle.begin(), throttle.end(),
+                           [](DccThrottle *t) { return t->urgent(); }))
+            loop(command);
+        command.refresh_reset();
+
+        uint64_t end_us = Sim::now_us() + uint64_t(msec) * 1000;
+        while (Sim::now_us() < end_us)
+            loop(command);
+
+        command.mode_off();
+
+        double avg_ms[2] = { 0, 0 }; // running, idle
+        double max_ms[2] = { 0, 0 };
+        int cnt[2] = { 0, 0 };
+        for (int i = 0; i < throttles; i++) {
+            DccCommand::RefreshStats stats;
+            command.refresh_stats(throttle[i], stats);
+            int idle = throttle[i]->idle() ? 1 : 0;
+            avg_ms[idle] += stats.avg_us / 1e3;
+            max_ms[idle] = std::max(max_ms[idle], stats.max_us / 1e3);
+            cnt[idle]++;
+        }
+
+        for (DccThrottle *t : throttle)
+            command.delete_throttle(t);
+
+        printf("%6d  %7.1f / %6.1f   %6.1f / %6.1f\n",
+               command.refresh_weight(),
+               cnt[0] > 0 ? avg_ms[0] / cnt[0] : 0.0, max_ms[0],
+               cnt[1] > 0 ? avg_ms[1] / cnt[1] : 0.0, max_ms[1]);
+    }
+
+    return 0;
+}
+
+
+// Upload writes ops mode writes to one throttle, keeping its write queue
+// full, with the others running, at a few write shares. Prints the time to
+// send them all, the longest refresh interval of the other throttles, and
+// the longest time from a speed change on another throttle (every 200 ms or
+// so) to the end of its first packet, which can be behind a write's 5
+// repeats.
+static int run_pom(DccCommand& command, int writes, int throttles)
+{
+    static const int shares[] = { 10, 25, 50, 90 };
+
+    printf("writes %d, throttles %d\n", writes, throttles);
+    printf("share  total ms  ms/write  others max refresh ms  change max ms\n");
+
+    for (int share : shares) {
+
+        command.write_share_pct(share);
+
+        std::vector<DccThrottle *> throttle;
+
+        for (int i = 0; i < throttles; i++) {
+            throttle.push_back(command.create_throttle());
+            throttle[i]->address(3 + i);
+            throttle[i]->speed(20);
+        }
+
+        command.mode_ops();
+
+        uint64_t settle_us = Sim::now_us() + 2000000;
+        while (Sim::now_us() < settle_us ||
+               std::any_of(throttle.begin(), throttle.end(),
+                           [](DccThrottle *t) { return t->urgent(); }))
+            loop(command);
+        command.refresh_reset();
+
+        DccThrottle *t = throttle[0];
+        uint64_t start_us = Sim::now_us();
+        uint64_t change_us = start_us + 200000;
+        uint64_t lat_max_us = 0;
+        int speed = 20;
+        int queued = 0;
+        while (t->write_done() < uint32_t(writes)) {
+            while (queued < writes && t->write_cv(DccCv::index_lo, queued & 0xff))
+                queued++;
+            if (lat_start_us >= start_us && !lat_wait)
+                lat_max_us = std::max(lat_max_us, lat_end_us - lat_start_us);
+            if (throttles > 1 && !lat_wait && Sim::now_us() >= change_us) {
+                speed = speed == 20 ? 21 : 20;
+                lat_address = 3 + 1;
+                lat_speed = speed | 0x80; // forward
+                lat_start_us = Sim::now_us();
+                lat_wait = true;
+                throttle[1]->speed(speed);
+                change_us = lat_start_us + 200000;
+            }
+            loop(command);
+        }
+        uint64_t total_us = Sim::now_us() - start_us;
+        lat_wait = false;
+
+        command.mode_off();
+
+        uint32_t max_us = 0;
+        for (int i = 2; i < throttles; i++) {
+            DccCommand::RefreshStats stats;
+            command.refresh_stats(throttle[i], stats);
+            max_us = std::max(max_us, stats.max_us);
+        }
+
+        for (DccThrottle *t : throttle)
+            command.delete_throttle(t);
+
+        printf("%5d  %8.1f  %8.1f  %21.1f  %13.1f\n", share, total_us / 1e3,
+               total_us / 1e3 / writes, max_us / 1e3, lat_max_us / 1e3);
+    }
+
+    return 0;
+}
+
+
+// Long address read (CV29 bit 5, CV18, CV17) and long address write (CV18,
+// CV17, CV29 bit 5), each as separate service mode operations one after the
+// other, then as one session. Prints the total time and packets for each.
+static int run_session(DccCommand& command)
+{
+    typedef DccCommand::SvcOp SvcOp;
+
+    static const SvcOp read_op[] = {
+        { SvcOp::READ_BIT, 5, DccCv::config, 0, -1, 0, 0 },
+        { SvcOp::READ_CV, 0, DccCv::address_lo, 0, -1, 0, 0 },
+        { SvcOp::READ_CV, 0, DccCv::address_hi, 0, -1, 0, 0 },
+    };
+    static const SvcOp write_op[] = {
+        { SvcOp::WRITE_CV, 0, DccCv::address_lo, 0xd2, -1, 0, 0 },
+        { SvcOp::WRITE_CV, 0, DccCv::address_hi, 0xc4, -1, 0, 0 },
+        { SvcOp::WRITE_BIT, 5, DccCv::config, 1, -1, 0, 0 },
+    };
+    static const int op_cnt = 3;
+
+    printf("               ms  packets  resets  acks  result\n");
+
+    for (int write = 0; write < 2; write++) {
+
+        const SvcOp *op = write ? write_op : read_op;
+
+        decoder.cv(DccCv::config, 0x20);
+        decoder.cv(DccCv::address_lo, 0xd2);
+        decoder.cv(DccCv::address_hi, 0xc4);
+
+        for (int session = 0; session < 2; session++) {
+
+            uint32_t pkt_start = pkt_cnt;
+            uint32_t reset_start = reset_cnt;
+            int ack_start = decoder.ack_cnt();
+            uint64_t start_us = Sim::now_us();
+
+            bool ok = true;
+            SvcOp done[op_cnt];
+            bool result;
+
+            if (session) {
+                command.mode_svc_session(op, op_cnt);
+                while (!command.svc_session_done(result, done))
+                    loop(command);
+                ok = result;
+            } else {
+                for (int i = 0; i < op_cnt && ok; i++) {
+                    done[i] = op[i];
+                    if (op[i].type == SvcOp::READ_CV)
+                        command.mode_svc_read_cv(op[i].cv_num);
+                    else if (op[i].type == SvcOp::READ_BIT)
+                        command.mode_svc_read_bit(op[i].cv_num, op[i].bit_num);
+                    else if (op[i].type == SvcOp::WRITE_CV)
+                        command.mode_svc_write_cv(op[i].cv_num, op[i].val);
+                    else
+                        command.mode_svc_write_bit(op[i].cv_num, op[i].bit_num, op[i].val);
+                    while (!command.svc_done(result, done[i].val))
+                        loop(command);
+                    ok = result;
+                }
+            }
+
+            // let the track go off before the next run
+            while (command.mode() != DccCommand::MODE_OFF)
+                loop(command);
+
+            printf("%-5s %-7s %6.1f  %7u  %6u  %4d  ",
+                   write ? "write" : "read", session ? "session" : "chained",
+                   (Sim::now_us() - start_us) / 1e3, pkt_cnt - pkt_start,
+                   reset_cnt - reset_start, decoder.ack_cnt() - ack_start);
+            if (!ok)
+                printf("failed\n");
+            else if (write)
+                printf("ok\n");
+            else
+                printf("cv29[5]=%u cv18=%u cv17=%u\n", uint(done[0].val),
+                       uint(done[1].val), uint(done[2].val));
+        }
+    }
+
+    return 0;
+}
+
+
+// Service mode reads of a set of cv values, the standard way and fast
+// (DccCommand::svc_read_fast), against a few decoder ack current profiles.
+// Prints ms and packets per cv, how many came back right, and the fast
+// read's retries and restarts. Fails if a fast read gets fewer right than
+// the standard one, or takes over 5% longer (as it may where it has to
+// start over the standard way: the short profile's acks are under the
+// standard's 5 ms, which neither way takes for one).
+static int run_fastread(DccCommand& command)
+{
+    struct Profile {
+        const char *name;
+        uint16_t base_ma;
+        uint16_t noise_ma;
+        uint16_t ack_ma;
+        int ack_us;
+        int delay_us;
+    };
+    static const Profile profiles[] = {
+        { "clean",  20,   0, 100, 6000,    0 },
+        { "noisy",  20,  60, 100, 6000,    0 },
+        { "weak",   20,  10,  75, 6000,    0 },
+        { "late",   20,   0, 100, 6000, 4000 },
+        { "short",  20,   0, 100, 3000,    0 },
+        { "heavy", 200,  30, 100, 6000,    0 },
+    };
+    static const uint8_t vals[] = {
+        0x00, 0xff, 0x55, 0xaa, 0x03, 0x80, 0x7f, 0xc4,
+        0x10, 0xef, 0x33, 0xcc, 0x01, 0xfe, 0x96, 0x69,
+    };
+    static const int val_cnt = sizeof(vals) / sizeof(vals[0]);
+
+    printf("profile  read      ms/cv  pkts/cv  right  retries  restarts\n");
+
+    int failed = 0;
+
+    for (const Profile& p : profiles) {
+
+        double ms[2];
+        int right[2];
+
+        decoder.load(p.base_ma, p.noise_ma);
+        decoder.ack(p.ack_ma, p.ack_us, p.delay_us);
+
+        for (int fast = 0; fast < 2; fast++) {
+
+            command.svc_read_fast(fast != 0);
+
+            uint32_t retry_start = command.svc_read_retry_cnt();
+            uint32_t restart_start = command.svc_read_restart_cnt();
+            uint32_t pkt_start = pkt_cnt;
+            uint64_t start_us = Sim::now_us();
+            right[fast] = 0;
+
+            for (int i = 0; i < val_cnt; i++) {
+                decoder.cv(DccCv::index_lo, vals[i]);
+                command.mode_svc_read_cv(DccCv::index_lo);
+                bool result;
+                uint8_t value = 0;
+                while (!command.svc_done(result, value))
+                    loop(command);
+                if (result && value == vals[i])
+                    right[fast]++;
+            }
+
+            ms[fast] = (Sim::now_us() - start_us) / 1e3 / val_cnt;
+            printf("%-7s  %-8s %6.1f  %7.1f  %2d/%-2d  %7u  %8u\n",
+                   p.name, fast ? "fast" : "standard", ms[fast],
+                   double(pkt_cnt - pkt_start) / val_cnt, right[fast], val_cnt,
+                   command.svc_read_retry_cnt() - retry_start,
+                   command.svc_read_restart_cnt() - restart_start);
+        }
+
+        if (right[1] < right[0] || ms[1] > ms[0] * 1.05) {
+            printf("%-7s  fast read failed\n", p.name);
+            failed++;
+        }
+    }
+
+    printf("fast reads: %s\n", failed == 0 ? "ok" : "failed");
+    return failed == 0 ? 0 : 1;
+}
+
+
+// Standard service mode reads of a set of cv values with the ack seen by the
+// adc irq handler, with and without it cancelling the rest of the verify
+// group (DccCommand::svc_ack_cancel), at a few main loop pass times. Prints
+// ms and packets per cv, how many came back right, and the ack detection
+// latency (DccAdc::ack_stats): from the first sample over the threshold to
+// the run reaching DccAdc::ack_width_min_us, which is when the cancel goes,
+// and to the run ending, which is when ack() latches; and the first of those
+// from when the decoder's ack pulse actually started. Then a read with a
+// pulse too long to be an ack (a load coming on) after every verify, none of
+// which may be taken for one.
+static int run_ack(DccCommand& command, DccAdc& adc)
+{
+    static const uint8_t vals[] = {
+        0x00, 0xff, 0x55, 0xaa, 0x03, 0x80, 0x7f, 0xc4,
+    };
+    static const int val_cnt = sizeof(vals) / sizeof(vals[0]);
+    static const uint32_t pass_us[] = { 10, 1000, 5000 };
+
+    printf("ack width min %u us, max %u us\n", DccAdc::ack_width_min_us,
+           DccAdc::ack_width_max_us);
+    printf("                                       "
+           "detect us   end us      from ack us\n");
+    printf("loop us  cancel  ms/cv  pkts/cv  right   avg  max   avg  max     "
+           "avg  max\n");
+
+    for (uint32_t pass : pass_us) {
+
+        loop_us = pass;
+
+        for (int cancel = 0; cancel < 2; cancel++) {
+
+            command.svc_ack_cancel(cancel != 0);
+            adc.ack_stats_reset();
+
+            uint32_t pkt_start = pkt_cnt;
+            uint64_t start_us = Sim::now_us();
+            int right = 0;
+            uint32_t ack_time_us = adc.ack_time_us();
+            uint64_t from_sum_us = 0;
+            uint32_t from_max_us = 0;
+            uint32_t from_cnt = 0;
+
+            for (int i = 0; i < val_cnt; i++) {
+                decoder.cv(DccCv::index_lo, vals[i]);
+                command.mode_svc_read_cv(DccCv::index_lo);
+                bool result;
+                uint8_t value = 0;
+                while (!command.svc_done(result, value)) {
+                    loop(command);
+                    if (adc.ack_time_us() != ack_time_us) {
+                        ack_time_us = adc.ack_time_us();
+                        uint32_t us = ack_time_us - uint32_t(decoder.ack_start_us());
+                        from_sum_us += us;
+                        from_max_us = std::max(from_max_us, us);
+                        from_cnt++;
+                    }
+                }
+                if (result && value == vals[i])
+                    right++;
+            }
+
+            DccAdc::AckStats stats;
+            adc.ack_stats(stats);
+
+            printf("%7u  %-6s %6.1f  %7.1f  %2d/%-2d  %4u %4u  %4u %4u    "
+                   "%4u %4u\n",
+                   pass, cancel ? "on" : "off",
+                   (Sim::now_us() - start_us) / 1e3 / val_cnt,
+                   double(pkt_cnt - pkt_start) / val_cnt, right, val_cnt,
+                   stats.avg_us, stats.max_us, stats.end_avg_us,
+                   stats.end_max_us,
+                   from_cnt > 0 ? uint32_t(from_sum_us / from_cnt) : 0,
+                   from_max_us);
+        }
+    }
+
+    static const int long_us = 20000;
+    decoder.ack(100, long_us);
+    adc.ack_stats_reset();
+    decoder.cv(DccCv::index_lo, 0xff);
+    command.mode_svc_read_cv(DccCv::index_lo);
+    bool result;
+    while (!command.svc_done(result))
+        loop(command);
+
+    int reject_cnt = 0;
+    for (int i = 0; i < command.svc_ack_cnt(); i++)
+        reject_cnt += command.svc_ack(i).reject_cnt;
+
+    DccAdc::AckStats stats;
+    adc.ack_stats(stats);
+    bool ok = stats.cnt == 0 && !result;
+    printf("%d us pulses: %u acks, %d rejected, read %s: %s\n", long_us,
+           stats.cnt, reject_cnt, result ? "ok" : "failed",
+           ok ? "ok" : "failed");
+
+    return ok ? 0 : 1;
+}
+
+
+// Queue stress: DccBitstream's producer (send_packet, cancel) with the
+// consumer (the irq handler, up to the next packet it starts) run at every
+// barrier in them, as if the irq came right there, a random 0 to 2 times,
+// and now and then a cancel from that irq (as DccCommand's ack handler
+// does). The stores between barriers aren't looked at by the other side
+// until the barrier's store after them, so these are the places it can
+// come in that matter. Every packet started is checked against what was
+// queued: in order, each sent repeat times in a row, except that one
+// queued before a cancel can be dropped (all or the rest of its repeats),
+// and one queued during or after a cancel never is by it, and once the
+// cancel has returned, none queued before it starts again.
+static const int queue_sig_gpio = 20; // own pwm slice, not sig_gpio's
+static const int queue_pwr_gpio = 21;
+
+static DccBitstream *queue_bs = nullptr;
+static uint32_t queue_rand = 1;
+
+struct QueuePkt {
+    DccPktSpeed128 pkt;
+    int repeat;
+    uint32_t cancels;   // cancel() calls started before send_packet returned
+};
+static const uint32_t queue_queuing = UINT32_MAX; // cancels until it returns
+
+static std::vector<QueuePkt> queue_pkt;
+static uint32_t queue_cancels = 0;
+static uint32_t queue_irq_cancels = 0;
+static uint32_t queue_preempts = 0;
+
+// checker: the first packet not finished, and how many times it's gone
+static size_t queue_next = 0;
+static int queue_sent = 0;
+static size_t queue_cut = 0; // first one a returned cancel() didn't drop
+static uint32_t queue_idle = 0;
+static uint32_t queue_reset = 0;
+static uint32_t queue_dropped = 0;
+static uint32_t queue_started = 0;
+static const char *queue_err = nullptr;
+
+static uint32_t queue_random(uint32_t n)
+{
+    queue_rand = queue_rand * 1664525 + 1013904223;
+    return (queue_rand >> 8) % n;
+}
+
+
+static bool queue_match(const DccBitstream::Started& s, const DccPkt& pkt)
+{
+    for (int i = 0; i < 3; i++)
+        if (s.msg[i] != pkt.data(i))
+            return false;
+    return true;
+}
+
+
+// Packet i didn't go all repeat times; only a cancel after it was queued
+// can do that.
+static void queue_drop(size_t i)
+{
+    uint32_t cancels = queue_pkt[i].cancels;
+    if ((cancels == queue_queuing || cancels == queue_cancels) && queue_err == nullptr)
+        queue_err = "packet dropped with no cancel after it was queued";
+    queue_dropped++;
+}
+
+
+static void queue_check(const DccBitstream::Started& s)
+{
+    queue_started++;
+
+    if (s.msg[0] == 0xff) {
+        // only for an empty queue, with nothing partly sent
+        if ((queue_sent > 0 || queue_bs->pending() != 0) && queue_err == nullptr)
+            queue_err = "idle packet with packets queued";
+        queue_idle++;
+        return;
+    }
+
+    if (s.msg[0] == 0x00) {
+        // in place of what a cancel dropped, which ends the one going out
+        if (queue_sent > 0) {
+            queue_drop(queue_next++);
+            queue_sent = 0;
+        }
+        queue_reset++;
+        return;
+    }
+
+    size_t j = queue_next;
+    while (j < queue_pkt.size() && !queue_match(s, queue_pkt[j].pkt))
+        j++;
+    if (j == queue_pkt.size()) {
+        if (queue_err == nullptr)
+            queue_err = "packet started out of order";
+        return;
+    }
+
+    if (j < queue_cut && queue_err == nullptr)
+        queue_err = "packet started after a cancel that dropped it";
+
+    // the ones skipped, and the rest of one partly sent, were dropped
+    if (j > queue_next) {
+        for (size_t i = queue_next; i < j; i++)
+            queue_drop(i);
+        queue_next = j;
+        queue_sent = 0;
+    }
+
+    if (++queue_sent == queue_pkt[j].repeat) {
+        queue_next++;
+        queue_sent = 0;
+    }
+}
+
+
+// A cancel() has returned: everything queued by then is dropped, which is
+// everything but one still being queued.
+static void queue_cancelled()
+{
+    size_t cut = queue_pkt.size();
+    if (cut > 0 && queue_pkt.back().cancels == queue_queuing)
+        cut--;
+    queue_cut = std::max(queue_cut, cut);
+}
+
+
+// the irq handler until it starts a packet; nothing preempts it
+static bool queue_in_irq = false;
+
+static void queue_consume()
+{
+    queue_in_irq = true;
+    uint32_t cnt = queue_bs->started_cnt();
+    while (queue_bs->started_cnt() == cnt)
+        Sim::irq_now(pwm_gpio_to_slice_num(queue_sig_gpio));
+    queue_in_irq = false;
+    queue_check(queue_bs->started(cnt));
+}
+
+
+static void queue_preempt()
+{
+    if (queue_in_irq)
+        return;
+    queue_preempts++;
+    for (int i = queue_random(3); i > 0; i--)
+        queue_consume();
+    if (queue_random(32) == 0) {
+        queue_cancels++;
+        queue_irq_cancels++;
+        queue_bs->cancel();
+        queue_cancelled();
+    }
+}
+
+
+static int run_queue(int pkts)
+{
+    DccBitstream bs(queue_sig_gpio, queue_pwr_gpio);
+    queue_bs = &bs;
+    bs.start_ops();
+    bs.busy(true);
+
+    queue_pkt.reserve(pkts);
+    Sim::on_preempt(queue_preempt);
+
+    while (queue_pkt.size() < size_t(pkts) && queue_err == nullptr) {
+        uint32_t r = queue_random(64);
+        if (r == 0) {
+            queue_cancels++;
+            bs.cancel();
+            queue_cancelled();
+        } else if (r < 16 || bs.pending() == DccBitstream::slot_max) {
+            queue_consume();
+        } else {
+            int n = queue_pkt.size();
+            queue_pkt.push_back({ DccPktSpeed128(1 + n % 100, (n / 100) % 100),
+                                  1 + int(queue_random(4)), queue_queuing });
+            QueuePkt& q = queue_pkt.back();
+            bs.send_packet(q.pkt, q.repeat);
+            q.cancels = queue_cancels;
+        }
+    }
+
+    // drain, with no more cancels
+    Sim::on_preempt(nullptr);
+    while (bs.pending() > 0 && queue_err == nullptr)
+        queue_consume();
+    queue_consume(); // idle
+    // everything has started; the rest was dropped
+    for (size_t i = queue_next; i < queue_pkt.size(); i++)
+        queue_drop(i);
+
+    bs.stop();
+    queue_bs = nullptr;
+
+    printf("queued %zu packets, %u started (%u idle, %u reset)\n",
+           queue_pkt.size(), queue_started, queue_idle, queue_reset);
+    printf("irq at a barrier %u times, cancels %u (%u from the irq), "
+           "packets dropped %u\n", queue_preempts, queue_cancels,
+           queue_irq_cancels, queue_dropped);
+    printf("%s%s\n", queue_err == nullptr ? "ok" : "failed: ",
+           queue_err == nullptr ? "" : queue_err);
+
+    return queue_err == nullptr ? 0 : 1;
+}
+
+
+// The bit irq handler as it was before packets were encoded into bit
+// tables: the next bit worked out from the byte and bit going out, one A/B
+// packet buffer ahead. Kept here only for run_bits to time against, with
+// what DccBitstream's handler has added around next_bit() since (the adc
+// sync check and the cycle counts), so only next_bit() differs.
+class OldBitstream
+{
+    public:
+
+        OldBitstream(uint slice) :
+            _current(&_pkt_idle), _next(&_pkt_idle),
+            _preamble_bits(DccPkt::ops_preamble_bits),
+            _slice(slice), _channel(0), _byte(-1),
+            _bit(DccPkt::ops_preamble_bits - 1)
+        {
+            pwm_config config = pwm_get_default_config();
+            pwm_init(_slice, &config, false);
+            pwm_irq_mux_connect(_slice, pwm_handler, this);
+            pwm_set_irq_enabled(_slice, true);
+        }
+
+        bool need_packet() const { return _next == &_pkt_idle; }
+
+        void send_packet(const DccPkt& pkt)
+        {
+            pwm_set_irq_enabled(_slice, false);
+            __dmb();
+            if (_current == &_pkt_a) {
+                _pkt_b = pkt;
+                _next = &_pkt_b;
+            } else {
+                _pkt_a = pkt;
+                _next = &_pkt_a;
+            }
+            __dmb();
+            pwm_set_irq_enabled(_slice, true);
+        }
+
+    private:
+
+        DccPktIdle _pkt_idle;
+        DccPkt _pkt_a;
+        DccPkt _pkt_b;
+        DccPkt *_current;
+        DccPkt *_next;
+        int _preamble_bits;
+        uint _slice;
+        uint _channel;
+        int _byte; // -1 for preamble, then index in _current
+        int _bit;  // counts down bit in preamble or _byte
+        int _sync_run = -1;
+        volatile uint32_t _isr_cnt = 0;
+        volatile uint32_t _isr_max_cyc = 0;
+        volatile uint64_t _isr_cyc = 0;
+
+        void prog_bit(int b)
+        {
+            int half_us = (b == 0 ? 100 : 58);
+            pwm_set_wrap(_slice, 2 * half_us - 1);
+            pwm_set_chan_level(_slice, _channel, half_us);
+        }
+
+        void next_bit()
+        {
+            if (_byte == -1) {
+                if (_bit == -1) {
+                    prog_bit(0);
+                    _byte = 0;
+                    _bit = 8 - 1;
+                } else {
+                    prog_bit(1);
+                    _bit--;
+                }
+            } else {
+                int msg_len = _current->msg_len();
+                if (_bit == -1) {
+                    if ((_byte + 1) == msg_len) {
+                        prog_bit(1);
+                        _current = _next;
+                        _next = &_pkt_idle;
+                        _byte = -1;
+                        _bit = _preamble_bits - 2;
+                    } else {
+                        prog_bit(0);
+                        _byte++;
+                        _bit = 8 - 1;
+                    }
+                } else {
+                    int b = (_current->data(_byte) >> _bit) & 1;
+                    prog_bit(b);
+                    _bit--;
+                }
+            }
+        }
+
+        static void pwm_handler(void *arg)
+        {
+            uint32_t start_cyc = rp2040.getCycleCount();
+            OldBitstream *me = (OldBitstream *)arg;
+            if (me->_sync_run >= 0)
+                return;
+            me->next_bit();
+            uint32_t cyc = rp2040.getCycleCount() - start_cyc;
+            me->_isr_cnt++;
+            me->_isr_cyc += cyc;
+            if (me->_isr_max_cyc < cyc)
+                me->_isr_max_cyc = cyc;
+        }
+};
+
+
+// Host time per bit in the bit irq handler (the whole handler, through the
+// sim's pwm irq), the old way (OldBitstream, bits worked out as they go)
+// and with the bit tables (DccBitstream), on the same refresh packets: a
+// few throttles' (whose encodings stay cached) and many throttles'. Each
+// packet is queued when the one before has started, and only the handler
+// calls after that are timed; the time to queue it (copying it, or looking
+// up or making its encoding) is per packet. This one is real time, not
+// virtual.
+static int run_bits()
+{
+    static const int mixes[] = { 4, 100 };
+    static const int pkts = 200000;
+    static const uint old_slice = 3;
+
+    DccBitstream bs(queue_sig_gpio, queue_pwr_gpio);
+    bs.start_ops();
+    uint bs_slice = pwm_gpio_to_slice_num(queue_sig_gpio);
+    xassert(bs_slice != old_slice);
+
+    OldBitstream old(old_slice);
+
+    printf("throttles  handler     ns/bit  queue ns/pkt  (bits)\n");
+
+    for (int throttles : mixes) {
+
+        std::vector<DccThrottle> throttle(throttles);
+        std::vector<DccPkt> mix;
+        for (int i = 0; i < throttles; i++) {
+            throttle[i].address(i < 50 ? 3 + i : 1000 + i); // short and long
+            throttle[i].speed(i - 50);
+            throttle[i].function(i % 29, true);
+        }
+        for (int i = 0; i < 10 * throttles; i++) {
+            int repeat;
+            mix.push_back(throttle[i % throttles].next_packet(repeat));
+        }
+
+        for (int table = 0; table < 2; table++) {
+
+            std::chrono::duration<double, std::nano> irq_ns(0);
+            std::chrono::duration<double, std::nano> queue_ns(0);
+            uint32_t bits = 0;
+
+            for (int p = 0; p < pkts; p++) {
+                const DccPkt& pkt = mix[p % mix.size()];
+                if (table) {
+                    auto t0 = std::chrono::steady_clock::now();
+                    bs.send_packet(pkt);
+                    auto t1 = std::chrono::steady_clock::now();
+                    uint32_t start = Sim::irq_cnt();
+                    while (bs.pending() > 0)
+                        Sim::irq_now(bs_slice);
+                    auto t2 = std::chrono::steady_clock::now();
+                    bits += Sim::irq_cnt() - start;
+                    queue_ns += t1 - t0;
+                    irq_ns += t2 - t1;
+                } else {
+                    auto t0 = std::chrono::steady_clock::now();
+                    old.send_packet(pkt);
+                    auto t1 = std::chrono::steady_clock::now();
+                    uint32_t start = Sim::irq_cnt();
+                    while (!old.need_packet())
+                        Sim::irq_now(old_slice);
+                    auto t2 = std::chrono::steady_clock::now();
+                    bits += Sim::irq_cnt() - start;
+                    queue_ns += t1 - t0;
+                    irq_ns += t2 - t1;
+                }
+            }
+
+            printf("%9d  %-8s  %7.1f  %12.1f  (%u)\n", throttles,
+                   table ? "table" : "old", irq_ns.count() / bits,
+                   queue_ns.count() / pkts, bits);
+        }
+    }
+
+    bs.stop();
+
+    return 0;
+}
+
+
+// The PIO program in dcc_bitstream_pio.cpp, as listed there, run one
+// instruction cycle (1 usec) at a time on a packet's DccPioWords, giving the
+// signal as a list of how long each level lasts. The program itself
+// (DccBitstreamPio::program_init) needs the pico-sdk's pio encoders, so
+// this follows the listing it is assembled from.
+class PioModel
+{
+    public:
+
+        // Run words[0..cnt-1] (whole packets) through, and on to the pull
+        // of the next packet's header, appending to runs.
+        void run(const uint32_t *words, int cnt, std::vector<int>& runs)
+        {
+            _words = words;
+            _cnt = cnt;
+            _idx = 0;
+            _runs = &runs;
+            int pc = 0;
+            while (true) {
+                const Instr& in = prog[pc];
+                if ((in.op == PULL) && _idx == _cnt)
+                    return; // stalled for the next packet
+                level(in.side, 1 + in.delay);
+                pc = step(in, pc);
+            }
+        }
+
+    private:
+
+        enum Op { PULL, PULL_IFEMPTY, OUT_X, OUT_Y, JMP, JMP_Y, JMP_X, NOP, SET_Y };
+        struct Instr { Op op; int arg; int side; int delay; };
+        static const Instr prog[18];
+
+        const uint32_t *_words;
+        int _cnt;
+        int _idx;
+        uint32_t _osr = 0;
+        int _osr_used = 32;
+        uint32_t _x = 0;
+        uint32_t _y = 0;
+        std::vector<int> *_runs;
+        int _level = -1;
+
+        // from the first high; the low ahead of it is just the start
+        void level(int l, int cycles)
+        {
+            if (_runs->empty() && l == 0)
+                return;
+            if (l != _level || _runs->empty())
+                _runs->push_back(0);
+            _runs->back() += cycles;
+            _level = l;
+        }
+
+        void pull()
+        {
+            xassert(_idx < _cnt);
+            _osr = _words[_idx++];
+            _osr_used = 0;
+        }
+
+        uint32_t out(int bits)
+        {
+            uint32_t v = bits == 32 ? _osr : _osr >> (32 - bits);
+            _osr = bits == 32 ? 0 : _osr << bits;
+            _osr_used += bits;
+            return v;
+        }
+
+        int step(const Instr& in, int pc)
+        {
+            switch (in.op) {
+            case PULL: pull(); break;
+            case PULL_IFEMPTY: if (_osr_used >= 32) pull(); break;
+            case OUT_X: _x = out(in.arg); break;
+            case OUT_Y: _y = out(in.arg); break;
+            case JMP: return in.arg;
+            case JMP_Y: if (_y-- != 0) return in.arg; break;
+            case JMP_X: if (_x-- != 0) return in.arg; break;
+            case NOP: break;
+            case SET_Y: _y = in.arg; break;
+            }
+            return (pc + 1) % 18; // wrap to new_pkt
+        }
+};
+
+const PioModel::Instr PioModel::prog[18] = {
+    { PULL, 0, 0, 0 },          //  0 new_pkt
+    { OUT_X, 32, 0, 0 },        //  1
+    { JMP, 4, 0, 0 },           //  2
+    { NOP, 0, 0, 2 },           //  3 bit
+    { PULL_IFEMPTY, 0, 0, 0 },  //  4 bit2
+    { OUT_Y, 1, 0, 0 },         //  5
+    { JMP_Y, 13, 0, 0 },        //  6
+    { SET_Y, 31, 1, 3 },        //  7 zero
+    { JMP_Y, 8, 1, 2 },         //  8 h0
+    { SET_Y, 29, 0, 2 },        //  9
+    { JMP_Y, 10, 0, 2 },        // 10 l0
+    { JMP_X, 3, 0, 0 },         // 11
+    { JMP, 0, 0, 0 },           // 12
+    { SET_Y, 27, 1, 1 },        // 13 one
+    { JMP_Y, 14, 1, 1 },        // 14 h1
+    { SET_Y, 24, 0, 0 },        // 15
+    { JMP_Y, 16, 0, 1 },        // 16 l1
+    { JMP_X, 3, 0, 0 },         // 17
+};
+
+
+static std::vector<uint64_t> pio_edge_us;
+
+static void pio_edge(uint64_t edge_us, int)
+{
+    pio_edge_us.push_back(edge_us);
+}
+
+
+// DccPioWords and the PIO program against DccBitstream's pwm signal:
+// idle, reset, a short address speed packet and a long address one, sent
+// back-to-back after the first packet, in ops and service mode. The pwm
+// signal comes from the sim's edges; the PIO one from PioModel running
+// the words each packet is encoded to, the first with the whole preamble
+// and the rest with the one before's stop bit as the first preamble bit,
+// as DccBitstreamPio queues them. Every high and low time has to match.
+static int run_pio()
+{
+    static const DccPktIdle idle;
+    static const DccPktReset reset;
+    static const DccPktSpeed128 speed_short(3, 10);
+    static const DccPktSpeed128 speed_long(1234, -20);
+    static const DccPkt *mix[] = { &idle, &reset, &speed_short, &speed_long };
+    static const int mix_cnt = sizeof(mix) / sizeof(mix[0]);
+
+    bool ok = true;
+
+    for (int svc = 0; svc < 2; svc++) {
+
+        DccBitstream bs(queue_sig_gpio, queue_pwr_gpio);
+        int preamble_bits = svc ? DccPkt::svc_preamble_bits : DccPkt::ops_preamble_bits;
+        const DccPkt& first = svc ? (const DccPkt&)reset : (const DccPkt&)idle;
+
+        // pwm: everything queued before the first bit is done
+        pio_edge_us.clear();
+        Sim::on_edge(pio_edge);
+        if (svc)
+            bs.start_svc();
+        else
+            bs.start_ops();
+        for (const DccPkt *pkt : mix)
+            bs.send_packet(*pkt);
+        Sim::advance_us(100000);
+        bs.stop();
+        Sim::on_edge(edge);
+
+        std::vector<int> pwm_runs;
+        for (size_t i = 1; i < pio_edge_us.size(); i++)
+            pwm_runs.push_back(pio_edge_us[i] - pio_edge_us[i - 1]);
+
+        // pio
+        PioModel pio;
+        std::vector<int> pio_runs;
+        int bits = 0;
+        for (int p = -1; p < mix_cnt; p++) {
+            uint32_t words[DccPioWords::words_max];
+            const DccPkt& pkt = p < 0 ? first : *mix[p];
+            int cnt = DccPioWords::encode(pkt, p < 0 ? preamble_bits : preamble_bits - 1,
+                                          words);
+            bits += DccPioWords::bit_cnt(words);
+            pio.run(words, cnt, pio_runs);
+        }
+
+        // the last one, the last stop bit's low half, is cut short where
+        // the model stalls for the next header
+        int mismatch = -1;
+        pio_runs.pop_back();
+        for (size_t i = 0; i < pio_runs.size() && mismatch < 0; i++)
+            if (i >= pwm_runs.size() || pio_runs[i] != pwm_runs[i])
+                mismatch = i;
+
+        printf("%-3s  %d packets, %d bits, %zu levels: ", svc ? "svc" : "ops",
+               mix_cnt + 1, bits, pio_runs.size());
+        if (mismatch < 0) {
+            printf("ok\n");
+        } else {
+            printf("failed at level %d, pio %d us, pwm %d us\n", mismatch,
+                   pio_runs[mismatch],
+                   size_t(mismatch) < pwm_runs.size() ? pwm_runs[mismatch] : -1);
+            ok = false;
+        }
+    }
+
+    return ok ? 0 : 1;
+}
+
+
+// DccThrottle as it was before it kept its state compact: the six refresh
+// packets and the two write packets kept built, and next_packet() copying
+// one out. Kept here only for run_throttle to measure against, so only the
+// refresh rotation (and the write packets, for the size) is here.
+class OldThrottle
+{
+    public:
+
+        OldThrottle() : _seq(0), _urgent(0), _write_cv_cnt(0), _write_bit_cnt(0)
+        {
+        }
+
+        void address(int address)
+        {
+            _pkt_speed.address(address);
+            _pkt_func_0.address(address);
+            _pkt_func_5.address(address);
+            _pkt_func_9.address(address);
+            _pkt_func_13.address(address);
+            _pkt_func_21.address(address);
+            _seq = 0;
+            _urgent = 0;
+            _pkt_write_cv.address(address);
+            _pkt_write_bit.address(address);
+        }
+
+        void speed(int speed)
+        {
+            if (_pkt_speed.speed() == speed)
+                return;
+            _pkt_speed.speed(speed);
+            _urgent |= (1 << 0);
+        }
+
+        void function(int num, bool on)
+        {
+            if (num <= 4) {
+                _pkt_func_0.f(num, on);
+                _urgent |= (1 << 1);
+            } else if (num <= 8) {
+                _pkt_func_5.f(num, on);
+                _urgent |= (1 << 3);
+            } else if (num <= 12) {
+                _pkt_func_9.f(num, on);
+                _urgent |= (1 << 5);
+            } else if (num <= 20) {
+                _pkt_func_13.f(num, on);
+                _urgent |= (1 << 7);
+            } else {
+                _pkt_func_21.f(num, on);
+                _urgent |= (1 << 9);
+            }
+        }
+
+        DccPkt next_packet(int& repeat)
+        {
+            if (_write_cv_cnt > 0) {
+                repeat = _write_cv_cnt;
+                _write_cv_cnt = 0;
+                return _pkt_write_cv;
+            }
+
+            if (_write_bit_cnt > 0) {
+                repeat = _write_bit_cnt;
+                _write_bit_cnt = 0;
+                return _pkt_write_bit;
+            }
+
+            repeat = 1;
+
+            int seq = _seq;
+
+            if (++_seq >= seq_max)
+                _seq = 0;
+
+            if ((seq & 1) == 0)
+                _urgent &= ~(1 << 0);
+            else
+                _urgent &= ~(1 << seq);
+
+            if ((seq & 1) == 0)
+                return _pkt_speed;
+            else if (seq == 1)
+                return _pkt_func_0;
+            else if (seq == 3)
+                return _pkt_func_5;
+            else if (seq == 5)
+                return _pkt_func_9;
+            else if (seq == 7)
+                return _pkt_func_13;
+            else
+                return _pkt_func_21;
+        }
+
+    private:
+
+        DccPktSpeed128  _pkt_speed;
+        DccPktFunc0     _pkt_func_0;
+        DccPktFunc5     _pkt_func_5;
+        DccPktFunc9     _pkt_func_9;
+        DccPktFunc13    _pkt_func_13;
+        DccPktFunc21    _pkt_func_21;
+
+        static const int seq_max = 10;
+        int _seq;
+
+        uint16_t _urgent;
+
+        DccPktOpsWriteCv _pkt_write_cv;
+        int _write_cv_cnt;
+
+        DccPktOpsWriteBit _pkt_write_bit;
+        int _write_bit_cnt;
+};
+
+
+// Host time per next_packet() over throttles of type T set up the same way
+// (half short and half long addresses, speeds, one function each). Real
+// time, not virtual.
+template <typename T>
+static double throttle_ns(uint32_t& sum)
+{
+    static const int throttles = 100;
+    static const int calls = 10000000;
+
+    static T throttle[throttles];
+
+    for (int i = 0; i < throttles; i++) {
+        throttle[i].address(i < 50 ? 3 + i : 1000 + i); // short and long
+        throttle[i].speed(i - 50);
+        throttle[i].function(i % 29, true);
+    }
+
+    sum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < calls; i++) {
+        int repeat;
+        DccPkt pkt = throttle[i % throttles].next_packet(repeat);
+        sum += pkt.data(pkt.msg_len() - 1);
+    }
+
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double, std::nano>(end - start).count() / calls;
+}
+
+
+// Memory per throttle, and host time to get the next packet from one
+// (next_packet), for DccThrottle now and as it was with its packets kept
+// built (OldThrottle). The sums of the packets' last bytes must match.
+static int run_throttle()
+{
+    uint32_t old_sum;
+    uint32_t new_sum;
+    double old_ns = throttle_ns<OldThrottle>(old_sum);
+    double new_ns = throttle_ns<DccThrottle>(new_sum);
+
+    printf("throttle  bytes  us/packet  (sum)\n");
+    printf("old       %5zu  %9.4f  (%u)\n", sizeof(OldThrottle), old_ns / 1e3,
+           old_sum);
+    printf("new       %5zu  %9.4f  (%u)\n", sizeof(DccThrottle), new_ns / 1e3,
+           new_sum);
+
+    bool ok = old_sum == new_sum;
+    printf("%s\n", ok ? "ok" : "failed: packets differ");
+
+    return ok ? 0 : 1;
+}
+
+
+// Group (DccThrottle's: speed 0, F0-F4 1, ... F21-F28 5) of a short
+// address packet, from its instruction byte.
+static int pkt_group(const DccPkt& pkt)
+{
+    uint8_t inst = pkt.data(1);
+    if (inst == 0x3f) return 0;             // 128 speed step
+    if ((inst & 0xe0) == 0x80) return 1;    // F0-F4
+    if ((inst & 0xf0) == 0xb0) return 2;    // F5-F8
+    if ((inst & 0xf0) == 0xa0) return 3;    // F9-F12
+    if (inst == 0xde) return 4;             // F13-F20
+    if (inst == 0xdf) return 5;             // F21-F28
+    return -1;
+}
+
+
+// Each group changed with the refresh rotation (next_packet) at each place
+// in its sequence, and the changes sent ahead of it (next_urgent) one in
+// every 1 to 4 packets, the way DccCommand mixes them in. Counts the
+// packets of the changed group until the throttle is no longer urgent;
+// that must be change_cnt() every time, whichever of the two sent them.
+// Prints the fewest and most sent for each group.
+static int run_changes()
+{
+    static const int groups = 6;
+    static const int first_func[groups] = { -1, 0, 5, 9, 13, 21 };
+    static const int seq_max = 10;
+    static const int mix_max = 4;
+
+    int cnt = DccThrottle::change_cnt();
+    bool ok = true;
+
+    printf("group  min  max  (change_cnt %d)\n", cnt);
+
+    for (int g = 0; g < groups; g++) {
+
+        int sent_min = INT_MAX;
+        int sent_max = 0;
+
+        for (int seq = 0; seq < seq_max; seq++) {
+            for (int mix = 1; mix <= mix_max; mix++) {
+
+                DccThrottle t;
+                int repeat;
+                while (t.urgent())
+                    t.next_urgent(repeat);
+                for (int i = 0; i < seq; i++)
+                    t.next_packet(repeat);
+
+                if (g == 0)
+                    t.speed(10);
+                else
+                    t.function(first_func[g], true);
+
+                int sent = 0;
+                for (int i = 0; t.urgent(); i++) {
+                    DccPkt pkt = (i % mix) == 0 ? t.next_urgent(repeat)
+                                                : t.next_packet(repeat);
+                    if (pkt_group(pkt) == g)
+                        sent++;
+                }
+
+                sent_min = std::min(sent_min, sent);
+                sent_max = std::max(sent_max, sent);
+            }
+        }
+
+        printf("%5d  %3d  %3d\n", g, sent_min, sent_max);
+        ok = ok && sent_min == cnt && sent_max == cnt;
+    }
+
+    printf("%s\n", ok ? "ok" : "failed");
+
+    return ok ? 0 : 1;
+}
+
+
+// DccCore1 with core 1's loop1() run between core 0's calls, the way the
+// other core could. Each cycle creates a throttle and runs until a write on
+// it is done, then deletes it and creates one again right away (which gets
+// the same proxy back), before core 1 has run either request. The new one
+// must have no writes pending until core 1 creates it, and core 1 must
+// delete the old one (not the new one's) first. At the end, every throttle
+// core 1 created must have been deleted.
+static void core1_loop(DccCore1& core1)
+{
+    core1.loop();
+    core1.loop1();
+    Sim::advance_us(loop_us);
+}
+
+
+static int run_core1(DccCommand& command, int cycles)
+{
+    DccCore1 core1(command);
+    int errs = 0;
+
+    core1.mode_ops();
+
+    for (int c = 0; c < cycles; c++) {
+
+        DccCore1::Throttle *t = core1.create_throttle();
+        t->address(3);
+        t->speed(10);
+        t->write_cv(DccCv::acceleration, c & 0xff);
+        while (t->write_pending() > 0)
+            core1_loop(core1);
+
+        core1.delete_throttle(t);
+        DccCore1::Throttle *u = core1.create_throttle();
+        if (u != t) {
+            printf("cycle %d: a different proxy\n", c);
+            errs++;
+        }
+        if (u->write_pending() != 0) {
+            printf("cycle %d: %d writes pending before core 1 created it\n",
+                   c, u->write_pending());
+            errs++;
+        }
+        u->write_cv(DccCv::deceleration, c & 0xff);
+        if (u->write_pending() != 1) {
+            printf("cycle %d: %d writes pending after one\n", c,
+                   u->write_pending());
+            errs++;
+        }
+
+        core1_loop(core1);
+        if (command.throttle_cnt() != 1) {
+            printf("cycle %d: %d throttles on core 1\n", c,
+                   command.throttle_cnt());
+            errs++;
+        }
+
+        while (u->write_pending() > 0)
+            core1_loop(core1);
+        core1.delete_throttle(u);
+        core1_loop(core1);
+    }
+
+    core1.mode_off();
+    core1_loop(core1);
+
+    printf("cycles %d, throttles left %d\n", cycles, command.throttle_cnt());
+    if (command.throttle_cnt() != 0)
+        errs++;
+
+    printf("%s\n", errs == 0 ? "ok" : "failed");
+
+    return errs == 0 ? 0 : 1;
+}
+
+
+// Reads of random values with whatever decoder current the options give
+// (-n noise, -p bursts, -a weak acks). Prints how many reads came back
+// right, wrong, or failed, and from each verify group's decision
+// (DccCommand::svc_ack), the false acks and missed acks (a bit's group
+// against the bit's value; the byte verify against whether every bit was
+// right), the runs rejected as too short, and the average confidence of
+// the right and wrong decisions.
+static int run_noise(DccCommand& command)
+{
+    static const int reads = 32;
+    static const int cv_num = 8;
+
+    int right = 0;
+    int wrong = 0;
+    int failed = 0;
+    int groups = 0;
+    int false_cnt = 0;
+    int miss_cnt = 0;
+    int reject_cnt = 0;
+    uint32_t right_conf = 0;
+    uint32_t wrong_conf = 0;
+
+    uint64_t start_us = Sim::now_us();
+    uint32_t rand = 1;
+
+    for (int i = 0; i < reads; i++) {
+        rand = rand * 1664525 + 1013904223;
+        uint8_t val = rand >> 24;
+        decoder.cv(cv_num, val);
+        command.mode_svc_read_cv(cv_num);
+        bool result;
+        uint8_t value = 0;
+        while (!command.svc_done(result, value))
+            loop(command);
+        // let the last group close (the track goes off)
+        while (command.mode() != DccCommand::MODE_OFF)
+            loop(command);
+
+        if (!result)
+            failed++;
+        else if (value == val)
+            right++;
+        else
+            wrong++;
+
+        bool bits_right = true;
+        for (int g = 0; g < command.svc_ack_cnt(); g++) {
+            const DccCommand::SvcAck& a = command.svc_ack(g);
+            bool expect;
+            if (a.bit == 8) {
+                expect = bits_right;
+            } else {
+                expect = ((val >> a.bit) & 1) != 0;
+                if (a.ack != expect)
+                    bits_right = false;
+            }
+            groups++;
+            reject_cnt += a.reject_cnt;
+            if (a.ack == expect) {
+                right_conf += a.confidence;
+            } else {
+                wrong_conf += a.confidence;
+                if (a.ack)
+                    false_cnt++;
+                else
+                    miss_cnt++;
+            }
+        }
+    }
+
+    int wrong_groups = false_cnt + miss_cnt;
+
+    printf("reads           %d right, %d wrong, %d failed\n", right, wrong, failed);
+    printf("time            %.1f ms/cv\n", (Sim::now_us() - start_us) / 1e3 / reads);
+    printf("groups          %d, %d false acks, %d missed, %d rejected runs\n",
+           groups, false_cnt, miss_cnt, reject_cnt);
+    printf("confidence      %u%% right, %u%% wrong\n",
+           groups > wrong_groups ? right_conf / (groups - wrong_groups) : 0,
+           wrong_groups > 0 ? wrong_conf / wrong_groups : 0);
+
+    return 0;
+}
+
+
+// Scripted track load in ops mode, with the default trip (DccCommand::trip)
+// and a throttle running. Prints, for each script, the trips and retries,
+// when power was cut (from the load going over the trip level), how long
+// it was off each time, whether it stayed on once the load was gone, and
+// for the first trip, what the capture before it has.
+static int run_trip(DccCommand& command, DccAdc& adc)
+{
+    typedef SimDecoder::Step Step;
+
+    // loco's inrush, 1 msec over the trip level then gone
+    static const Step inrush[] = { { 0, 2900 }, { 1000, 0 } };
+    // a short for 3 sec; the adc reads it as full scale (3000 mA)
+    static const Step dead[] = { { 0, 5000 }, { 3000000, 0 } };
+    // overload just over the trip level for 1 sec
+    static const Step over[] = { { 0, 2600 }, { 1000000, 0 } };
+    // driver at its current limit for 1 sec, chopping: 300 usec over, 100
+    // under
+    static std::vector<Step> chop;
+    for (uint32_t us = 0; us < 1000000; us += 400) {
+        chop.push_back({ us, 3000 });
+        chop.push_back({ us + 300, 1000 });
+    }
+    chop.push_back({ 1000000, 0 });
+
+    static const struct {
+        const char *name;
+        const Step *step;
+        int step_cnt;
+        uint32_t run_ms;
+    } script[] = {
+        { "inrush", inrush, 2, 500 },
+        { "short", dead, 2, 8000 },
+        { "over", over, 2, 4000 },
+        { "chop", chop.data(), int(chop.size()), 4000 },
+    };
+
+    DccThrottle *throttle = command.create_throttle();
+    throttle->speed(20);
+
+    printf("trip %d mA for %d us\n", command.trip_ma(), command.trip_us());
+    printf("script  trips  retries  cut after us  stays on  "
+           "off ms each trip\n");
+
+    for (auto& sc : script) {
+
+        command.mode_ops();
+        uint64_t end_us = Sim::now_us() + 100000;
+        while (Sim::now_us() < end_us)
+            loop(command);
+
+        pwr_on_us.clear();
+        pwr_off_us.clear();
+        uint32_t trip_cnt = command.trip_cnt();
+        uint32_t retry_cnt = command.trip_retry_cnt();
+
+        uint64_t start_us = Sim::now_us();
+        decoder.script(sc.step, sc.step_cnt);
+        uint16_t capture[DccAdc::trip_capture_max];
+        bool captured = false;
+        end_us = start_us + uint64_t(sc.run_ms) * 1000;
+        while (Sim::now_us() < end_us) {
+            loop(command);
+            if (!captured && command.tripped()) {
+                adc.trip_capture(capture);
+                captured = true;
+            }
+        }
+
+        trip_cnt = command.trip_cnt() - trip_cnt;
+        retry_cnt = command.trip_retry_cnt() - retry_cnt;
+
+        char cut[16] = "-";
+        if (!pwr_off_us.empty())
+            snprintf(cut, sizeof(cut), "%llu",
+                     (unsigned long long)(pwr_off_us[0] - start_us));
+
+        printf("%-6s  %5u  %7u  %12s  %-8s ", sc.name, trip_cnt, retry_cnt,
+               cut, command.tripped() ? "no" : "yes");
+        for (size_t i = 0; i < pwr_off_us.size(); i++) {
+            if (i < pwr_on_us.size())
+                printf(" %llu", (unsigned long long)(pwr_on_us[i] - pwr_off_us[i]) / 1000);
+            else
+                printf(" (off)");
+        }
+        printf("\n");
+
+        if (captured) {
+            int over_cnt = 0;
+            for (int i = 0; i < DccAdc::trip_capture_max; i++)
+                if (capture[i] >= command.trip_ma())
+                    over_cnt++;
+            printf("        capture %u mA ... %u mA, %d of %d over\n",
+                   capture[0], capture[DccAdc::trip_capture_max - 1],
+                   over_cnt, DccAdc::trip_capture_max);
+        }
+
+        command.mode_off();
+        decoder.script(nullptr, 0);
+    }
+
+    command.delete_throttle(throttle);
+
+    return 0;
+}
+
+
+// Host time for DccAdc::short_ma() and long_ma(), after sampling for a while
+// in ops mode so the windows are full of the decoder's current (-b, -n).
+// Real time, not virtual, like run_throttle.
+// A few standard service mode reads of one value with the current trace on
+// (DccCommand::trace), read out every pass of the main loop as a host would.
+// Decodes the records and prints, for each tag, the samples and their
+// average and highest current, then the trace's size per sample and whether
+// it is complete: sample numbers only jump at a sync, and there are as many
+// samples as the time traced has.
+static int run_trace(DccCommand& command, DccAdc& adc)
+{
+    static const int reads = 4;
+    static const int cv_num = 8;
+    static const uint8_t cv_val = 0xa5;
+
+    std::vector<uint8_t> trace;
+    uint8_t buf[256];
+
+    decoder.cv(cv_num, cv_val);
+    command.trace(true);
+    uint64_t start_us = Sim::now_us();
+
+    for (int i = 0; i < reads; i++) {
+        command.mode_svc_read_cv(cv_num);
+        bool result;
+        while (!command.svc_done(result) || command.mode() != DccCommand::MODE_OFF) {
+            loop(command);
+            int len;
+            while ((len = command.trace_read(buf, sizeof(buf))) > 0)
+                trace.insert(trace.end(), buf, buf + len);
+        }
+    }
+
+    uint64_t end_us = Sim::now_us();
+    command.trace(false);
+
+    struct Tag {
+        uint32_t cnt;
+        uint64_t ma_sum;
+        uint16_t ma_max;
+    };
+    Tag tags[DccAdc::trace_tag_max + 1] = {};
+
+    uint32_t sample_cnt = 0;
+    uint32_t sync_cnt = 0;
+    uint32_t gap_cnt = 0;
+    uint32_t num = 0;
+    uint16_t raw = 0;
+    int tag = -1;
+
+    for (size_t i = 0; i < trace.size(); ) {
+        uint8_t b = trace[i++];
+        if ((b & 0xc0) == 0xc0) {
+            tag = b & 0x3f;
+            continue;
+        }
+        if ((b & 0xf0) == 0x90) {
+            uint32_t sync = 0;
+            for (int j = 0; j < 4; j++)
+                sync |= uint32_t(trace[i++]) << (8 * j);
+            if (sync_cnt > 0 && sync != num)
+                gap_cnt++;
+            num = sync;
+            sync_cnt++;
+            continue;
+        }
+        if ((b & 0x80) == 0)
+            raw += int8_t(b << 1) >> 1;
+        else
+            raw = ((b & 0x0f) << 8) | trace[i++];
+        xassert(tag >= 0);
+        uint16_t ma = adc.raw_to_ma(raw);
+        tags[tag].cnt++;
+        tags[tag].ma_sum += ma;
+        tags[tag].ma_max = std::max(tags[tag].ma_max, ma);
+        sample_cnt++;
+        num++;
+    }
+
+    printf("%d reads of cv%d = 0x%02x\n", reads, cv_num, cv_val);
+    printf("tag             samples  avg mA  max mA\n");
+    for (int t = 0; t <= DccAdc::trace_tag_max; t++) {
+        if (tags[t].cnt == 0)
+            continue;
+        char name[16];
+        if (t >= DccCommand::TRACE_VERIFY_BIT)
+            snprintf(name, sizeof(name), "verify b%d=%d",
+                     (t - DccCommand::TRACE_VERIFY_BIT) >> 1,
+                     (t - DccCommand::TRACE_VERIFY_BIT) & 1);
+        else if (t == DccCommand::TRACE_IDLE)
+            snprintf(name, sizeof(name), "idle");
+        else if (t == DccCommand::TRACE_RESET)
+            snprintf(name, sizeof(name), "reset");
+        else if (t == DccCommand::TRACE_OPS)
+            snprintf(name, sizeof(name), "ops");
+        else if (t == DccCommand::TRACE_VERIFY_CV)
+            snprintf(name, sizeof(name), "verify cv");
+        else
+            snprintf(name, sizeof(name), "tag %d", t);
+        printf("%-14s  %7u  %6.1f  %6u\n", name, tags[t].cnt,
+               double(tags[t].ma_sum) / tags[t].cnt, tags[t].ma_max);
+    }
+
+    printf("samples         %u in %.1f ms (%.1f per ms)\n", sample_cnt,
+           (end_us - start_us) / 1e3, sample_cnt * 1e3 / (end_us - start_us));
+    printf("bytes           %zu, %.2f per sample\n", trace.size(),
+           double(trace.size()) / sample_cnt);
+    printf("syncs           %u, %u gaps, %u lost\n", sync_cnt, gap_cnt,
+           command.trace_lost());
+
+    return 0;
+}
+
+
+// A sound decoder's volumes, in two pages of indexed cvs, written and read
+// back in service mode, then written in ops mode, three ways: writing cv31
+// and cv32 ahead of every cv (a service mode session for each cv), with the
+// page kept (one session of *_INDEXED operations) in the order given, and
+// with the page kept and the batch sorted by page. Prints the time, the cv
+// operations (page cvs included), and the packets for each.
+static int run_indexed(DccCommand& command)
+{
+    typedef DccCommand::SvcOp SvcOp;
+
+    struct Cv { uint8_t hi, lo; uint16_t cv_num; uint8_t val; };
+    static const Cv cvs[] = {
+        { 16, 1, DccCv::prime_vol, 192 },
+        { 16, 2, 260, 10 },
+        { 16, 1, DccCv::horn_vol, 128 },
+        { 16, 2, 300, 20 },
+        { 16, 1, DccCv::bell_vol, 60 },
+        { 16, 2, 262, 30 },
+        { 16, 1, DccCv::clank_vol, 40 },
+        { 16, 1, DccCv::squeal_vol, 50 },
+    };
+    static const int cv_cnt = sizeof(cvs) / sizeof(cvs[0]);
+    static_assert(cv_cnt <= DccCommand::svc_op_max);
+    static const char *how[] = { "every cv", "kept", "sorted" };
+
+    printf("                    ms  cv ops  packets  result\n");
+
+    for (int write = 1; write >= 0; write--) {
+
+        for (int h = 0; h < 3; h++) {
+
+            for (const Cv& c : cvs)
+                decoder.cv(c.hi, c.lo, c.cv_num, write ? 0 : c.val);
+            decoder.cv(DccCv::index_hi, 0);
+            decoder.cv(DccCv::index_lo, 0);
+
+            uint32_t pkt_start = pkt_cnt;
+            uint64_t start_us = Sim::now_us();
+            int ops = 0;
+            bool ok = true;
+            bool result;
+
+            SvcOp op[cv_cnt];
+            for (int i = 0; i < cv_cnt; i++)
+                op[i] = { write ? SvcOp::WRITE_INDEXED : SvcOp::READ_INDEXED, 0,
+                          cvs[i].cv_num, write ? cvs[i].val : uint8_t(0), -1,
+                          cvs[i].hi, cvs[i].lo };
+
+            if (h == 0) {
+                for (int i = 0; i < cv_cnt && ok; i++) {
+                    SvcOp one[3] = {
+                        { SvcOp::WRITE_CV, 0, DccCv::index_hi, op[i].index_hi, -1, 0, 0 },
+                        { SvcOp::WRITE_CV, 0, DccCv::index_lo, op[i].index_lo, -1, 0, 0 },
+                        { write ? SvcOp::WRITE_CV : SvcOp::READ_CV, 0,
+                          op[i].cv_num, op[i].val, -1, 0, 0 },
+                    };
+                    command.mode_svc_session(one, 3);
+                    while (!command.svc_session_done(result, one))
+                        loop(command);
+                    while (command.mode() != DccCommand::MODE_OFF)
+                        loop(command);
+                    ops += 3;
+                    ok = result;
+                    op[i].val = one[2].val;
+                }
+            } else {
+                if (h == 2)
+                    DccCv::sort_pages(op, cv_cnt);
+                command.mode_svc_session(op, cv_cnt);
+                while (!command.svc_session_done(result, op))
+                    loop(command);
+                while (command.mode() != DccCommand::MODE_OFF)
+                    loop(command);
+                ok = result;
+                // the page writes ahead of the operations
+                DccCv::Page page;
+                for (int i = 0; i < cv_cnt; i++) {
+                    ops += page.writes(op[i].index_hi, op[i].index_lo) + 1;
+                    page.hi = op[i].index_hi;
+                    page.lo = op[i].index_lo;
+                }
+            }
+
+            for (int i = 0; i < cv_cnt && ok; i++) {
+                uint8_t val = write ? decoder.cv(op[i].index_hi, op[i].index_lo, op[i].cv_num)
+                                    : op[i].val;
+                int j = 0;
+                while (cvs[j].cv_num != op[i].cv_num)
+                    j++;
+                ok = (val == cvs[j].val);
+            }
+
+            printf("%-5s %-8s %7.1f  %6d  %7u  %s\n", write ? "write" : "read",
+                   how[h], (Sim::now_us() - start_us) / 1e3, ops,
+                   pkt_cnt - pkt_start, ok ? "ok" : "failed");
+        }
+    }
+
+    // ops mode: one throttle, writes getting most of the track
+    command.write_share_pct(DccCommand::write_share_pct_max);
+    DccThrottle *t = command.create_throttle();
+    command.mode_ops();
+
+    printf("                    ms  cv ops  packets\n");
+
+    for (int h = 0; h < 3; h++) {
+
+        uint32_t queued_start = t->write_queued();
+        uint32_t pkt_start = pkt_cnt;
+        uint64_t start_us = Sim::now_us();
+        t->address(3); // forgets the page
+
+        DccThrottle::Indexed batch[cv_cnt];
+        for (int i = 0; i < cv_cnt; i++)
+            batch[i] = { cvs[i].hi, cvs[i].lo, cvs[i].cv_num, cvs[i].val };
+
+        int i = 0;
+        while (i < cv_cnt || t->write_pending() > 0) {
+            if (h == 0) {
+                if (i < cv_cnt && t->write_pending() + 3 <= DccThrottle::write_max) {
+                    t->write_cv(DccCv::index_hi, batch[i].index_hi);
+                    t->write_cv(DccCv::index_lo, batch[i].index_lo);
+                    t->write_cv(batch[i].cv_num, batch[i].cv_val);
+                    i++;
+                }
+            } else if (h == 1) {
+                if (i < cv_cnt && t->write_indexed(batch[i].index_hi, batch[i].index_lo,
+                                                   batch[i].cv_num, batch[i].cv_val))
+                    i++;
+            } else if (i < cv_cnt) {
+                i += t->write_indexed(batch + i, cv_cnt - i);
+            }
+            loop(command);
+        }
+
+        printf("pom   %-8s %7.1f  %6u  %7u\n", how[h],
+               (Sim::now_us() - start_us) / 1e3, t->write_queued() - queued_start,
+               pkt_cnt - pkt_start);
+    }
+
+    command.mode_off();
+    command.delete_throttle(t);
+
+    return 0;
+}
+
+
+// A loco's config (address, motor cvs, two indexed volumes) as one service
+// mode session: written back unchanged with svc_loco unknown, the way it was
+// before the cache, then with it known: read, read again (with
+// svc_read_cached), written back unchanged, and written with two values
+// changed. Then the config as it is now written in ops mode, all values the
+// cache got in service mode, and with one more changed. Prints the time, packets, and the
+// operations (or writes) done from the cache for each.
+static int run_cache(DccCommand& command)
+{
+    typedef DccCommand::SvcOp SvcOp;
+
+    static const SvcOp config[] = {
+        { SvcOp::WRITE_CV, 0, 2, 8, -1, 0, 0 },
+        { SvcOp::WRITE_CV, 0, DccCv::acceleration, 12, -1, 0, 0 },
+        { SvcOp::WRITE_CV, 0, DccCv::deceleration, 10, -1, 0, 0 },
+        { SvcOp::WRITE_CV, 0, 5, 200, -1, 0, 0 },
+        { SvcOp::WRITE_CV, 0, DccCv::address_hi, 0xc4, -1, 0, 0 },
+        { SvcOp::WRITE_CV, 0, DccCv::address_lo, 0xd2, -1, 0, 0 },
+        { SvcOp::WRITE_INDEXED, 0, DccCv::prime_vol, 192, -1, 16, 1 },
+        { SvcOp::WRITE_INDEXED, 0, DccCv::horn_vol, 128, -1, 16, 1 },
+    };
+    static const int op_cnt = sizeof(config) / sizeof(config[0]);
+    static_assert(op_cnt <= DccCommand::svc_op_max);
+    static const int loco = 1234;
+
+    struct Run { const char *name; bool write; int changed; bool known; };
+    static const Run runs[] = {
+        { "write same", true, 0, false },
+        { "read", false, 0, true },
+        { "read again", false, 0, true },
+        { "write same", true, 0, true },
+        { "write 2 new", true, 2, true },
+    };
+
+    for (const SvcOp& c : config) {
+        if (c.type == SvcOp::WRITE_INDEXED)
+            decoder.cv(c.index_hi, c.index_lo, c.cv_num, c.val);
+        else
+            decoder.cv(c.cv_num, c.val);
+    }
+    decoder.cv(DccCv::index_hi, 0);
+    decoder.cv(DccCv::index_lo, 0);
+
+    command.svc_read_cached(true);
+
+    printf("                     ms  packets  cached  result\n");
+
+    for (const Run& r : runs) {
+
+        command.svc_loco(r.known ? loco : DccPkt::address_inv);
+
+        SvcOp op[op_cnt];
+        for (int i = 0; i < op_cnt; i++) {
+            op[i] = config[i];
+            if (!r.write)
+                op[i].type = op[i].type == SvcOp::WRITE_CV ? SvcOp::READ_CV
+                                                           : SvcOp::READ_INDEXED;
+            else if (i < r.changed)
+                op[i].val++;
+        }
+
+        uint32_t pkt_start = pkt_cnt;
+        uint32_t cached_start = command.svc_cached_cnt();
+        uint64_t start_us = Sim::now_us();
+        bool result;
+
+        command.mode_svc_session(op, op_cnt);
+        while (!command.svc_session_done(result, op))
+            loop(command);
+        while (command.mode() != DccCommand::MODE_OFF)
+            loop(command);
+
+        bool ok = result;
+        for (int i = 0; i < op_cnt && ok; i++) {
+            uint8_t val = op[i].type == SvcOp::READ_INDEXED || op[i].type == SvcOp::WRITE_INDEXED
+                              ? decoder.cv(op[i].index_hi, op[i].index_lo, op[i].cv_num)
+                              : decoder.cv(op[i].cv_num);
+            ok = val == op[i].val;
+        }
+
+        printf("%-5s %-11s %7.1f  %7u  %6u  %s\n", r.known ? "svc" : "none", r.name,
+               (Sim::now_us() - start_us) / 1e3, pkt_cnt - pkt_start,
+               command.svc_cached_cnt() - cached_start, ok ? "ok" : "failed");
+    }
+
+    // ops mode: the loco's throttle, writes getting most of the track
+    command.write_share_pct(DccCommand::write_share_pct_max);
+    DccThrottle *t = command.create_throttle();
+    t->address(loco);
+    command.mode_ops();
+
+    for (int changed = 0; changed < 2; changed++) {
+
+        uint32_t queued_start = t->write_queued();
+        uint32_t skipped_start = t->write_skipped();
+        uint64_t start_us = Sim::now_us();
+
+        int i = 0;
+        while (i < op_cnt || t->write_pending() > 0) {
+            if (i < op_cnt) {
+                const SvcOp& c = config[i];
+                uint8_t val = c.val + (i < 2) + (i == 2 && changed);
+                if (c.type == SvcOp::WRITE_INDEXED ?
+                        t->write_indexed(c.index_hi, c.index_lo, c.cv_num, val) :
+                        t->write_cv(c.cv_num, val))
+                    i++;
+            }
+            loop(command);
+        }
+
+        // the last write's packets are still going out; count the writes
+        uint32_t skipped = t->write_skipped() - skipped_start;
+        printf("pom   %-11s %7.1f  %7s  %6u  %u sent\n",
+               changed ? "write 1 new" : "write same",
+               (Sim::now_us() - start_us) / 1e3, "-", skipped,
+               t->write_queued() - queued_start - skipped);
+    }
+
+    command.mode_off();
+    command.delete_throttle(t);
+
+    printf("cache: %d of %d blocks, %zu bytes\n", command.cv_cache().block_cnt(),
+           DccCvCache::block_max, sizeof(DccCvCache));
+
+    return 0;
+}
+
+
+// Standard service mode reads of random values, with the driver's switching
+// spikes at a few sizes, the adc free-running and synced. Prints ms per cv,
+// how many came back right, the baseline and its noise as the ack detection
+// saw them, groups decided wrong, and the ack detection latency from when
+// the decoder's ack pulse started.
+static int run_sync(DccCommand& command, DccAdc& adc)
+{
+    static const int reads = 16;
+    static const int cv_num = 8;
+    static const uint16_t spike_ma[] = { 0, 100, 200, 400 };
+
+    printf("                                 base   noise  wrong  from ack us\n");
+    printf("spike mA  adc     ms/cv  right     mA      mA  groups   avg  max\n");
+
+    for (uint16_t spike : spike_ma) {
+
+        decoder.spikes(spike);
+
+        for (int sync = 0; sync < 2; sync++) {
+
+            command.adc_sync(sync ? sync_slice : -1);
+
+            uint64_t start_us = Sim::now_us();
+            uint32_t rand = 1;
+            int right = 0;
+            int groups = 0;
+            int wrong_groups = 0;
+            uint32_t base_sum = 0;
+            uint32_t noise_sum = 0;
+            uint32_t ack_time_us = adc.ack_time_us();
+            uint64_t from_sum_us = 0;
+            uint32_t from_max_us = 0;
+            uint32_t from_cnt = 0;
+
+            for (int i = 0; i < reads; i++) {
+                rand = rand * 1664525 + 1013904223;
+                uint8_t val = rand >> 24;
+                decoder.cv(cv_num, val);
+                command.mode_svc_read_cv(cv_num);
+                bool result;
+                uint8_t value = 0;
+                while (!command.svc_done(result, value) ||
+                       command.mode() != DccCommand::MODE_OFF) {
+                    loop(command);
+                    if (adc.ack_time_us() != ack_time_us) {
+                        ack_time_us = adc.ack_time_us();
+                        uint32_t us = ack_time_us - uint32_t(decoder.ack_start_us());
+                        from_sum_us += us;
+                        from_max_us = std::max(from_max_us, us);
+                        from_cnt++;
+                    }
+                }
+                if (result && value == val)
+                    right++;
+
+                for (int g = 0; g < command.svc_ack_cnt(); g++) {
+                    const DccCommand::SvcAck& a = command.svc_ack(g);
+                    if (a.bit < 8 && a.ack != (((val >> a.bit) & 1) != 0))
+                        wrong_groups++;
+                    base_sum += a.base_ma;
+                    noise_sum += a.noise_ma;
+                    groups++;
+                }
+            }
+
+            printf("%8u  %-6s %6.1f  %2d/%-2d  %5.1f  %6.1f  %6d  %4u %4u\n",
+                   spike, sync ? "synced" : "free",
+                   (Sim::now_us() - start_us) / 1e3 / reads, right, reads,
+                   double(base_sum) / groups, double(noise_sum) / groups,
+                   wrong_groups,
+                   from_cnt > 0 ? uint32_t(from_sum_us / from_cnt) : 0,
+                   from_max_us);
+        }
+    }
+
+    DccBitstreamStats stats;
+    command.stats(stats);
+    printf("sync late       %u\n", stats.sync_late_cnt);
+
+    return 0;
+}
+
+
+static int run_adc(DccCommand& command, DccAdc& adc)
+{
+    static const int calls = 10000000;
+
+    command.mode_ops();
+    uint64_t end_us = Sim::now_us() + 100000;
+    while (Sim::now_us() < end_us)
+        loop(command);
+
+    uint32_t sum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < calls; i++)
+        sum += adc.short_ma();
+    auto mid = std::chrono::steady_clock::now();
+    for (int i = 0; i < calls; i++)
+        sum += adc.long_ma();
+    auto end = std::chrono::steady_clock::now();
+
+    double short_ns = std::chrono::duration<double, std::nano>(mid - start).count();
+    double long_ns = std::chrono::duration<double, std::nano>(end - mid).count();
+
+    printf("sizeof(DccAdc)  %zu bytes\n", sizeof(DccAdc));
+    printf("short_ma        %.1f ns (%u mA)\n", short_ns / calls, adc.short_ma());
+    printf("long_ma         %.1f ns (%u mA, sum %u)\n", long_ns / calls,
+           adc.long_ma(), sum);
+
+    command.mode_off();
+
+    return 0;
+}
+
+
+static int run_svc(DccCommand& command, const char *what, bool read)
+{
+    uint64_t start_us = Sim::now_us();
+
+    bool result = false;
+    uint8_t value = 0;
+
+    while (!(read ? command.svc_done(result, value) : command.svc_done(result)))
+        loop(command);
+
+    double ms = (Sim::now_us() - start_us) / 1e3;
+
+    if (read && result)
+        printf("%s = %u (0x%02x)\n", what, uint(value), uint(value));
+    else
+        printf("%s %s\n", what,
+               result ? "ok" : command.svc_no_load() ? "failed, no load" : "failed");
+
+    printf("time            %.1f ms\n", ms);
+    printf("packets         %u (%u resets)\n", pkt_cnt, reset_cnt);
+    printf("acks            %d\n", decoder.ack_cnt());
+    printf("adc overruns    %u\n", Sim::adc_overrun_cnt());
+
+    return result ? 0 : 2;
+}
+
+
+static uint64_t timeline_us = 0;
+
+static void timeline_edge(uint64_t edge_us, int level)
+{
+    // print the half-bit that just ended
+    if (timeline_us != 0)
+        printf("%10llu %4d %d\n", (unsigned long long)timeline_us,
+               int(edge_us - timeline_us), 1 - level);
+    timeline_us = edge_us;
+    decoder.edge(edge_us, level);
+}
+
+
+static int run_timeline(DccCommand& command, int msec, bool svc)
+{
+    Sim::on_edge(timeline_edge);
+
+    printf("     start half level\n");
+
+    DccThrottle *throttle = nullptr;
+
+    if (svc) {
+        command.mode_svc_read_cv(1);
+    } else {
+        throttle = command.create_throttle();
+        command.mode_ops();
+    }
+
+    uint64_t start_us = Sim::now_us();
+
+    while (Sim::now_us() < start_us + uint64_t(msec) * 1000)
+        loop(command);
+
+    command.mode_off();
+
+    if (throttle != nullptr)
+        command.delete_throttle(throttle);
+
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int cv_val = 0;
+    int ack_ma = 100;
+    int ack_delay_us = 0;
+    bool read_fast = false;
+    bool adc_sync = false;
+
+    int arg = 1;
+    while (arg < argc && argv[arg][0] == '-') {
+        char opt = argv[arg][1];
+        if (opt == 'q') {
+            decoder.present(false);
+            arg++;
+            continue;
+        }
+        if (opt == 'f') {
+            read_fast = true;
+            arg++;
+            continue;
+        }
+        if (opt == 'y') {
+            adc_sync = true;
+            arg++;
+            continue;
+        }
+        if (arg + 1 >= argc)
+            return usage();
+        int val = atoi(argv[arg + 1]);
+        if (opt == 'l')
+            loop_us = val;
+        else if (opt == 's')
+            stall_us = val;
+        else if (opt == 'b')
+            decoder.load(val, 0);
+        else if (opt == 'n')
+            decoder.load(decoder.current_ma(0), val);
+        else if (opt == 'p')
+            decoder.bursts(val);
+        else if (opt == 'a')
+            ack_ma = val;
+        else if (opt == 'd')
+            ack_delay_us = val;
+        else if (opt == 'v')
+            cv_val = val;
+        else if (opt == 'e')
+            decoder.spikes(val);
+        else
+            return usage();
+        arg += 2;
+    }
+
+    if (arg >= argc)
+        return usage();
+
+    decoder.ack(ack_ma, 6000, ack_delay_us);
+
+    for (int cv_num = DccPkt::cv_num_min; cv_num <= DccPkt::cv_num_max; cv_num++)
+        decoder.cv(cv_num, cv_val);
+
+    Sim::on_edge(edge);
+    Sim::on_current(current);
+    decoder.on_pkt(pkt);
+
+    static DccAdc adc(adc_gpio);
+    static DccCommand command(sig_gpio, pwr_gpio, adc);
+    command.svc_read_fast(read_fast);
+    if (adc_sync)
+        command.adc_sync(sync_slice);
+
+    const char *cmd = argv[arg++];
+    int params = argc - arg;
+    char what[32];
+
+    if (strcmp(cmd, "ops") == 0) {
+        int throttles = params > 0 ? atoi(argv[arg]) : 1;
+        int msec = params > 1 ? atoi(argv[arg + 1]) : 1000;
+        return run_ops(command, throttles, msec);
+    } else if (strcmp(cmd, "read") == 0 && params == 1) {
+        int cv_num = atoi(argv[arg]);
+        snprintf(what, sizeof(what), "read cv%d", cv_num);
+        command.mode_svc_read_cv(cv_num);
+        return run_svc(command, what, true);
+    } else if (strcmp(cmd, "write") == 0 && params == 2) {
+        int cv_num = atoi(argv[arg]);
+        snprintf(what, sizeof(what), "write cv%d", cv_num);
+        command.mode_svc_write_cv(cv_num, atoi(argv[arg + 1]));
+        return run_svc(command, what, false);
+    } else if (strcmp(cmd, "throttle") == 0) {
+        return run_throttle();
+    } else if (strcmp(cmd, "queue") == 0) {
+        return run_queue(params > 0 ? atoi(argv[arg]) : 100000);
+    } else if (strcmp(cmd, "pio") == 0) {
+        return run_pio();
+    } else if (strcmp(cmd, "bits") == 0) {
+        return run_bits();
+    } else if (strcmp(cmd, "changes") == 0) {
+        return run_changes();
+    } else if (strcmp(cmd, "core1") == 0) {
+        return run_core1(command, params > 0 ? atoi(argv[arg]) : 100);
+    } else if (strcmp(cmd, "adc") == 0) {
+        return run_adc(command, adc);
+    } else if (strcmp(cmd, "noise") == 0) {
+        return run_noise(command);
+    } else if (strcmp(cmd, "trip") == 0) {
+        return run_trip(command, adc);
+    } else if (strcmp(cmd, "trace") == 0) {
+        return run_trace(command, adc);
+    } else if (strcmp(cmd, "sync") == 0) {
+        return run_sync(command, adc);
+    } else if (strcmp(cmd, "refresh") == 0) {
+        int throttles = params > 0 ? atoi(argv[arg]) : 100;
+        int running = params > 1 ? atoi(argv[arg + 1]) : 10;
+        return run_refresh(command, throttles, running);
+    } else if (strcmp(cmd, "admit") == 0 && params == 1) {
+        return run_admit(command, atoi(argv[arg]));
+    } else if (strcmp(cmd, "pom") == 0) {
+        int writes = params > 0 ? atoi(argv[arg]) : 64;
+        int throttles = params > 1 ? atoi(argv[arg + 1]) : 20;
+        return run_pom(command, writes, throttles);
+    } else if (strcmp(cmd, "fastread") == 0) {
+        return run_fastread(command);
+    } else if (strcmp(cmd, "ack") == 0) {
+        return run_ack(command, adc);
+    } else if (strcmp(cmd, "indexed") == 0) {
+        return run_indexed(command);
+    } else if (strcmp(cmd, "cache") == 0) {
+        return run_cache(command);
+    } else if (strcmp(cmd, "session") == 0) {
+        return run_session(command);
+    } else if (strcmp(cmd, "latency") == 0) {
+        return run_latency(command, params > 0 ? atoi(argv[arg]) : 100);
+    } else if (strcmp(cmd, "timeline") == 0 && params >= 1) {
+        bool svc = params > 1 && strcmp(argv[arg + 1], "svc") == 0;
+        return run_timeline(command, atoi(argv[arg]), svc);
+    }
+
+    return usage();
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Simulated ADC: free-running conversions at 48 MHz / (div + 1) into a
+// 4-deep fifo, or one conversion (96 cycles) each time cs is written with
+// ADC_CS_START_ONCE_BITS set. Samples come from the current profile in sim.h.
+// With dreq enabled, a dma channel reading adc_hw->fifo takes each one as
+// soon as the fifo reaches the threshold (see dma.h).
+
+#define ADC_CS_EN_BITS 0x00000001
+#define ADC_CS_START_ONCE_BITS 0x00000004
+
+struct adc_hw_t
+{
+    uint32_t cs;   // dma writes of it start a conversion (START_ONCE)
+    uint32_t fifo; // dma reads of it pop the fifo
+};
+
+extern adc_hw_t *adc_hw;
+
+void adc_init();
+void adc_gpio_init(uint gpio);
+void adc_select_input(uint input);
+void adc_fifo_setup(bool en, bool dreq_en, uint16_t dreq_thresh,
+                    bool err_in_fifo, bool byte_shift);
+void adc_set_clkdiv(float div);
+void adc_run(bool run);
+bool adc_fifo_is_empty();
+uint8_t adc_fifo_get_level();
+uint16_t adc_fifo_get();
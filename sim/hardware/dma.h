@@ -0,0 +1,70 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Simulated DMA, enough for DccAdc's sample ring. A channel paced by
+// DREQ_ADC moves a sample each time the adc fifo has one (adc_fifo_setup's
+// dreq); one paced by a pwm slice's wrap (pwm_get_dreq) moves one word each
+// time the slice wraps; one with DREQ_FORCE does its whole transfer as soon
+// as it is triggered. A channel writing another's al1_transfer_count_trig triggers
+// it, and chaining, the write ring, and the irq 1 line work as on the
+// rp2040, except that a channel's irq is dropped (not left pending) if the
+// irq is disabled. Register fields are pointer sized so host addresses fit.
+
+#define NUM_DMA_CHANNELS 12
+
+#define DREQ_PWM_WRAP0 24
+#define DREQ_ADC 36
+#define DREQ_FORCE 63
+
+enum dma_channel_transfer_size { DMA_SIZE_8 = 0, DMA_SIZE_16 = 1, DMA_SIZE_32 = 2 };
+
+struct dma_channel_config
+{
+    dma_channel_transfer_size size;
+    bool read_inc;
+    bool write_inc;
+    uint ring_bits;     // 0 for no ring
+    bool ring_write;
+    uint dreq;
+    uint chain_to;      // itself for no chaining
+};
+
+struct dma_channel_hw_t
+{
+    uintptr_t read_addr;
+    uintptr_t write_addr;
+    uint32_t transfer_count;            // left in the transfer going
+    uint32_t al1_transfer_count_trig;   // only written by other channels
+};
+
+struct dma_hw_t
+{
+    dma_channel_hw_t ch[NUM_DMA_CHANNELS];
+};
+
+extern dma_hw_t *dma_hw;
+
+inline dma_channel_hw_t *dma_channel_hw_addr(uint ch) { return &dma_hw->ch[ch]; }
+
+int dma_claim_unused_channel(bool required);
+void dma_channel_unclaim(uint ch);
+
+dma_channel_config dma_channel_get_default_config(uint ch);
+void channel_config_set_transfer_data_size(dma_channel_config *c,
+                                           dma_channel_transfer_size size);
+void channel_config_set_read_increment(dma_channel_config *c, bool inc);
+void channel_config_set_write_increment(dma_channel_config *c, bool inc);
+void channel_config_set_ring(dma_channel_config *c, bool write, uint size_bits);
+void channel_config_set_dreq(dma_channel_config *c, uint dreq);
+void channel_config_set_chain_to(dma_channel_config *c, uint chain_to);
+
+void dma_channel_configure(uint ch, const dma_channel_config *c,
+                           volatile void *write_addr,
+                           const volatile void *read_addr,
+                           uint transfer_count, bool trigger);
+void dma_channel_start(uint ch);
+void dma_channel_abort(uint ch);
+
+void dma_channel_set_irq1_enabled(uint ch, bool enabled);
+void dma_channel_acknowledge_irq1(uint ch);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Only the dma irq 1 (DccAdc's sample ring) is handled here; the pwm wrap
+// irq is in pwm.h.
+
+#define DMA_IRQ_0 11
+#define DMA_IRQ_1 12
+
+typedef void (*irq_handler_t)(void);
+
+void irq_set_enabled(uint num, bool enabled);
+void irq_set_exclusive_handler(uint num, irq_handler_t handler);
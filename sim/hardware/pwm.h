@@ -0,0 +1,32 @@
+#pragma once
+
+#include <Arduino.h>
+
+// One simulated slice per gpio pair, like the RP2040: slice = (gpio / 2) % 8,
+// channel = gpio % 2. TOP and CC are double-buffered while the slice is
+// running, and take effect at the next wrap, when the wrap irq fires (and
+// the wrap dreq, see dma.h). The counter can be read and set while it runs.
+
+struct pwm_config
+{
+    uint32_t div;
+};
+
+uint pwm_gpio_to_slice_num(uint gpio);
+uint pwm_gpio_to_channel(uint gpio);
+
+pwm_config pwm_get_default_config();
+void pwm_config_set_clkdiv_int(pwm_config *c, uint div);
+void pwm_init(uint slice, pwm_config *c, bool start);
+
+void pwm_set_enabled(uint slice, bool enabled);
+void pwm_set_wrap(uint slice, uint16_t wrap);
+void pwm_set_chan_level(uint slice, uint chan, uint16_t level);
+
+uint16_t pwm_get_counter(uint slice);
+void pwm_set_counter(uint slice, uint16_t c);
+
+uint pwm_get_dreq(uint slice);
+
+void pwm_clear_irq(uint slice);
+void pwm_set_irq_enabled(uint slice, bool enabled);
@@ -0,0 +1,5 @@
+#pragma once
+
+#include <Arduino.h>
+
+void pwm_irq_mux_connect(uint slice, void (*handler)(void *), void *arg);
@@ -0,0 +1,808 @@
+#include <Arduino.h>
+#include "hardware/adc.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/pwm.h"
+#include "pwm_irq_mux.h"
+#include "xassert.h"
+#include "sim.h"
+
+
+// Time is kept in nsec so the adc conversion period (48 MHz / 4800 = 100
+// usec, but not always a whole number of usec) doesn't drift.
+
+static uint64_t now_ns = 0;
+
+static const uint32_t sys_hz = 200000000;
+
+Stream Serial;
+
+RP2040 rp2040;
+
+static Sim::edge_func *edge_cb = nullptr;
+static Sim::current_func *current_cb = nullptr;
+static Sim::preempt_func *preempt_cb = nullptr;
+
+static uint32_t irq_cnt = 0;
+
+static void dma_dreq(uint dreq);
+
+//----------------------------------------------------------------------------
+
+int Stream::printf(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int n = vprintf(fmt, args);
+    va_end(args);
+    return n;
+}
+
+
+uint32_t millis()
+{
+    return uint32_t(now_ns / 1000000);
+}
+
+
+uint32_t micros()
+{
+    return uint32_t(now_ns / 1000);
+}
+
+
+uint64_t time_us_64()
+{
+    return now_ns / 1000;
+}
+
+
+uint32_t RP2040::getCycleCount()
+{
+    return uint32_t(now_ns * (sys_hz / 1000000) / 1000);
+}
+
+
+uint32_t clock_get_hz(clock_index)
+{
+    return sys_hz;
+}
+
+//----------------------------------------------------------------------------
+
+static const int gpio_max = 32;
+static bool gpio_out[gpio_max];
+static int pwm_gpio = -1; // gpio with GPIO_FUNC_PWM (dcc signal)
+
+
+void gpio_init(uint gpio)
+{
+    xassert(gpio < gpio_max);
+    gpio_out[gpio] = false;
+}
+
+
+void gpio_set_dir(uint, bool)
+{
+}
+
+
+void gpio_put(uint gpio, bool value)
+{
+    xassert(gpio < gpio_max);
+    gpio_out[gpio] = value;
+}
+
+
+bool gpio_get(uint gpio)
+{
+    xassert(gpio < gpio_max);
+    return gpio_out[gpio];
+}
+
+
+void gpio_set_function(uint gpio, int fn)
+{
+    xassert(gpio < gpio_max);
+    if (fn == GPIO_FUNC_PWM)
+        pwm_gpio = gpio;
+}
+
+
+static const int irq_max = 32;
+static bool irq_enabled[irq_max];
+static irq_handler_t irq_handler[irq_max];
+
+
+void irq_set_enabled(uint num, bool enabled)
+{
+    xassert(num < irq_max);
+    irq_enabled[num] = enabled;
+}
+
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler)
+{
+    xassert(num < irq_max && irq_handler[num] == nullptr);
+    irq_handler[num] = handler;
+}
+
+//----------------------------------------------------------------------------
+
+static const int slice_max = 8;
+
+struct Slice
+{
+    bool enabled;
+    uint32_t div;
+    uint16_t top;           // as written
+    uint16_t cc[2];         // as written
+    uint16_t top_cur;       // in use this period
+    uint16_t cc_cur[2];     // in use this period
+    uint16_t ctr;           // as set while stopped
+    uint64_t start_ns;      // when the counter was (would have been) 0
+    uint64_t wrap_ns;       // end of this period
+    bool irq_enabled;
+    bool irq_pending;
+    void (*handler)(void *);
+    void *arg;
+};
+
+static Slice slices[slice_max];
+
+static int out_level = 0; // dcc signal level
+
+
+uint pwm_gpio_to_slice_num(uint gpio)
+{
+    return (gpio >> 1) % slice_max;
+}
+
+
+uint pwm_gpio_to_channel(uint gpio)
+{
+    return gpio & 1;
+}
+
+
+pwm_config pwm_get_default_config()
+{
+    return pwm_config { 1 };
+}
+
+
+void pwm_config_set_clkdiv_int(pwm_config *c, uint div)
+{
+    c->div = div;
+}
+
+
+static void edge(uint64_t edge_ns, int level)
+{
+    if (level == out_level)
+        return;
+    out_level = level;
+    if (edge_cb != nullptr)
+        (*edge_cb)(edge_ns / 1000, level);
+}
+
+
+static uint64_t counts_ns(const Slice& s, uint32_t counts)
+{
+    return uint64_t(counts) * s.div * 1000000000 / sys_hz;
+}
+
+
+// start a pwm period at now_ns using the latched top and cc
+static void period_start(uint slice)
+{
+    Slice& s = slices[slice];
+
+    s.start_ns = now_ns;
+    s.wrap_ns = now_ns + counts_ns(s, s.top_cur + 1);
+
+    if (pwm_gpio >= 0 && pwm_gpio_to_slice_num(pwm_gpio) == slice) {
+        // output is high for count=[0...level-1], low for [level...top]
+        uint16_t level = s.cc_cur[pwm_gpio_to_channel(pwm_gpio)];
+        if (level > 0)
+            edge(now_ns, 1);
+        if (level <= s.top_cur) {
+            uint64_t fall_ns = now_ns + counts_ns(s, level);
+            edge(fall_ns, 0);
+        }
+    }
+}
+
+
+static void pwm_irq(uint slice)
+{
+    Slice& s = slices[slice];
+
+    if (!s.irq_enabled) {
+        s.irq_pending = true;
+        return;
+    }
+
+    s.irq_pending = false;
+    if (s.handler != nullptr) {
+        irq_cnt++;
+        (*s.handler)(s.arg);
+    }
+}
+
+
+static void pwm_wrap(uint slice)
+{
+    Slice& s = slices[slice];
+
+    // double-buffered values take effect at the wrap
+    s.top_cur = s.top;
+    s.cc_cur[0] = s.cc[0];
+    s.cc_cur[1] = s.cc[1];
+
+    period_start(slice);
+
+    pwm_irq(slice);
+
+    dma_dreq(pwm_get_dreq(slice));
+}
+
+
+void pwm_init(uint slice, pwm_config *c, bool start)
+{
+    xassert(slice < slice_max);
+    Slice& s = slices[slice];
+    s.div = c->div;
+    s.top = s.top_cur = 0xffff;
+    s.cc[0] = s.cc[1] = s.cc_cur[0] = s.cc_cur[1] = 0;
+    s.irq_pending = false;
+    s.enabled = false;
+    s.ctr = 0;
+    pwm_set_enabled(slice, start);
+}
+
+
+void pwm_set_enabled(uint slice, bool enabled)
+{
+    xassert(slice < slice_max);
+    Slice& s = slices[slice];
+    if (enabled && !s.enabled) {
+        s.enabled = true;
+        period_start(slice);
+        if (s.ctr != 0)
+            pwm_set_counter(slice, s.ctr);
+    } else {
+        s.enabled = enabled;
+    }
+}
+
+
+void pwm_set_wrap(uint slice, uint16_t wrap)
+{
+    xassert(slice < slice_max);
+    Slice& s = slices[slice];
+    s.top = wrap;
+    if (!s.enabled)
+        s.top_cur = wrap; // not double-buffered when stopped
+}
+
+
+void pwm_set_chan_level(uint slice, uint chan, uint16_t level)
+{
+    xassert(slice < slice_max && chan < 2);
+    Slice& s = slices[slice];
+    s.cc[chan] = level;
+    if (!s.enabled)
+        s.cc_cur[chan] = level; // not double-buffered when stopped
+}
+
+
+// Not for the dcc signal's slice: its edges this period are already out.
+void pwm_set_counter(uint slice, uint16_t c)
+{
+    xassert(slice < slice_max);
+    Slice& s = slices[slice];
+    if (!s.enabled) {
+        s.ctr = c;
+        return;
+    }
+    xassert(c <= s.top_cur);
+    s.start_ns = now_ns - counts_ns(s, c);
+    s.wrap_ns = s.start_ns + counts_ns(s, s.top_cur + 1);
+}
+
+
+uint16_t pwm_get_counter(uint slice)
+{
+    xassert(slice < slice_max);
+    const Slice& s = slices[slice];
+    if (!s.enabled)
+        return s.ctr;
+    return (now_ns - s.start_ns) * sys_hz / (uint64_t(s.div) * 1000000000);
+}
+
+
+uint pwm_get_dreq(uint slice)
+{
+    xassert(slice < slice_max);
+    return DREQ_PWM_WRAP0 + slice;
+}
+
+
+void pwm_clear_irq(uint slice)
+{
+    xassert(slice < slice_max);
+    slices[slice].irq_pending = false;
+}
+
+
+void pwm_set_irq_enabled(uint slice, bool enabled)
+{
+    xassert(slice < slice_max);
+    Slice& s = slices[slice];
+    s.irq_enabled = enabled;
+    if (enabled && s.irq_pending)
+        pwm_irq(slice); // fires as soon as it is unmasked
+}
+
+
+void pwm_irq_mux_connect(uint slice, void (*handler)(void *), void *arg)
+{
+    xassert(slice < slice_max);
+    slices[slice].handler = handler;
+    slices[slice].arg = arg;
+}
+
+//----------------------------------------------------------------------------
+
+static const uint32_t adc_hz = 48000000;
+static const int adc_fifo_max = 4;
+
+static const uint64_t adc_conv_ns = 2000; // 96 cycles
+
+static bool adc_running = false;
+static uint64_t adc_period_ns = adc_conv_ns; // div = 0
+static uint64_t adc_next_ns = 0;
+static uint64_t adc_once_ns = UINT64_MAX; // START_ONCE conversion done
+static uint16_t adc_fifo[adc_fifo_max];
+static int adc_fifo_cnt = 0;
+static bool adc_dreq_en = false;
+static int adc_dreq_thresh = 0;
+static uint32_t adc_overruns = 0;
+
+static adc_hw_t adc_regs;
+adc_hw_t *adc_hw = &adc_regs;
+
+
+void adc_init()
+{
+    adc_running = false;
+    adc_once_ns = UINT64_MAX;
+    adc_fifo_cnt = 0;
+    adc_regs.cs = ADC_CS_EN_BITS;
+}
+
+
+void adc_gpio_init(uint)
+{
+}
+
+
+void adc_select_input(uint)
+{
+}
+
+
+void adc_fifo_setup(bool, bool dreq_en, uint16_t dreq_thresh, bool, bool)
+{
+    adc_dreq_en = dreq_en;
+    adc_dreq_thresh = dreq_thresh;
+}
+
+
+void adc_set_clkdiv(float div)
+{
+    // conversion every (1 + div) adc clocks, minimum 96
+    float cycles = 1.0f + div;
+    if (cycles < 96.0f)
+        cycles = 96.0f;
+    adc_period_ns = uint64_t(cycles * 1e9f / adc_hz + 0.5f);
+}
+
+
+void adc_run(bool run)
+{
+    if (run && !adc_running)
+        adc_next_ns = now_ns + adc_period_ns;
+    adc_running = run;
+}
+
+
+bool adc_fifo_is_empty()
+{
+    return adc_fifo_cnt == 0;
+}
+
+
+uint8_t adc_fifo_get_level()
+{
+    return adc_fifo_cnt;
+}
+
+
+uint16_t adc_fifo_get()
+{
+    if (adc_fifo_cnt == 0)
+        return 0;
+    uint16_t v = adc_fifo[0];
+    adc_fifo_cnt--;
+    memmove(adc_fifo, adc_fifo + 1, adc_fifo_cnt * sizeof(adc_fifo[0]));
+    return v;
+}
+
+
+static void adc_sample()
+{
+    uint16_t ma = 0;
+    if (current_cb != nullptr)
+        ma = (*current_cb)(now_ns / 1000);
+
+    if (adc_fifo_cnt < adc_fifo_max)
+        adc_fifo[adc_fifo_cnt++] = Sim::ma_to_raw(ma);
+    else
+        adc_overruns++;
+
+    dma_dreq(DREQ_ADC);
+}
+
+
+// written by dma; a start while converting is ignored
+static void adc_cs_write(uint32_t cs)
+{
+    adc_regs.cs = cs & ~ADC_CS_START_ONCE_BITS;
+    if ((cs & ADC_CS_START_ONCE_BITS) && !adc_running && adc_once_ns == UINT64_MAX)
+        adc_once_ns = now_ns + adc_conv_ns;
+}
+
+
+static bool adc_dreq()
+{
+    return adc_dreq_en && adc_fifo_cnt > 0 && adc_fifo_cnt >= adc_dreq_thresh;
+}
+
+//----------------------------------------------------------------------------
+
+struct DmaCh
+{
+    bool claimed;
+    bool busy;
+    dma_channel_config cfg;
+    uint32_t count;     // transfer count reloaded on each trigger
+    bool irq1_enabled;
+};
+
+static DmaCh dma_ch[NUM_DMA_CHANNELS];
+
+static dma_hw_t dma_regs;
+dma_hw_t *dma_hw = &dma_regs;
+
+
+int dma_claim_unused_channel(bool required)
+{
+    for (int ch = 0; ch < NUM_DMA_CHANNELS; ch++) {
+        if (!dma_ch[ch].claimed) {
+            dma_ch[ch].claimed = true;
+            return ch;
+        }
+    }
+    xassert(!required);
+    return -1;
+}
+
+
+void dma_channel_unclaim(uint ch)
+{
+    xassert(ch < NUM_DMA_CHANNELS);
+    dma_ch[ch].claimed = false;
+}
+
+
+dma_channel_config dma_channel_get_default_config(uint ch)
+{
+    return dma_channel_config { DMA_SIZE_32, true, false, 0, false, DREQ_FORCE, ch };
+}
+
+
+void channel_config_set_transfer_data_size(dma_channel_config *c,
+                                           dma_channel_transfer_size size)
+{
+    c->size = size;
+}
+
+
+void channel_config_set_read_increment(dma_channel_config *c, bool inc)
+{
+    c->read_inc = inc;
+}
+
+
+void channel_config_set_write_increment(dma_channel_config *c, bool inc)
+{
+    c->write_inc = inc;
+}
+
+
+void channel_config_set_ring(dma_channel_config *c, bool write, uint size_bits)
+{
+    c->ring_write = write;
+    c->ring_bits = size_bits;
+}
+
+
+void channel_config_set_dreq(dma_channel_config *c, uint dreq)
+{
+    c->dreq = dreq;
+}
+
+
+void channel_config_set_chain_to(dma_channel_config *c, uint chain_to)
+{
+    c->chain_to = chain_to;
+}
+
+
+static void dma_trigger(uint ch);
+
+
+// one transfer on a busy channel
+static void dma_transfer(uint ch)
+{
+    DmaCh& d = dma_ch[ch];
+    dma_channel_hw_t& hw = dma_regs.ch[ch];
+    uint32_t size = 1u << d.cfg.size;
+
+    uint32_t val;
+    if (hw.read_addr == uintptr_t(&adc_regs.fifo))
+        val = adc_fifo_get();
+    else if (size == 1)
+        val = *(const uint8_t *)hw.read_addr;
+    else if (size == 2)
+        val = *(const uint16_t *)hw.read_addr;
+    else
+        val = *(const uint32_t *)hw.read_addr;
+
+    int trig = -1;
+    for (int i = 0; i < NUM_DMA_CHANNELS; i++)
+        if (hw.write_addr == uintptr_t(&dma_regs.ch[i].al1_transfer_count_trig))
+            trig = i;
+
+    if (trig >= 0)
+        dma_ch[trig].count = val;
+    else if (hw.write_addr == uintptr_t(&adc_regs.cs))
+        adc_cs_write(val);
+    else if (size == 1)
+        *(uint8_t *)hw.write_addr = val;
+    else if (size == 2)
+        *(uint16_t *)hw.write_addr = val;
+    else
+        *(uint32_t *)hw.write_addr = val;
+
+    uintptr_t mask = (uintptr_t(1) << d.cfg.ring_bits) - 1;
+    if (d.cfg.read_inc) {
+        uintptr_t next = hw.read_addr + size;
+        if (d.cfg.ring_bits > 0 && !d.cfg.ring_write)
+            next = (hw.read_addr & ~mask) | (next & mask);
+        hw.read_addr = next;
+    }
+    if (d.cfg.write_inc) {
+        uintptr_t next = hw.write_addr + size;
+        if (d.cfg.ring_bits > 0 && d.cfg.ring_write)
+            next = (hw.write_addr & ~mask) | (next & mask);
+        hw.write_addr = next;
+    }
+
+    if (trig >= 0)
+        dma_trigger(trig);
+
+    if (--hw.transfer_count > 0)
+        return;
+
+    // done: chain, then the irq
+    d.busy = false;
+    if (d.cfg.chain_to != ch)
+        dma_trigger(d.cfg.chain_to);
+    if (d.irq1_enabled && irq_enabled[DMA_IRQ_1] && irq_handler[DMA_IRQ_1] != nullptr)
+        (*irq_handler[DMA_IRQ_1])();
+}
+
+
+static void dma_trigger(uint ch)
+{
+    xassert(ch < NUM_DMA_CHANNELS);
+    DmaCh& d = dma_ch[ch];
+    d.busy = true;
+    dma_regs.ch[ch].transfer_count = d.count;
+    if (d.count == 0) {
+        d.busy = false;
+        return;
+    }
+    if (d.cfg.dreq == DREQ_FORCE)
+        while (d.busy)
+            dma_transfer(ch);
+    else if (d.cfg.dreq == DREQ_ADC)
+        while (d.busy && adc_dreq())
+            dma_transfer(ch);
+}
+
+
+// a dreq has come up; busy channels paced by it take what they can, which
+// for a pwm wrap is one transfer
+static void dma_dreq(uint dreq)
+{
+    for (int ch = 0; ch < NUM_DMA_CHANNELS; ch++) {
+        DmaCh& d = dma_ch[ch];
+        if (dreq == DREQ_ADC)
+            while (d.busy && d.cfg.dreq == dreq && adc_dreq())
+                dma_transfer(ch);
+        else if (d.busy && d.cfg.dreq == dreq)
+            dma_transfer(ch);
+    }
+}
+
+
+void dma_channel_configure(uint ch, const dma_channel_config *c,
+                           volatile void *write_addr,
+                           const volatile void *read_addr,
+                           uint transfer_count, bool trigger)
+{
+    xassert(ch < NUM_DMA_CHANNELS);
+    DmaCh& d = dma_ch[ch];
+    d.cfg = *c;
+    d.count = transfer_count;
+    dma_regs.ch[ch].write_addr = uintptr_t(write_addr);
+    dma_regs.ch[ch].read_addr = uintptr_t(read_addr);
+    if (trigger)
+        dma_trigger(ch);
+}
+
+
+void dma_channel_start(uint ch)
+{
+    dma_trigger(ch);
+}
+
+
+void dma_channel_abort(uint ch)
+{
+    xassert(ch < NUM_DMA_CHANNELS);
+    dma_ch[ch].busy = false;
+}
+
+
+void dma_channel_set_irq1_enabled(uint ch, bool enabled)
+{
+    xassert(ch < NUM_DMA_CHANNELS);
+    dma_ch[ch].irq1_enabled = enabled;
+}
+
+
+void dma_channel_acknowledge_irq1(uint)
+{
+}
+
+//----------------------------------------------------------------------------
+
+uint64_t Sim::now_us()
+{
+    return now_ns / 1000;
+}
+
+
+void Sim::advance_us(uint64_t us)
+{
+    const uint64_t end_ns = now_ns + us * 1000;
+
+    while (true) {
+
+        // find the next event
+        int slice = -1;
+        uint64_t next_ns = UINT64_MAX;
+        for (int i = 0; i < slice_max; i++) {
+            if (slices[i].enabled && slices[i].wrap_ns < next_ns) {
+                slice = i;
+                next_ns = slices[i].wrap_ns;
+            }
+        }
+        bool adc = false;
+        if (adc_running && adc_next_ns < next_ns) {
+            adc = true;
+            next_ns = adc_next_ns;
+        }
+        bool adc_once = false;
+        if (adc_once_ns < next_ns) {
+            adc_once = true;
+            next_ns = adc_once_ns;
+        }
+
+        if (next_ns > end_ns)
+            break;
+
+        now_ns = next_ns;
+
+        if (adc_once) {
+            adc_once_ns = UINT64_MAX;
+            adc_sample();
+        } else if (adc) {
+            adc_next_ns += adc_period_ns;
+            adc_sample();
+        } else {
+            pwm_wrap(slice);
+        }
+    }
+
+    now_ns = end_ns;
+}
+
+
+void Sim::on_edge(edge_func *func)
+{
+    edge_cb = func;
+}
+
+
+void Sim::on_current(current_func *func)
+{
+    current_cb = func;
+}
+
+
+bool Sim::gpio(uint gpio)
+{
+    return gpio_get(gpio);
+}
+
+
+void Sim::on_preempt(preempt_func *func)
+{
+    preempt_cb = func;
+}
+
+
+void sim_preempt()
+{
+    static bool in_preempt = false;
+
+    if (preempt_cb == nullptr || in_preempt)
+        return;
+
+    in_preempt = true;
+    (*preempt_cb)();
+    in_preempt = false;
+}
+
+
+void Sim::irq_now(uint slice)
+{
+    xassert(slice < slice_max);
+    pwm_irq(slice);
+}
+
+
+uint32_t Sim::irq_cnt()
+{
+    return ::irq_cnt;
+}
+
+
+uint32_t Sim::adc_overrun_cnt()
+{
+    return adc_overruns;
+}
+
+
+uint16_t Sim::ma_to_raw(uint16_t ma)
+{
+    // mv = ma * 1.1; raw = mv * 4096 / 3300
+    uint32_t raw = (uint32_t(ma) * 11 * 4096 + 33000 / 2) / 33000;
+    return raw > 4095 ? 4095 : raw;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Virtual-time hardware for the host build.
+//
+// Nothing happens on its own: the caller runs one pass of its main loop,
+// then calls advance_us() with however long that pass is supposed to take.
+// Every pwm wrap (and its irq handler) and every adc conversion in that
+// interval happens in time order, so a run is exactly repeatable.
+
+namespace Sim
+{
+
+// current virtual time
+uint64_t now_us();
+
+// advance virtual time, running pwm wraps, wrap irq handlers, and adc
+// conversions (with the dma that takes them, and its irq handler) due along
+// the way
+void advance_us(uint64_t us);
+
+// called for each edge on the pwm gpio (the dcc signal), in time order
+typedef void edge_func(uint64_t edge_us, int level);
+void on_edge(edge_func *func);
+
+// called for each adc conversion; returns the track current in mA
+typedef uint16_t current_func(uint64_t now_us);
+void on_current(current_func *func);
+
+// state of a gpio output, e.g. track power enable
+bool gpio(uint gpio);
+
+// Called at each barrier (__dmb) in the code being run, as if an irq came
+// in right there; nullptr (the default) for none. Not called again from
+// inside itself.
+typedef void preempt_func();
+void on_preempt(preempt_func *func);
+
+// run a pwm slice's wrap irq handler now, without moving time
+void irq_now(uint slice);
+
+// pwm wrap irq handler calls so far
+uint32_t irq_cnt();
+
+// adc conversions dropped because the fifo was full
+uint32_t adc_overrun_cnt();
+
+// mA to adc counts, the inverse of DccAdc's conversion (DRV8874 1.1 mV/mA,
+// 3.3V reference, 12 bits)
+uint16_t ma_to_raw(uint16_t ma);
+
+} // namespace Sim
@@ -0,0 +1,275 @@
+#include <Arduino.h>
+#include "xassert.h"
+#include "dcc_bit.h"
+#include "dcc_cv.h"
+#include "dcc_pkt.h"
+#include "sim.h"
+#include "sim_decoder.h"
+
+
+SimDecoder *SimDecoder::_me = nullptr;
+
+
+SimDecoder::SimDecoder(int pwr_gpio) :
+    _pwr_gpio(pwr_gpio),
+    _bit(),
+    _present(true),
+    _base_ma(20),
+    _noise_ma(0),
+    _ack_ma(100),
+    _ack_us(6000),
+    _ack_delay_us(0),
+    _edge_us(0),
+    _ack_end_us(0),
+    _ack_cnt(0),
+    _svc(false),
+    _last_len(0),
+    _last_done(false),
+    _noise(1),
+    _burst_ma(0),
+    _burst_max_us(0),
+    _burst_gap_us(0),
+    _burst_now_ma(0),
+    _burst_end_us(0),
+    _burst_next_us(0),
+    _burst_rand(1),
+    _spike_ma(0),
+    _spike_us(0),
+    _spike_edge_us{0, 0},
+    _step(nullptr),
+    _step_cnt(0),
+    _step_idx(0),
+    _step_start_us(0),
+    _pkt_func(nullptr)
+{
+    memset(_cv, 0, sizeof(_cv));
+    _me = this;
+    _bit.on_pkt_recv(pkt_recv);
+}
+
+
+void SimDecoder::edge(uint64_t edge_us, int level)
+{
+    (void)level;
+    _edge_us = edge_us;
+    _spike_edge_us[0] = _spike_edge_us[1];
+    _spike_edge_us[1] = edge_us;
+    _bit.edge(edge_us);
+}
+
+
+uint16_t SimDecoder::current_ma(uint64_t now_us)
+{
+    if (!Sim::gpio(_pwr_gpio))
+        return 0;
+
+    int step_ma = 0;
+    if (_step != nullptr) {
+        while (_step_idx + 1 < _step_cnt &&
+               now_us - _step_start_us >= _step[_step_idx + 1].at_us)
+            _step_idx++;
+        if (now_us - _step_start_us >= _step[_step_idx].at_us)
+            step_ma = _step[_step_idx].ma;
+    }
+
+    // the sim reports a period's falling edge when it starts
+    if (_spike_ma > 0) {
+        uint64_t edge_us = _spike_edge_us[1];
+        if (edge_us > now_us)
+            edge_us = _spike_edge_us[0];
+        if (edge_us <= now_us && now_us - edge_us < uint64_t(_spike_us))
+            step_ma += _spike_ma;
+    }
+
+    if (!_present)
+        return step_ma;
+
+    int ma = _base_ma + step_ma;
+
+    if (_noise_ma > 0) {
+        _noise = _noise * 1103515245 + 12345;
+        ma += int((_noise >> 16) % (_noise_ma + 1)) - _noise_ma / 2;
+    }
+
+    if (_burst_ma > 0) {
+        if (now_us >= _burst_next_us) {
+            _burst_rand = _burst_rand * 1103515245 + 12345;
+            _burst_now_ma = _burst_ma / 2 + (_burst_rand >> 16) % (_burst_ma / 2 + 1);
+            _burst_rand = _burst_rand * 1103515245 + 12345;
+            _burst_end_us = now_us + _burst_max_us / 4 +
+                            (_burst_rand >> 16) % (_burst_max_us * 3 / 4 + 1);
+            _burst_rand = _burst_rand * 1103515245 + 12345;
+            _burst_next_us = _burst_end_us + (_burst_rand >> 8) % (2 * _burst_gap_us + 1);
+        }
+        if (now_us < _burst_end_us)
+            ma += _burst_now_ma;
+    }
+
+    if (now_us < _ack_end_us && now_us + _ack_us >= _ack_end_us)
+        ma += _ack_ma;
+
+    return ma < 0 ? 0 : ma;
+}
+
+
+void SimDecoder::load(uint16_t base_ma, uint16_t noise_ma)
+{
+    _base_ma = base_ma;
+    _noise_ma = noise_ma;
+}
+
+
+void SimDecoder::bursts(uint16_t burst_ma, int max_us, int gap_us)
+{
+    _burst_ma = burst_ma;
+    _burst_max_us = max_us;
+    _burst_gap_us = gap_us;
+}
+
+
+void SimDecoder::spikes(uint16_t spike_ma, int spike_us)
+{
+    _spike_ma = spike_ma;
+    _spike_us = spike_us;
+}
+
+
+void SimDecoder::script(const Step *step, int step_cnt)
+{
+    xassert(step == nullptr || step_cnt > 0);
+
+    _step = step;
+    _step_cnt = step_cnt;
+    _step_idx = 0;
+    _step_start_us = Sim::now_us();
+}
+
+
+void SimDecoder::ack(uint16_t ack_ma, int ack_us, int delay_us)
+{
+    _ack_ma = ack_ma;
+    _ack_us = ack_us;
+    _ack_delay_us = delay_us;
+}
+
+
+void SimDecoder::cv(int cv_num, uint8_t cv_val)
+{
+    xassert(DccPkt::cv_num_min <= cv_num && cv_num <= DccPkt::cv_num_max);
+    cv_ref(_cv[DccCv::index_hi - 1], _cv[DccCv::index_lo - 1], cv_num) = cv_val;
+}
+
+
+uint8_t SimDecoder::cv(int cv_num) const
+{
+    return cv(_cv[DccCv::index_hi - 1], _cv[DccCv::index_lo - 1], cv_num);
+}
+
+
+void SimDecoder::cv(int index_hi, int index_lo, int cv_num, uint8_t cv_val)
+{
+    xassert(DccPkt::cv_num_min <= cv_num && cv_num <= DccPkt::cv_num_max);
+    cv_ref(index_hi, index_lo, cv_num) = cv_val;
+}
+
+
+uint8_t SimDecoder::cv(int index_hi, int index_lo, int cv_num) const
+{
+    xassert(DccPkt::cv_num_min <= cv_num && cv_num <= DccPkt::cv_num_max);
+    if (cv_num < indexed_min || cv_num > indexed_max)
+        return _cv[cv_num - 1];
+    auto it = _indexed.find((index_hi << 24) | (index_lo << 16) | cv_num);
+    return it == _indexed.end() ? 0 : it->second;
+}
+
+
+uint8_t& SimDecoder::cv_ref(int index_hi, int index_lo, int cv_num)
+{
+    if (cv_num < indexed_min || cv_num > indexed_max)
+        return _cv[cv_num - 1];
+    return _indexed[(index_hi << 24) | (index_lo << 16) | cv_num];
+}
+
+
+void SimDecoder::pkt_recv(const uint8_t *pkt, int pkt_len, int, uint64_t, int)
+{
+    xassert(_me != nullptr);
+    _me->pkt(pkt, pkt_len);
+}
+
+
+void SimDecoder::pkt(const uint8_t *pkt, int pkt_len)
+{
+    if (_pkt_func != nullptr)
+        (*_pkt_func)(pkt, pkt_len, _edge_us);
+
+    if (!_present || pkt_len < 3 || pkt_len > int(sizeof(_last)))
+        return;
+
+    // bad xor: ignore
+    uint8_t x = 0;
+    for (int i = 0; i < pkt_len; i++)
+        x ^= pkt[i];
+    if (x != 0)
+        return;
+
+    bool repeat = (pkt_len == _last_len && memcmp(pkt, _last, pkt_len) == 0);
+    if (!repeat) {
+        memcpy(_last, pkt, pkt_len);
+        _last_len = pkt_len;
+        _last_done = false;
+    }
+
+    if (pkt_len == 3 && pkt[0] == 0x00 && pkt[1] == 0x00) {
+        _svc = true; // reset
+        return;
+    }
+
+    if (!_svc || !DccPkt::is_svc_direct(pkt, pkt_len)) {
+        if (pkt[0] != 0xff)
+            _svc = false; // anything but idle ends service mode
+        return;
+    }
+
+    // service mode decoders act on the second of two identical packets
+    if (repeat && !_last_done) {
+        _last_done = true;
+        if (svc(pkt)) {
+            _ack_end_us = _edge_us + _ack_delay_us + _ack_us;
+            _ack_cnt++;
+        }
+    }
+}
+
+
+// act on a service mode direct packet; return true to ack
+bool SimDecoder::svc(const uint8_t *pkt)
+{
+    int op = (pkt[0] >> 2) & 0x03;
+    int cv_num = ((int(pkt[0] & 0x03) << 8) | pkt[1]) + 1;
+    uint8_t& val = cv_ref(_cv[DccCv::index_hi - 1], _cv[DccCv::index_lo - 1], cv_num);
+
+    if (op == 1) {
+        // verify byte
+        return val == pkt[2];
+    } else if (op == 3) {
+        // write byte
+        val = pkt[2];
+        return true;
+    } else {
+        // bit manipulation: 111K_DBBB
+        int bit = pkt[2] & 0x07;
+        int bit_val = (pkt[2] >> 3) & 1;
+        if (pkt[2] & 0x10) {
+            // write bit
+            if (bit_val)
+                val |= (1 << bit);
+            else
+                val &= ~(1 << bit);
+            return true;
+        } else {
+            // verify bit
+            return ((val >> bit) & 1) == bit_val;
+        }
+    }
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <Arduino.h>
+#include <map>
+#include "dcc_bit.h"
+#include "dcc_pkt.h"
+
+// Simulated decoder on the track. It decodes the dcc signal edges with
+// DccBit, keeps a set of CVs, and answers service-mode verifies and writes
+// with an ack pulse in the track current it reports to the simulated adc.
+
+class SimDecoder
+{
+
+    public:
+
+        SimDecoder(int pwr_gpio);
+
+        // feed an edge of the dcc signal (Sim::on_edge)
+        void edge(uint64_t edge_us, int level);
+
+        // track current (Sim::on_current)
+        uint16_t current_ma(uint64_t now_us);
+
+        // no decoder at all: no load, no acks
+        void present(bool on) { _present = on; }
+
+        // idle load and peak-to-peak noise
+        void load(uint16_t base_ma, uint16_t noise_ma);
+
+        // Bursts on top of the load, like a sound decoder's amplifier: each
+        // from half to all of burst_ma, and from a quarter to all of max_us
+        // long, with a random gap averaging gap_us between them. 0 for none.
+        void bursts(uint16_t burst_ma, int max_us=2500, int gap_us=20000);
+
+        // The driver's switching spikes: spike_ma for spike_us after each
+        // edge of the signal, there whether or not the decoder is present.
+        // 0 for none.
+        void spikes(uint16_t spike_ma, int spike_us=10);
+
+        // Scripted load on the track (e.g. a short, or a loco's inrush), on
+        // top of the decoder's, starting now: each step's current from its
+        // time until the next step's, and the last step's from then on.
+        // There whether or not the decoder is present; none while power is
+        // off. The steps are not copied. nullptr for none.
+        struct Step {
+            uint32_t at_us;
+            uint16_t ma;
+        };
+        void script(const Step *step, int step_cnt);
+
+        // ack pulse, starting delay_us after the packet that causes it
+        void ack(uint16_t ack_ma, int ack_us, int delay_us=0);
+
+        // Cvs 257..512 are indexed: there is a set of them for each page,
+        // and the one used is in the page cv31 and cv32 select, or the one
+        // given.
+        void cv(int cv_num, uint8_t cv_val);
+        uint8_t cv(int cv_num) const;
+        void cv(int index_hi, int index_lo, int cv_num, uint8_t cv_val);
+        uint8_t cv(int index_hi, int index_lo, int cv_num) const;
+        static const int indexed_min = 257;
+        static const int indexed_max = 512;
+
+        // called for every packet received
+        typedef void pkt_func(const uint8_t *pkt, int pkt_len, uint64_t end_us);
+        void on_pkt(pkt_func *func) { _pkt_func = func; }
+
+        int ack_cnt() const { return _ack_cnt; }
+
+        // when the last ack pulse started (or starts)
+        uint64_t ack_start_us() const { return _ack_end_us - _ack_us; }
+
+    private:
+
+        int _pwr_gpio;
+
+        DccBit _bit;
+
+        bool _present;
+        uint16_t _base_ma;
+        uint16_t _noise_ma;
+        uint16_t _ack_ma;
+        int _ack_us;
+        int _ack_delay_us;
+
+        uint8_t _cv[DccPkt::cv_num_max];
+        std::map<uint32_t, uint8_t> _indexed; // by page and cv number
+        uint8_t& cv_ref(int index_hi, int index_lo, int cv_num);
+
+        uint64_t _edge_us;          // last edge, i.e. end of a packet
+        uint64_t _ack_end_us;       // ack pulse on until this time
+        int _ack_cnt;
+
+        bool _svc;                  // got a reset; in service mode
+        uint8_t _last[8];           // previous packet, to see repeats
+        int _last_len;
+        bool _last_done;            // previous packet already acted on
+
+        uint32_t _noise;            // lcg state
+
+        uint16_t _burst_ma;
+        int _burst_max_us;
+        int _burst_gap_us;
+        uint16_t _burst_now_ma;     // the burst going (or last)
+        uint64_t _burst_end_us;
+        uint64_t _burst_next_us;
+        uint32_t _burst_rand;       // lcg state
+
+        uint16_t _spike_ma;
+        int _spike_us;
+        uint64_t _spike_edge_us[2]; // last two edges, the newest maybe ahead
+
+        const Step *_step;
+        int _step_cnt;
+        int _step_idx;              // the step going
+        uint64_t _step_start_us;    // when the script started
+
+        pkt_func *_pkt_func;
+
+        void pkt(const uint8_t *pkt, int pkt_len);
+        bool svc(const uint8_t *pkt);
+
+        static SimDecoder *_me;
+        static void pkt_recv(const uint8_t *pkt, int pkt_len, int preamble_len,
+                             uint64_t start_us, int bad_cnt);
+
+}; // class SimDecoder
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+#define xassert(c)                                                      \
+    do {                                                                \
+        if (!(c)) {                                                     \
+            fprintf(stderr, "%s:%d: assertion failed: %s\n",            \
+                    __FILE__, __LINE__, #c);                            \
+            abort();                                                    \
+        }                                                               \
+    } while (0)